@@ -12,6 +12,7 @@
 #include "arbiter.h"
 #include "proto.h"
 #include "arbiterlimits.h"
+#include "xidlist.h"
 #include "sockhub/sockhub.h"
 
 #ifdef TEST
@@ -38,8 +39,6 @@ static int connum = 0;
 static ArbiterConnData conns[MAX_SERVERS];
 static char *arbiter_unix_sock_dir;
 
-typedef unsigned xid_t;
-
 static void DiscardConnection()
 {
 	if (connected)
@@ -345,7 +344,28 @@ void ArbiterInitSnapshot(Snapshot snapshot)
 	}
 }
 
-TransactionId ArbiterStartTransaction(Snapshot snapshot, TransactionId *gxmin, int nParticipants)
+/*
+ * Snapshot version is sent by the arbiter as two words: the epoch and the counter.
+ */
+static uint64 ArbiterVersion(xid_t *words)
+{
+	return ((uint64)words[0] << 32) | words[1];
+}
+
+/*
+ * Applies the difference received from the arbiter to the sorted xip array of
+ * the snapshot.
+ */
+static bool ArbiterApplyDelta(Snapshot snapshot, xid_t *removed, int nremoved, xid_t *added, int nadded)
+{
+	int n = xidlist_apply(snapshot->xip, snapshot->xcnt, GetMaxSnapshotSubxidCount(), removed, nremoved, added, nadded);
+	if (n < 0)
+		return false;
+	snapshot->xcnt = n;
+	return true;
+}
+
+TransactionId ArbiterStartTransaction(Snapshot snapshot, TransactionId *gxmin, uint64 *version, int nParticipants)
 {
 	int i;
 	xid_t xid;
@@ -367,19 +387,20 @@ TransactionId ArbiterStartTransaction(Snapshot snapshot, TransactionId *gxmin, i
 
 	// results
 	reslen = arbiter_recv_results(arbiter, RESULTS_SIZE, results);
-	if (reslen < 5) goto failure;
+	if (reslen < 7) goto failure;
 	if (results[0] != RES_OK) goto failure;
 	xid = results[1];
 	*gxmin = results[2];
+	*version = ArbiterVersion(results + 3);
 
 	ArbiterInitSnapshot(snapshot);
-	snapshot->xmin = results[3];
-	snapshot->xmax = results[4];
-	snapshot->xcnt = reslen - 5;
+	snapshot->xmin = results[5];
+	snapshot->xmax = results[6];
+	snapshot->xcnt = reslen - 7;
 
 	for (i = 0; i < snapshot->xcnt; i++)
 	{
-		snapshot->xip[i] = results[5 + i];
+		snapshot->xip[i] = results[7 + i];
 	}
 
 	return xid;
@@ -389,10 +410,11 @@ failure:
 	return INVALID_XID;
 }
 
-void ArbiterGetSnapshot(TransactionId xid, Snapshot snapshot, TransactionId *gxmin)
+void ArbiterGetSnapshot(TransactionId xid, Snapshot snapshot, TransactionId *gxmin, uint64 *version)
 {
-	int i;
 	int reslen;
+	int nremoved;
+	uint64 base;
 	xid_t results[RESULTS_SIZE];
 	ArbiterConn arbiter = GetConnection();
 	if (!arbiter) {
@@ -402,26 +424,33 @@ void ArbiterGetSnapshot(TransactionId xid, Snapshot snapshot, TransactionId *gxm
 	assert(snapshot != NULL);
 
 	// command
-	if (!arbiter_send_command(arbiter, CMD_SNAPSHOT, 1, xid)) goto failure;
+	if (!arbiter_send_command(arbiter, CMD_SNAPSHOT, 3, xid, (xid_t)(*version >> 32), (xid_t)*version)) goto failure;
 
-	// response
+	// response: ok, gxmin, version (2 words), base version (2 words), xmin, xmax, number of removed xids, removed xids, added xids
 	reslen = arbiter_recv_results(arbiter, RESULTS_SIZE, results);
-	if (reslen < 4) goto failure;
+	if (reslen < 9) goto failure;
 	if (results[0] != RES_OK) goto failure;
+	base = ArbiterVersion(results + 4);
+	nremoved = results[8];
+	if (base != 0 && base != *version) goto failure;
+	if (nremoved > reslen - 9) goto failure;
+
 	*gxmin = results[1];
 	ArbiterInitSnapshot(snapshot);
-	snapshot->xmin = results[2];
-	snapshot->xmax = results[3];
-	snapshot->xcnt = reslen - 4;
-
-	for (i = 0; i < snapshot->xcnt; i++)
+	if (base == 0)
 	{
-		snapshot->xip[i] = results[4 + i];
+		// the full list of active transactions is sent
+		snapshot->xcnt = 0;
 	}
+	if (!ArbiterApplyDelta(snapshot, results + 9, nremoved, results + 9 + nremoved, reslen - 9 - nremoved)) goto failure;
+	snapshot->xmin = results[6];
+	snapshot->xmax = results[7];
+	*version = ArbiterVersion(results + 2);
 
 	return;
 failure:
 	DiscardConnection();
+	*version = 0; // the snapshot may be partially updated, ask for the full one next time
 	elog(ERROR,
 		"ArbiterGetSnapshot: failed to"
 		" get the snapshot for xid = %d\n",
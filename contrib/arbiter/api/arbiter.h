@@ -17,17 +17,20 @@ void ArbiterInitSnapshot(Snapshot snapshot);
 
 /**
  * Starts a new global transaction. Returns the
- * transaction id, fills the 'snapshot' and 'gxmin' on success. 'gxmin' is the
- * smallest xmin among all snapshots known to arbiter. Returns INVALID_XID
- * otherwise.
+ * transaction id, fills the 'snapshot', its 'version' and 'gxmin' on success.
+ * 'gxmin' is the smallest xmin among all snapshots known to arbiter. Returns
+ * INVALID_XID otherwise.
  */
-TransactionId ArbiterStartTransaction(Snapshot snapshot, TransactionId *gxmin, int nParticipants);
+TransactionId ArbiterStartTransaction(Snapshot snapshot, TransactionId *gxmin, uint64 *version, int nParticipants);
 
 /**
  * Asks the arbiter for a fresh snapshot. Fills the 'snapshot' and 'gxmin' on
  * success. 'gxmin' is the smallest xmin among all snapshots known to arbiter.
+ * '*version' is the version of the 'snapshot' the caller already has (0 if
+ * none): the arbiter sends only the difference from it, which is applied to
+ * the 'snapshot' in place, and the new version is stored in '*version'.
  */
-void ArbiterGetSnapshot(TransactionId xid, Snapshot snapshot, TransactionId *gxmin);
+void ArbiterGetSnapshot(TransactionId xid, Snapshot snapshot, TransactionId *gxmin, uint64 *version);
 
 /**
  * Commits transaction only once all participants have called this function,
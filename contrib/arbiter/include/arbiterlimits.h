@@ -9,6 +9,7 @@
 
 #define MAX_TRANSACTIONS 4096
 #define MAX_SNAPSHOTS_PER_TRANS 8
+#define SNAPSHOT_HISTORY 16 /* how many recent snapshots are kept to send deltas against */
 
 #define BUFFER_SIZE (256 * 1024)
 #define LISTEN_QUEUE_SIZE 100
@@ -21,5 +22,7 @@
 #define ELECTION_TIMEOUT_MS_MAX 300
 #define RAFT_LOGLEN 1024
 #define RAFT_KEEP_APPLIED 512 /* how many applied entries to keep during compaction */
+#define RAFT_BATCH_SIZE 512 /* how many updates an entry can carry */
+#define RAFT_WINDOW 8 /* how many entries can be sent to a follower without waiting for its reply */
 
 #endif
@@ -3,12 +3,11 @@
 
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "arbiterlimits.h"
 
 #define NOBODY -1
 
-#define MAJORITY_IS_NOT_ENOUGH // wait for unanimous ack for applying a new entry
-
 #define DEFAULT_LISTENHOST "0.0.0.0"
 #define DEFAULT_LISTENPORT 5431
 
@@ -29,13 +28,18 @@
 #endif
 
 // raft module does not care what you mean by action and argument
+typedef struct raft_update_t {
+	int action;
+	int argument;
+} raft_update_t;
+
 typedef struct raft_entry_t {
 	int term;
 	bool snapshot; // true if this is a snapshot entry
 	union {
 		struct { // snapshot == false
-			int action;
-			int argument;
+			int nupdates;
+			raft_update_t updates[RAFT_BATCH_SIZE];
 		};
 		struct { // snapshot == true
 			int minarg;
@@ -50,6 +54,7 @@ typedef struct raft_log_t {
 	int first;
 	int size;    // number of entries past first
 	int acked;   // number of entries replicated to the majority of servers
+	int verified; // number of entries known to match the leader's log
 	int applied; // number of entries applied to the state machine
 	raft_entry_t entries[RAFT_LOGLEN]; // wraps around
 } raft_log_t;
@@ -58,6 +63,8 @@ typedef struct raft_server_t {
 	int seqno;  // the rpc sequence number
 	int tosend; // index of the next entry to send
 	int acked;  // index of the highest entry known to be replicated
+	int beaten; // 'acked' at the previous heartbeat, to detect lost updates
+	bool stuck; // needs a compacted entry, which has been reported already
 
 	char *host;
 	int port;
@@ -79,6 +86,9 @@ typedef struct raft_t {
 	raft_server_t servers[MAX_SERVERS];
 
 	int timer;
+	bool unanimous; // wait for all servers, not just the majority, to ack an entry
+
+	raft_entry_t pending; // updates emitted but not yet put into the log
 
 	raft_applier_t applier;
 } raft_t;
@@ -101,17 +111,19 @@ typedef struct raft_msg_update_t {
 	raft_msg_t msg;
 	int previndex; // the index of the preceding log entry
 	int prevterm;  // the term of the preceding log entry
+	int acked;     // the leader's acked number
 
 	bool empty;    // the message is just a heartbeat if empty
-	raft_entry_t entry;
-
-	int acked;     // the leader's acked number
+	raft_entry_t entry; // only the used part of 'updates' is sent
 } raft_msg_update_t;
 
+#define RAFT_MSG_UPDATE_SIZE(NUPDATES) \
+	(offsetof(raft_msg_update_t, entry.updates) + (NUPDATES) * sizeof(raft_update_t))
+
 typedef struct raft_msg_done_t {
 	raft_msg_t msg;
-	int index; // the index of the appended entry
-	int term;  // the term of the appended entry
+	int index; // the index of the appended entry, or of the last entry on failure
+	int term;  // the term of that entry
 	bool success;
 } raft_msg_done_t;
 
@@ -133,6 +145,7 @@ bool raft_set_myid(raft_t *r, int myid);
 
 // log actions
 bool raft_emit(raft_t *r, int action, int argument);
+bool raft_flush(raft_t *r);
 int raft_apply(raft_t *r, raft_applier_t applier);
 
 // control
@@ -1,10 +1,13 @@
 #ifndef SNAPSHOT_H
 #define SNAPSHOT_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "int.h"
 #include "arbiterlimits.h"
 
 typedef struct Snapshot {
+	uint64_t version; /* the same version means the same set of active transactions */
 	xid_t xmin;
 	xid_t xmax;
 	int nactive;
@@ -13,5 +16,10 @@ typedef struct Snapshot {
 } Snapshot;
 
 void snapshot_sort(Snapshot *s);
+void snapshot_diff(Snapshot *from, Snapshot *to, xid_t *removed, int *nremoved, xid_t *added, int *nadded);
+bool snapshot_delta(Snapshot *base, Snapshot *to, xid_t *removed, int *nremoved, xid_t *added, int *nadded);
+
+/* recently generated snapshots, 'history[version % SNAPSHOT_HISTORY]' */
+Snapshot *snapshot_history_find(Snapshot *history, uint64_t version);
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef XIDLIST_H
+#define XIDLIST_H
+
+#include "int.h"
+
+/*
+ * Applies the difference between two snapshots to the sorted list 'xip' of
+ * 'xcnt' active xids, which has room for 'maxcnt' of them: drops the
+ * 'removed' xids and inserts the 'added' ones. Both lists are sorted.
+ * Returns the new number of xids, or -1 if they do not fit.
+ */
+int xidlist_apply(xid_t *xip, int xcnt, int maxcnt, xid_t *removed, int nremoved, xid_t *added, int nadded);
+
+#endif
@@ -34,6 +34,33 @@ Transaction* transaction_hash[MAX_TRANSACTIONS];
 xid_t prev_gxid, next_gxid;
 xid_t global_xmin = INVALID_XID;
 
+/*
+ * Version of the set of active transactions, changed whenever a transaction
+ * begins or finishes. Recently generated snapshots are kept by version, so
+ * that a snapshot can be sent as a delta against the one the client has.
+ *
+ * The high word of the version is the epoch: the value of 'next_gxid' at the
+ * moment this arbiter became the leader. The leader never reuses xids of the
+ * previous one, so its epoch is above the epoch of any version issued before.
+ * The low word counts changes within the epoch and starts a new epoch if it
+ * wraps around. Versions are never zero, which means "no snapshot".
+ */
+uint64_t snapshot_version;
+Snapshot snapshot_history[SNAPSHOT_HISTORY];
+
+static void start_version_epoch(void) {
+	snapshot_version = ((uint64_t)next_gxid << 32) | 1;
+	shout("snapshot version epoch %u\n", next_gxid);
+}
+
+static void bump_snapshot_version(void) {
+	snapshot_version += 1;
+	if ((xid_t)snapshot_version == 0) {
+		/* The counter wrapped: xids were used since the epoch started, so next_gxid is above it. */
+		start_version_epoch();
+	}
+}
+
 static Transaction *find_transaction(xid_t xid) {    
 	Transaction *t;    
 	for (t = transaction_hash[xid % MAX_TRANSACTIONS]; t != NULL && t->xid != xid; t = t->collision);
@@ -81,6 +108,7 @@ inline static void free_transaction(Transaction* t) {
 	for (tpp = &transaction_hash[t->xid % MAX_TRANSACTIONS]; *tpp != t; tpp = &(*tpp)->collision);
 	*tpp = t->collision;
 	l2_list_unlink(&t->elem);
+	bump_snapshot_version();
 	t->elem.next = free_transactions;
 	free_transactions = &t->elem;
 	if (t->xmin == global_xmin) { 
@@ -229,24 +257,42 @@ static xid_t max_of_xids(xid_t a, xid_t b) {
 	return a > b ? a : b;
 }
 
+/* Versions are sent as two words: the epoch and the counter */
+static void append_version(client_t client, uint64_t version) {
+	xid_t epoch = (xid_t)(version >> 32);
+	xid_t counter = (xid_t)version;
+	client_message_append(client, sizeof(xid_t), &epoch);
+	client_message_append(client, sizeof(xid_t), &counter);
+}
+
 static void gen_snapshot(Snapshot *s) {
 	Transaction* t;
     int n = 0;
-	s->times_sent = 0;
-	for (t = (Transaction*)active_transactions.prev; t != (Transaction*)&active_transactions; t = (Transaction*)t->elem.prev) {
-		s->active[n++] = t->xid;
-	}
-	while (n > 1 && s->active[n-2]+1 == s->active[n-1]) { 
-		n -= 1;
+	Snapshot *h = &snapshot_history[snapshot_version % SNAPSHOT_HISTORY];
+	if (h->version != snapshot_version) {
+		/* otherwise nothing began or finished since this version was generated */
+		for (t = (Transaction*)active_transactions.prev; t != (Transaction*)&active_transactions; t = (Transaction*)t->elem.prev) {
+			h->active[n++] = t->xid;
+		}
+		while (n > 1 && h->active[n-2]+1 == h->active[n-1]) { 
+			n -= 1;
+		}
+		if (n > 0) {
+			h->xmin = h->active[0];
+			h->xmax = h->active[--n];
+			assert(h->xmin <= h->xmax);
+		} else {
+			h->xmin = h->xmax = 0;
+		} 
+		h->nactive = n;
+		h->version = snapshot_version;
 	}
-	if (n > 0) {
-        s->xmin = s->active[0];
-        s->xmax = s->active[--n];
-		assert(s->xmin <= s->xmax);
-	} else {
-		s->xmin = s->xmax = 0;
-	} 
-	s->nactive = n;
+	s->version = h->version;
+	s->xmin = h->xmin;
+	s->xmax = h->xmax;
+	s->nactive = h->nactive;
+	memcpy(s->active, h->active, sizeof(xid_t) * h->nactive);
+	s->times_sent = 0;
 }
 
 static void onhello(client_t client, int argc, xid_t *argv) {
@@ -407,6 +453,7 @@ static void onbegin(client_t client, int argc, xid_t *argv) {
 	}
 	transaction_clear(t);
 	l2_list_link(&active_transactions, &t->elem);
+	bump_snapshot_version();
 
 	t->xid = next_gxid;
 	CHECK(
@@ -454,6 +501,7 @@ static void onbegin(client_t client, int argc, xid_t *argv) {
 		client_message_append(client, sizeof(xid_t), &ok);
 		client_message_append(client, sizeof(xid_t), &t->xid);
 		client_message_append(client, sizeof(xid_t), &global_xmin);
+		append_version(client, snap->version);
 		client_message_append(client, sizeof(xid_t), &snap->xmin);
 		client_message_append(client, sizeof(xid_t), &snap->xmax);
 		client_message_append(client, sizeof(xid_t) * snap->nactive, snap->active);
@@ -558,16 +606,20 @@ static void onvote(client_t client, int argc, xid_t *argv, int vote) {
 }
 
 static void onsnapshot(client_t client, int argc, xid_t *argv) {
+	static xid_t removed[MAX_TRANSACTIONS];
+	static xid_t added[MAX_TRANSACTIONS];
 	Snapshot snapshot_now;
+	int nremoved = 0, nadded;
 
 	CHECK(
-		argc == 2,
+		(argc == 2) || (argc == 4),
 		client,
 		"SNAPSHOT: wrong number of arguments"
 	);
 
 	xid_t xid = argv[1];
-	Snapshot *snap;
+	uint64_t base_version = (argc == 4) ? ((uint64_t)argv[2] << 32) | argv[3] : 0;
+	Snapshot *snap, *base;
 	Transaction *t = find_transaction(xid);
 	if (t == NULL) {
 		shout(
@@ -602,13 +654,35 @@ static void onsnapshot(client_t client, int argc, xid_t *argv) {
 		snap->times_sent += 1; /* FIXME: does times_sent get used anywhere? see also 4765234987 */
 	}
 
+	/*
+	 * Send the difference from the snapshot the client already has, unless
+	 * that one is forgotten or the difference is not shorter than the
+	 * snapshot itself. Zero base version in the response means that the
+	 * full list of active transactions follows.
+	 */
+	base = snapshot_history_find(snapshot_history, base_version);
+	if (!snapshot_delta(base, snap, removed, &nremoved, added, &nadded)) {
+		base = NULL;
+		base_version = 0;
+		nremoved = 0;
+	}
+
 	xid_t ok = RES_OK;
+	xid_t nremoved_xid = nremoved;
 	client_message_start(client); {
 		client_message_append(client, sizeof(xid_t), &ok);
 		client_message_append(client, sizeof(xid_t), &global_xmin);
+		append_version(client, snap->version);
+		append_version(client, base_version);
 		client_message_append(client, sizeof(xid_t), &snap->xmin);
 		client_message_append(client, sizeof(xid_t), &snap->xmax);
-		client_message_append(client, sizeof(xid_t) * snap->nactive, snap->active);
+		client_message_append(client, sizeof(xid_t), &nremoved_xid);
+		if (base != NULL) {
+			client_message_append(client, sizeof(xid_t) * nremoved, removed);
+			client_message_append(client, sizeof(xid_t) * nadded, added);
+		} else {
+			client_message_append(client, sizeof(xid_t) * snap->nactive, snap->active);
+		}
 	} client_message_finish(client);
 }
 
@@ -742,11 +816,12 @@ static void onmessage(client_t client, size_t len, char *data) {
 
 static void usage(char *prog) {
 	printf(
-		"Usage: %s -i ID -r HOST:PORT [-r HOST:PORT ...] [-d DATADIR] [-k] [-l LOGFILE]\n"
+		"Usage: %s -i ID -r HOST:PORT [-r HOST:PORT ...] [-d DATADIR] [-m] [-k] [-l LOGFILE]\n"
 		"   arbiter will try to kill the other one running at\n"
 		"   the same DATADIR.\n"
 		"   -r : Listen on the HOST and PORT. Specify multiple times to enable Raft protocol.\n"
 		"   -i : A number to distinguish this instance among the Raft peers.\n"
+		"   -m : Apply transaction statuses once replicated to the majority of Raft peers, not to all of them.\n"
 		"   -l : Run as a daemon and write output to LOGFILE.\n"
 		"   -k : Just kill the other arbiter and exit.\n",
 		prog
@@ -849,7 +924,7 @@ bool configure(int argc, char **argv) {
     initGraph(&graph);
 
 	int opt;
-	while ((opt = getopt(argc, argv, "hd:i:r:l:k")) != -1) {
+	while ((opt = getopt(argc, argv, "hd:i:r:l:km")) != -1) {
 		char *host;
 		char *portstr;
 		int port;
@@ -880,6 +955,9 @@ bool configure(int argc, char **argv) {
 			case 'k':
 				assassin = true;
 				break;
+			case 'm':
+				raft.unanimous = false;
+				break;
 			default:
 				usage(argv[0]);
 				return false;
@@ -936,6 +1014,8 @@ int main(int argc, char **argv) {
 
 	prev_gxid = next_gxid - 1;
 	debug("initial next_gxid = %u\n", next_gxid);
+
+	start_version_epoch();
 	if (!clg) {
 		shout("could not open clog at '%s'\n", datadir);
 		return EXIT_FAILURE;
@@ -974,6 +1054,7 @@ int main(int argc, char **argv) {
 	mstimer_t t;
 	mstimer_reset(&t);
 	int old_term = 0;
+	bool was_leader = false;
 	while (true) {
 		int ms = mstimer_reset(&t);
 		raft_msg_t *m = NULL;
@@ -989,6 +1070,9 @@ int main(int argc, char **argv) {
 		}
 
 		if (use_raft) {
+			/* All the statuses emitted during this tick go to the followers as one entry. */
+			raft_flush(&raft);
+
 			int applied = raft_apply(&raft, apply_clog_update);
 			if (applied) {
 				debug("applied %d updates\n", applied);
@@ -1014,6 +1098,12 @@ int main(int argc, char **argv) {
 				}
 				old_term = raft.term;
 			}
+
+			/* Snapshot versions of the new leader must differ from the ones of the previous leader. */
+			if (raft.role == ROLE_LEADER && !was_leader) {
+				start_version_epoch();
+			}
+			was_leader = raft.role == ROLE_LEADER;
 		} else {
 			server_set_enabled(server, true);
 		}
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "raft.h"
+#include "util.h"
+
+/*
+ * Runs a group of raft servers in one process over the loopback interface,
+ * kills and pauses the leaders and checks the state applied by the servers.
+ */
+
+#define SERVERS 3
+#define STATELEN 10
+#define TIMEOUT_MS 10000
+
+static raft_t rafts[SERVERS];
+static int states[SERVERS][STATELEN];
+static int expected[STATELEN];
+static bool alive[SERVERS];
+static bool paused[SERVERS];
+static mstimer_t timers[SERVERS];
+static int baseport;
+
+static int applying;
+
+static void raft_update_apply(int action, int argument) {
+	states[applying][argument % STATELEN] = action;
+}
+
+static bool running(int i) {
+	return alive[i] && !paused[i];
+}
+
+static bool start(int i) {
+	raft_t *r = rafts + i;
+	int j;
+
+	raft_init(r);
+	r->unanimous = false;
+	for (j = 0; j < SERVERS; j++) {
+		if (!raft_add_server(r, "127.0.0.1", baseport + j)) return false;
+	}
+	if (!raft_set_myid(r, i)) return false;
+	if (raft_create_udp_socket(r) == -1) return false;
+	// all the servers are served by one loop, which should never block
+	if (fcntl(r->sock, F_SETFL, fcntl(r->sock, F_GETFL) | O_NONBLOCK) == -1) return false;
+
+	memset(states[i], 0, sizeof(states[i]));
+	mstimer_reset(timers + i);
+	alive[i] = true;
+	paused[i] = false;
+	return true;
+}
+
+static void kill_server(int i) {
+	close(rafts[i].sock);
+	alive[i] = false;
+}
+
+static void step(void) {
+	int i;
+	for (i = 0; i < SERVERS; i++) {
+		raft_t *r = rafts + i;
+		raft_msg_t *m;
+
+		if (!running(i)) continue;
+
+		raft_tick(r, mstimer_reset(timers + i));
+		while ((m = raft_recv_message(r)) != NULL) {
+			raft_handle_message(r, m);
+		}
+		applying = i;
+		raft_apply(r, raft_update_apply);
+	}
+	usleep(1000);
+}
+
+// returns the leader recognized by all the running servers, or NOBODY
+static int leader(void) {
+	int i, l = NOBODY;
+	for (i = 0; i < SERVERS; i++) {
+		if (running(i) && (rafts[i].role == ROLE_LEADER)) {
+			if (l != NOBODY) return NOBODY;
+			l = i;
+		}
+	}
+	if (l == NOBODY) return NOBODY;
+	for (i = 0; i < SERVERS; i++) {
+		if (!running(i)) continue;
+		if ((rafts[i].term != rafts[l].term) || (rafts[i].leader != l)) return NOBODY;
+	}
+	return l;
+}
+
+// true if the running servers have applied the whole log of the leader
+static bool converged(void) {
+	int i, l = leader();
+	if (l == NOBODY) return false;
+	for (i = 0; i < SERVERS; i++) {
+		if (!running(i)) continue;
+		if (rafts[i].log.applied != rafts[l].log.first + rafts[l].log.size) return false;
+	}
+	return true;
+}
+
+static int wait_leader(void) {
+	mstimer_t t;
+	int elapsed = 0;
+	mstimer_reset(&t);
+	while (elapsed < TIMEOUT_MS) {
+		int l;
+		step();
+		if ((l = leader()) != NOBODY) return l;
+		elapsed += mstimer_reset(&t);
+	}
+	return NOBODY;
+}
+
+static bool wait_converged(void) {
+	mstimer_t t;
+	int elapsed = 0;
+	mstimer_reset(&t);
+	while (elapsed < TIMEOUT_MS) {
+		step();
+		if (converged()) return true;
+		elapsed += mstimer_reset(&t);
+	}
+	return false;
+}
+
+static void run(int ms) {
+	mstimer_t t;
+	int elapsed = 0;
+	mstimer_reset(&t);
+	while (elapsed < ms) {
+		step();
+		elapsed += mstimer_reset(&t);
+	}
+}
+
+static bool emit_all(int l, int action, bool flush) {
+	int arg;
+	for (arg = 0; arg < STATELEN; arg++) {
+		if (!raft_emit(rafts + l, action, arg)) return false;
+	}
+	return !flush || raft_flush(rafts + l);
+}
+
+static void set_expected(int action) {
+	int arg;
+	for (arg = 0; arg < STATELEN; arg++) {
+		expected[arg] = action;
+	}
+}
+
+static bool check_states(const char *what) {
+	bool ok = true;
+	int i, j;
+	for (i = 0; i < SERVERS; i++) {
+		bool same;
+		if (!running(i)) continue;
+		same = memcmp(states[i], expected, sizeof(expected)) == 0;
+		printf("%s: [%d] term %d applied %d:", what, i, rafts[i].term, rafts[i].log.applied);
+		for (j = 0; j < STATELEN; j++) {
+			printf(" %d", states[i][j]);
+		}
+		printf(" (%s)\n", same ? "ok" : "FAILED");
+		ok &= same;
+	}
+	return ok;
+}
+
+static bool test_leader_kill(void) {
+	int l, old;
+
+	for (l = 0; l < SERVERS; l++) {
+		if (!start(l)) return false;
+	}
+
+	if ((l = wait_leader()) == NOBODY) return false;
+	if (!emit_all(l, 1, true)) return false;
+	set_expected(1);
+	if (!wait_converged()) return false;
+	if (!check_states("initial leader")) return false;
+
+	// the killed leader's committed updates survive, and a new leader
+	// continues the log
+	old = l;
+	kill_server(old);
+	if ((l = wait_leader()) == NOBODY) return false;
+	printf("killed [%d], elected [%d]\n", old, l);
+	if (!emit_all(l, 2, true)) return false;
+	set_expected(2);
+	if (!wait_converged()) return false;
+	if (!check_states("after leader kill")) return false;
+
+	// the restarted server gets the whole log from the new leader
+	if (!start(old)) return false;
+	if (!wait_converged()) return false;
+	if (!check_states("after restart")) return false;
+	return true;
+}
+
+static bool test_stale_pending(void) {
+	int l, stale, other;
+
+	if ((stale = wait_leader()) == NOBODY) return false;
+
+	// emitted, but not flushed before the leadership is lost
+	if (!emit_all(stale, 9, false)) return false;
+	paused[stale] = true;
+
+	if ((l = wait_leader()) == NOBODY) return false;
+	printf("paused [%d], elected [%d]\n", stale, l);
+	if (!emit_all(l, 3, true)) return false;
+	set_expected(3);
+	if (!wait_converged()) return false;
+
+	paused[stale] = false;
+	mstimer_reset(timers + stale);
+	if (!wait_converged()) return false;
+	if (!check_states("after unpause")) return false;
+
+	// make the demoted leader claim the leadership before anybody else
+	kill_server(l);
+	rafts[stale].timer = 0;
+	for (other = 0; other < SERVERS; other++) {
+		if ((other != stale) && running(other)) {
+			rafts[other].timer = ELECTION_TIMEOUT_MS_MAX;
+		}
+	}
+	if ((l = wait_leader()) == NOBODY) return false;
+	printf("killed the leader, elected [%d]\n", l);
+	if (!wait_converged()) return false;
+	run(ELECTION_TIMEOUT_MS_MAX);
+	if (!check_states("after reelection")) return false;
+	return l == stale;
+}
+
+int main() {
+	bool ok = true;
+
+	baseport = 20000 + (getpid() % 10000) * SERVERS;
+
+	printf("--- leader kill ---\n");
+	ok &= test_leader_kill();
+	printf("--- stale pending updates ---\n");
+	ok &= test_stale_pending();
+
+	if (ok) {
+		printf("raft-test passed\n");
+		return EXIT_SUCCESS;
+	} else {
+		printf("raft-test FAILED\n");
+		return EXIT_FAILURE;
+	}
+}
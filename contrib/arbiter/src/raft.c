@@ -10,6 +10,8 @@ static void raft_server_init(raft_server_t *s) {
 	s->seqno = 0;
 	s->tosend = 0;
 	s->acked = 0;
+	s->beaten = 0;
+	s->stuck = false;
 
 	s->host = DEFAULT_LISTENHOST;
 	s->port = DEFAULT_LISTENPORT;
@@ -76,20 +78,25 @@ void raft_init(raft_t *r) {
 	r->log.first = 0;
 	r->log.size = 0;
 	r->log.acked = 0;
+	r->log.verified = 0;
 	r->log.applied = 0;
 
 	r->servernum = 0;
+	r->unanimous = true;
+	r->pending.nupdates = 0;
 }
 
 int raft_apply(raft_t *r, raft_applier_t applier) {
 	int applied_now = 0;
 	while (r->log.acked > r->log.applied) {
-		applier(
-			RAFT_LOG(r, r->log.applied).action,
-			RAFT_LOG(r, r->log.applied).argument
-		);
+		raft_entry_t *e = &RAFT_LOG(r, r->log.applied);
+		int i;
+		assert(!e->snapshot);
+		for (i = 0; i < e->nupdates; i++) {
+			applier(e->updates[i].action, e->updates[i].argument);
+		}
 		r->log.applied++;
-		applied_now++;
+		applied_now += e->nupdates;
 	}
 	return applied_now;
 }
@@ -153,9 +160,18 @@ int raft_create_udp_socket(raft_t *r) {
 }
 
 static bool msg_size_is(raft_msg_t *m, int mlen) {
+	raft_msg_update_t *u = (raft_msg_update_t *)m;
 	switch (m->msgtype) {
 		case RAFT_MSG_UPDATE:
-			return mlen == sizeof(raft_msg_update_t);
+			if (mlen < (int)RAFT_MSG_UPDATE_SIZE(0)) {
+				return false;
+			}
+			if (u->empty) {
+				return mlen == RAFT_MSG_UPDATE_SIZE(0);
+			}
+			return (u->entry.nupdates >= 0)
+				&& (u->entry.nupdates <= RAFT_BATCH_SIZE)
+				&& (mlen == RAFT_MSG_UPDATE_SIZE(u->entry.nupdates));
 		case RAFT_MSG_DONE:
 			return mlen == sizeof(raft_msg_done_t);
 		case RAFT_MSG_CLAIM:
@@ -189,58 +205,102 @@ static void raft_send(raft_t *r, int dst, void *m, int mlen) {
 	}
 }
 
-static void raft_beat(raft_t *r, int dst) {
-	if (dst == NOBODY) {
-		// send a beat/update to everybody
-		int i;
-		for (i = 0; i < r->servernum; i++) {
-			if (i == r->me) continue;
-			raft_beat(r, i);
-		}
-		return;
-	}
-
+// sends the entry at 'index' to 'dst', or a heartbeat if 'index' is NOBODY
+static bool raft_send_entry(raft_t *r, int dst, int index) {
 	assert(r->role == ROLE_LEADER);
 	assert(r->leader == r->me);
 
 	raft_server_t *s = r->servers + dst;
 
 	raft_msg_update_t m;
+	int mlen;
 
 	m.msg.msgtype = RAFT_MSG_UPDATE;
 	m.msg.term = r->term;
 	m.msg.from = r->me;
 
-	if (s->tosend < r->log.first + r->log.size) {
-		raft_entry_t *e = &RAFT_LOG(r, s->tosend);
+	if (index != NOBODY) {
+		// the entries preceding 'first' are compacted into the one at 'first'
+		raft_entry_t *e = &RAFT_LOG(r, max(index, r->log.first));
 		if (e->snapshot) {
-			// TODO: implement snapshot sending
-			shout("tosend = %d, first = %d, size = %d\n", s->tosend, r->log.first, r->log.size);
-			assert(false); // snapshot sending not implemented
+			// TODO: implement snapshot sending, the follower is stuck until then
+			if (!s->stuck) {
+				shout("cannot send compacted entry %d to [%d], first = %d, size = %d\n", index, dst, r->log.first, r->log.size);
+				s->stuck = true;
+			}
+			return false;
 		}
 
-		// the follower is a bit behind: send an update
-		m.previndex = s->tosend - 1;
+		m.previndex = index - 1;
 		if (m.previndex >= 0) {
 			m.prevterm = RAFT_LOG(r, m.previndex).term;
 		} else {
 			m.prevterm = -1;
 		}
-		m.entry = *e;
+		m.entry.term = e->term;
+		m.entry.snapshot = false;
+		m.entry.nupdates = e->nupdates;
+		memcpy(m.entry.updates, e->updates, e->nupdates * sizeof(raft_update_t));
 		m.empty = false;
+		mlen = RAFT_MSG_UPDATE_SIZE(e->nupdates);
 	} else {
-		// the follower is up to date: send a heartbeat
 		m.empty = true;
+		mlen = RAFT_MSG_UPDATE_SIZE(0);
 	}
 	m.acked = r->log.acked;
 
 	s->seqno++;
 	m.msg.seqno = s->seqno;
 	if (!m.empty) {
-		debug("[to %d] update with seqno = %d, tosend = %d, previndex = %d\n", dst, m.msg.seqno, s->tosend, m.previndex);
+		debug("[to %d] update with seqno = %d, index = %d, updates = %d\n", dst, m.msg.seqno, index, m.entry.nupdates);
 	}
 
-	raft_send(r, dst, &m, sizeof(m));
+	raft_send(r, dst, &m, mlen);
+	return true;
+}
+
+/*
+ * Sends the entries the follower does not have yet, keeping at most
+ * RAFT_WINDOW of them unacknowledged. Returns the number of entries sent.
+ */
+static int raft_replicate(raft_t *r, int dst) {
+	if (dst == NOBODY) {
+		int i, sent = 0;
+		for (i = 0; i < r->servernum; i++) {
+			if (i == r->me) continue;
+			sent += raft_replicate(r, i);
+		}
+		return sent;
+	}
+
+	raft_server_t *s = r->servers + dst;
+	int sent = 0;
+	while ((s->tosend < r->log.first + r->log.size) && (s->tosend - s->acked < RAFT_WINDOW)) {
+		if (!raft_send_entry(r, dst, s->tosend)) {
+			break;
+		}
+		s->tosend++;
+		sent++;
+	}
+	return sent;
+}
+
+static void raft_beat(raft_t *r) {
+	int i;
+	for (i = 0; i < r->servernum; i++) {
+		if (i == r->me) continue;
+
+		raft_server_t *s = r->servers + i;
+		if ((s->tosend > s->acked) && (s->acked == s->beaten)) {
+			// nothing was acked since the previous beat, the updates might have been lost
+			s->tosend = s->acked;
+		}
+		s->beaten = s->acked;
+
+		if (raft_replicate(r, i) == 0) {
+			raft_send_entry(r, i, NOBODY);
+		}
+	}
 }
 
 static void raft_claim(raft_t *r) {
@@ -296,7 +356,7 @@ void raft_tick(raft_t *r, int msec) {
 				raft_claim(r);
 				break;
 			case ROLE_LEADER:
-				raft_beat(r, NOBODY);
+				raft_beat(r);
 				break;
 		}
 		raft_reset_timer(r);
@@ -318,8 +378,11 @@ static int raft_log_compact(raft_log_t *l, int keep_applied) {
 			snap.minarg = min(snap.minarg, e->minarg);
 			snap.maxarg = max(snap.maxarg, e->maxarg);
 		} else {
-			snap.minarg = min(snap.minarg, e->argument);
-			snap.maxarg = max(snap.maxarg, e->argument);
+			int j;
+			for (j = 0; j < e->nupdates; j++) {
+				snap.minarg = min(snap.minarg, e->updates[j].argument);
+				snap.maxarg = max(snap.maxarg, e->updates[j].argument);
+			}
 		}
 		compacted++;
 	}
@@ -332,10 +395,33 @@ static int raft_log_compact(raft_log_t *l, int keep_applied) {
 	return compacted;
 }
 
+/*
+ * Updates are collected in a pending batch, which becomes a single log entry
+ * on raft_flush() or when the batch is full. So all the updates emitted
+ * between two flushes are replicated in one round.
+ */
 bool raft_emit(raft_t *r, int action, int argument) {
 	assert(r->leader == r->me);
 	assert(r->role == ROLE_LEADER);
 
+	if ((r->pending.nupdates == RAFT_BATCH_SIZE) && !raft_flush(r)) {
+		return false;
+	}
+
+	raft_update_t *u = r->pending.updates + r->pending.nupdates;
+	u->action = action;
+	u->argument = argument;
+	r->pending.nupdates++;
+	return true;
+}
+
+/*
+ * Puts the pending batch, even an empty one, into the log as an entry of the
+ * current term and starts replicating it.
+ */
+static bool raft_append_pending(raft_t *r) {
+	assert(r->role == ROLE_LEADER);
+
 	if (r->log.size == RAFT_LOGLEN) {
 		int compacted = raft_log_compact(&r->log, RAFT_KEEP_APPLIED);
 		if (compacted > 1) {
@@ -352,24 +438,39 @@ bool raft_emit(raft_t *r, int action, int argument) {
 	raft_entry_t *e = &RAFT_LOG(r, r->log.first + r->log.size);
 	e->snapshot = false;
 	e->term = r->term;
-	e->action = action;
-	e->argument = argument;
+	e->nupdates = r->pending.nupdates;
+	memcpy(e->updates, r->pending.updates, r->pending.nupdates * sizeof(raft_update_t));
 	r->log.size++;
+	r->pending.nupdates = 0;
 
-	raft_beat(r, NOBODY);
-	raft_reset_timer(r);
+	raft_replicate(r, NOBODY);
 	return true;
 }
 
+bool raft_flush(raft_t *r) {
+	if (r->pending.nupdates == 0) {
+		return true;
+	}
+
+	if (r->role != ROLE_LEADER) {
+		// the updates were decided upon the state of the lost term
+		shout("not a leader any more, dropping %d updates\n", r->pending.nupdates);
+		r->pending.nupdates = 0;
+		return false;
+	}
+
+	return raft_append_pending(r);
+}
+
 static bool log_append(raft_log_t *l, int previndex, int prevterm, raft_entry_t *e) {
 	if (e->snapshot) {
 		assert(false);
 	}
 	debug(
 		"log_append(%p, previndex=%d, prevterm=%d,"
-		" term=%d, action=%d, argument=%d)\n",
+		" term=%d, nupdates=%d)\n",
 		l, previndex, prevterm,
-		e->term, e->action, e->argument
+		e->term, e->nupdates
 	);
 	if (previndex != -1) {
 		if (previndex < l->first) {
@@ -449,32 +550,54 @@ static void raft_handle_update(raft_t *r, raft_msg_update_t *m) {
 	if (sender != r->leader) {
 		shout("changing leader to %d\n", sender);
 		r->leader = sender;
+		// the entries past the committed ones may come from another leader
+		r->log.verified = r->log.acked;
 	}
 
 	raft_reset_timer(r);
 
-	if (m->acked > r->log.acked) {
-		r->log.acked = min(
-			r->log.first + r->log.size,
-			m->acked
-		);
-		raft_server_t *s = r->servers + sender;
-		s->acked = s->tosend = r->log.acked;
-	}
-
 	if (m->empty) {
 		// just a hearbeat
-		return;
+		goto acked;
 	}
 
 	if (!log_append(&r->log, m->previndex, m->prevterm, &m->entry)) {
 		debug("log_append failed\n");
+		if (
+			(m->previndex >= r->log.first) &&
+			(m->previndex < r->log.first + r->log.size) &&
+			(RAFT_LOG(r, m->previndex).term != m->prevterm)
+		) {
+			// the preceding entry conflicts, the leader should step back
+			reply.index = m->previndex - 1;
+			if (reply.index >= r->log.first) {
+				reply.term = RAFT_LOG(r, reply.index).term;
+			} else {
+				reply.term = -1;
+			}
+		}
 		goto finish;
 	}
-	reply.index = r->log.first + r->log.size - 1;
+	reply.index = m->previndex + 1;
 	reply.term = RAFT_LOG(r, reply.index).term;
 
+	// the entry matched, so does everything preceding it
+	r->log.verified = min(
+		max(r->log.verified, reply.index + 1),
+		r->log.first + r->log.size
+	);
+
 	reply.success = true;
+acked:
+	// the leader's acked may cover entries we have not verified yet
+	if (min(m->acked, r->log.verified) > r->log.acked) {
+		r->log.acked = min(m->acked, r->log.verified);
+		raft_server_t *s = r->servers + sender;
+		s->acked = s->tosend = r->log.acked;
+	}
+	if (m->empty) {
+		return;
+	}
 finish:
 	raft_send(r, sender, &reply, sizeof(reply));
 }
@@ -488,6 +611,10 @@ static void raft_refresh_acked(raft_t *r) {
 		int newacked = r->servers[i].acked;
 		if (newacked <= r->log.acked) continue;
 
+		// only the entries of the current term are committed by counting the
+		// replicas, the preceding ones get committed along with them (Raft §5.4.2)
+		if (RAFT_LOG(r, newacked - 1).term != r->term) continue;
+
 		int replication = 1; // count self as yes
 		for (j = 0; j < r->servernum; j++) {
 			if (j == r->me) continue;
@@ -501,9 +628,7 @@ static void raft_refresh_acked(raft_t *r) {
 		assert(replication <= r->servernum);
 
 		if (replication * 2 > r->servernum) {
-			#ifdef MAJORITY_IS_NOT_ENOUGH
-			if (replication < r->servernum) continue;
-			#endif
+			if (r->unanimous && (replication < r->servernum)) continue;
 			r->log.acked = newacked;
 		}
 	}
@@ -519,43 +644,38 @@ static void raft_handle_done(raft_t *r, raft_msg_done_t *m) {
 		return;
 	}
 
+	/*
+	 * Several updates may be in flight, so the replies are not matched
+	 * against the seqno: handling a reply twice or out of order is harmless.
+	 */
 	raft_server_t *server = r->servers + sender;
-	if (m->msg.seqno != server->seqno) {
-		debug("[from %d] ============= mseqno(%d) != sseqno(%d)\n", sender, m->msg.seqno, server->seqno);
-		return;
-	}
-	server->seqno++;
 	if (m->msg.term < r->term) {
 		debug("[from %d] ============= msgterm(%d) != term(%d)\n", sender, m->term, r->term);
 		return;
 	}
 
 	if (m->success) {
-		debug("[from %d] ============= done\n", sender);
-		server->tosend++;
-		server->acked = server->tosend;
-		raft_refresh_acked(r);
+		debug("[from %d] ============= done %d\n", sender, m->index);
+		if (m->index + 1 > server->acked) {
+			server->acked = m->index + 1;
+			server->stuck = false;
+			raft_refresh_acked(r);
+		}
+		if (server->tosend < server->acked) {
+			server->tosend = server->acked;
+		}
 	} else {
-		debug("[from %d] ============= refused\n", sender);
-		if (server->tosend > 0) {
-			// the client should have specified the last index it had gotten
-			if (server->tosend == m->index + 1) {
-				shout(
-					"[from %d] the last index I have is %d, but"
-					" I still refuse, this should not happen\n",
-					sender, m->index
-				);
-				assert(false);
-			}
-			server->tosend = m->index + 1;
+		debug("[from %d] ============= refused, continue from %d\n", sender, m->index + 1);
+		if (m->index + 1 < server->tosend) {
+			server->tosend = max(m->index + 1, 0);
+		}
+		if (server->acked > server->tosend) {
+			// the follower has restarted and lost some entries
+			server->acked = server->tosend;
 		}
-		assert(server->tosend >= server->acked); // FIXME: remove this, because 'tosend' is actually allowed to be less than 'acked' if the follower has restarted
 	}
 
-	if (server->tosend < r->log.first + r->log.size) {
-		// send the next entry
-		raft_beat(r, sender);
-	}
+	raft_replicate(r, sender);
 }
 
 static void raft_set_term(raft_t *r, int term) {
@@ -563,12 +683,15 @@ static void raft_set_term(raft_t *r, int term) {
 	r->term = term;
 	r->vote = NOBODY;
 	r->votes = 0;
+	r->log.verified = r->log.acked;
 }
 
 void raft_ensure_term(raft_t *r, int term) {
 	assert(r->role == ROLE_LEADER);
 	if (term > r->term) {
 		r->term = term;
+		// the entries of the previous term get committed along with this one
+		raft_append_pending(r);
 	}
 }
 
@@ -580,7 +703,7 @@ static void raft_handle_claim(raft_t *r, raft_msg_claim_t *m) {
 			shout("demoting myself\n");
 		}
 		if (m->msg.term > r->term) {
-			raft_set_term(r, m->term);
+			raft_set_term(r, m->msg.term);
 		}
 		r->role = ROLE_FOLLOWER;
 	}
@@ -595,13 +718,12 @@ static void raft_handle_claim(raft_t *r, raft_msg_claim_t *m) {
 
 	if (m->msg.term < r->term) goto finish;
 
-	// check if the candidate's log is up to date
-	if (m->index < r->log.first + r->log.size - 1) goto finish;
-	if (m->index == r->log.first + r->log.size - 1) {
-		if ((m->index >= 0) && (RAFT_LOG(r, m->index).term != m->term)) {
-			goto finish;
-		}
-	}
+	// check if the candidate's log is up to date: the later last term wins,
+	// and the longer log wins if the last terms are equal
+	int lastindex = r->log.first + r->log.size - 1;
+	int lastterm = (lastindex >= 0) ? RAFT_LOG(r, lastindex).term : -1;
+	if (m->term < lastterm) goto finish;
+	if ((m->term == lastterm) && (m->index < lastindex)) goto finish;
 
 	if ((r->vote == NOBODY) || (r->vote == candidate)) {
 		r->vote = candidate;
@@ -627,9 +749,19 @@ static void raft_handle_vote(raft_t *r, raft_msg_vote_t *m) {
 
 	if (r->votes * 2 > r->servernum) {
 		// got the support of a majority
+		int i;
 		r->role = ROLE_LEADER;
 		r->leader = r->me;
+		for (i = 0; i < r->servernum; i++) {
+			raft_server_t *s = r->servers + i;
+			s->tosend = s->acked = s->beaten = r->log.acked;
+		}
 		raft_reset_timer(r);
+
+		// the entries of the previous terms get committed along with the first
+		// entry of ours, the updates emitted in a lost term are never resurrected
+		r->pending.nupdates = 0;
+		raft_append_pending(r);
 	}
 }
 
@@ -662,7 +794,7 @@ void raft_handle_message(raft_t *r, raft_msg_t *m) {
 	}
 }
 
-static char buf[1024];
+static char buf[sizeof(raft_msg_update_t)]; // the largest message
 
 raft_msg_t *raft_recv_message(raft_t *r) {
 	struct sockaddr_in addr;
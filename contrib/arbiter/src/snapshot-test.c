@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "xidlist.h"
+#include "util.h"
+
+/*
+ * Plays the arbiter and a client asking it for snapshots: the arbiter keeps
+ * the recent snapshots by version and replies with the difference from the
+ * one the client has, or with the full snapshot if that one is forgotten.
+ */
+
+static Snapshot history[SNAPSHOT_HISTORY];
+static uint64_t version;
+
+static xid_t active[MAX_TRANSACTIONS];
+static int nactive;
+static xid_t next_xid = 100;
+
+typedef struct Client {
+	uint64_t version;
+	xid_t xip[MAX_TRANSACTIONS];
+	int xcnt;
+} Client;
+
+static xid_t removed[MAX_TRANSACTIONS];
+static xid_t added[MAX_TRANSACTIONS];
+
+static Snapshot *gen_snapshot(void) {
+	Snapshot *h = &history[version % SNAPSHOT_HISTORY];
+	h->version = version;
+	h->nactive = nactive;
+	memcpy(h->active, active, sizeof(xid_t) * nactive);
+	return h;
+}
+
+static void begin(int n) {
+	while (n-- > 0) {
+		active[nactive++] = next_xid++;
+	}
+	version += 1;
+}
+
+static void finish(int i) {
+	memmove(active + i, active + i + 1, sizeof(xid_t) * (nactive - i - 1));
+	nactive -= 1;
+	version += 1;
+}
+
+/* Returns true if the difference has been sent, false if the full snapshot */
+static bool get_snapshot(Client *c) {
+	Snapshot *snap = gen_snapshot();
+	Snapshot *base = snapshot_history_find(history, c->version);
+	int nremoved, nadded;
+
+	if (!snapshot_delta(base, snap, removed, &nremoved, added, &nadded)) {
+		c->xcnt = xidlist_apply(c->xip, 0, MAX_TRANSACTIONS, NULL, 0, snap->active, snap->nactive);
+		c->version = snap->version;
+		return false;
+	}
+	c->xcnt = xidlist_apply(c->xip, c->xcnt, MAX_TRANSACTIONS, removed, nremoved, added, nadded);
+	c->version = snap->version;
+	return true;
+}
+
+static bool check_client(Client *c, bool delta, bool expected, const char *what) {
+	bool same = (c->xcnt == nactive) && (memcmp(c->xip, active, sizeof(xid_t) * nactive) == 0);
+	bool ok = same && (delta == expected);
+	printf(
+		"%s: %s, %d xids %s (%s)\n",
+		what, delta ? "delta" : "full", c->xcnt,
+		same ? "match" : "DIFFER",
+		ok ? "ok" : "FAILED"
+	);
+	return ok;
+}
+
+static bool check_apply_overflow(void) {
+	xid_t xip[4] = {1, 3, 5};
+	xid_t rm[] = {3};
+	xid_t add[] = {2, 4, 6};
+	bool ok = xidlist_apply(xip, 3, 4, rm, 1, add, 3) == -1;
+	printf("overflow is detected (%s)\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int main() {
+	bool ok = true;
+	Client c;
+	int i;
+
+	memset(&c, 0, sizeof(c));
+	version = 1;
+	begin(20);
+
+	ok &= check_client(&c, get_snapshot(&c), false, "no snapshot yet");
+
+	finish(3);
+	finish(10);
+	begin(2);
+	ok &= check_client(&c, get_snapshot(&c), true, "few changes");
+	ok &= check_client(&c, get_snapshot(&c), true, "nothing changed");
+
+	// the difference is longer than the snapshot
+	for (i = 0; i < 15; i++) {
+		finish(0);
+	}
+	begin(1);
+	ok &= check_client(&c, get_snapshot(&c), false, "many changes");
+
+	// the version of the client is overwritten in the history
+	begin(10);
+	get_snapshot(&c);
+	for (i = 0; i < SNAPSHOT_HISTORY; i++) {
+		begin(1);
+		gen_snapshot();
+	}
+	finish(0);
+	ok &= check_client(&c, get_snapshot(&c), false, "base version forgotten");
+
+	// the oldest version still kept
+	for (i = 0; i < SNAPSHOT_HISTORY - 1; i++) {
+		begin(1);
+		gen_snapshot();
+	}
+	ok &= check_client(&c, get_snapshot(&c), true, "oldest version kept");
+
+	// random workload, a client asking for snapshots at random moments
+	srand(0);
+	for (i = 0; i < 10000; i++) {
+		if ((nactive < MAX_TRANSACTIONS / 2) && (rand() % 2)) {
+			begin(rand() % 3 + 1);
+		} else if (nactive > 0) {
+			finish(rand() % nactive);
+		}
+		gen_snapshot();
+		if (rand() % (SNAPSHOT_HISTORY + 4) == 0) {
+			bool delta = get_snapshot(&c);
+			if ((c.xcnt != nactive) || memcmp(c.xip, active, sizeof(xid_t) * nactive)) {
+				ok &= check_client(&c, delta, delta, "random workload");
+				break;
+			}
+		}
+	}
+	printf("random workload: %d steps (%s)\n", i, i == 10000 ? "ok" : "FAILED");
+	ok &= i == 10000;
+
+	ok &= check_apply_overflow();
+
+	if (ok) {
+		printf("snapshot-test passed\n");
+		return EXIT_SUCCESS;
+	} else {
+		printf("snapshot-test FAILED\n");
+		return EXIT_FAILURE;
+	}
+}
@@ -14,3 +14,47 @@ static int compare_xid(void const* x, void const* y) {
 void snapshot_sort(Snapshot *s) {
 	qsort(s->active, s->nactive, sizeof(xid_t), compare_xid);
 }
+
+/*
+ * Both snapshots have sorted active lists, so the difference is found by a
+ * single merge pass. Fills 'removed' with xids active in 'from' but not in
+ * 'to', and 'added' with xids active in 'to' but not in 'from'.
+ */
+void snapshot_diff(Snapshot *from, Snapshot *to, xid_t *removed, int *nremoved, xid_t *added, int *nadded) {
+	int i = 0, j = 0;
+	*nremoved = *nadded = 0;
+	while (i < from->nactive && j < to->nactive) {
+		if (from->active[i] < to->active[j]) {
+			removed[(*nremoved)++] = from->active[i++];
+		} else if (from->active[i] > to->active[j]) {
+			added[(*nadded)++] = to->active[j++];
+		} else {
+			i++;
+			j++;
+		}
+	}
+	while (i < from->nactive) {
+		removed[(*nremoved)++] = from->active[i++];
+	}
+	while (j < to->nactive) {
+		added[(*nadded)++] = to->active[j++];
+	}
+}
+
+Snapshot *snapshot_history_find(Snapshot *history, uint64_t version) {
+	Snapshot *h = &history[version % SNAPSHOT_HISTORY];
+	return (version != 0 && h->version == version) ? h : NULL;
+}
+
+/*
+ * Fills the difference from 'base' to 'to', if it is worth sending. Returns
+ * false if the full snapshot should be sent instead: the base snapshot is
+ * forgotten (NULL) or the difference is not shorter than the snapshot itself.
+ */
+bool snapshot_delta(Snapshot *base, Snapshot *to, xid_t *removed, int *nremoved, xid_t *added, int *nadded) {
+	if (base == NULL) {
+		return false;
+	}
+	snapshot_diff(base, to, removed, nremoved, added, nadded);
+	return *nremoved + *nadded < to->nactive;
+}
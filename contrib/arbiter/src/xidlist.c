@@ -0,0 +1,36 @@
+#include "xidlist.h"
+
+/*
+ * Single merge pass: all the lists are sorted. New xids are merged from the
+ * tail, so that no xid is overwritten before it is moved.
+ */
+int xidlist_apply(xid_t *xip, int xcnt, int maxcnt, xid_t *removed, int nremoved, xid_t *added, int nadded) {
+	int i, j, k, n;
+
+	// drop finished transactions
+	for (i = 0, j = 0, n = 0; i < xcnt; i++) {
+		while (j < nremoved && removed[j] < xip[i]) {
+			j++;
+		}
+		if (j < nremoved && removed[j] == xip[i]) {
+			j++;
+		} else {
+			xip[n++] = xip[i];
+		}
+	}
+	if (n + nadded > maxcnt) {
+		return -1;
+	}
+
+	i = n - 1;
+	j = nadded - 1;
+	n += nadded;
+	for (k = n - 1; j >= 0; k--) {
+		if (i >= 0 && xip[i] > added[j]) {
+			xip[k] = xip[i--];
+		} else {
+			xip[k] = added[j--];
+		}
+	}
+	return n;
+}
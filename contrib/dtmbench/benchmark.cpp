@@ -0,0 +1,260 @@
+#include <unistd.h>
+
+#include "dtmbench.h"
+
+using namespace pqxx;
+
+Config::Config()
+{
+    workload = "transfer";
+    protocol = "local";
+    isolationLevel = "read committed";
+    nReaders = 1;
+    nWriters = 10;
+    nIterations = 1000;
+    duration = 0;
+    nAccounts = 100000;
+    firstAccount = 0;
+    range = 0;
+    updatePercent = -1;
+    nReads = 10;
+    nHotAccounts = 10;
+    hotPercent = 90;
+    nShards = 0;
+    rate = 0;
+    reportInterval = 1;
+    initialize = false;
+    prepared = false;
+    pipelined = false;
+    avoidDeadlocks = false;
+    maxSnapshot = false;
+    pathman = false;
+    format = OUTPUT_TEXT;
+}
+
+Benchmark::Benchmark(Config const& config, Protocol& proto, Workload& load)
+: cfg(config), protocol(proto), workload(load), start(0), elapsed(0), running(false) {}
+
+void Benchmark::initialize()
+{
+    timestamp_t begin = getCurrentTime();
+    size_t nNodes = protocol.distributed() ? cfg.connections.size() : 1;
+    for (size_t i = 0; i < nNodes; i++) {
+        connection conn(cfg.connections[i]);
+        protocol.initialize(conn, cfg);
+    }
+    fprintf(stderr, "%d accounts inserted in %f seconds\n", cfg.nAccounts, (double)(getCurrentTime() - begin)/USEC);
+}
+
+/*
+ * With rate limit transactions are started according to the schedule and latency is measured
+ * from the scheduled start, so delays of the system are not hidden by postponing of the following
+ * transactions (coordinated omission). Without rate limit latency is measured from actual start.
+ */
+void* Benchmark::writer(void* arg)
+{
+    Worker& w = *(Worker*)arg;
+    Benchmark& bench = *w.bench;
+    Config const& cfg = bench.cfg;
+    Session& session = *w.session;
+    timestamp_t interval = cfg.rate > 0 ? (timestamp_t)(USEC*cfg.nWriters/cfg.rate) : 0;
+    timestamp_t deadline = cfg.duration != 0 ? bench.start + (timestamp_t)cfg.duration*USEC : 0;
+    timestamp_t next = bench.start + interval*session.id/cfg.nWriters;
+    Plan plan;
+
+    for (int i = 0; bench.running && (deadline != 0 || i < cfg.nIterations); i++) {
+        timestamp_t scheduled = getCurrentTime();
+        if (interval != 0) {
+            if (next > scheduled) {
+                usleep(next - scheduled);
+            }
+            scheduled = next;
+            next += interval;
+        }
+        if (deadline != 0 && scheduled >= deadline) {
+            break;
+        }
+        plan.clear();
+        bench.workload.generate(session, plan);
+        while (!session.run(plan) && bench.running);
+
+        session.stats.latency[plan.readOnly ? OP_READ : OP_UPDATE].add(getCurrentTime() - scheduled);
+        session.stats.transactions += 1;
+    }
+    return NULL;
+}
+
+/*
+ * Readers check that total balance of accounts at all nodes is zero
+ */
+void* Benchmark::reader(void* arg)
+{
+    Worker& w = *(Worker*)arg;
+    Benchmark& bench = *w.bench;
+    Session& session = *w.session;
+    int nParticipants = bench.protocol.distributed() ? session.nNodes() : 1;
+    Plan plan;
+
+    while (bench.running) {
+        timestamp_t start = getCurrentTime();
+        plan.clear();
+        for (int i = 0; i < nParticipants; i++) {
+            plan.total(i);
+        }
+        if (!session.run(plan)) {
+            continue;
+        }
+        session.stats.latency[OP_CHECK].add(getCurrentTime() - start);
+        session.stats.transactions += 1;
+
+        int64_t sum = 0;
+        for (size_t i = 0; i < plan.statements.size(); i++) {
+            sum += plan.statements[i].result;
+        }
+        if (sum != 0) {
+            fprintf(stderr, "Total=%ld, transaction %s\n", (long)sum, session.gtid.c_str());
+            session.stats.inconsistencies += 1;
+        }
+    }
+    return NULL;
+}
+
+void* Benchmark::monitor(void* arg)
+{
+    Benchmark& bench = *(Benchmark*)arg;
+    FILE* out = bench.cfg.format == OUTPUT_TEXT ? stdout : stderr;
+    size_t prevTransactions = 0;
+    size_t prevAborts = 0;
+
+    while (bench.running) {
+        sleep(bench.cfg.reportInterval);
+        size_t transactions = 0;
+        size_t aborts = 0;
+        for (size_t i = 0; i < bench.workers.size(); i++) {
+            if (!bench.workers[i].reader) {
+                transactions += bench.workers[i].session->stats.transactions;
+                aborts += bench.workers[i].session->stats.aborts;
+            }
+        }
+        fprintf(out, "%d: %5ld TPS, %ld aborts\n", (int)((getCurrentTime() - bench.start)/USEC),
+                (long)(transactions - prevTransactions)/bench.cfg.reportInterval, (long)(aborts - prevAborts));
+        fflush(out);
+        prevTransactions = transactions;
+        prevAborts = aborts;
+    }
+    return NULL;
+}
+
+void Benchmark::run()
+{
+    pthread_t logger;
+
+    /* Establish all connections before start of measurement */
+    workers.resize(cfg.nWriters + cfg.nReaders);
+    for (int i = 0; i < cfg.nWriters + cfg.nReaders; i++) {
+        workers[i].bench = this;
+        workers[i].reader = i >= cfg.nWriters;
+        workers[i].session = new Session(cfg, protocol, i); /* distinct ids make distinct gtids */
+    }
+
+    running = true;
+    start = getCurrentTime();
+    for (size_t i = 0; i < workers.size(); i++) {
+        pthread_create(&workers[i].thread, NULL, workers[i].reader ? reader : writer, &workers[i]);
+    }
+    if (cfg.reportInterval != 0) {
+        pthread_create(&logger, NULL, monitor, this);
+    }
+
+    for (int i = 0; i < cfg.nWriters; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    elapsed = getCurrentTime() - start;
+    running = false;
+
+    for (size_t i = cfg.nWriters; i < workers.size(); i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (cfg.reportInterval != 0) {
+        pthread_join(logger, NULL);
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        Stats& stats = workers[i].session->stats;
+        if (workers[i].reader) {
+            /* Throughput is measured by writers */
+            total.inconsistencies += stats.inconsistencies;
+            total.latency[OP_CHECK].merge(stats.latency[OP_CHECK]);
+        } else {
+            total.merge(stats);
+        }
+        delete workers[i].session;
+    }
+    workers.clear();
+}
+
+static double percent(size_t part, size_t whole)
+{
+    return whole != 0 ? part*100.0/whole : 0;
+}
+
+void Benchmark::report(FILE* out)
+{
+    double tps = elapsed != 0 ? (double)total.transactions*USEC/elapsed : 0;
+
+    switch (cfg.format) {
+      case OUTPUT_JSON:
+        fprintf(out,
+                "{\"workload\":\"%s\", \"protocol\":\"%s\", \"tps\":%f, \"transactions\":%ld,"
+                " \"aborts\":%ld, \"abort_percent\":%f, \"inconsistencies\":%ld, \"elapsed\":%f,"
+                " \"readers\":%d, \"writers\":%d, \"update_percent\":%d, \"accounts\":%d,"
+                " \"iterations\":%d, \"duration\":%d, \"rate\":%f, \"prepared\":%s, \"pipelined\":%s, \"hosts\":%ld, \"latency\":{",
+                cfg.workload.c_str(), cfg.protocol.c_str(), tps, (long)total.transactions,
+                (long)total.aborts, percent(total.aborts, total.transactions + total.aborts), (long)total.inconsistencies,
+                (double)elapsed/USEC, cfg.nReaders, cfg.nWriters, cfg.updatePercent, cfg.nAccounts,
+                cfg.nIterations, cfg.duration, cfg.rate, cfg.prepared ? "true" : "false", cfg.pipelined ? "true" : "false",
+                (long)cfg.connections.size());
+        for (int op = 0, n = 0; op < N_OPERATIONS; op++) {
+            Histogram const& h = total.latency[op];
+            if (h.count() != 0) {
+                fprintf(out, "%s\"%s\":{\"count\":%ld, \"avg\":%ld, \"p50\":%ld, \"p90\":%ld, \"p99\":%ld, \"p999\":%ld, \"max\":%ld}",
+                        n++ != 0 ? ", " : "", operationName[op], (long)h.count(), (long)h.average(),
+                        (long)h.percentile(0.5), (long)h.percentile(0.9), (long)h.percentile(0.99), (long)h.percentile(0.999),
+                        (long)h.max());
+            }
+        }
+        fprintf(out, "}}\n");
+        break;
+
+      case OUTPUT_CSV:
+        fprintf(out, "workload,protocol,writers,readers,hosts,rate,prepared,pipelined,tps,aborts,operation,count,avg,p50,p90,p99,p999,max\n");
+        for (int op = 0; op < N_OPERATIONS; op++) {
+            Histogram const& h = total.latency[op];
+            if (h.count() != 0) {
+                fprintf(out, "%s,%s,%d,%d,%ld,%f,%d,%d,%f,%ld,%s,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n",
+                        cfg.workload.c_str(), cfg.protocol.c_str(), cfg.nWriters, cfg.nReaders, (long)cfg.connections.size(),
+                        cfg.rate, cfg.prepared, cfg.pipelined, tps, (long)total.aborts,
+                        operationName[op], (long)h.count(), (long)h.average(),
+                        (long)h.percentile(0.5), (long)h.percentile(0.9), (long)h.percentile(0.99), (long)h.percentile(0.999),
+                        (long)h.max());
+            }
+        }
+        break;
+
+      case OUTPUT_TEXT:
+        fprintf(out, "TPS=%f, transactions=%ld, aborts=%ld (%.2f%%), inconsistencies=%ld, elapsed=%f sec\n",
+                tps, (long)total.transactions, (long)total.aborts, percent(total.aborts, total.transactions + total.aborts),
+                (long)total.inconsistencies, (double)elapsed/USEC);
+        fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s %10s\n", "usec", "count", "avg", "p50", "p90", "p99", "p99.9", "max");
+        for (int op = 0; op < N_OPERATIONS; op++) {
+            Histogram const& h = total.latency[op];
+            if (h.count() != 0) {
+                fprintf(out, "%-10s %10ld %10ld %10ld %10ld %10ld %10ld %10ld\n",
+                        operationName[op], (long)h.count(), (long)h.average(),
+                        (long)h.percentile(0.5), (long)h.percentile(0.9), (long)h.percentile(0.99), (long)h.percentile(0.999),
+                        (long)h.max());
+            }
+        }
+        break;
+    }
+}
@@ -0,0 +1,272 @@
+/*
+ * dtmbench.h
+ *
+ * Benchmark of distributed transaction managers shared by multimaster, pg_dtm, pg_tsdtm,
+ * postgres_fdw, bdr and pg_shard tests. Workload (which accounts are accessed by transaction)
+ * and protocol (how transaction is started and committed at participating nodes) are pluggable.
+ */
+#ifndef __DTMBENCH_H__
+#define __DTMBENCH_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include <pqxx/connection>
+#include <pqxx/nontransaction>
+#include <pqxx/pipeline>
+
+using namespace std;
+
+#define USEC 1000000
+
+typedef int64_t timestamp_t; /* microseconds */
+
+timestamp_t getCurrentTime();
+
+/* snprintf into std::string */
+string format(char const* fmt, ...);
+
+enum OutputFormat
+{
+    OUTPUT_TEXT,
+    OUTPUT_JSON,
+    OUTPUT_CSV
+};
+
+struct Config
+{
+    vector<string> connections;
+    string workload;
+    string protocol;
+    string isolationLevel;
+    int nReaders;
+    int nWriters;
+    int nIterations;    /* per writer, ignored if duration is specified */
+    int duration;       /* seconds */
+    int nAccounts;      /* number of accounts created by initialization */
+    int firstAccount;   /* accounts [firstAccount, firstAccount+range) are used by this client */
+    int range;
+    int updatePercent;  /* -1: default of workload */
+    int nReads;         /* number of accounts read by read-mostly transaction */
+    int nHotAccounts;
+    int hotPercent;
+    int nShards;        /* postgres_fdw: number of foreign tables populated by initialization */
+    double rate;        /* total rate of writers' transactions per second, 0 means closed loop */
+    int reportInterval; /* seconds */
+    bool initialize;
+    bool prepared;
+    bool pipelined;
+    bool avoidDeadlocks;
+    bool maxSnapshot;
+    bool pathman;
+    OutputFormat format;
+
+    Config();
+};
+
+/*
+ * Log-linear histogram of latencies: each power of two is split into SUB_BUCKETS buckets,
+ * so relative error of percentiles doesn't exceed 1/SUB_BUCKETS.
+ */
+class Histogram
+{
+  public:
+    enum {
+        SUB_BUCKETS_LOG = 4,
+        SUB_BUCKETS = 1 << SUB_BUCKETS_LOG,
+        N_BUCKETS = 64 << SUB_BUCKETS_LOG
+    };
+
+    Histogram();
+    void add(timestamp_t value);
+    void merge(Histogram const& other);
+    timestamp_t percentile(double q) const;
+    uint64_t count() const { return n; }
+    timestamp_t average() const { return n != 0 ? (timestamp_t)(sum/n) : 0; }
+    timestamp_t max() const { return maximum; }
+
+  private:
+    static int bucket(uint64_t value);
+    static uint64_t bucketBound(int bucket);
+
+    vector<uint64_t> buckets;
+    uint64_t n;
+    uint64_t sum;
+    timestamp_t maximum;
+};
+
+enum Operation
+{
+    OP_UPDATE, /* read-write transaction, measured from its scheduled start */
+    OP_READ,   /* read-only transaction of writer */
+    OP_CHECK,  /* reader's transaction checking total balance */
+    OP_BEGIN,  /* start of distributed transaction by protocol */
+    OP_COMMIT, /* commit of distributed transaction by protocol */
+    N_OPERATIONS
+};
+
+extern char const* const operationName[N_OPERATIONS];
+
+struct Stats
+{
+    Histogram latency[N_OPERATIONS];
+    size_t transactions;
+    size_t aborts;
+    size_t inconsistencies;
+
+    Stats() : transactions(0), aborts(0), inconsistencies(0) {}
+    void merge(Stats const& other);
+};
+
+enum StatementKind
+{
+    STMT_UPDATE,
+    STMT_SELECT,
+    STMT_TOTAL
+};
+
+struct Statement
+{
+    StatementKind kind;
+    int participant;
+    int account;
+    int delta;
+    int64_t result;
+};
+
+/*
+ * Transaction generated by workload. Participants are numbered from 0 and are mapped
+ * to the nodes by session: with non-distributed protocol all of them refer to the same node.
+ */
+struct Plan
+{
+    vector<Statement> statements;
+    int nParticipants;
+    bool readOnly;
+
+    Plan() : nParticipants(1), readOnly(true) {}
+    void clear();
+    void update(int participant, int account, int delta);
+    void select(int participant, int account);
+    void total(int participant);
+};
+
+class Session;
+
+class Protocol
+{
+  public:
+    virtual ~Protocol() {}
+
+    /* Whether transaction can span several nodes */
+    virtual bool distributed() const = 0;
+
+    /* Create schema at the node, called for all nodes if protocol is distributed, otherwise for the first one */
+    virtual void initialize(pqxx::connection& conn, Config const& cfg);
+
+    virtual void begin(Session& session) = 0;
+    virtual void commit(Session& session) = 0;
+
+    /* Rollback transaction at all participants, errors are ignored */
+    virtual void abort(Session& session);
+};
+
+/* Returns NULL if there is no protocol with such name */
+Protocol* createProtocol(string const& name);
+extern char const* const protocolNames;
+
+class Workload
+{
+  public:
+    virtual ~Workload() {}
+    virtual void generate(Session& session, Plan& plan) = 0;
+};
+
+/* Returns NULL if there is no workload with such name */
+Workload* createWorkload(string const& name);
+extern char const* const workloadNames;
+
+/*
+ * Connections of benchmark thread to all nodes and state of its current transaction
+ */
+class Session
+{
+  public:
+    Config const& cfg;
+    Protocol& protocol;
+    int id;
+    Stats stats;
+    string gtid;   /* identifier of current transaction, unique among all clients */
+    vector<bool> prepared; /* participants at which transaction is prepared, so it has to be aborted by "rollback prepared" */
+
+    Session(Config const& cfg, Protocol& protocol, int id);
+    ~Session();
+
+    int nNodes() const { return (int)conns.size(); }
+    int nParticipants() const { return (int)nodes.size(); }
+    uint32_t random(uint32_t n);
+
+    /* Execute plan by protocol, returns false if transaction is aborted */
+    bool run(Plan& plan);
+
+    void exec(int participant, string const& sql);
+    int64_t query(int participant, string const& sql);
+
+    /* Execute statement at all participants, concurrently if pipelining is enabled */
+    void execAll(string const& sql);
+    vector<int64_t> queryAll(string const& sql);
+
+    /* Execute "prepare transaction" at all participants, marking those at which it succeeded */
+    void prepareAll(string const& sql);
+
+  private:
+    void open(Plan const& plan);
+    void close();
+    string statementText(Statement const& stmt) const;
+    vector<pqxx::result> runAll(string const& sql);
+
+    string clientId;
+    vector<pqxx::connection*> conns;
+    vector<int> nodes;
+    vector<pqxx::nontransaction*> txns;
+    uint64_t seed;
+    size_t seqno;
+};
+
+class Benchmark
+{
+  public:
+    Benchmark(Config const& cfg, Protocol& protocol, Workload& workload);
+
+    void initialize();
+    void run();
+    void report(FILE* out);
+
+  private:
+    struct Worker
+    {
+        Benchmark* bench;
+        Session* session;
+        pthread_t thread;
+        bool reader;
+    };
+
+    static void* writer(void* arg);
+    static void* reader(void* arg);
+    static void* monitor(void* arg);
+
+    Config const& cfg;
+    Protocol& protocol;
+    Workload& workload;
+    vector<Worker> workers;
+    Stats total;
+    timestamp_t start;
+    timestamp_t elapsed;
+    volatile bool running;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dtmbench.h"
+
+static void usage()
+{
+    printf("Options:\n"
+           "\t-c STR\tdatabase connection string, repeat for each node\n"
+           "\t-r N\tnumber of readers (1)\n"
+           "\t-w N\tnumber of writers (10)\n"
+           "\t-a N\tnumber of accounts (100000)\n"
+           "\t-n N\tnumber of iterations per writer (1000)\n"
+           "\t-t N\tduration of test in seconds, overrides number of iterations\n"
+           "\t-p N\tupdate percent (100, 5 for readmostly)\n"
+           "\t-l STR\tisolation level (read committed)\n"
+           "\t-s\tscatter ids to avoid conflicts, same as --workload scatter\n"
+           "\t-d\tavoid deadlocks by ordering accounts\n"
+           "\t-P\tuse prepared statements\n"
+           "\t-i\tinitialize database\n"
+           "\t--workload NAME\tworkload: %s (transfer)\n"
+           "\t--protocol NAME\ttransaction manager: %s (local)\n"
+           "\t--rate N\ttotal rate of transactions per second, 0 means closed loop (0)\n"
+           "\t--pipeline\tsend statements to the nodes through libpqxx pipelines\n"
+           "\t--reads N\tnumber of accounts read by readmostly transaction (10)\n"
+           "\t--hot-accounts N\tnumber of hot accounts for hotkey workload (10)\n"
+           "\t--hot-percent N\tpercent of accesses to hot accounts (90)\n"
+           "\t--first-account N\tfirst account used by this client (0)\n"
+           "\t--range N\tnumber of accounts used by this client (all accounts)\n"
+           "\t--max-snapshot\ttsdtm: use maximal snapshot of participants\n"
+           "\t--shards N\tfdw: number of foreign tables populated by initialization (0)\n"
+           "\t--pathman\tfdw: create partitions using pg_pathman\n"
+           "\t--format FMT\toutput format: text, json or csv (text)\n"
+           "\t--report-interval N\tinterval of progress reports in seconds, 0 disables them (1)\n",
+           workloadNames, protocolNames);
+}
+
+int main(int argc, char* argv[])
+{
+    Config cfg;
+
+    if (argc == 1) {
+        printf("Use -h to show usage options\n");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        char const* opt = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (strcmp(opt, "-c") == 0 && hasValue) {
+            cfg.connections.push_back(string(argv[++i]));
+        } else if (strcmp(opt, "-r") == 0 && hasValue) {
+            cfg.nReaders = atoi(argv[++i]);
+        } else if (strcmp(opt, "-w") == 0 && hasValue) {
+            cfg.nWriters = atoi(argv[++i]);
+        } else if (strcmp(opt, "-a") == 0 && hasValue) {
+            cfg.nAccounts = atoi(argv[++i]);
+        } else if (strcmp(opt, "-n") == 0 && hasValue) {
+            cfg.nIterations = atoi(argv[++i]);
+        } else if (strcmp(opt, "-t") == 0 && hasValue) {
+            cfg.duration = atoi(argv[++i]);
+        } else if (strcmp(opt, "-p") == 0 && hasValue) {
+            cfg.updatePercent = atoi(argv[++i]);
+        } else if (strcmp(opt, "-l") == 0 && hasValue) {
+            cfg.isolationLevel = argv[++i];
+        } else if (strcmp(opt, "-s") == 0) {
+            cfg.workload = "scatter";
+        } else if (strcmp(opt, "-d") == 0) {
+            cfg.avoidDeadlocks = true;
+        } else if (strcmp(opt, "-P") == 0) {
+            cfg.prepared = true;
+        } else if (strcmp(opt, "-i") == 0) {
+            cfg.initialize = true;
+        } else if (strcmp(opt, "--workload") == 0 && hasValue) {
+            cfg.workload = argv[++i];
+        } else if (strcmp(opt, "--protocol") == 0 && hasValue) {
+            cfg.protocol = argv[++i];
+        } else if (strcmp(opt, "--rate") == 0 && hasValue) {
+            cfg.rate = atof(argv[++i]);
+        } else if (strcmp(opt, "--pipeline") == 0) {
+            cfg.pipelined = true;
+        } else if (strcmp(opt, "--reads") == 0 && hasValue) {
+            cfg.nReads = atoi(argv[++i]);
+        } else if (strcmp(opt, "--hot-accounts") == 0 && hasValue) {
+            cfg.nHotAccounts = atoi(argv[++i]);
+        } else if (strcmp(opt, "--hot-percent") == 0 && hasValue) {
+            cfg.hotPercent = atoi(argv[++i]);
+        } else if (strcmp(opt, "--first-account") == 0 && hasValue) {
+            cfg.firstAccount = atoi(argv[++i]);
+        } else if (strcmp(opt, "--range") == 0 && hasValue) {
+            cfg.range = atoi(argv[++i]);
+        } else if (strcmp(opt, "--max-snapshot") == 0) {
+            cfg.maxSnapshot = true;
+        } else if (strcmp(opt, "--shards") == 0 && hasValue) {
+            cfg.nShards = atoi(argv[++i]);
+        } else if (strcmp(opt, "--pathman") == 0) {
+            cfg.pathman = true;
+        } else if (strcmp(opt, "--format") == 0 && hasValue) {
+            string fmt = argv[++i];
+            if (fmt == "text") {
+                cfg.format = OUTPUT_TEXT;
+            } else if (fmt == "json") {
+                cfg.format = OUTPUT_JSON;
+            } else if (fmt == "csv") {
+                cfg.format = OUTPUT_CSV;
+            } else {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(opt, "--report-interval") == 0 && hasValue) {
+            cfg.reportInterval = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (cfg.connections.empty()) {
+        printf("At least one connection has to be specified\n");
+        return 1;
+    }
+    if (cfg.range <= 0) {
+        cfg.range = cfg.nAccounts - cfg.firstAccount;
+    }
+    if (cfg.nWriters <= 0 || cfg.range < cfg.nWriters) {
+        printf("Number of writers should be positive and not larger than number of accounts\n");
+        return 1;
+    }
+
+    Protocol* protocol = createProtocol(cfg.protocol);
+    if (protocol == NULL) {
+        printf("Unknown protocol %s, supported protocols are: %s\n", cfg.protocol.c_str(), protocolNames);
+        return 1;
+    }
+    Workload* workload = createWorkload(cfg.workload);
+    if (workload == NULL) {
+        printf("Unknown workload %s, supported workloads are: %s\n", cfg.workload.c_str(), workloadNames);
+        return 1;
+    }
+
+    Benchmark bench(cfg, *protocol, *workload);
+    try {
+        if (cfg.initialize) {
+            bench.initialize();
+            return 0;
+        }
+        bench.run();
+    } catch (pqxx::pqxx_exception const& x) {
+        fprintf(stderr, "%s\n", x.base().what());
+        return 1;
+    }
+    bench.report(stdout);
+
+    delete workload;
+    delete protocol;
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Protocols of distributed transaction managers. Transaction is started and committed by explicit
+ * statements sent through nontransaction objects, so all protocols share the same execution path.
+ */
+#include <algorithm>
+
+#include "dtmbench.h"
+
+using namespace pqxx;
+
+char const* const protocolNames = "local, fdw, pg_shard, pg_dtm, tsdtm";
+
+void Protocol::initialize(connection& conn, Config const& cfg)
+{
+    nontransaction txn(conn);
+    txn.exec("drop table if exists t");
+    txn.exec("create table t(u int primary key, v int)");
+    txn.exec(format("insert into t (select generate_series(0,%d), 0)", cfg.nAccounts-1));
+}
+
+void Protocol::abort(Session& session)
+{
+    for (int i = 0; i < session.nParticipants(); i++) {
+        try {
+            session.exec(i, session.prepared[i] ? format("rollback prepared '%s'", session.gtid.c_str()) : string("rollback"));
+        } catch (pqxx_exception const&) {}
+    }
+}
+
+/*
+ * Transaction is executed at one node: multimaster, bdr, or coordinator of postgres_fdw or pg_shard
+ */
+class LocalProtocol : public Protocol
+{
+  public:
+    virtual bool distributed() const {
+        return false;
+    }
+
+    virtual void begin(Session& session) {
+        session.exec(0, "begin transaction isolation level " + session.cfg.isolationLevel);
+    }
+
+    virtual void commit(Session& session) {
+        session.exec(0, "commit");
+    }
+};
+
+/*
+ * Table t is partitioned between foreign tables t_fdw1..t_fdwN which are created by tests/reinit-fdw.sh
+ */
+class FdwProtocol : public LocalProtocol
+{
+  public:
+    virtual void initialize(connection& conn, Config const& cfg) {
+        if (cfg.nShards == 0) {
+            nontransaction txn(conn);
+            txn.exec(format("insert into t (select generate_series(0,%d), 0)", cfg.nAccounts-1));
+            return;
+        }
+        int accountsPerShard = (cfg.nAccounts + cfg.nShards - 1)/cfg.nShards;
+        for (int i = 0; i < cfg.nShards; i++) {
+            nontransaction txn(conn);
+            if (cfg.pathman) {
+                txn.exec(format("select add_foreign_range_partition('t', %d::int, %d, 't_fdw%d', 'shard%d')",
+                                accountsPerShard*i, accountsPerShard*(i+1), i+1, i % 3 + 1));
+            } else {
+                txn.exec(format("alter table t_fdw%d add check (u between %d and %d)",
+                                i+1, accountsPerShard*i, accountsPerShard*(i+1)-1));
+            }
+            txn.exec(format("insert into t_fdw%d (select generate_series(%d,%d), 0)",
+                            i+1, accountsPerShard*i, accountsPerShard*(i+1)-1));
+        }
+    }
+};
+
+class PgShardProtocol : public LocalProtocol
+{
+  public:
+    virtual void initialize(connection& conn, Config const& cfg) {
+        nontransaction txn(conn);
+        txn.exec("create extension if not exists pg_shard");
+        txn.exec("drop table if exists t");
+        txn.exec("create table t(u int primary key, v int)");
+        txn.exec("select master_create_distributed_table(table_name := 't', partition_column := 'u')");
+        txn.exec("select master_create_worker_shards(table_name := 't', shard_count := 100, replication_factor := 1)");
+        /* pg_shard doesn't support multirow insert */
+        for (int i = 0; i < cfg.nAccounts; i++) {
+            txn.exec(format("insert into t values (%d, 0)", i));
+        }
+    }
+};
+
+/*
+ * Snapshot sharing by pg_dtm: xid assigned by arbiter at the first participant is joined by others
+ */
+class PgDtmProtocol : public Protocol
+{
+  public:
+    virtual bool distributed() const {
+        return true;
+    }
+
+    virtual void initialize(connection& conn, Config const& cfg) {
+        {
+            nontransaction txn(conn);
+            txn.exec("drop extension if exists pg_dtm");
+            txn.exec("create extension pg_dtm");
+        }
+        Protocol::initialize(conn, cfg);
+    }
+
+    virtual void begin(Session& session) {
+        int64_t xid = session.query(0, "select dtm_begin_transaction()");
+        for (int i = 1; i < session.nParticipants(); i++) {
+            session.exec(i, format("select dtm_join_transaction(%u)", (unsigned)xid));
+        }
+        session.execAll("begin transaction isolation level " + session.cfg.isolationLevel);
+    }
+
+    virtual void commit(Session& session) {
+        session.execAll("commit transaction");
+    }
+};
+
+/*
+ * Clock-SI by pg_tsdtm: snapshot is extended at the first participant and accessed at others,
+ * commit is two-phase with CSN equal to maximum of CSNs proposed by participants
+ */
+class TsDtmProtocol : public Protocol
+{
+  public:
+    virtual bool distributed() const {
+        return true;
+    }
+
+    virtual void initialize(connection& conn, Config const& cfg) {
+        {
+            nontransaction txn(conn);
+            txn.exec("drop extension if exists pg_tsdtm");
+            txn.exec("create extension pg_tsdtm");
+        }
+        Protocol::initialize(conn, cfg);
+    }
+
+    virtual void begin(Session& session) {
+        char const* gtid = session.gtid.c_str();
+        session.execAll("begin transaction isolation level " + session.cfg.isolationLevel);
+        if (session.cfg.maxSnapshot) {
+            vector<int64_t> snapshots = session.queryAll(format("select dtm_extend('%s')", gtid));
+            int64_t snapshot = *std::max_element(snapshots.begin(), snapshots.end());
+            session.execAll(format("select dtm_access(%ld, '%s')", (long)snapshot, gtid));
+        } else {
+            int64_t snapshot = session.query(0, format("select dtm_extend('%s')", gtid));
+            for (int i = 1; i < session.nParticipants(); i++) {
+                snapshot = session.query(i, format("select dtm_access(%ld, '%s')", (long)snapshot, gtid));
+            }
+        }
+    }
+
+    virtual void commit(Session& session) {
+        char const* gtid = session.gtid.c_str();
+        if (session.nParticipants() == 1) {
+            session.exec(0, "commit");
+            return;
+        }
+        session.prepareAll(format("prepare transaction '%s'", gtid));
+        session.execAll(format("select dtm_begin_prepare('%s')", gtid));
+        vector<int64_t> csns = session.queryAll(format("select dtm_prepare('%s', 0)", gtid));
+        int64_t csn = *std::max_element(csns.begin(), csns.end());
+        session.execAll(format("select dtm_end_prepare('%s', %ld)", gtid, (long)csn));
+        session.execAll(format("commit prepared '%s'", gtid));
+    }
+};
+
+Protocol* createProtocol(string const& name)
+{
+    if (name == "local") {
+        return new LocalProtocol();
+    } else if (name == "fdw") {
+        return new FdwProtocol();
+    } else if (name == "pg_shard") {
+        return new PgShardProtocol();
+    } else if (name == "pg_dtm") {
+        return new PgDtmProtocol();
+    } else if (name == "tsdtm") {
+        return new TsDtmProtocol();
+    }
+    return NULL;
+}
@@ -0,0 +1,301 @@
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <algorithm>
+
+#include "dtmbench.h"
+
+using namespace pqxx;
+
+timestamp_t getCurrentTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (timestamp_t)tv.tv_sec*USEC + tv.tv_usec;
+}
+
+string format(char const* fmt, ...)
+{
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof buf, fmt, args);
+    va_end(args);
+    if (len < 0) {
+        return string();
+    }
+    if ((size_t)len < sizeof buf) {
+        return string(buf, len);
+    }
+    vector<char> big(len + 1);
+    va_start(args, fmt);
+    vsnprintf(&big[0], big.size(), fmt, args);
+    va_end(args);
+    return string(&big[0], len);
+}
+
+void Plan::clear()
+{
+    statements.clear();
+    nParticipants = 1;
+    readOnly = true;
+}
+
+void Plan::update(int participant, int account, int delta)
+{
+    Statement stmt = { STMT_UPDATE, participant, account, delta, 0 };
+    statements.push_back(stmt);
+    readOnly = false;
+    nParticipants = std::max(nParticipants, participant + 1);
+}
+
+void Plan::select(int participant, int account)
+{
+    Statement stmt = { STMT_SELECT, participant, account, 0, 0 };
+    statements.push_back(stmt);
+    nParticipants = std::max(nParticipants, participant + 1);
+}
+
+void Plan::total(int participant)
+{
+    Statement stmt = { STMT_TOTAL, participant, 0, 0, 0 };
+    statements.push_back(stmt);
+    nParticipants = std::max(nParticipants, participant + 1);
+}
+
+/*
+ * Pipelines are destroyed before transactions they are attached to also when statement throws an exception
+ */
+struct Pipelines
+{
+    vector<pipeline*> pipes;
+
+    Pipelines(vector<nontransaction*> const& txns) : pipes(txns.size()) {
+        for (size_t i = 0; i < txns.size(); i++) {
+            pipes[i] = new pipeline(*txns[i]);
+        }
+    }
+    ~Pipelines() {
+        for (size_t i = 0; i < pipes.size(); i++) {
+            delete pipes[i];
+        }
+    }
+    pipeline& operator[](size_t i) { return *pipes[i]; }
+};
+
+static int64_t getValue(result const& r)
+{
+    return r.empty() || r[0][0].is_null() ? 0 : r[0][0].as(int64_t());
+}
+
+Session::Session(Config const& config, Protocol& proto, int sessionId)
+: cfg(config), protocol(proto), id(sessionId), seqno(0)
+{
+    char host[256];
+    if (gethostname(host, sizeof host) != 0) {
+        host[0] = '\0';
+    }
+    host[sizeof(host)-1] = '\0';
+    clientId = format("%s.%d", host, (int)getpid());
+
+    seed = ((uint64_t)getpid() << 32) ^ (uint64_t)getCurrentTime() ^ ((uint64_t)(id + 1) * 0x9E3779B97F4A7C15ULL);
+    if (seed == 0) {
+        seed = 1;
+    }
+
+    for (size_t i = 0; i < cfg.connections.size(); i++) {
+        conns.push_back(new connection(cfg.connections[i]));
+        if (cfg.prepared) {
+            /* Use SQL level prepared statements because them can be also sent through pipeline */
+            nontransaction txn(*conns[i]);
+            txn.exec("prepare dtmbench_update(integer,integer) as update t set v = v + $1 where u = $2");
+            txn.exec("prepare dtmbench_select(integer) as select v from t where u = $1");
+            txn.exec("prepare dtmbench_total as select sum(v) from t");
+        }
+    }
+}
+
+Session::~Session()
+{
+    close();
+    for (size_t i = 0; i < conns.size(); i++) {
+        delete conns[i];
+    }
+}
+
+/* xorshift64*: random() of libc is serialized by global lock */
+uint32_t Session::random(uint32_t n)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (uint32_t)((seed * 2685821657736338717ULL) >> 32) % n;
+}
+
+/*
+ * Map participants of the plan to distinct random nodes and start transaction objects at them
+ */
+void Session::open(Plan const& plan)
+{
+    int nSlots = protocol.distributed() ? std::min(plan.nParticipants, nNodes()) : 1;
+    vector<int> all(nNodes());
+
+    for (int i = 0; i < nNodes(); i++) {
+        all[i] = i;
+    }
+    nodes.resize(nSlots);
+    for (int i = 0; i < nSlots; i++) {
+        int j = i + random(nNodes() - i);
+        std::swap(all[i], all[j]);
+        nodes[i] = all[i];
+    }
+    txns.resize(nSlots);
+    for (int i = 0; i < nSlots; i++) {
+        txns[i] = new nontransaction(*conns[nodes[i]]);
+    }
+    gtid = format("%s.%d.%lu", clientId.c_str(), id, (unsigned long)++seqno);
+    prepared.assign(nSlots, false);
+}
+
+void Session::close()
+{
+    for (size_t i = 0; i < txns.size(); i++) {
+        delete txns[i];
+    }
+    txns.clear();
+    nodes.clear();
+}
+
+string Session::statementText(Statement const& stmt) const
+{
+    switch (stmt.kind) {
+      case STMT_UPDATE:
+        return cfg.prepared
+            ? format("execute dtmbench_update(%d,%d)", stmt.delta, stmt.account)
+            : format("update t set v = v + %d where u = %d", stmt.delta, stmt.account);
+      case STMT_SELECT:
+        return cfg.prepared
+            ? format("execute dtmbench_select(%d)", stmt.account)
+            : format("select v from t where u = %d", stmt.account);
+      case STMT_TOTAL:
+      default:
+        return cfg.prepared ? "execute dtmbench_total" : "select sum(v) from t";
+    }
+}
+
+bool Session::run(Plan& plan)
+{
+    open(plan);
+    try {
+        timestamp_t start = getCurrentTime();
+        protocol.begin(*this);
+        stats.latency[OP_BEGIN].add(getCurrentTime() - start);
+
+        if (cfg.pipelined) {
+            Pipelines pipes(txns);
+            vector<pipeline::query_id> ids(plan.statements.size());
+            for (size_t i = 0; i < plan.statements.size(); i++) {
+                Statement& stmt = plan.statements[i];
+                ids[i] = pipes[stmt.participant % nParticipants()].insert(statementText(stmt));
+            }
+            for (size_t i = 0; i < plan.statements.size(); i++) {
+                Statement& stmt = plan.statements[i];
+                stmt.result = getValue(pipes[stmt.participant % nParticipants()].retrieve(ids[i]));
+            }
+        } else {
+            for (size_t i = 0; i < plan.statements.size(); i++) {
+                Statement& stmt = plan.statements[i];
+                stmt.result = getValue(txns[stmt.participant % nParticipants()]->exec(statementText(stmt)));
+            }
+        }
+
+        start = getCurrentTime();
+        protocol.commit(*this);
+        stats.latency[OP_COMMIT].add(getCurrentTime() - start);
+    } catch (pqxx_exception const&) {
+        protocol.abort(*this);
+        close();
+        stats.aborts += 1;
+        return false;
+    }
+    close();
+    return true;
+}
+
+void Session::exec(int participant, string const& sql)
+{
+    txns[participant]->exec(sql);
+}
+
+int64_t Session::query(int participant, string const& sql)
+{
+    return getValue(txns[participant]->exec(sql));
+}
+
+void Session::execAll(string const& sql)
+{
+    runAll(sql);
+}
+
+vector<int64_t> Session::queryAll(string const& sql)
+{
+    vector<result> results = runAll(sql);
+    vector<int64_t> values(results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+        values[i] = getValue(results[i]);
+    }
+    return values;
+}
+
+/*
+ * Unlike runAll, results of all participants are retrieved even if some of them failed, so that
+ * it is known at which participants transaction has to be aborted by "rollback prepared"
+ */
+void Session::prepareAll(string const& sql)
+{
+    if (cfg.pipelined && txns.size() > 1) {
+        Pipelines pipes(txns);
+        vector<pipeline::query_id> ids(txns.size());
+        bool failed = false;
+        for (size_t i = 0; i < txns.size(); i++) {
+            ids[i] = pipes[i].insert(sql);
+        }
+        for (size_t i = 0; i < txns.size(); i++) {
+            try {
+                pipes[i].retrieve(ids[i]);
+                prepared[i] = true;
+            } catch (pqxx_exception const&) {
+                failed = true;
+            }
+        }
+        if (failed) {
+            throw failure("prepare transaction failed at some of the participants");
+        }
+    } else {
+        for (size_t i = 0; i < txns.size(); i++) {
+            txns[i]->exec(sql);
+            prepared[i] = true;
+        }
+    }
+}
+
+vector<result> Session::runAll(string const& sql)
+{
+    vector<result> results(txns.size());
+    if (cfg.pipelined && txns.size() > 1) {
+        Pipelines pipes(txns);
+        vector<pipeline::query_id> ids(txns.size());
+        for (size_t i = 0; i < txns.size(); i++) {
+            ids[i] = pipes[i].insert(sql);
+        }
+        for (size_t i = 0; i < txns.size(); i++) {
+            results[i] = pipes[i].retrieve(ids[i]);
+        }
+    } else {
+        for (size_t i = 0; i < txns.size(); i++) {
+            results[i] = txns[i]->exec(sql);
+        }
+    }
+    return results;
+}
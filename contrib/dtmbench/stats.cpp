@@ -0,0 +1,84 @@
+#include "dtmbench.h"
+
+char const* const operationName[N_OPERATIONS] =
+{
+    "update",
+    "read",
+    "check",
+    "begin",
+    "commit"
+};
+
+Histogram::Histogram() : buckets(N_BUCKETS), n(0), sum(0), maximum(0) {}
+
+int Histogram::bucket(uint64_t value)
+{
+    int shift = 1;
+    if (value < 2*SUB_BUCKETS) {
+        return (int)value;
+    }
+    while ((value >> shift) >= 2*SUB_BUCKETS) {
+        shift += 1;
+    }
+    return shift*SUB_BUCKETS + (int)(value >> shift);
+}
+
+/* Largest value falling into the bucket */
+uint64_t Histogram::bucketBound(int bucket)
+{
+    if (bucket < 2*SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket/SUB_BUCKETS - 1;
+    int top = bucket - shift*SUB_BUCKETS;
+    return (((uint64_t)top + 1) << shift) - 1;
+}
+
+void Histogram::add(timestamp_t value)
+{
+    if (value < 0) {
+        value = 0;
+    }
+    buckets[bucket(value)] += 1;
+    sum += value;
+    n += 1;
+    if (value > maximum) {
+        maximum = value;
+    }
+}
+
+void Histogram::merge(Histogram const& other)
+{
+    for (int i = 0; i < N_BUCKETS; i++) {
+        buckets[i] += other.buckets[i];
+    }
+    n += other.n;
+    sum += other.sum;
+    if (other.maximum > maximum) {
+        maximum = other.maximum;
+    }
+}
+
+timestamp_t Histogram::percentile(double q) const
+{
+    uint64_t target = (uint64_t)(n*q);
+    uint64_t accumulated = 0;
+    for (int i = 0; i < N_BUCKETS; i++) {
+        accumulated += buckets[i];
+        if (accumulated > target) {
+            timestamp_t bound = (timestamp_t)bucketBound(i);
+            return bound < maximum ? bound : maximum;
+        }
+    }
+    return maximum;
+}
+
+void Stats::merge(Stats const& other)
+{
+    for (int i = 0; i < N_OPERATIONS; i++) {
+        latency[i].merge(other.latency[i]);
+    }
+    transactions += other.transactions;
+    aborts += other.aborts;
+    inconsistencies += other.inconsistencies;
+}
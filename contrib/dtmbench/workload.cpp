@@ -0,0 +1,114 @@
+#include <algorithm>
+
+#include "dtmbench.h"
+
+char const* const workloadNames = "transfer, readmostly, hotkey, scatter";
+
+/*
+ * Bank transfer: withdraw from one account and deposit to another. Total balance is always zero,
+ * which is checked by readers. With distributed protocol accounts are located at different nodes.
+ */
+class TransferWorkload : public Workload
+{
+  public:
+    virtual void generate(Session& session, Plan& plan) {
+        if ((int)session.random(100) < updatePercent(session.cfg)) {
+            transfer(session, plan);
+        } else {
+            plan.select(0, account(session));
+            plan.select(1, account(session));
+        }
+    }
+
+  protected:
+    virtual int defaultUpdatePercent() const {
+        return 100;
+    }
+
+    int updatePercent(Config const& cfg) const {
+        return cfg.updatePercent >= 0 ? cfg.updatePercent : defaultUpdatePercent();
+    }
+
+    virtual int account(Session& session) {
+        return session.cfg.firstAccount + session.random(session.cfg.range);
+    }
+
+    void transfer(Session& session, Plan& plan) {
+        int src = account(session);
+        int dst = account(session);
+        if (session.cfg.avoidDeadlocks && src > dst) {
+            std::swap(src, dst);
+        }
+        plan.update(0, src, -1);
+        plan.update(1, dst, 1);
+    }
+};
+
+/*
+ * Transaction reads a number of random accounts, small fraction of transactions are transfers
+ */
+class ReadMostlyWorkload : public TransferWorkload
+{
+  public:
+    virtual void generate(Session& session, Plan& plan) {
+        if ((int)session.random(100) < updatePercent(session.cfg)) {
+            transfer(session, plan);
+        } else {
+            for (int i = 0; i < session.cfg.nReads; i++) {
+                plan.select(i % 2, account(session));
+            }
+        }
+    }
+
+  protected:
+    virtual int defaultUpdatePercent() const {
+        return 5;
+    }
+};
+
+/*
+ * Most of the transfers access small set of hot accounts, causing lock conflicts and deadlocks
+ */
+class HotKeyWorkload : public TransferWorkload
+{
+  protected:
+    virtual int account(Session& session) {
+        Config const& cfg = session.cfg;
+        if ((int)session.random(100) < cfg.hotPercent) {
+            return cfg.firstAccount + session.random(std::min(cfg.nHotAccounts, cfg.range));
+        }
+        return TransferWorkload::account(session);
+    }
+};
+
+/*
+ * Each writer accesses its own subset of accounts, so there are no conflicts between transactions
+ * and only overhead of transaction manager is measured
+ */
+class ScatterWorkload : public TransferWorkload
+{
+  protected:
+    virtual int account(Session& session) {
+        Config const& cfg = session.cfg;
+        int nWriters = cfg.nWriters;
+        int acc = session.random(cfg.range)/nWriters*nWriters + session.id % nWriters;
+        if (acc >= cfg.range) {
+            acc -= nWriters;
+        }
+        return cfg.firstAccount + acc;
+    }
+};
+
+Workload* createWorkload(string const& name)
+{
+    if (name == "transfer") {
+        return new TransferWorkload();
+    } else if (name == "readmostly") {
+        return new ReadMostlyWorkload();
+    } else if (name == "hotkey") {
+        return new HotKeyWorkload();
+    } else if (name == "scatter") {
+        return new ScatterWorkload();
+    }
+    return NULL;
+}
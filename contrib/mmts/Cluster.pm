@@ -107,48 +107,54 @@ sub configure
 
 	foreach my $node (@$nodes)
 	{
-		my $id = $node->{id};
-		my $host = $node->host;
-		my $pgport = $node->port;
-		my $arbiter_port = $node->{arbiter_port};
-		my $unix_sock_dir = $ENV{PGHOST};
-
-		$node->append_conf("postgresql.conf", qq(
-			log_statement = none
-			listen_addresses = '$host'
-			unix_socket_directories = '$unix_sock_dir'
-			port = $pgport
-			max_prepared_transactions = 10
-			max_connections = 10
-			max_worker_processes = 100
-			wal_level = logical
-			max_wal_senders = 6
-			wal_sender_timeout = 0
-			default_transaction_isolation = 'repeatable read'
-			max_replication_slots = 6
-			shared_preload_libraries = 'multimaster'
-			shared_buffers = 16MB
-
-			multimaster.arbiter_port = $arbiter_port
-			multimaster.workers = 1
-			multimaster.node_id = $id
-			multimaster.conn_strings = '$connstr'
-			multimaster.heartbeat_recv_timeout = 1050
-			multimaster.heartbeat_send_timeout = 250
-			multimaster.max_nodes = 6
-			multimaster.ignore_tables_without_pk = false
-			multimaster.queue_size = 4194304
-			log_line_prefix = '%t: '
-		));
-
-		$node->append_conf("pg_hba.conf", qq(
-			local replication all trust
-			host replication all 127.0.0.1/32 trust
-			host replication all ::1/128 trust
-		));
+		configure_node($node, $connstr);
 	}
 }
 
+sub configure_node
+{
+	my ($node, $connstr) = @_;
+	my $id = $node->{id};
+	my $host = $node->host;
+	my $pgport = $node->port;
+	my $arbiter_port = $node->{arbiter_port};
+	my $unix_sock_dir = $ENV{PGHOST};
+
+	$node->append_conf("postgresql.conf", qq(
+		log_statement = none
+		listen_addresses = '$host'
+		unix_socket_directories = '$unix_sock_dir'
+		port = $pgport
+		max_prepared_transactions = 10
+		max_connections = 10
+		max_worker_processes = 100
+		wal_level = logical
+		max_wal_senders = 6
+		wal_sender_timeout = 0
+		default_transaction_isolation = 'repeatable read'
+		max_replication_slots = 6
+		shared_preload_libraries = 'multimaster'
+		shared_buffers = 16MB
+
+		multimaster.arbiter_port = $arbiter_port
+		multimaster.workers = 1
+		multimaster.node_id = $id
+		multimaster.conn_strings = '$connstr'
+		multimaster.heartbeat_recv_timeout = 1050
+		multimaster.heartbeat_send_timeout = 250
+		multimaster.max_nodes = 6
+		multimaster.ignore_tables_without_pk = false
+		multimaster.queue_size = 4194304
+		log_line_prefix = '%t: '
+	));
+
+	$node->append_conf("pg_hba.conf", qq(
+		local replication all trust
+		host replication all 127.0.0.1/32 trust
+		host replication all ::1/128 trust
+	));
+}
+
 sub start
 {
 	my ($self) = @_;
@@ -399,4 +405,26 @@ sub add_node()
 	push(@{$self->{nodes}}, $node);
 }
 
+# Add empty node which waits to be populated by mtm.bootstrap_node()
+sub add_bootstrap_node()
+{
+	my ($self) = @_;
+
+	my $node_id = scalar(@{$self->{nodes}}) + 1;
+	my $host = "127.0.0.1";
+	my ($pgport, $arbiter_port) = allocate_ports($host, 2);
+	my $node = new PostgresNode("node$node_id", $host, $pgport);
+	$node->{id} = $node_id;
+	$node->{arbiter_port} = $arbiter_port;
+	$node->{mmconnstr} = "${ \$node->connstr('postgres') } arbiter_port=${ \$node->{arbiter_port} }";
+	push(@{$self->{nodes}}, $node);
+
+	$node->init(hba_permit_replication => 0);
+	configure_node($node, $self->all_connstrs());
+	$node->append_conf("postgresql.conf", qq(
+		multimaster.wait_bootstrap = on
+	));
+	return $node;
+}
+
 1;
@@ -77,24 +77,70 @@
 
 #include "multimaster.h"
 #include "state.h"
+#include "latency.h"
+#include "seqrange.h"
 
 #define MAX_ROUTES       16
 #define INIT_BUFFER_SIZE 1024
-#define HANDSHAKE_MAGIC  0xCAFEDEED
+#define HANDSHAKE_MAGIC  (0xCAFEDE00 + MTM_ARBITER_PROTOCOL_VERSION)
+
+#define MTM_FIELD_DXID   0x01
+#define MTM_FIELD_SXID   0x02
+#define MTM_FIELD_STATUS 0x04
+#define MTM_FIELD_CSN    0x08
+#define MTM_FIELD_GID    0x10
+#define MTM_FIELD_PROBE  0x20
+#define MTM_FIELD_SEQ    0x40
+
+#define MTM_MAX_RECORD_SIZE (2 + 10 + 10 + 1 + 10 + 1 + MULTIMASTER_MAX_GID_SIZE + 6*10 + 3*10)
+
+#define MTM_MAX_DEADLOCK_MESSAGES 256 /* maximal number of deadlock probes handled per read, the rest are dropped */
+
+#define MTM_PEER_MAX_BATCHES    64 /* number of queued batches for which send latency is tracked separately */
+
+typedef enum
+{
+	MTM_PEER_DISCONNECTED,
+	MTM_PEER_CONNECTING,   /* non-blocking connect is in progress */
+	MTM_PEER_HANDSHAKE,    /* waiting for response to handshake */
+	MTM_PEER_CONNECTED
+} MtmPeerState;
+
+/*
+ * Outgoing connection of arbiter sender
+ */
+typedef struct
+{
+	MtmPeerState state;
+	int          sd;
+	MtmBuffer    out;            /* queue of encoded batches, out.data[sent..used) is not yet written to socket */
+	int          sent;
+	int          handshakeSize;  /* size of handshake message at the beginning of the queue */
+	MtmBuffer    in;             /* partially received handshake response */
+	timestamp_t  connectTime;    /* time of last connection attempt */
+	timestamp_t  fullTime;       /* time since which queue exceeds multimaster.arbiter_queue_size, 0 if it does not */
+	int          nBatches;
+	struct {
+		int         end;         /* end of batch in the queue */
+		timestamp_t time;        /* time when batch was queued */
+	} batches[MTM_PEER_MAX_BATCHES];
+} MtmPeer;
 
 static int*        sockets;
 static int         gateway;
 static bool        send_heartbeat;
 static timestamp_t last_sent_heartbeat;
 static TimeoutId   heartbeat_timer;
-static nodemask_t  busy_mask;
+static MtmPeer*    peers;
+static MtmMessageQueue* retained; /* messages waiting until queue of their peer is drained */
+static nodemask_t  retainedMask;
+static int         wakeupPipe[2] = {-1, -1};
 static timestamp_t last_heartbeat_to_node[MAX_NODES];
 
 static void MtmSender(Datum arg);
 static void MtmReceiver(Datum arg);
 static void MtmMonitor(Datum arg);
 static void MtmSendHeartbeat(void);
-static bool MtmSendToNode(int node, void const* buf, int size);
 
 char const* const MtmMessageKindMnem[] = 
 {
@@ -107,7 +153,10 @@ char const* const MtmMessageKindMnem[] =
 	"STATUS",
 	"HEARTBEAT",
 	"POLL_REQUEST",
-	"POLL_STATUS"
+	"POLL_STATUS",
+	"DEADLOCK_PROBE",
+	"DEADLOCK",
+	"SEQUENCE_RANGE"
 };
 
 static BackgroundWorker MtmSenderWorker = {
@@ -137,6 +186,13 @@ static BackgroundWorker MtmMonitorWorker = {
 
 void MtmArbiterInitialize(void)
 {
+	/* Pipe is created by postmaster, so that all backends inherit it and can wake up sender */
+	if (pipe(wakeupPipe) < 0
+		|| fcntl(wakeupPipe[0], F_SETFL, O_NONBLOCK) < 0
+		|| fcntl(wakeupPipe[1], F_SETFL, O_NONBLOCK) < 0)
+	{
+		MTM_ELOG(ERROR, "Arbiter failed to create wakeup pipe: %m");
+	}
 	MTM_ELOG(LOG, "Register background workers");
 	RegisterBackgroundWorker(&MtmSenderWorker);
 	RegisterBackgroundWorker(&MtmRecevierWorker);
@@ -149,6 +205,26 @@ static void SetStop(int sig)
 	stop = 1;
 }
 
+/*
+ * Wake up sender waiting for sockets of peers. Can be called from signal handler.
+ */
+void MtmWakeupSender(void)
+{
+	int save_errno = errno;
+	char c = 0;
+	/* If pipe is full, sender is going to be woken up anyway */
+	if (write(wakeupPipe[1], &c, 1) < 0) {
+		/* ignore */
+	}
+	errno = save_errno;
+}
+
+static void MtmDrainWakeupPipe(void)
+{
+	char buf[256];
+	while (read(wakeupPipe[0], buf, sizeof buf) > 0);
+}
+
 #if USE_EPOLL
 static int    epollfd;
 #else
@@ -301,6 +377,15 @@ static void MtmSetSocketOptions(int sd)
 #endif
 }
 
+/*
+ * Check if there is no connection with the node. Receiver tracks incoming connections in sockets array,
+ * while sender tracks outgoing connections in peers array.
+ */
+static bool MtmIsDisconnected(int node)
+{
+	return sockets != NULL ? sockets[node] < 0 : peers[node].state == MTM_PEER_DISCONNECTED;
+}
+
 /*
  * Check response message and update onde state
  */
@@ -323,7 +408,7 @@ static void MtmCheckResponse(MtmArbiterMessage* resp)
 	// }
 
 	if (BIT_CHECK(Mtm->disabledNodeMask, resp->node-1) &&
-		sockets[resp->node-1] < 0)
+		MtmIsDisconnected(resp->node-1))
 	{
 		/* We've received heartbeat from disabled node.
 		 * Looks like it is restarted.
@@ -334,6 +419,312 @@ static void MtmCheckResponse(MtmArbiterMessage* resp)
 	}
 }
 
+/*
+ * Check if response can change state of the cluster, so it has to be processed under exclusive MtmLock.
+ * Heartbeats are received much more frequently than other messages and in most cases
+ * just confirm that nothing is changed, so them are handled without MtmLock.
+ * Deadlock probes are handled after MtmLock is released, sequence ranges are protected by their own lock.
+ */
+static bool MtmResponseChangesState(MtmArbiterMessage* resp)
+{
+	int node = resp->node;
+	return (resp->code != MSG_HEARTBEAT && resp->code != MSG_DEADLOCK_PROBE && resp->code != MSG_DEADLOCK
+			&& resp->code != MSG_SEQUENCE_RANGE)
+		|| Mtm->nodes[node-1].disabledNodeMask != resp->disabledNodeMask
+		|| Mtm->nodes[node-1].connectivityMask != resp->connectivityMask
+		|| BIT_CHECK(Mtm->inducedLockNodeMask, node-1) != resp->lockReq
+		|| BIT_CHECK(Mtm->currentLockNodeMask, node-1) != resp->locked
+		|| (BIT_CHECK(Mtm->disabledNodeMask, node-1) && MtmIsDisconnected(node-1));
+}
+
+/*
+ * -------------------------------------------
+ * Wire format of arbiter messages
+ * -------------------------------------------
+ * Each record of the batch starts with message code and mask of present fields.
+ * Xids are varint encoded, CSN is encoded as zigzag varint delta from CSN of previous record in the batch.
+ * Only fields meaningful for the message code are sent, in particular gid is sent only for poll messages:
+ * votes are matched with transactions by xid. Deadlock probes carry global transaction identifiers
+ * of initiator and target as varints and round of detection in CSN field. Sequence range leases carry
+ * key of the sequence, zigzag varint start of the range and its length, and time of the lease in CSN field.
+ */
+
+static char* MtmPackVarint(char* dst, uint64 val)
+{
+	while (val >= 0x80) {
+		*dst++ = (char)(val | 0x80);
+		val >>= 7;
+	}
+	*dst++ = (char)val;
+	return dst;
+}
+
+static bool MtmUnpackVarint(char const** src, char const* end, uint64* val)
+{
+	char const* p = *src;
+	uint64 result = 0;
+	int shift = 0;
+	while (p < end && shift < 64) {
+		uint8 b = (uint8)*p++;
+		result |= (uint64)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			*src = p;
+			*val = result;
+			return true;
+		}
+		shift += 7;
+	}
+	return false;
+}
+
+/*
+ * Fields of arbiter message which are meaningful for the message code
+ */
+static uint8 MtmMessageFields(MtmMessageCode code)
+{
+	switch (code) {
+	  case MSG_PREPARED:
+	  case MSG_PRECOMMITTED:
+	  case MSG_ABORTED:
+		return MTM_FIELD_DXID|MTM_FIELD_SXID|MTM_FIELD_CSN;
+	  case MSG_HEARTBEAT:
+		return MTM_FIELD_CSN;
+	  case MSG_POLL_REQUEST:
+		return MTM_FIELD_GID;
+	  case MSG_POLL_STATUS:
+		return MTM_FIELD_STATUS|MTM_FIELD_CSN|MTM_FIELD_GID;
+	  case MSG_DEADLOCK_PROBE:
+	  case MSG_DEADLOCK:
+		return MTM_FIELD_CSN|MTM_FIELD_PROBE;
+	  case MSG_SEQUENCE_RANGE:
+		return MTM_FIELD_CSN|MTM_FIELD_SEQ;
+	  default:
+		return MTM_FIELD_DXID|MTM_FIELD_SXID|MTM_FIELD_STATUS|MTM_FIELD_CSN|MTM_FIELD_GID;
+	}
+}
+
+static void MtmBufferReserve(MtmBuffer* buf, int size)
+{
+	if (buf->used + size > buf->size) {
+		int newSize = buf->size == 0 ? INIT_BUFFER_SIZE : buf->size;
+		while (buf->used + size > newSize) {
+			newSize *= 2;
+		}
+		buf->data = buf->size == 0
+			? MemoryContextAlloc(TopMemoryContext, newSize)
+			: repalloc(buf->data, newSize);
+		buf->size = newSize;
+	}
+}
+
+/*
+ * Start new batch: node-level fields are taken from the first (the most recent) message in the batch
+ */
+static void MtmBeginBatch(MtmBuffer* buf, MtmArbiterMessage* msg)
+{
+	MtmArbiterBatchHeader hdr;
+	hdr.version = MTM_ARBITER_PROTOCOL_VERSION;
+	hdr.node = MtmNodeId;
+	hdr.flags = (msg->lockReq ? MTM_BATCH_LOCK_REQ : 0) | (msg->locked ? MTM_BATCH_LOCKED : 0);
+	hdr.reserved = 0;
+	hdr.size = 0;
+	hdr.oldestSnapshot = msg->oldestSnapshot;
+	hdr.disabledNodeMask = msg->disabledNodeMask;
+	hdr.connectivityMask = msg->connectivityMask;
+	buf->used = 0;
+	buf->lastCsn = 0;
+	MtmBufferReserve(buf, sizeof hdr);
+	memcpy(buf->data, &hdr, sizeof hdr);
+	buf->used = sizeof hdr;
+}
+
+static void MtmEncodeMessage(MtmBuffer* buf, MtmArbiterMessage* msg)
+{
+	char* dst;
+	char* fields;
+	int64 delta;
+	uint8 mask = MtmMessageFields(msg->code);
+
+	MtmBufferReserve(buf, MTM_MAX_RECORD_SIZE);
+	dst = buf->data + buf->used;
+	*dst++ = (char)msg->code;
+	fields = dst++;
+	*fields = 0;
+	if ((mask & MTM_FIELD_DXID) && msg->dxid != InvalidTransactionId) {
+		*fields |= MTM_FIELD_DXID;
+		dst = MtmPackVarint(dst, msg->dxid);
+	}
+	if ((mask & MTM_FIELD_SXID) && msg->sxid != InvalidTransactionId) {
+		*fields |= MTM_FIELD_SXID;
+		dst = MtmPackVarint(dst, msg->sxid);
+	}
+	if ((mask & MTM_FIELD_STATUS) && msg->status != 0) {
+		*fields |= MTM_FIELD_STATUS;
+		*dst++ = (char)msg->status;
+	}
+	if ((mask & MTM_FIELD_CSN) && msg->csn != 0) {
+		*fields |= MTM_FIELD_CSN;
+		delta = (int64)(msg->csn - buf->lastCsn);
+		dst = MtmPackVarint(dst, ((uint64)delta << 1) ^ (uint64)(delta >> 63));
+		buf->lastCsn = msg->csn;
+	}
+	if ((mask & MTM_FIELD_GID) && *msg->gid) {
+		int len = strlen(msg->gid);
+		*fields |= MTM_FIELD_GID;
+		*dst++ = (char)len;
+		memcpy(dst, msg->gid, len);
+		dst += len;
+	}
+	if (mask & MTM_FIELD_PROBE) {
+		*fields |= MTM_FIELD_PROBE;
+		dst = MtmPackVarint(dst, msg->probeNode);
+		dst = MtmPackVarint(dst, msg->probeHops);
+		dst = MtmPackVarint(dst, msg->probeInitiator.node);
+		dst = MtmPackVarint(dst, msg->probeInitiator.xid);
+		dst = MtmPackVarint(dst, msg->probeTarget.node);
+		dst = MtmPackVarint(dst, msg->probeTarget.xid);
+	}
+	if (mask & MTM_FIELD_SEQ) {
+		*fields |= MTM_FIELD_SEQ;
+		dst = MtmPackVarint(dst, msg->seqKey);
+		dst = MtmPackVarint(dst, ((uint64)msg->seqBase << 1) ^ (uint64)(msg->seqBase >> 63));
+		dst = MtmPackVarint(dst, (uint64)(msg->seqEnd - msg->seqBase));
+	}
+	buf->used = dst - buf->data;
+}
+
+static void MtmEndBatch(MtmBuffer* buf)
+{
+	uint32 size = buf->used;
+	memcpy(buf->data + offsetof(MtmArbiterBatchHeader, size), &size, sizeof size);
+}
+
+/*
+ * Cursor for decoding batches received from the node
+ */
+typedef struct
+{
+	MtmArbiterBatchHeader hdr;
+	char const* cur;
+	char const* end;
+	csn_t lastCsn;
+} MtmBatchCursor;
+
+/*
+ * Locate next complete batch in the receive buffer starting at *pos.
+ * Returns false if there is no complete batch, *error is set if batch is malformed.
+ */
+static bool MtmNextBatch(MtmBuffer* buf, int* pos, MtmBatchCursor* batch, bool* error)
+{
+	if (buf->used - *pos < (int)sizeof(MtmArbiterBatchHeader)) {
+		return false;
+	}
+	memcpy(&batch->hdr, buf->data + *pos, sizeof(MtmArbiterBatchHeader));
+	if (batch->hdr.version != MTM_ARBITER_PROTOCOL_VERSION || batch->hdr.size < sizeof(MtmArbiterBatchHeader)) {
+		MTM_ELOG(WARNING, "Arbiter receive batch with unsupported protocol version %d from node %d", batch->hdr.version, batch->hdr.node);
+		*error = true;
+		return false;
+	}
+	if (buf->used - *pos < (int)batch->hdr.size) {
+		return false;
+	}
+	batch->cur = buf->data + *pos + sizeof(MtmArbiterBatchHeader);
+	batch->end = buf->data + *pos + batch->hdr.size;
+	batch->lastCsn = 0;
+	*pos += batch->hdr.size;
+	return true;
+}
+
+/*
+ * Decode next message of the batch.
+ * Returns false at the end of the batch, *error is set if message is truncated or malformed.
+ */
+static bool MtmDecodeMessage(MtmBatchCursor* batch, MtmArbiterMessage* msg, bool* error)
+{
+	uint64 val;
+	uint8  fields;
+
+	if (batch->cur == batch->end) {
+		return false;
+	}
+	if (batch->end - batch->cur < 2) {
+		goto OnError;
+	}
+	msg->code = (MtmMessageCode)(uint8)*batch->cur++;
+	fields = (uint8)*batch->cur++;
+	msg->node = batch->hdr.node;
+	msg->lockReq = (batch->hdr.flags & MTM_BATCH_LOCK_REQ) != 0;
+	msg->locked = (batch->hdr.flags & MTM_BATCH_LOCKED) != 0;
+	msg->oldestSnapshot = batch->hdr.oldestSnapshot;
+	msg->disabledNodeMask = batch->hdr.disabledNodeMask;
+	msg->connectivityMask = batch->hdr.connectivityMask;
+	msg->dxid = msg->sxid = InvalidTransactionId;
+	msg->status = 0;
+	msg->csn = 0;
+	msg->gid[0] = '\0';
+	msg->probeNode = msg->probeHops = 0;
+	msg->probeInitiator.node = msg->probeTarget.node = 0;
+	msg->probeInitiator.xid = msg->probeTarget.xid = InvalidTransactionId;
+	msg->seqKey = 0;
+	msg->seqBase = msg->seqEnd = 0;
+
+	if (fields & MTM_FIELD_DXID) {
+		if (!MtmUnpackVarint(&batch->cur, batch->end, &val)) goto OnError;
+		msg->dxid = (TransactionId)val;
+	}
+	if (fields & MTM_FIELD_SXID) {
+		if (!MtmUnpackVarint(&batch->cur, batch->end, &val)) goto OnError;
+		msg->sxid = (TransactionId)val;
+	}
+	if (fields & MTM_FIELD_STATUS) {
+		if (batch->cur >= batch->end) goto OnError;
+		msg->status = (XidStatus)(uint8)*batch->cur++;
+	}
+	if (fields & MTM_FIELD_CSN) {
+		if (!MtmUnpackVarint(&batch->cur, batch->end, &val)) goto OnError;
+		msg->csn = batch->lastCsn + (csn_t)(int64)((val >> 1) ^ -(int64)(val & 1));
+		batch->lastCsn = msg->csn;
+	}
+	if (fields & MTM_FIELD_GID) {
+		int len;
+		if (batch->cur >= batch->end) goto OnError;
+		len = (uint8)*batch->cur++;
+		if (len >= MULTIMASTER_MAX_GID_SIZE || batch->end - batch->cur < len) goto OnError;
+		memcpy(msg->gid, batch->cur, len);
+		msg->gid[len] = '\0';
+		batch->cur += len;
+	}
+	if (fields & MTM_FIELD_PROBE) {
+		uint64 vals[6];
+		int j;
+		for (j = 0; j < 6; j++) {
+			if (!MtmUnpackVarint(&batch->cur, batch->end, &vals[j])) goto OnError;
+		}
+		msg->probeNode = (int)vals[0];
+		msg->probeHops = (int)vals[1];
+		msg->probeInitiator.node = (int)vals[2];
+		msg->probeInitiator.xid = (TransactionId)vals[3];
+		msg->probeTarget.node = (int)vals[4];
+		msg->probeTarget.xid = (TransactionId)vals[5];
+	}
+	if (fields & MTM_FIELD_SEQ) {
+		uint64 vals[3];
+		int j;
+		for (j = 0; j < 3; j++) {
+			if (!MtmUnpackVarint(&batch->cur, batch->end, &vals[j])) goto OnError;
+		}
+		msg->seqKey = (uint32)vals[0];
+		msg->seqBase = (int64)((vals[1] >> 1) ^ -(int64)(vals[1] & 1));
+		msg->seqEnd = msg->seqBase + (int64)vals[2];
+	}
+	return true;
+
+  OnError:
+	MTM_ELOG(WARNING, "Arbiter receive malformed message from node %d", batch->hdr.node);
+	*error = true;
+	return false;
+}
+
 static void MtmScheduleHeartbeat()
 {
 	if (!stop) { 
@@ -341,85 +732,154 @@ static void MtmScheduleHeartbeat()
 		send_heartbeat = true;
 	}
 	PGSemaphoreUnlock(&Mtm->sendSemaphore);
+	MtmWakeupSender();
 }
-	
-static void MtmSendHeartbeat()
+
+/*
+ * -------------------------------------------
+ * Non-blocking transport of arbiter sender
+ * -------------------------------------------
+ * Each peer has its own queue of encoded batches. Sender never blocks on socket: batches are appended to the queue
+ * of the peer and the whole pending part of the queue is written by one send call as much as socket accepts.
+ * Connection establishment and handshake are asynchronous too, so slow or half-dead peer can not delay
+ * votes and heartbeats sent to other nodes. If queue of the peer exceeds multimaster.arbiter_queue_size,
+ * sender stops taking messages for this node from the shared send queue: they are retained until the socket
+ * accepts queued data. Only if the queue stays full for multimaster.heartbeat_recv_timeout, connection
+ * is considered to be stalled: it is closed and queued messages are discarded, as it happens when connection
+ * is broken.
+ */
+
+static void MtmPeerDisconnect(int node)
 {
-	int i;
-	MtmArbiterMessage msg;
-	timestamp_t now = MtmGetSystemTime();
-	MtmInitMessage(&msg, MSG_HEARTBEAT);
-	msg.node = MtmNodeId;
-	msg.csn = now;
-	if (last_sent_heartbeat != 0 && last_sent_heartbeat + MSEC_TO_USEC(MtmHeartbeatSendTimeout)*2 < now) { 
-		MTM_LOG1("More than %lld microseconds since last heartbeat", now - last_sent_heartbeat);
+	MtmPeer* peer = &peers[node];
+	if (peer->sd >= 0) {
+		pg_closesocket(peer->sd, MtmUseRDMA);
+		peer->sd = -1;
 	}
-	last_sent_heartbeat = now;
+	peer->state = MTM_PEER_DISCONNECTED;
+	peer->out.used = 0;
+	peer->sent = 0;
+	peer->handshakeSize = 0;
+	peer->nBatches = 0;
+	peer->in.used = 0;
+	peer->fullTime = 0;
+	Mtm->nodes[node].arbiterQueueSize = 0;
+}
 
-	for (i = 0; i < Mtm->nAllNodes; i++)
-	{
-		if (i+1 != MtmNodeId) { 
-			if (!BIT_CHECK(busy_mask, i))
-				/*
-				 * Old behaviour here can cause subtle bugs, for example
-				 * it can happened that none of mentioned conditiotions is
-				 * true when disabled node connects to a major node which
-				 * is online. So just send it allways. --sk
-				 */
-				// && (Mtm->status != MTM_ONLINE
-				// 	|| sockets[i] >= 0
-				// 	|| !BIT_CHECK(Mtm->disabledNodeMask, i)
-				// 	|| BIT_CHECK(Mtm->reconnectMask, i)))
-			{ 
-				if (!MtmSendToNode(i, &msg, sizeof(msg))) {
-					MTM_ELOG(LOG, "Arbiter failed to send heartbeat to node %d", i+1);
-				} else {
-					if (last_heartbeat_to_node[i] + MSEC_TO_USEC(MtmHeartbeatSendTimeout)*2 < now) { 
-						MTM_LOG1("Last heartbeat to node %d was sent %lld microseconds ago", i+1, now - last_heartbeat_to_node[i]);
-					}
-					last_heartbeat_to_node[i] = now;
-					/* Connectivity mask can be cleared by MtmWatchdog: in this case sockets[i] >= 0 */
-					if (BIT_CHECK(SELF_CONNECTIVITY_MASK, i)) { 
-						MTM_LOG1("Force reconnect to node %d", i+1);    
-						pg_closesocket(sockets[i], MtmUseRDMA);
-						sockets[i] = -1;
-						MtmReconnectNode(i+1); /* set reconnect mask to force node reconnent */
-					}
-					MTM_LOG4("Send heartbeat to node %d with timestamp %lld", i+1, now);    
-				}
-			} else { 
-				MTM_LOG2("Do not send heartbeat to node %d, busy mask %lld, status %s", i+1, busy_mask, MtmNodeStatusMnem[Mtm->status]);
-			}
+/*
+ * Check if queue of the peer together with pending bytes exceeds multimaster.arbiter_queue_size
+ */
+static bool MtmPeerIsFull(int node, int pending)
+{
+	MtmPeer* peer = &peers[node];
+	return peer->state != MTM_PEER_DISCONNECTED && peer->out.used - peer->sent + pending >= MtmArbiterQueueSize;
+}
+
+static void MtmPeerEnqueue(int node, void const* data, int size)
+{
+	MtmPeer* peer = &peers[node];
+	if (peer->state == MTM_PEER_DISCONNECTED) {
+		return; /* message is lost as if it was sent to broken connection */
+	}
+	if (peer->sent != 0 && peer->out.used + size > peer->out.size) {
+		/* Shift pending part of the queue to the beginning of buffer */
+		int i;
+		memmove(peer->out.data, peer->out.data + peer->sent, peer->out.used - peer->sent);
+		for (i = 0; i < peer->nBatches; i++) {
+			peer->batches[i].end -= peer->sent;
 		}
+		peer->handshakeSize = Max(peer->handshakeSize - peer->sent, 0);
+		peer->out.used -= peer->sent;
+		peer->sent = 0;
 	}
-	
+	MtmBufferReserve(&peer->out, size);
+	memcpy(peer->out.data + peer->out.used, data, size);
+	peer->out.used += size;
+	if (peer->nBatches == MTM_PEER_MAX_BATCHES) {
+		/* Merge with last batch: its latency is counted from the time of the earlier one */
+		peer->batches[peer->nBatches-1].end = peer->out.used;
+	} else {
+		peer->batches[peer->nBatches].end = peer->out.used;
+		peer->batches[peer->nBatches].time = MtmGetSystemTime();
+		peer->nBatches += 1;
+	}
+	Mtm->nodes[node].arbiterQueueSize = peer->out.used - peer->sent;
 }
 
-/* This function should be called from all places where sender can be blocked.
- * It checks send_heartbeat flag set by timer and if it is set then sends heartbeats to all alive nodes 
+/*
+ * Write as much of pending output as socket accepts without blocking.
+ * Only handshake can be sent until connection is established.
  */
-void MtmCheckHeartbeat()
+static void MtmPeerFlush(int node)
 {
-	if (send_heartbeat && !stop) {
-		send_heartbeat = false;
-		enable_timeout_after(heartbeat_timer, MtmHeartbeatSendTimeout);
-		MtmSendHeartbeat();
-	}			
+	MtmPeer* peer = &peers[node];
+	int limit = peer->state == MTM_PEER_CONNECTED ? peer->out.used : peer->handshakeSize;
+	int rc, i, j;
+	timestamp_t now;
+
+	if (peer->state == MTM_PEER_DISCONNECTED || peer->state == MTM_PEER_CONNECTING) {
+		return;
+	}
+
+	while (peer->sent < limit) {
+		while ((rc = pg_send(peer->sd, peer->out.data + peer->sent, limit - peer->sent, 0, MtmUseRDMA)) < 0 && errno == EINTR);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+				break;
+			}
+			MTM_ELOG(WARNING, "Arbiter fail to write to node %d: %s", node+1, strerror(errno));
+			MtmPeerDisconnect(node);
+			return;
+		}
+		peer->sent += rc;
+	}
+	now = MtmGetSystemTime();
+	for (i = 0; i < peer->nBatches && peer->batches[i].end <= peer->sent; i++) {
+		/* Exponential moving average of time between queuing of batch and passing it to the socket */
+		timestamp_t latency = now - peer->batches[i].time;
+		Mtm->nodes[node].arbiterSendLatency = (Mtm->nodes[node].arbiterSendLatency*7 + latency)/8;
+	}
+	if (i != 0) {
+		for (j = i; j < peer->nBatches; j++) {
+			peer->batches[j-i] = peer->batches[j];
+		}
+		peer->nBatches -= i;
+	}
+	if (peer->sent == peer->out.used) {
+		peer->sent = peer->out.used = peer->handshakeSize = 0;
+	}
+	if (!MtmPeerIsFull(node, 0)) {
+		peer->fullTime = 0;
+	}
+	Mtm->nodes[node].arbiterQueueSize = peer->out.used - peer->sent;
 }
 
+static bool MtmPeerHasPendingIO(int node)
+{
+	MtmPeer* peer = &peers[node];
+	return peer->state == MTM_PEER_CONNECTING
+		|| peer->state == MTM_PEER_HANDSHAKE
+		|| (peer->state == MTM_PEER_CONNECTED && peer->sent < peer->out.used);
+}
 
-static int MtmConnectSocket(int node, int port)
+/*
+ * Start non-blocking connection to the node. Handshake is queued before any other message.
+ */
+static void MtmPeerConnect(int node)
 {
  	struct addrinfo *addrs = NULL;
 	struct addrinfo *addr;
 	struct addrinfo hint;
 	char portstr[MAXPGPATH];
 	MtmHandshakeMessage req;
-	MtmArbiterMessage   resp;
-	int sd = -1;
-	int rc;
+	MtmPeer* peer = &peers[node];
+	int port = Mtm->nodes[node].con.arbiterPort;
 	char const* host = Mtm->nodes[node].con.hostName;
-	nodemask_t save_mask = busy_mask;
+	int sd;
+	int rc;
+
+	Assert(peer->state == MTM_PEER_DISCONNECTED);
+	peer->connectTime = MtmGetSystemTime();
 
 	/* Initialize hint structure */
 	MemSet(&hint, 0, sizeof(hint));
@@ -432,21 +892,20 @@ static int MtmConnectSocket(int node, int port)
 	if (rc != 0) 
 	{
 		MTM_ELOG(LOG, "Arbiter failed to resolve host '%s' by name: %s", host, gai_strerror(rc));
-		return -1;
+		return;
 	}
-	BIT_SET(busy_mask, node);
-	
-  Retry:
-
 	sd = pg_socket(AF_INET, SOCK_STREAM, 0, MtmUseRDMA);
 	if (sd < 0) {
 		MTM_ELOG(LOG, "Arbiter failed to create socket: %s", strerror(errno));
-		goto Error;
+		pg_freeaddrinfo_all(hint.ai_family, addrs);
+		return;
 	}
 	rc = pg_fcntl(sd, F_SETFL, O_NONBLOCK, MtmUseRDMA);
 	if (rc < 0) {
 		MTM_ELOG(LOG, "Arbiter failed to switch socket to non-blocking mode: %s", strerror(errno));
-		goto Error;
+		pg_closesocket(sd, MtmUseRDMA);
+		pg_freeaddrinfo_all(hint.ai_family, addrs);
+		return;
 	}
 	for (addr = addrs; addr != NULL; addr = addr->ai_next)
 	{
@@ -458,140 +917,314 @@ static int MtmConnectSocket(int node, int port)
 			break;
 		}
 	}
+	pg_freeaddrinfo_all(hint.ai_family, addrs);
 
-	if (rc != 0 && errno == EINPROGRESS) {
-		rc = MtmWaitSocket(sd, true, MtmHeartbeatSendTimeout);
-		if (rc == 1) {
-			socklen_t	optlen = sizeof(int);
-			int			errcode;
-
-			if (pg_getsockopt(sd, SOL_SOCKET, SO_ERROR, (void*)&errcode, &optlen, MtmUseRDMA) < 0) {
-				MTM_ELOG(WARNING, "Arbiter failed to getsockopt for %s:%d: %s", host, port, strerror(errcode));
-				goto Error;
-			}
-			if (errcode != 0) {
-				MTM_ELOG(WARNING, "Arbiter trying to connect to %s:%d: %s", host, port, strerror(errcode));
-				goto Error;
-			}
-		} else if (rc == 0) {
-			MTM_ELOG(WARNING, "Arbiter failed to connect to socket to %s:%d within specified timeout", host, port);
-			goto Error;
-		} else { 
-			MTM_ELOG(WARNING, "Arbiter failed to wait socket to %s:%d: %s", host, port, strerror(errno));
-			goto Error;
-		}
-	}
-	else if (rc != 0) {
+	if (rc != 0 && errno != EINPROGRESS) {
 		MTM_ELOG(WARNING, "Arbiter failed to connect to %s:%d: (%d) %s", host, port, rc, strerror(errno));
-		goto Error;
+		pg_closesocket(sd, MtmUseRDMA);
+		return;
 	}
+	peer->sd = sd;
+	peer->state = MTM_PEER_CONNECTING;
 
-	MtmSetSocketOptions(sd);
 	MtmInitMessage(&req.hdr, MSG_HANDSHAKE);
 	req.hdr.node = MtmNodeId;
 	req.hdr.dxid = HANDSHAKE_MAGIC;
 	req.hdr.sxid = ShmemVariableCache->nextXid;
 	req.hdr.csn  = MtmGetCurrentTime();
 	strcpy(req.connStr, Mtm->nodes[MtmNodeId-1].con.connStr);
-	if (!MtmWriteSocket(sd, &req, sizeof req)) { 
-		MTM_ELOG(WARNING, "Arbiter failed to send handshake message to %s:%d: %s", host, port, strerror(errno));
-		pg_closesocket(sd, MtmUseRDMA);
-		goto Retry;
+	MtmPeerEnqueue(node, &req, sizeof req);
+	peer->handshakeSize = sizeof req;
+
+	if (rc == 0) {
+		MtmSetSocketOptions(sd);
+		peer->state = MTM_PEER_HANDSHAKE;
+		MtmPeerFlush(node);
 	}
-	if (MtmReadSocket(sd, &resp, sizeof resp) != sizeof(resp)) { 
-		MTM_ELOG(WARNING, "Arbiter failed to receive response for handshake message from %s:%d: %s", host, port, strerror(errno));
-		pg_closesocket(sd, MtmUseRDMA);
-		goto Retry;
+}
+
+/*
+ * Socket of connecting peer becomes writable: check result of connect and send handshake
+ */
+static void MtmPeerConnected(int node)
+{
+	MtmPeer* peer = &peers[node];
+	socklen_t optlen = sizeof(int);
+	int errcode;
+
+	if (pg_getsockopt(peer->sd, SOL_SOCKET, SO_ERROR, (void*)&errcode, &optlen, MtmUseRDMA) < 0) {
+		MTM_ELOG(WARNING, "Arbiter failed to getsockopt for node %d: %s", node+1, strerror(errno));
+		MtmPeerDisconnect(node);
+	} else if (errcode != 0) {
+		MTM_ELOG(WARNING, "Arbiter trying to connect to node %d: %s", node+1, strerror(errcode));
+		MtmPeerDisconnect(node);
+	} else {
+		MtmSetSocketOptions(peer->sd);
+		peer->state = MTM_PEER_HANDSHAKE;
+		MtmPeerFlush(node);
 	}
+}
+
+/*
+ * Socket of handshaking peer becomes readable: receive handshake response
+ */
+static void MtmPeerReceiveHandshake(int node)
+{
+	MtmPeer* peer = &peers[node];
+	MtmArbiterMessage resp;
+	int rc;
+
+	MtmBufferReserve(&peer->in, sizeof resp);
+	while ((rc = pg_recv(peer->sd, peer->in.data + peer->in.used, sizeof(resp) - peer->in.used, 0, MtmUseRDMA)) < 0 && errno == EINTR);
+	if (rc <= 0) {
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		MTM_ELOG(WARNING, "Arbiter failed to receive response for handshake message from node %d: %s", node+1, strerror(errno));
+		MtmPeerDisconnect(node);
+		return;
+	}
+	peer->in.used += rc;
+	if (peer->in.used < (int)sizeof(resp)) {
+		return;
+	}
+	memcpy(&resp, peer->in.data, sizeof resp);
+	peer->in.used = 0;
 	if (resp.code != MSG_STATUS || resp.dxid != HANDSHAKE_MAGIC) {
-		MTM_ELOG(WARNING, "Arbiter get unexpected response %d for handshake message from %s:%d", resp.code, host, port);
-		pg_closesocket(sd, MtmUseRDMA);
-		goto Retry;
+		MTM_ELOG(WARNING, "Arbiter get unexpected response %d for handshake message from node %d", resp.code, node+1);
+		MtmPeerDisconnect(node);
+		return;
 	}
-	if (addrs)
-		pg_freeaddrinfo_all(hint.ai_family, addrs);
+	peer->state = MTM_PEER_CONNECTED;
 
 	MtmLock(LW_EXCLUSIVE);
 	MtmCheckResponse(&resp);
 	MtmUnlock();
 
 	MtmOnNodeConnect(node+1);
+	MTM_LOG1("Arbiter established connection with node %d", node+1);
 
-	busy_mask = save_mask;
-	
-	return sd;
+	/* Send messages queued while connection was established */
+	MtmPeerFlush(node);
+}
 
-Error:
-	busy_mask = save_mask;
-	if (sd >= 0) { 
-		pg_closesocket(sd, MtmUseRDMA);
+/*
+ * Wait until some of peers with pending IO becomes ready or sender is woken up, but not longer than timeout,
+ * and perform the IO
+ */
+static void MtmPollPeers(int timeoutMsec)
+{
+	struct timeval tv;
+	fd_set rdset, wrset;
+	int max_sd = wakeupPipe[0];
+	int i, rc;
+	timestamp_t now = MtmGetSystemTime();
+
+	FD_ZERO(&rdset);
+	FD_ZERO(&wrset);
+	FD_SET(wakeupPipe[0], &rdset);
+	for (i = 0; i < Mtm->nAllNodes; i++) {
+		MtmPeer* peer = &peers[i];
+		if (peer->state == MTM_PEER_CONNECTING || peer->state == MTM_PEER_HANDSHAKE) {
+			if (now > peer->connectTime + MSEC_TO_USEC(MtmHeartbeatRecvTimeout)) {
+				MTM_ELOG(WARNING, "Arbiter failed to connect to node %d within specified timeout", i+1);
+				MtmPeerDisconnect(i);
+				continue;
+			}
+		}
+		if (peer->fullTime != 0 && now > peer->fullTime + MSEC_TO_USEC(MtmHeartbeatRecvTimeout)) {
+			MTM_ELOG(WARNING, "Arbiter queue of node %d exceeds %d bytes for more than %d msec: connection is stalled",
+					 i+1, MtmArbiterQueueSize, MtmHeartbeatRecvTimeout);
+			MtmPeerDisconnect(i);
+			continue;
+		}
+		if (MtmPeerHasPendingIO(i)) {
+			if (peer->state == MTM_PEER_HANDSHAKE && peer->sent >= peer->handshakeSize) {
+				FD_SET(peer->sd, &rdset);
+			} else {
+				FD_SET(peer->sd, &wrset);
+			}
+			max_sd = Max(max_sd, peer->sd);
+		}
 	}
-	if (addrs) {
-		pg_freeaddrinfo_all(hint.ai_family, addrs);
+	tv.tv_sec = timeoutMsec/1000;
+	tv.tv_usec = timeoutMsec%1000*1000;
+	do {
+		rc = pg_select(max_sd+1, &rdset, &wrset, NULL, &tv, MtmUseRDMA);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc <= 0) {
+		return;
+	}
+	if (FD_ISSET(wakeupPipe[0], &rdset)) {
+		MtmDrainWakeupPipe();
+	}
+	for (i = 0; i < Mtm->nAllNodes; i++) {
+		MtmPeer* peer = &peers[i];
+		if (peer->sd < 0) {
+			continue;
+		}
+		if (FD_ISSET(peer->sd, &wrset)) {
+			if (peer->state == MTM_PEER_CONNECTING) {
+				MtmPeerConnected(i);
+			} else {
+				MtmPeerFlush(i);
+			}
+		} else if (FD_ISSET(peer->sd, &rdset)) {
+			MtmPeerReceiveHandshake(i);
+		}
 	}
-	return -1;
 }
 
-
-static void MtmOpenConnections()
+static bool MtmHasPendingIO(void)
 {
-	int nNodes = MtmMaxNodes;
 	int i;
+	for (i = 0; i < Mtm->nAllNodes; i++) {
+		if (MtmPeerHasPendingIO(i)) {
+			return true;
+		}
+	}
+	return false;
+}
 
-	sockets = (int*)palloc(sizeof(int)*nNodes);
+/*
+ * Start connection to the node if it is not connected. Attempts are performed not more often than once per heartbeat
+ * period unless reconnect is explicitly requested through Mtm->reconnectMask.
+ */
+static void MtmCheckConnection(int node)
+{
+	MtmPeer* peer = &peers[node];
+	bool reconnect = BIT_CHECK(Mtm->reconnectMask, node);
 
-	for (i = 0; i < nNodes; i++) {
-		sockets[i] = -1;
+	if (reconnect) {
+		MtmLock(LW_EXCLUSIVE);
+		BIT_CLEAR(Mtm->reconnectMask, node);
+		MtmUnlock();
 	}
-	for (i = 0; i < nNodes; i++) {
-		if (i+1 != MtmNodeId && i < Mtm->nAllNodes) { 
-			sockets[i] = MtmConnectSocket(i, Mtm->nodes[i].con.arbiterPort);
-		}
+	if (peer->state == MTM_PEER_DISCONNECTED
+		&& (reconnect || peer->connectTime + MSEC_TO_USEC(MtmHeartbeatSendTimeout) <= MtmGetSystemTime()))
+	{
+		MtmPeerConnect(node);
 	}
-	MtmStateProcessEvent(MTM_ARBITER_RECEIVER_START);
 }
 
+/*
+ * Check if some of retained messages can be passed to the queue of their peer
+ */
+static bool MtmCanSendRetained(void)
+{
+	int i;
+	for (i = 0; i < Mtm->nAllNodes; i++) {
+		if (BIT_CHECK(retainedMask, i) && !MtmPeerIsFull(i, 0)) {
+			return true;
+		}
+	}
+	return false;
+}
 
-static bool MtmSendToNode(int node, void const* buf, int size)
-{	
-	bool result = true;
-	nodemask_t save_mask = busy_mask;
-	BIT_SET(busy_mask, node);
-	while (true) {
-#if 0
-		/* Original intention was to reestablish connection when reconnect mask is set to avoid hanged-up connection.
-		 * But reconnectMask is set not only when connection is broken, so breaking connection in all this cases cause avalanche of connection failures.
-		 */
-		if (sockets[node] >= 0 && BIT_CHECK(Mtm->reconnectMask, node)) {
-			MTM_ELOG(WARNING, "Arbiter is forced to reconnect to node %d", node+1); 
-			pg_closesocket(sockets[node], MtmUseRDMA);
-			sockets[node] = -1;
+/*
+ * Wait for new messages. Sender can not wait for semaphore and sockets at the same time,
+ * so while some peers have pending IO, it waits for their sockets together with wakeup pipe,
+ * which is written by MtmSendMessage after signaling semaphore.
+ * When all connections keep up with the traffic, sender just sleeps on semaphore.
+ */
+static void MtmSenderWait(void)
+{
+	while (!stop) {
+		if (!MtmHasPendingIO()) {
+			PGSemaphoreLock(&Mtm->sendSemaphore);
+			return;
 		}
-#endif
-		if (BIT_CHECK(Mtm->reconnectMask, node)) {
-			MtmLock(LW_EXCLUSIVE);		
-			BIT_CLEAR(Mtm->reconnectMask, node);
-			MtmUnlock();
+		if (PGSemaphoreTryLock(&Mtm->sendSemaphore)) {
+			return;
 		}
-		if (sockets[node] < 0 || !MtmWriteSocket(sockets[node], buf, size)) {
-			if (sockets[node] >= 0) { 
-				MTM_ELOG(WARNING, "Arbiter fail to write to node %d: %s", node+1, strerror(errno));
-				pg_closesocket(sockets[node], MtmUseRDMA);
-				sockets[node] = -1;
-			}
-			sockets[node] = MtmConnectSocket(node, Mtm->nodes[node].con.arbiterPort);
-			if (sockets[node] < 0) { 
-				result = false;
-				break;
+		MtmPollPeers(MtmHeartbeatSendTimeout);
+		if (MtmCanSendRetained()) {
+			return;
+		}
+		MtmCheckHeartbeat();
+	}
+}
+
+static void MtmSendHeartbeat()
+{
+	int i;
+	MtmArbiterMessage msg;
+	static MtmBuffer batch;
+	timestamp_t now = MtmGetSystemTime();
+	MtmInitMessage(&msg, MSG_HEARTBEAT);
+	msg.node = MtmNodeId;
+	msg.csn = now;
+	MtmBeginBatch(&batch, &msg);
+	MtmEncodeMessage(&batch, &msg);
+	MtmEndBatch(&batch);
+	if (last_sent_heartbeat != 0 && last_sent_heartbeat + MSEC_TO_USEC(MtmHeartbeatSendTimeout)*2 < now) { 
+		MTM_LOG1("More than %lld microseconds since last heartbeat", now - last_sent_heartbeat);
+	}
+	last_sent_heartbeat = now;
+
+	for (i = 0; i < Mtm->nAllNodes; i++)
+	{
+		if (i+1 != MtmNodeId) { 
+			/*
+			 * Old behaviour here can cause subtle bugs, for example
+			 * it can happened that none of mentioned conditiotions is
+			 * true when disabled node connects to a major node which
+			 * is online. So just send it allways. --sk
+			 */
+			MtmCheckConnection(i);
+			if (peers[i].state == MTM_PEER_DISCONNECTED) {
+				MTM_ELOG(LOG, "Arbiter failed to send heartbeat to node %d", i+1);
+			} else {
+				MtmPeerEnqueue(i, batch.data, batch.used);
+				MtmPeerFlush(i);
+				if (last_heartbeat_to_node[i] + MSEC_TO_USEC(MtmHeartbeatSendTimeout)*2 < now) { 
+					MTM_LOG1("Last heartbeat to node %d was sent %lld microseconds ago", i+1, now - last_heartbeat_to_node[i]);
+				}
+				last_heartbeat_to_node[i] = now;
+				/* Connectivity mask can be cleared by MtmWatchdog: in this case connection is still alive */
+				if (peers[i].state == MTM_PEER_CONNECTED && BIT_CHECK(SELF_CONNECTIVITY_MASK, i)) { 
+					MTM_LOG1("Force reconnect to node %d", i+1);    
+					MtmPeerDisconnect(i);
+					MtmReconnectNode(i+1); /* set reconnect mask to force node reconnent */
+				}
+				MTM_LOG4("Send heartbeat to node %d with timestamp %lld", i+1, now);    
 			}
-			MTM_LOG1("Arbiter reestablish connection with node %d", node+1);
-		} else { 
-			result = true;
-			break;
 		}
 	}
-	busy_mask = save_mask;
-	return result;
+	
+}
+
+/* This function should be called from all places where sender can be blocked.
+ * It checks send_heartbeat flag set by timer and if it is set then sends heartbeats to all alive nodes 
+ */
+void MtmCheckHeartbeat()
+{
+	if (send_heartbeat && !stop) {
+		send_heartbeat = false;
+		enable_timeout_after(heartbeat_timer, MtmHeartbeatSendTimeout);
+		MtmSendHeartbeat();
+	}			
+}
+
+
+static void MtmOpenConnections()
+{
+	int nNodes = MtmMaxNodes;
+	int i;
+
+	peers = (MtmPeer*)palloc0(sizeof(MtmPeer)*nNodes);
+
+	for (i = 0; i < nNodes; i++) {
+		peers[i].sd = -1;
+		peers[i].state = MTM_PEER_DISCONNECTED;
+	}
+	for (i = 0; i < nNodes; i++) {
+		if (i+1 != MtmNodeId && i < Mtm->nAllNodes) { 
+			MtmPeerConnect(i);
+		}
+	}
+	MtmStateProcessEvent(MTM_ARBITER_RECEIVER_START);
 }
 
 static int MtmReadFromNode(int node, void* buf, int buf_size)
@@ -692,19 +1325,60 @@ static void MtmAcceptIncomingConnections()
 static void MtmAppendBuffer(MtmBuffer* txBuffer, MtmArbiterMessage* msg)
 {
 	MtmBuffer* buf = &txBuffer[msg->node-1];
-	if (buf->used == buf->size) {
-		if (buf->size == 0) { 
-			buf->size = INIT_BUFFER_SIZE;
-			buf->data = palloc(buf->size * sizeof(MtmArbiterMessage));
-		} else { 
-			buf->size *= 2;
-			buf->data = repalloc(buf->data, buf->size * sizeof(MtmArbiterMessage));
-		}
+	if (buf->used == 0) {
+		MtmBeginBatch(buf, msg);
 	}
 	msg->node = MtmNodeId;
-	buf->data[buf->used++] = *msg;
+	MtmEncodeMessage(buf, msg);
+}
+
+
+/*
+ * Move messages from the list to the batches of their nodes and return them to the free list.
+ * Messages for nodes which queue is full are appended to the retained list.
+ * Returns true if there are votes for prepared transactions among moved messages.
+ * Called under queueSpinlock.
+ */
+static bool MtmCollectMessages(MtmMessageQueue* queue, MtmBuffer* txBuffer, MtmMessageQueue*** tail)
+{
+	MtmMessageQueue *curr, *next;
+	bool flush = false;
+
+	for (curr = queue; curr != NULL; curr = next) {
+		int node = curr->msg.node-1;
+		next = curr->next;
+		if (MtmPeerIsFull(node, txBuffer[node].used)) {
+			if (peers[node].fullTime == 0) {
+				peers[node].fullTime = MtmGetSystemTime();
+			}
+			BIT_SET(retainedMask, node);
+			**tail = curr;
+			*tail = &curr->next;
+			continue;
+		}
+		flush |= curr->msg.code == MSG_PREPARED || curr->msg.code == MSG_PRECOMMITTED;
+		MtmAppendBuffer(txBuffer, &curr->msg);
+		curr->next = Mtm->freeQueue;
+		Mtm->freeQueue = curr;
+	}
+	return flush;
 }
 
+/*
+ * Check if there are votes for prepared transactions in the send queue
+ */
+static bool MtmHasPendingVotes(void)
+{
+	MtmMessageQueue* curr;
+	bool found = false;
+
+	SpinLockAcquire(&Mtm->queueSpinlock);
+	for (curr = Mtm->sendQueue; curr != NULL && !found; curr = curr->next) {
+		found = curr->msg.code == MSG_PREPARED || curr->msg.code == MSG_PRECOMMITTED;
+	}
+	SpinLockRelease(&Mtm->queueSpinlock);
+	return found;
+}
 
 static void MtmSender(Datum arg)
 {
@@ -736,10 +1410,20 @@ static void MtmSender(Datum arg)
 	MtmOpenConnections();
 
 	while (!stop) {
-		MtmMessageQueue *curr, *next;		
-		PGSemaphoreLock(&Mtm->sendSemaphore);
+		MtmMessageQueue *queue, **tail;
+		bool flush;
+		MtmSenderWait();
 		CHECK_FOR_INTERRUPTS();
 
+		if (MtmGroupCommitWindow != 0 && !send_heartbeat && MtmHasPendingVotes()) {
+			/* Collect votes of transactions prepared within group commit window, but do not delay heartbeats */
+			timestamp_t now = MtmGetSystemTime();
+			timestamp_t deadline = last_sent_heartbeat + MSEC_TO_USEC(MtmHeartbeatSendTimeout);
+			if (deadline > now) {
+				pg_usleep(Min((timestamp_t)MtmGroupCommitWindow, deadline - now));
+			}
+		}
+
 		if (ConfigReloadPending)
 		{
 			ConfigReloadPending = false;
@@ -753,19 +1437,32 @@ static void MtmSender(Datum arg)
 		 */
 		SpinLockAcquire(&Mtm->queueSpinlock);
 
-		for (curr = Mtm->sendQueue; curr != NULL; curr = next) {
-			next = curr->next;
-			MtmAppendBuffer(txBuffer, &curr->msg);
-			curr->next = Mtm->freeQueue;
-			Mtm->freeQueue = curr;
-		}
+		/* Retained messages are older, so they are sent first */
+		queue = retained;
+		retained = NULL;
+		retainedMask = 0;
+		tail = &retained;
+		flush = MtmCollectMessages(queue, txBuffer, &tail);
+		flush |= MtmCollectMessages(Mtm->sendQueue, txBuffer, &tail);
+		*tail = NULL;
 		Mtm->sendQueue = NULL;
 
 		SpinLockRelease(&Mtm->queueSpinlock);
 
+		if (flush && MtmGroupCommit) {
+			/*
+			 * Executor workers do not flush PREPARE records (see synchronous_twophase),
+			 * so flush WAL of all collected transactions at once before voting for them.
+			 */
+			XLogFlush(GetXLogInsertRecPtr());
+		}
+
 		for (i = 0; i < Mtm->nAllNodes; i++) { 
 			if (txBuffer[i].used != 0) { 
-				MtmSendToNode(i, txBuffer[i].data, txBuffer[i].used*sizeof(MtmArbiterMessage));
+				MtmEndBatch(&txBuffer[i]);
+				MtmCheckConnection(i);
+				MtmPeerEnqueue(i, txBuffer[i].data, txBuffer[i].used);
+				MtmPeerFlush(i);
 				txBuffer[i].used = 0;
 			}
 		}		
@@ -836,14 +1533,21 @@ static void MtmMonitor(Datum arg)
 static void MtmReceiver(Datum arg)
 {
 	int nNodes = MtmMaxNodes;
-	int nResponses;
-	int i, j, n, rc;
+	int i, n, rc;
+	int pos;
+	bool locked;
+	bool error;
+	MtmBatchCursor batch;
+	MtmArbiterMessage response;
 	MtmBuffer* rxBuffer = (MtmBuffer*)palloc0(sizeof(MtmBuffer)*nNodes);
+	MtmArbiterMessage* deadlockMessages = (MtmArbiterMessage*)palloc(sizeof(MtmArbiterMessage)*MTM_MAX_DEADLOCK_MESSAGES);
+	int nDeadlockMessages, k;
 	timestamp_t lastHeartbeatCheck = MtmGetSystemTime();
 	timestamp_t now;
 	timestamp_t selectTimeout = MtmHeartbeatRecvTimeout;
 
 #if USE_EPOLL
+	int j;
 	struct epoll_event* events = (struct epoll_event*)palloc(sizeof(struct epoll_event)*nNodes);
     epollfd = epoll_create(nNodes);
 #else
@@ -867,8 +1571,7 @@ static void MtmReceiver(Datum arg)
 	MtmAcceptIncomingConnections();
 
 	for (i = 0; i < nNodes; i++) { 
-		rxBuffer[i].size = INIT_BUFFER_SIZE;
-		rxBuffer[i].data = palloc(INIT_BUFFER_SIZE*sizeof(MtmArbiterMessage));
+		MtmBufferReserve(&rxBuffer[i], INIT_BUFFER_SIZE);
 	}
 
 	while (!stop) {
@@ -928,37 +1631,60 @@ static void MtmReceiver(Datum arg)
 				}
 
 				rxBuffer[i].used += rc;
-				nResponses = rxBuffer[i].used/sizeof(MtmArbiterMessage);
+				pos = 0;
+				error = false;
 
-				
-				MtmLock(LW_EXCLUSIVE);						
+				/* MtmLock is obtained only when some of responses in the batch can change state */
+				locked = false;
+				nDeadlockMessages = 0;
 
-				for (j = 0; j < nResponses; j++) { 
-					MtmArbiterMessage* msg = &rxBuffer[i].data[j];
+				while (!error && MtmNextBatch(&rxBuffer[i], &pos, &batch, &error))
+				while (MtmDecodeMessage(&batch, &response, &error))
+				{
+					MtmArbiterMessage* msg = &response;
 					MtmTransState* ts;
 					MtmTransMap* tm;
 					int node = msg->node;
 
 					Assert(node > 0 && node <= nNodes && node != MtmNodeId);
 
-					if (Mtm->nodes[node-1].connectivityMask != msg->connectivityMask) { 
-						MTM_ELOG(LOG, "Node %d changes it connectivity mask from %llx to %llx", node, Mtm->nodes[node-1].connectivityMask, msg->connectivityMask);
+					if (!locked && MtmResponseChangesState(msg)) {
+						MtmLock(LW_EXCLUSIVE);
+						locked = true;
 					}
 
-					Mtm->nodes[node-1].oldestSnapshot = msg->oldestSnapshot;
-					Mtm->nodes[node-1].disabledNodeMask = msg->disabledNodeMask;
-					Mtm->nodes[node-1].connectivityMask = msg->connectivityMask;
-					Mtm->nodes[node-1].lastHeartbeat = MtmGetSystemTime();
+					pg_atomic_write_u64(&Mtm->nodes[node-1].oldestSnapshot, msg->oldestSnapshot);
+					pg_atomic_write_u64(&Mtm->nodes[node-1].lastHeartbeat, MtmGetSystemTime());
 
-					MtmCheckResponse(msg);
+					if (locked) {
+						if (Mtm->nodes[node-1].connectivityMask != msg->connectivityMask) { 
+							MTM_ELOG(LOG, "Node %d changes it connectivity mask from %llx to %llx", node, Mtm->nodes[node-1].connectivityMask, msg->connectivityMask);
+						}
+						Mtm->nodes[node-1].disabledNodeMask = msg->disabledNodeMask;
+						Mtm->nodes[node-1].connectivityMask = msg->connectivityMask;
+
+						MtmCheckResponse(msg);
+					}
 					MTM_LOG2("Receive response %s for transaction %s from node %d", MtmMessageKindMnem[msg->code], msg->gid, node);
 
 					switch (msg->code) {
 					  case MSG_HEARTBEAT:
 						MTM_LOG4("Receive HEARTBEAT from node %d with timestamp %lld delay %lld", 
 								 node, msg->csn, USEC_TO_MSEC(MtmGetSystemTime() - msg->csn)); 
-						Mtm->nodes[node-1].nHeartbeats += 1;
+						pg_atomic_fetch_add_u64(&Mtm->nodes[node-1].nHeartbeats, 1);
 						continue;						
+					  case MSG_DEADLOCK_PROBE:
+					  case MSG_DEADLOCK:
+						/* Handling of probes inspects lock manager, so it is postponed until MtmLock is released */
+						if (nDeadlockMessages < MTM_MAX_DEADLOCK_MESSAGES) {
+							deadlockMessages[nDeadlockMessages++] = *msg;
+						} else {
+							MTM_LOG1("Drop %s message from node %d", MtmMessageKindMnem[msg->code], node);
+						}
+						continue;
+					  case MSG_SEQUENCE_RANGE:
+						MtmSeqRangeReceived(msg);
+						continue;
 					  case MSG_POLL_REQUEST:
 						Assert(*msg->gid);
 						tm = (MtmTransMap*)hash_search(MtmGid2State, msg->gid, HASH_FIND, NULL);
@@ -1035,7 +1761,7 @@ static void MtmReceiver(Datum arg)
 						MTM_ELOG(WARNING, "Ignore response for non-existing transaction %llu from node %d", (long64)msg->dxid, node);
 						continue;
 					}
-					Assert(msg->code == MSG_ABORTED || strcmp(msg->gid, ts->gid) == 0);
+					Assert(msg->code == MSG_ABORTED || *msg->gid == '\0' || strcmp(msg->gid, ts->gid) == 0);
 					if (BIT_CHECK(ts->votedMask, node-1)) {
 						MTM_ELOG(WARNING, "Receive deteriorated %s response for transaction %s (%llu) from node %d",
 							 MtmMessageKindMnem[msg->code], ts->gid, (long64)ts->xid, node);
@@ -1053,6 +1779,7 @@ static void MtmReceiver(Datum arg)
 								continue;
 							}
 							Mtm->nodes[node-1].transDelay += MtmGetCurrentTime() - ts->csn;
+							MtmLatencyRecord(MTM_LATENCY_VOTING, node, ts->phaseStartTime, MtmGetSystemTime());
 							ts->xids[node-1] = msg->sxid;
 							
 #if 0
@@ -1106,6 +1833,7 @@ static void MtmReceiver(Datum arg)
 							break;
 						  case MSG_PRECOMMITTED:
 							MTM_TXTRACE(ts, "MtmTransReceiver got MSG_PRECOMMITTED");
+							MtmLatencyRecord(MTM_LATENCY_PRECOMMIT, node, ts->phaseStartTime, MtmGetSystemTime());
                             if (ts->status == TRANSACTION_STATUS_COMMITTED) {
                                 MTM_ELOG(WARNING, "Receive PRECOMMITTED response for already committed transaction %s (%llu) from node %d",
                                      ts->gid, (long64)ts->xid, node);
@@ -1117,8 +1845,9 @@ static void MtmReceiver(Datum arg)
 									MtmSyncClock(ts->csn);
 								}
 								if ((ts->participantsMask & ~Mtm->disabledNodeMask & ~ts->votedMask) == 0) {
-									ts->csn = MtmAssignCSN();
 									ts->status = TRANSACTION_STATUS_UNKNOWN;
+									pg_write_barrier(); /* see MtmXidInMVCCSnapshot */
+									ts->csn = MtmAssignCSN();
 									MtmWakeUpBackend(ts);
 								}
 							} else { 
@@ -1137,11 +1866,33 @@ static void MtmReceiver(Datum arg)
 						Assert(false); /* All broadcasts are now sent through pglogical */
 					}
 				}
-				MtmUnlock();
+				if (locked) {
+					MtmUnlock();
+				}
+				for (k = 0; k < nDeadlockMessages; k++) {
+					if (deadlockMessages[k].code == MSG_DEADLOCK_PROBE) {
+						MtmHandleDeadlockProbe(&deadlockMessages[k]);
+					} else {
+						MtmHandleDeadlock(&deadlockMessages[k]);
+					}
+				}
 				
-				rxBuffer[i].used -= nResponses*sizeof(MtmArbiterMessage);
+				if (error) {
+					MtmDisconnect(i);
+					rxBuffer[i].used = 0;
+					continue;
+				}
+				rxBuffer[i].used -= pos;
 				if (rxBuffer[i].used != 0) { 
-					memmove(rxBuffer[i].data, (char*)rxBuffer[i].data + nResponses*sizeof(MtmArbiterMessage), rxBuffer[i].used);
+					memmove(rxBuffer[i].data, rxBuffer[i].data + pos, rxBuffer[i].used);
+					if (rxBuffer[i].used >= (int)sizeof(MtmArbiterBatchHeader)) {
+						/* Make sure that buffer is large enough for the whole batch */
+						uint32 size;
+						memcpy(&size, rxBuffer[i].data + offsetof(MtmArbiterBatchHeader, size), sizeof size);
+						if (size > (uint32)rxBuffer[i].used) {
+							MtmBufferReserve(&rxBuffer[i], size - rxBuffer[i].used);
+						}
+					}
 				}
 			}
 		}
@@ -1155,8 +1906,9 @@ static void MtmReceiver(Datum arg)
 				if (now > lastHeartbeatCheck + MSEC_TO_USEC(MtmHeartbeatRecvTimeout)) { 
 					if (!MtmWatchdog(now)) { 
 						for (i = 0; i < nNodes; i++) { 
-							if (Mtm->nodes[i].lastHeartbeat != 0 && sockets[i] >= 0) {
-								MTM_LOG1("Last heartbeat from node %d received %lld microseconds ago", i+1, now - Mtm->nodes[i].lastHeartbeat);
+							timestamp_t lastHeartbeat = pg_atomic_read_u64(&Mtm->nodes[i].lastHeartbeat);
+							if (lastHeartbeat != 0 && sockets[i] >= 0) {
+								MTM_LOG1("Last heartbeat from node %d received %lld microseconds ago", i+1, now - lastHeartbeat);
 							}
 						}
 					}
@@ -1,14 +1,17 @@
 #include "postgres.h"
 #include "fmgr.h"
 #include "miscadmin.h"
+#include "access/xact.h"
 #include "postmaster/postmaster.h"
 #include "postmaster/bgworker.h"
 #include "storage/s_lock.h"
 #include "storage/spin.h"
 #include "storage/proc.h"
+#include "storage/ipc.h"
 #include "storage/pg_sema.h"
 #include "storage/shmem.h"
 #include "datatype/timestamp.h"
+#include "utils/memutils.h"
 #include "utils/portal.h"
 #include "tcop/pquery.h"
 
@@ -17,6 +20,7 @@
 #include "utils/guc.h"
 
 bool MtmIsLogicalReceiver;
+timestamp_t BgwPoolItemEnqueueTime;
 int  MtmMaxWorkers;
 
 static BgwPool* MtmPool;
@@ -29,10 +33,361 @@ static void BgwShutdownWorker(int sig)
 	}
 }
 
+/*
+ * Try to get work item from the queue.
+ * Item is not copied: it remains in shared memory until BgwPoolRelease is called.
+ */
+static bool BgwPoolDequeue(BgwPool* pool, uint64* pos, uint32* nSlots)
+{
+	uint64 head = pg_atomic_read_u64(&pool->head);
+	while (true) {
+		size_t slot = head % pool->nSlots;
+		int64  diff = (int64)(pg_atomic_read_u64(&pool->seq[slot]) - (head + 1));
+		if (diff == 0) {
+			uint32 n;
+			pg_read_barrier();
+			n = pool->itemSlots[slot];
+			if (pg_atomic_compare_exchange_u64(&pool->head, &head, head + n)) {
+				*pos = head;
+				*nSlots = n;
+				return true;
+			}
+		} else if (diff < 0) {
+			return false; /* queue is empty or item is not yet published */
+		} else {
+			head = pg_atomic_read_u64(&pool->head);
+		}
+	}
+}
+
+static bool BgwPoolIsEmpty(BgwPool* pool)
+{
+	uint64 head = pg_atomic_read_u64(&pool->head);
+	return pg_atomic_read_u64(&pool->seq[head % pool->nSlots]) != head + 1;
+}
+
+static void BgwPoolUpdatePeakTime(BgwPool* pool)
+{
+	uint64 zero = 0;
+	pg_atomic_compare_exchange_u64(&pool->lastPeakTime, &zero, MtmGetSystemTime());
+}
+
+/*
+ * Wakeup one idle worker. Workers receiving new work wakeup next worker if queue is still not empty,
+ * so producers do not have to signal all workers.
+ */
+static void BgwPoolWakeupWorker(BgwPool* pool)
+{
+	pg_memory_barrier(); /* pairs with registration of idle worker */
+	if (pg_atomic_read_u32(&pool->nIdle) != 0) {
+		uint32 i, n = pg_atomic_read_u32(&pool->nRegistered);
+		for (i = 0; i < n; i++) {
+			uint32 idle = 1;
+			if (pg_atomic_compare_exchange_u32(&pool->workers[i].idle, &idle, 0)) {
+				pg_atomic_fetch_sub_u32(&pool->nIdle, 1);
+				SetLatch(&ProcGlobal->allProcs[pool->workers[i].procno].procLatch);
+				break;
+			}
+		}
+	}
+}
+
+static void BgwPoolWakeupProducers(BgwPool* pool)
+{
+	pg_memory_barrier(); /* pairs with registration of blocked producer */
+	if (pg_atomic_read_u32(&pool->nBlocked) != 0) {
+		int i;
+		for (i = 0; i < BGW_POOL_MAX_PRODUCERS; i++) {
+			uint32 procno = pg_atomic_read_u32(&pool->blockedProducers[i]);
+			if (procno != 0) {
+				SetLatch(&ProcGlobal->allProcs[procno-1].procLatch);
+			}
+		}
+	}
+}
+
+static bool BgwPoolIsIdle(BgwPool* pool)
+{
+	return pg_atomic_read_u32(&pool->pending) == 0
+		&& pg_atomic_read_u32(&pool->active) == 0
+		&& pg_atomic_read_u32(&pool->nReady) == 0;
+}
+
+static void BgwPoolWakeupIdleWaiters(BgwPool* pool)
+{
+	pg_memory_barrier(); /* pairs with registration of idle waiter */
+	if (pg_atomic_read_u32(&pool->nIdleWaiters) != 0 && (BgwPoolIsIdle(pool) || pool->shutdown)) {
+		int i;
+		for (i = 0; i < BGW_POOL_MAX_PRODUCERS; i++) {
+			uint32 procno = pg_atomic_read_u32(&pool->idleWaiters[i]);
+			if (procno != 0) {
+				SetLatch(&ProcGlobal->allProcs[procno-1].procLatch);
+			}
+		}
+	}
+}
+
+/*
+ * Return slots occupied by work item to the queue
+ */
+static void BgwPoolRelease(BgwPool* pool, uint64 pos, uint32 nSlots)
+{
+	uint32 i;
+	pg_memory_barrier(); /* complete access to the item before slots can be reused */
+	for (i = 0; i < nSlots; i++) {
+		pg_atomic_write_u64(&pool->seq[(pos + i) % pool->nSlots], pos + i + pool->nSlots);
+	}
+	BgwPoolWakeupProducers(pool);
+}
+
+/*
+ * -------------------------------------------
+ * Dependency-aware scheduling of transactions
+ * -------------------------------------------
+ */
+
+static bool BgwPoolTxnIsActive(BgwPool* pool, uint64 id)
+{
+	return id != 0 && pool->txns[id % BGW_POOL_MAX_TXNS].id == id;
+}
+
+static bool BgwPoolAddSuccessor(BgwPoolTxn* pred, uint32 succ)
+{
+	uint32 i;
+	for (i = 0; i < pred->nSuccessors; i++) {
+		if (pred->successors[i] == succ) {
+			return false;
+		}
+	}
+	/* Predecessor is last writer for at most BGW_POOL_MAX_WRITE_SET keys, so it can not have more successors */
+	Assert(pred->nSuccessors < BGW_POOL_MAX_WRITE_SET);
+	pred->successors[pred->nSuccessors++] = succ;
+	return true;
+}
+
+/*
+ * Register transaction in dependency graph.
+ * Returns index of transaction descriptor or BGW_POOL_NO_TXN if there are too many not completed transactions.
+ */
+static uint32 BgwPoolRegisterTxn(BgwPool* pool, BgwPoolWriteSet* ws)
+{
+	uint64 id;
+	uint32 t, i;
+	BgwPoolTxn* txn;
+
+	SpinLockAcquire(&pool->schedLock);
+	id = pool->lastTxnId + 1;
+	t = id % BGW_POOL_MAX_TXNS;
+	txn = &pool->txns[t];
+	if (txn->id != 0) {
+		SpinLockRelease(&pool->schedLock);
+		return BGW_POOL_NO_TXN;
+	}
+	pool->lastTxnId = id;
+	txn->id = id;
+	txn->nDeps = 0;
+	txn->nSuccessors = 0;
+	txn->barrierSucc = BGW_POOL_NO_TXN;
+	txn->followers = BGW_POOL_NO_TXN;
+	txn->nextFollower = BGW_POOL_NO_TXN;
+	txn->isBarrier = ws->barrier;
+	txn->parked = false;
+
+	if (ws->barrier) {
+		/*
+		 * Barrier depends on all active transactions. Transactions which are already followed by some other barrier
+		 * are not linked: this barrier depends on the previous one.
+		 */
+		for (i = pool->unfenced; i != BGW_POOL_NO_TXN; i = pool->txns[i].next) {
+			pool->txns[i].barrierSucc = t;
+			txn->nDeps += 1;
+		}
+		pool->unfenced = BGW_POOL_NO_TXN;
+		pool->lastBarrier = id;
+	} else {
+		if (BgwPoolTxnIsActive(pool, pool->lastBarrier)) {
+			BgwPoolTxn* barrier = &pool->txns[pool->lastBarrier % BGW_POOL_MAX_TXNS];
+			txn->nextFollower = barrier->followers;
+			barrier->followers = t;
+			txn->nDeps += 1;
+		}
+		for (i = 0; i < ws->nKeys; i++) {
+			uint32 h = ws->keys[i] % BGW_POOL_KEY_TABLE_SIZE;
+			uint64 writer = pool->lastWriter[h];
+			if (writer != id && BgwPoolTxnIsActive(pool, writer)
+				&& BgwPoolAddSuccessor(&pool->txns[writer % BGW_POOL_MAX_TXNS], t))
+			{
+				txn->nDeps += 1;
+			}
+			pool->lastWriter[h] = id;
+		}
+	}
+	/* Include transaction in list of transactions which next barrier has to wait for */
+	txn->prev = BGW_POOL_NO_TXN;
+	txn->next = pool->unfenced;
+	if (pool->unfenced != BGW_POOL_NO_TXN) {
+		pool->txns[pool->unfenced].prev = t;
+	}
+	pool->unfenced = t;
+	SpinLockRelease(&pool->schedLock);
+	return t;
+}
+
+/*
+ * Check if transaction can be executed. Otherwise its work item is parked and will be executed by the worker
+ * completing the last predecessor.
+ */
+static bool BgwPoolTxnIsReady(BgwPool* pool, uint32 t, uint64 pos, uint32 nSlots)
+{
+	BgwPoolTxn* txn = &pool->txns[t];
+	bool ready;
+
+	SpinLockAcquire(&pool->schedLock);
+	ready = txn->nDeps == 0;
+	if (!ready) {
+		txn->parked = true;
+		txn->pos = pos;
+		txn->nSlots = nSlots;
+	}
+	SpinLockRelease(&pool->schedLock);
+	return ready;
+}
+
+static void BgwPoolResolveDependency(BgwPool* pool, uint32 t, uint32* next)
+{
+	BgwPoolTxn* txn = &pool->txns[t];
+	Assert(txn->nDeps > 0);
+	if (--txn->nDeps == 0 && txn->parked) {
+		if (*next == BGW_POOL_NO_TXN) {
+			*next = t;
+		} else {
+			pool->ready[pg_atomic_fetch_add_u32(&pool->nReady, 1)] = t;
+		}
+	}
+}
+
+/*
+ * Remove completed transaction from dependency graph.
+ * Returns index of parked successor which should be executed by this worker or BGW_POOL_NO_TXN.
+ * Other parked successors which became ready are placed in ready list.
+ */
+static uint32 BgwPoolCompleteTxn(BgwPool* pool, uint32 t, uint64* pos, uint32* nSlots)
+{
+	BgwPoolTxn* txn = &pool->txns[t];
+	uint32 next = BGW_POOL_NO_TXN;
+	uint32 nReady;
+	bool   pushed;
+	uint32 i;
+
+	SpinLockAcquire(&pool->schedLock);
+	nReady = pg_atomic_read_u32(&pool->nReady);
+	for (i = 0; i < txn->nSuccessors; i++) {
+		BgwPoolResolveDependency(pool, txn->successors[i], &next);
+	}
+	if (txn->barrierSucc != BGW_POOL_NO_TXN) {
+		BgwPoolResolveDependency(pool, txn->barrierSucc, &next);
+	} else {
+		/* Transaction is not followed by barrier: exclude it from the list of unfenced transactions */
+		if (txn->prev != BGW_POOL_NO_TXN) {
+			pool->txns[txn->prev].next = txn->next;
+		} else {
+			pool->unfenced = txn->next;
+		}
+		if (txn->next != BGW_POOL_NO_TXN) {
+			pool->txns[txn->next].prev = txn->prev;
+		}
+	}
+	for (i = txn->followers; i != BGW_POOL_NO_TXN; i = pool->txns[i].nextFollower) {
+		BgwPoolResolveDependency(pool, i, &next);
+	}
+	txn->id = 0;
+	if (next != BGW_POOL_NO_TXN) {
+		*pos = pool->txns[next].pos;
+		*nSlots = pool->txns[next].nSlots;
+	}
+	pushed = pg_atomic_read_u32(&pool->nReady) != nReady;
+	SpinLockRelease(&pool->schedLock);
+	if (pushed) {
+		BgwPoolWakeupWorker(pool);
+	}
+	BgwPoolWakeupProducers(pool); /* producer may wait for free transaction descriptor */
+	return next;
+}
+
+/*
+ * Check if some barrier scheduled in the pool is not completed yet.
+ * Barrier depends on all previously scheduled barriers, so inactive last barrier means that all of them are completed.
+ */
+bool BgwPoolHasActiveBarrier(BgwPool* pool)
+{
+	bool active;
+	SpinLockAcquire(&pool->schedLock);
+	active = BgwPoolTxnIsActive(pool, pool->lastBarrier);
+	SpinLockRelease(&pool->schedLock);
+	return active;
+}
+
+/*
+ * Get parked transaction whose predecessors are completed
+ */
+static bool BgwPoolGetReady(BgwPool* pool, uint64* pos, uint32* nSlots)
+{
+	bool found = false;
+	if (pg_atomic_read_u32(&pool->nReady) != 0) {
+		SpinLockAcquire(&pool->schedLock);
+		if (pg_atomic_read_u32(&pool->nReady) != 0) {
+			uint32 t = pool->ready[pg_atomic_sub_fetch_u32(&pool->nReady, 1)];
+			*pos = pool->txns[t].pos;
+			*nSlots = pool->txns[t].nSlots;
+			found = true;
+		}
+		SpinLockRelease(&pool->schedLock);
+	}
+	return found;
+}
+
+static bool BgwPoolHasWork(BgwPool* pool)
+{
+	return !BgwPoolIsEmpty(pool) || pg_atomic_read_u32(&pool->nReady) != 0;
+}
+
+/*
+ * Copy work item to local memory, release its slots and execute it
+ */
+static void BgwPoolExecuteItem(BgwPool* pool, uint64 pos, uint32 nSlots)
+{
+	static char*  work;
+	static size_t workSize;
+	size_t slot = pos % pool->nSlots;
+	size_t size = pool->itemSize[slot];
+
+	if (size > workSize) {
+		workSize = Max(size, workSize*2);
+		work = work == NULL ? MemoryContextAlloc(TopMemoryContext, workSize) : repalloc(work, workSize);
+	}
+	memcpy(work, &pool->queue[slot*BGW_POOL_SLOT_SIZE], size);
+	BgwPoolItemEnqueueTime = pool->itemTime[slot];
+	BgwPoolRelease(pool, pos, nSlots);
+
+	pg_atomic_fetch_sub_u32(&pool->pending, 1);
+	pg_atomic_fetch_add_u32(&pool->active, 1);
+	if (BgwPoolHasWork(pool)) {
+		if (pg_atomic_read_u32(&pool->active) >= pg_atomic_read_u32(&pool->nWorkers)) {
+			BgwPoolUpdatePeakTime(pool);
+		}
+		BgwPoolWakeupWorker(pool);
+	}
+	pool->executor(work, size);
+	pg_atomic_fetch_sub_u32(&pool->active, 1);
+	pg_atomic_write_u64(&pool->lastPeakTime, 0);
+}
+
 static void BgwPoolMainLoop(BgwPool* pool)
 {
-    int size;
-    void* work;
+	BgwPoolWorker* worker;
+	uint32 index;
+	uint64 pos;
+	uint32 nSlots;
 	static PortalData fakePortal;
 
 	MTM_ELOG(LOG, "Start background worker %d, shutdown=%d", MyProcPid, pool->shutdown);
@@ -52,76 +407,133 @@ static void BgwPoolMainLoop(BgwPool* pool)
 	ActivePortal->status = PORTAL_ACTIVE;
 	ActivePortal->sourceText = "";
 
-	while (true) {
+	index = pg_atomic_fetch_add_u32(&pool->nRegistered, 1);
+	if (index >= pool->maxWorkers) {
+		MTM_ELOG(ERROR, "Too many background workers in pool: %d", (int)index+1);
+	}
+	worker = &pool->workers[index];
+	worker->procno = MyProc->pgprocno;
+
+	/* WAL of prepared transactions is flushed by arbiter sender before sending votes */
+	SetConfigOption("synchronous_twophase", MtmGroupCommit ? "off" : "on", PGC_SUSET, PGC_S_OVERRIDE);
+
+	while (!pool->shutdown) {
 		if (ConfigReloadPending)
 		{
 			ConfigReloadPending = false;
 			ProcessConfigFile(PGC_SIGHUP);
 		}
 
-        PGSemaphoreLock(&pool->available);
-        SpinLockAcquire(&pool->lock);
-		if (pool->shutdown) { 	
-			PGSemaphoreUnlock(&pool->available);
-			break;
+		if (BgwPoolGetReady(pool, &pos, &nSlots)) {
+			/* Parked item: its predecessors are already completed */
+		} else if (BgwPoolDequeue(pool, &pos, &nSlots)) {
+			size_t slot = pos % pool->nSlots;
+			if (pool->itemSize[slot] == 0) { /* skip dummy item */
+				BgwPoolRelease(pool, pos, nSlots);
+				continue;
+			}
+			if (pool->itemTxn[slot] != BGW_POOL_NO_TXN
+				&& !BgwPoolTxnIsReady(pool, pool->itemTxn[slot], pos, nSlots))
+			{
+				continue; /* item is parked until completion of its predecessors */
+			}
+		} else {
+			uint32 idle = 1;
+			int rc = 0;
+
+			ResetLatch(&MyProc->procLatch);
+			pg_atomic_write_u32(&worker->idle, 1);
+			pg_atomic_fetch_add_u32(&pool->nIdle, 1);
+			pg_memory_barrier();
+			/* Recheck queue after registration, so that BgwPoolWakeupWorker will not miss us */
+			if (!BgwPoolHasWork(pool) && !pool->shutdown) {
+				rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, BGW_POOL_WAIT_TIMEOUT);
+			}
+			if (pg_atomic_compare_exchange_u32(&worker->idle, &idle, 0)) {
+				pg_atomic_fetch_sub_u32(&pool->nIdle, 1);
+			}
+			if (rc & WL_POSTMASTER_DEATH) {
+				proc_exit(1);
+			}
+			continue;
+		}
+		/* Execute item and then chain of its dependent transactions parked in the queue */
+		while (true) {
+			uint32 txn = pool->itemTxn[pos % pool->nSlots];
+			uint32 next = BGW_POOL_NO_TXN;
+			uint64 nextPos = 0;
+			uint32 nextSlots = 0;
+
+			BgwPoolExecuteItem(pool, pos, nSlots);
+			if (txn != BGW_POOL_NO_TXN) {
+				next = BgwPoolCompleteTxn(pool, txn, &nextPos, &nextSlots);
+			}
+			BgwPoolWakeupIdleWaiters(pool);
+			if (next == BGW_POOL_NO_TXN) {
+				break;
+			}
+			pos = nextPos;
+			nSlots = nextSlots;
 		}
-        size = *(int*)&pool->queue[pool->head];
-        Assert(size < pool->size);
-        work = palloc(size);
-        pool->pending -= 1;
-        pool->active += 1;
-		if (pool->lastPeakTime == 0 && pool->active == pool->nWorkers && pool->pending != 0) {
-			pool->lastPeakTime = MtmGetSystemTime();
-		}
-        if (pool->head + size + 4 > pool->size) { 
-            memcpy(work, pool->queue, size);
-            pool->head = INTALIGN(size);
-        } else { 
-            memcpy(work, &pool->queue[pool->head+4], size);
-            pool->head += 4 + INTALIGN(size);
-        }
-        if (pool->size == pool->head) { 
-            pool->head = 0;
-        }
-        if (pool->producerBlocked) {
-            pool->producerBlocked = false;
-            PGSemaphoreUnlock(&pool->overflow);
-			pool->lastPeakTime = 0;
-        }
-        SpinLockRelease(&pool->lock);
-        pool->executor(work, size);
-        pfree(work);
-        SpinLockAcquire(&pool->lock);
-        pool->active -= 1;
-		pool->lastPeakTime = 0;
-        SpinLockRelease(&pool->lock);
     }
-	SpinLockRelease(&pool->lock);
 	MTM_ELOG(LOG, "Shutdown background worker %d", MyProcPid);
 }
 
 void BgwPoolInit(BgwPool* pool, BgwPoolExecutor executor, char const* dbname,  char const* dbuser, size_t queueSize, size_t nWorkers)
 {
+	size_t i;
+
 	MtmPool = pool;
-    pool->queue = (char*)ShmemAlloc(queueSize);
-	if (pool->queue == NULL) { 
+	pool->nSlots = queueSize / BGW_POOL_SLOT_SIZE;
+	pool->size = pool->nSlots * BGW_POOL_SLOT_SIZE;
+    pool->queue = (char*)ShmemAlloc(pool->size);
+	pool->seq = (pg_atomic_uint64*)ShmemAlloc(pool->nSlots*sizeof(pg_atomic_uint64));
+	pool->itemSlots = (uint32*)ShmemAlloc(pool->nSlots*sizeof(uint32));
+	pool->itemSize = (uint32*)ShmemAlloc(pool->nSlots*sizeof(uint32));
+	pool->itemTxn = (uint32*)ShmemAlloc(pool->nSlots*sizeof(uint32));
+	pool->itemTime = (timestamp_t*)ShmemAlloc(pool->nSlots*sizeof(timestamp_t));
+	pool->txns = (BgwPoolTxn*)ShmemAlloc(BGW_POOL_MAX_TXNS*sizeof(BgwPoolTxn));
+	pool->lastWriter = (uint64*)ShmemAlloc(BGW_POOL_KEY_TABLE_SIZE*sizeof(uint64));
+	pool->ready = (uint32*)ShmemAlloc(BGW_POOL_MAX_TXNS*sizeof(uint32));
+	pool->maxWorkers = Max(nWorkers, MtmMaxWorkers);
+	pool->workers = (BgwPoolWorker*)ShmemAlloc(pool->maxWorkers*sizeof(BgwPoolWorker));
+	if (pool->queue == NULL || pool->seq == NULL || pool->itemSlots == NULL || pool->itemSize == NULL || pool->workers == NULL
+		|| pool->itemTxn == NULL || pool->itemTime == NULL || pool->txns == NULL || pool->lastWriter == NULL || pool->ready == NULL)
+	{
 		elog(PANIC, "Failed to allocate memory for background workers pool: %lld bytes requested", (long64)queueSize);
 	}
     pool->executor = executor;
-    PGSemaphoreCreate(&pool->available);
-    PGSemaphoreCreate(&pool->overflow);
-    PGSemaphoreReset(&pool->available);
-    PGSemaphoreReset(&pool->overflow);
-    SpinLockInit(&pool->lock);
+	for (i = 0; i < pool->nSlots; i++) {
+		pg_atomic_init_u64(&pool->seq[i], i);
+	}
+	for (i = 0; i < pool->maxWorkers; i++) {
+		pg_atomic_init_u32(&pool->workers[i].idle, 0);
+		pool->workers[i].procno = 0;
+	}
+	for (i = 0; i < BGW_POOL_MAX_PRODUCERS; i++) {
+		pg_atomic_init_u32(&pool->blockedProducers[i], 0);
+		pg_atomic_init_u32(&pool->idleWaiters[i], 0);
+	}
+	for (i = 0; i < BGW_POOL_MAX_TXNS; i++) {
+		pool->txns[i].id = 0;
+	}
+	memset(pool->lastWriter, 0, BGW_POOL_KEY_TABLE_SIZE*sizeof(uint64));
+	SpinLockInit(&pool->schedLock);
+	pool->lastTxnId = 0;
+	pool->lastBarrier = 0;
+	pool->unfenced = BGW_POOL_NO_TXN;
+	pg_atomic_init_u32(&pool->nReady, 0);
 	pool->shutdown = false;
-    pool->producerBlocked = false;
-    pool->head = 0;
-    pool->tail = 0;
-    pool->size = queueSize;
-    pool->active = 0;
-    pool->pending = 0;
-	pool->nWorkers = nWorkers;
-	pool->lastPeakTime = 0;
+	pg_atomic_init_u64(&pool->head, 0);
+	pg_atomic_init_u64(&pool->tail, 0);
+	pg_atomic_init_u32(&pool->active, 0);
+	pg_atomic_init_u32(&pool->pending, 0);
+	pg_atomic_init_u32(&pool->nWorkers, nWorkers);
+	pg_atomic_init_u32(&pool->nRegistered, 0);
+	pg_atomic_init_u32(&pool->nIdle, 0);
+	pg_atomic_init_u32(&pool->nBlocked, 0);
+	pg_atomic_init_u32(&pool->nIdleWaiters, 0);
+	pg_atomic_init_u64(&pool->lastPeakTime, 0);
 	pool->lastDynamicWorkerStartTime = 0;
 	strncpy(pool->dbname, dbname, MAX_DBNAME_LEN);
 	strncpy(pool->dbuser, dbuser, MAX_DBUSER_LEN);
@@ -129,7 +541,7 @@ void BgwPoolInit(BgwPool* pool, BgwPoolExecutor executor, char const* dbname,  c
  
 timestamp_t BgwGetLastPeekTime(BgwPool* pool)
 {
-	return pool->lastPeakTime;
+	return pg_atomic_read_u64(&pool->lastPeakTime);
 }
 
 static void BgwPoolStaticWorkerMainLoop(Datum arg)
@@ -163,17 +575,16 @@ void BgwPoolStart(int nWorkers, BgwPoolConstructor constructor)
 
 size_t BgwPoolGetQueueSize(BgwPool* pool)
 {
-	size_t used;
-    SpinLockAcquire(&pool->lock);
-	used = pool->head <= pool->tail ? pool->tail - pool->head : pool->size - pool->head + pool->tail;
-    SpinLockRelease(&pool->lock);            
-	return used;
+	uint64 head = pg_atomic_read_u64(&pool->head);
+	uint64 tail = pg_atomic_read_u64(&pool->tail);
+	return tail > head ? (size_t)(tail - head)*BGW_POOL_SLOT_SIZE : 0;
 }
 
 
 static void BgwStartExtraWorker(BgwPool* pool)
 {
-	if (pool->nWorkers < MtmMaxWorkers) { 
+	uint32 nWorkers = pg_atomic_read_u32(&pool->nWorkers);
+	if (nWorkers < MtmMaxWorkers && pg_atomic_compare_exchange_u32(&pool->nWorkers, &nWorkers, nWorkers + 1)) { 
 		timestamp_t now = MtmGetSystemTime();
 		/*if (pool->lastDynamicWorkerStartTime + MULTIMASTER_BGW_RESTART_TIMEOUT*USECS_PER_SEC < now)*/
 		{ 
@@ -184,7 +595,7 @@ static void BgwStartExtraWorker(BgwPool* pool)
 			worker.bgw_start_time = BgWorkerStart_ConsistentState;
 			worker.bgw_main = BgwPoolDynamicWorkerMainLoop;
 			worker.bgw_restart_time = MULTIMASTER_BGW_RESTART_TIMEOUT;
-			snprintf(worker.bgw_name, BGW_MAXLEN, "bgw_pool_dynworker_%d", (int)++pool->nWorkers);
+			snprintf(worker.bgw_name, BGW_MAXLEN, "bgw_pool_dynworker_%d", (int)nWorkers + 1);
 			worker.bgw_main_arg = PointerGetDatum(pool);
 			pool->lastDynamicWorkerStartTime = now;
 			if (!RegisterDynamicBackgroundWorker(&worker, &handle)) { 
@@ -194,60 +605,222 @@ static void BgwStartExtraWorker(BgwPool* pool)
 	}
 }
 
+/*
+ * Try to allocate nSlots adjacent slots at the tail of the queue and place work item in them.
+ * If write set is specified, transaction is registered in dependency graph only after its slots are allocated,
+ * so that parked transactions never wait for predecessor which is not in the queue.
+ * Returns false if there is no free space in the queue or too many not completed transactions.
+ */
+static bool BgwPoolTryEnqueue(BgwPool* pool, BgwPoolFragment* fragments, int nFragments, size_t size, uint32 nSlots, BgwPoolWriteSet* ws)
+{
+	uint64 pos = pg_atomic_read_u64(&pool->tail);
+	while (true) {
+		size_t first = pos % pool->nSlots;
+		/* Item can not wrap around the end of the queue: fill rest of the queue with dummy item */
+		uint32 n = first + nSlots > pool->nSlots ? (uint32)(pool->nSlots - first) : nSlots;
+		int64  diff = 0;
+		uint32 i;
+
+		for (i = 0; i < n; i++) {
+			diff = (int64)(pg_atomic_read_u64(&pool->seq[(pos + i) % pool->nSlots]) - (pos + i));
+			if (diff != 0) {
+				break;
+			}
+		}
+		if (diff < 0) {
+			return false; /* slots are not yet released by consumers */
+		}
+		if (diff > 0) {
+			pos = pg_atomic_read_u64(&pool->tail);
+		} else if (pg_atomic_compare_exchange_u64(&pool->tail, &pos, pos + n)) {
+			bool   complete = n == nSlots;
+			uint32 txn = BGW_POOL_NO_TXN;
+			if (complete && ws != NULL) {
+				txn = BgwPoolRegisterTxn(pool, ws);
+				if (txn == BGW_POOL_NO_TXN) {
+					complete = false; /* allocated slots are published as dummy item */
+				}
+			}
+			pool->itemSlots[first] = n;
+			if (complete) {
+				char* dst = &pool->queue[first*BGW_POOL_SLOT_SIZE];
+				for (i = 0; i < (uint32)nFragments; i++) {
+					memcpy(dst, fragments[i].data, fragments[i].size);
+					dst += fragments[i].size;
+				}
+				pool->itemSize[first] = size;
+				pool->itemTxn[first] = txn;
+				pool->itemTime[first] = MtmGetSystemTime();
+			} else {
+				pool->itemSize[first] = 0;
+				pool->itemTxn[first] = BGW_POOL_NO_TXN;
+			}
+			pg_write_barrier();
+			pg_atomic_write_u64(&pool->seq[first], pos + 1);
+			if (complete) {
+				return true;
+			}
+			if (n == nSlots) {
+				return false; /* too many not completed transactions */
+			}
+			pos += n;
+		}
+	}
+}
+
 void BgwPoolExecute(BgwPool* pool, void* work, size_t size)
 {
-    if (size+4 > pool->size) {
+	BgwPoolScheduleExecute(pool, work, size, NULL);
+}
+
+void BgwPoolScheduleExecute(BgwPool* pool, void* work, size_t size, BgwPoolWriteSet* ws)
+{
+	BgwPoolFragment fragment;
+	fragment.data = work;
+	fragment.size = size;
+	BgwPoolScheduleExecuteFragments(pool, &fragment, 1, ws);
+}
+
+/*
+ * Execute work in the context of the caller. Work consisting of several fragments has to be assembled in local memory.
+ */
+void BgwPoolExecuteFragmentsInline(BgwPool* pool, BgwPoolFragment* fragments, int nFragments)
+{
+	BgwPoolItemEnqueueTime = 0;
+	if (nFragments == 1) {
+		pool->executor(fragments[0].data, fragments[0].size);
+	} else {
+		size_t size = 0;
+		char*  work;
+		int    i;
+
+		for (i = 0; i < nFragments; i++) {
+			size += fragments[i].size;
+		}
+		work = palloc(size);
+		size = 0;
+		for (i = 0; i < nFragments; i++) {
+			memcpy(work + size, fragments[i].data, fragments[i].size);
+			size += fragments[i].size;
+		}
+		pool->executor(work, size);
+		pfree(work);
+	}
+}
+
+/*
+ * Place work in the queue. If write set is specified, work is not started until all previously scheduled
+ * transactions with intersected write sets are completed.
+ */
+void BgwPoolScheduleExecuteFragments(BgwPool* pool, BgwPoolFragment* fragments, int nFragments, BgwPoolWriteSet* ws)
+{
+	size_t size = 0;
+	uint32 nSlots;
+	int    producer = -1;
+	int    i;
+
+	for (i = 0; i < nFragments; i++) {
+		size += fragments[i].size;
+	}
+	nSlots = (size + BGW_POOL_SLOT_SIZE - 1) / BGW_POOL_SLOT_SIZE;
+
+    if (nSlots > pool->nSlots || size == 0) {
 		/* 
 		 * Size of work is larger than size of shared buffer: 
 		 * run it immediately
 		 */
-		pool->executor(work, size);
+		if (ws != NULL) {
+			/* Dependencies of scheduled transaction are not tracked in this case: wait for completion of all of them */
+			BgwPoolWaitIdle(pool);
+		}
+		BgwPoolExecuteFragmentsInline(pool, fragments, nFragments);
 		return;
 	}
  
-    SpinLockAcquire(&pool->lock);
     while (!pool->shutdown) { 
-        if ((pool->head <= pool->tail && pool->size - pool->tail < size + 4 && pool->head < size) 
-            || (pool->head > pool->tail && pool->head - pool->tail < size + 4))
-        {
-            if (pool->lastPeakTime == 0) {
-				pool->lastPeakTime = MtmGetSystemTime();
-			}
-			pool->producerBlocked = true;
-            SpinLockRelease(&pool->lock);
-            PGSemaphoreLock(&pool->overflow);
-            SpinLockAcquire(&pool->lock);
-        } else {
-            pool->pending += 1;
-			if (pool->active + pool->pending > pool->nWorkers) { 
+		if (BgwPoolTryEnqueue(pool, fragments, nFragments, size, nSlots, ws)) {
+			uint32 pending = pg_atomic_add_fetch_u32(&pool->pending, 1);
+			uint32 active = pg_atomic_read_u32(&pool->active);
+			uint32 nWorkers = pg_atomic_read_u32(&pool->nWorkers);
+			if (active + pending > nWorkers) { 
 				BgwStartExtraWorker(pool);				
 			}
-			if (pool->lastPeakTime == 0 && pool->active == pool->nWorkers && pool->pending != 0) {
-				pool->lastPeakTime = MtmGetSystemTime();
-			}
-            *(int*)&pool->queue[pool->tail] = size;
-            if (pool->size - pool->tail >= size + 4) { 
-                memcpy(&pool->queue[pool->tail+4], work, size);
-                pool->tail += 4 + INTALIGN(size);
-            } else { 
-                memcpy(pool->queue, work, size);
-                pool->tail = INTALIGN(size);
-            }
-            if (pool->tail == pool->size) {
-                pool->tail = 0;
-            }
-            PGSemaphoreUnlock(&pool->available);
-            break;
-        }
+			if (active >= nWorkers) {
+				BgwPoolUpdatePeakTime(pool);
+			}
+			BgwPoolWakeupWorker(pool);
+			break;
+		}
+		if (producer < 0) {
+			/* Register as blocked producer and recheck free space, so that BgwPoolRelease will not miss us */
+			uint32 procno = MyProc->pgprocno + 1;
+			for (producer = 0; producer < BGW_POOL_MAX_PRODUCERS; producer++) {
+				uint32 empty = 0;
+				if (pg_atomic_compare_exchange_u32(&pool->blockedProducers[producer], &empty, procno)) {
+					break;
+				}
+			}
+			pg_atomic_fetch_add_u32(&pool->nBlocked, 1);
+			BgwPoolUpdatePeakTime(pool);
+			continue;
+		}
+		if (WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, BGW_POOL_WAIT_TIMEOUT) & WL_POSTMASTER_DEATH) {
+			proc_exit(1);
+		}
+		ResetLatch(&MyProc->procLatch);
     }
-    SpinLockRelease(&pool->lock);            
+	if (producer >= 0) {
+		if (producer < BGW_POOL_MAX_PRODUCERS) {
+			pg_atomic_write_u32(&pool->blockedProducers[producer], 0);
+		}
+		pg_atomic_fetch_sub_u32(&pool->nBlocked, 1);
+		pg_atomic_write_u64(&pool->lastPeakTime, 0);
+	}
+}
+
+/*
+ * Wait until all scheduled work is completed. Waiter is woken up by the worker completing the last work item.
+ */
+void BgwPoolWaitIdle(BgwPool* pool)
+{
+	int waiter = -1;
+
+	while (!pool->shutdown && !BgwPoolIsIdle(pool))
+	{
+		if (waiter < 0) {
+			/* Register as idle waiter and recheck state of the pool, so that BgwPoolWakeupIdleWaiters will not miss us */
+			uint32 procno = MyProc->pgprocno + 1;
+			for (waiter = 0; waiter < BGW_POOL_MAX_PRODUCERS; waiter++) {
+				uint32 empty = 0;
+				if (pg_atomic_compare_exchange_u32(&pool->idleWaiters[waiter], &empty, procno)) {
+					break;
+				}
+			}
+			pg_atomic_fetch_add_u32(&pool->nIdleWaiters, 1);
+			pg_memory_barrier();
+			continue;
+		}
+		if (WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, BGW_POOL_WAIT_TIMEOUT) & WL_POSTMASTER_DEATH) {
+			proc_exit(1);
+		}
+		ResetLatch(&MyProc->procLatch);
+	}
+	if (waiter >= 0) {
+		if (waiter < BGW_POOL_MAX_PRODUCERS) {
+			pg_atomic_write_u32(&pool->idleWaiters[waiter], 0);
+		}
+		pg_atomic_fetch_sub_u32(&pool->nIdleWaiters, 1);
+	}
 }
 
 void BgwPoolStop(BgwPool* pool)
 {
-    SpinLockAcquire(&pool->lock);
+	uint32 i, n = pg_atomic_read_u32(&pool->nRegistered);
 	pool->shutdown = true;
-    SpinLockRelease(&pool->lock);            
-	PGSemaphoreUnlock(&pool->available);
-	PGSemaphoreUnlock(&pool->overflow);
+	pg_memory_barrier();
+	for (i = 0; i < n; i++) {
+		SetLatch(&ProcGlobal->allProcs[pool->workers[i].procno].procLatch);
+	}
+	BgwPoolWakeupProducers(pool);
+	BgwPoolWakeupIdleWaiters(pool);
 }
@@ -4,6 +4,7 @@
 #include "storage/s_lock.h"
 #include "storage/spin.h"
 #include "storage/pg_sema.h"
+#include "port/atomics.h"
 #include "bkb.h"
 
 typedef void(*BgwPoolExecutor)(void* work, size_t size);
@@ -15,28 +16,118 @@ typedef ulong64 timestamp_t;
 #define MAX_DBUSER_LEN 30
 #define MULTIMASTER_BGW_RESTART_TIMEOUT BGW_NEVER_RESTART /* seconds */
 
+#define BGW_POOL_SLOT_SIZE     512  /* queue is split into slots of this size, work item occupies one or more adjacent slots */
+#define BGW_POOL_MAX_PRODUCERS 64   /* maximal number of producers which can wait for free space in the queue */
+#define BGW_POOL_WAIT_TIMEOUT  1000 /* msec */
+
+#define BGW_POOL_MAX_WRITE_SET  256         /* transactions with larger write set are scheduled as barriers */
+#define BGW_POOL_MAX_TXNS       4096        /* maximal number of scheduled but not yet completed transactions */
+#define BGW_POOL_KEY_TABLE_SIZE (64*1024)   /* size of the table mapping hash of written key to its last writer */
+#define BGW_POOL_NO_TXN         ((uint32)~0)
+
 extern timestamp_t MtmGetSystemTime(void);   /* non-adjusted current system time */
 extern timestamp_t MtmGetCurrentTime(void);  /* adjusted current system time */
 
 extern bool MtmIsLogicalReceiver;
+extern timestamp_t BgwPoolItemEnqueueTime; /* enqueue time of work item executed by this process, 0 if it is executed inline */
 extern int  MtmMaxWorkers;
 
+/*
+ * Worker of the pool. Idle workers are sleeping on their latches and are woken up by producers.
+ */
+typedef struct
+{
+	pg_atomic_uint32 idle;    /* worker is waiting for work */
+	int              procno;  /* pgprocno of worker */
+} BgwPoolWorker;
+
+/*
+ * Fragment of work item. Work can be passed to the pool as sequence of fragments (for example messages received
+ * from replication stream), which are gathered directly into the queue without accumulating them in intermediate buffer.
+ */
+typedef struct
+{
+	void*  data;
+	size_t size;
+} BgwPoolFragment;
+
+/*
+ * Set of keys written by transaction: hashes of relation OID and replica identity key of updated tuples.
+ * Barrier transaction (DDL, unknown relation, too large write set) conflicts with all other transactions.
+ */
+typedef struct
+{
+	bool   barrier;
+	uint32 nKeys;
+	uint32 keys[BGW_POOL_MAX_WRITE_SET];
+} BgwPoolWriteSet;
+
+/*
+ * Descriptor of scheduled transaction in dependency graph.
+ * Transaction can be started only when all its predecessors (transactions with intersected write sets
+ * received before it) are completed. Worker completing the last predecessor executes transaction itself,
+ * so chain of conflicting transactions is applied by the same worker.
+ */
+typedef struct
+{
+	uint64 id;              /* identifier of transaction, 0 if descriptor is free */
+	uint32 barrierSucc;     /* index of barrier following this transaction or BGW_POOL_NO_TXN */
+	uint32 prev;            /* neighbours in list of active transactions not followed by barrier */
+	uint32 next;
+	uint32 followers;       /* barrier: head of list of transactions waiting for its completion */
+	uint32 nextFollower;    /* next transaction waiting for completion of the same barrier */
+	uint32 nDeps;           /* number of not completed predecessors */
+	uint32 nSuccessors;
+	bool   isBarrier;
+	bool   parked;          /* work item was dequeued before predecessors were completed */
+	uint64 pos;             /* position of parked work item in the queue */
+	uint32 nSlots;          /* number of slots occupied by parked work item */
+	uint32 successors[BGW_POOL_MAX_WRITE_SET]; /* indexes of dependent transactions */
+} BgwPoolTxn;
+
+/*
+ * Pool of background workers with bounded multi-producer/multi-consumer lock-free queue.
+ * Queue consists of nSlots slots, each slot has sequence number which is used to detect whether slot is free
+ * (seq == position) or contains published work (seq == position + 1). Work item occupies several adjacent slots,
+ * so it is gathered directly in shared memory without intermediate buffer. Item is copied to local memory of worker
+ * and its slots are released before execution, so that executed transactions never hold space needed by producers
+ * (for example for commit of prepared transaction which executed transaction is waiting for).
+ * Item never wraps around the end of the queue: in this case remaining slots are filled with dummy item.
+ */
 typedef struct
 {
     BgwPoolExecutor executor;
-    volatile slock_t lock;
-    PGSemaphoreData available;
-    PGSemaphoreData overflow;
-    size_t head;
-    size_t tail;
+	pg_atomic_uint64 head;           /* position of first not consumed slot */
+	pg_atomic_uint64 tail;           /* position of first not allocated slot */
+	pg_atomic_uint64* seq;           /* sequence numbers of slots */
+	uint32*          itemSlots;      /* number of slots occupied by work item starting at this slot */
+	uint32*          itemSize;       /* size of work item starting at this slot (0 for dummy item) */
+	uint32*          itemTxn;        /* index of transaction descriptor of work item or BGW_POOL_NO_TXN */
+	timestamp_t*     itemTime;       /* time when work item starting at this slot was enqueued */
+    size_t nSlots;
     size_t size;
-    size_t active;
-    size_t pending;
-	size_t nWorkers;
-	time_t lastPeakTime;
+	pg_atomic_uint32 active;         /* number of items executed by workers */
+	pg_atomic_uint32 pending;        /* number of items in the queue */
+	pg_atomic_uint32 nWorkers;       /* number of started workers (static and dynamic) */
+	pg_atomic_uint32 nRegistered;    /* number of workers registered in workers array */
+	pg_atomic_uint32 nIdle;          /* number of idle workers */
+	pg_atomic_uint32 nBlocked;       /* number of producers waiting for free space */
+	pg_atomic_uint32 blockedProducers[BGW_POOL_MAX_PRODUCERS]; /* pgprocno+1 of waiting producers or 0 */
+	pg_atomic_uint32 nIdleWaiters;   /* number of processes waiting until all work is completed */
+	pg_atomic_uint32 idleWaiters[BGW_POOL_MAX_PRODUCERS]; /* pgprocno+1 of processes waiting for idle pool or 0 */
+	pg_atomic_uint64 lastPeakTime;   /* time when all workers became busy or queue became full */
 	timestamp_t lastDynamicWorkerStartTime;
-    bool   producerBlocked;
-	bool   shutdown;
+	size_t maxWorkers;
+	BgwPoolWorker* workers;
+	slock_t          schedLock;      /* protects dependency graph: txns, lastWriter and ready */
+	uint64           lastTxnId;      /* identifier of last scheduled transaction */
+	uint64           lastBarrier;    /* identifier of last scheduled barrier */
+	uint32           unfenced;       /* head of list of active transactions not followed by barrier */
+	BgwPoolTxn*      txns;           /* descriptors of scheduled transactions, indexed by id % BGW_POOL_MAX_TXNS */
+	uint64*          lastWriter;     /* identifier of last transaction writing key with this hash */
+	uint32*          ready;          /* parked transactions with completed predecessors */
+	pg_atomic_uint32 nReady;
+	volatile bool shutdown;
     char   dbname[MAX_DBNAME_LEN];
 	char   dbuser[MAX_DBUSER_LEN];
     char*  queue;
@@ -50,6 +141,16 @@ extern void BgwPoolInit(BgwPool* pool, BgwPoolExecutor executor, char const* dbn
 
 extern void BgwPoolExecute(BgwPool* pool, void* work, size_t size);
 
+extern void BgwPoolScheduleExecute(BgwPool* pool, void* work, size_t size, BgwPoolWriteSet* ws);
+
+extern void BgwPoolScheduleExecuteFragments(BgwPool* pool, BgwPoolFragment* fragments, int nFragments, BgwPoolWriteSet* ws);
+
+extern void BgwPoolExecuteFragmentsInline(BgwPool* pool, BgwPoolFragment* fragments, int nFragments);
+
+extern void BgwPoolWaitIdle(BgwPool* pool);
+
+extern bool BgwPoolHasActiveBarrier(BgwPool* pool);
+
 extern size_t BgwPoolGetQueueSize(BgwPool* pool);
 
 extern timestamp_t BgwGetLastPeekTime(BgwPool* pool);
@@ -0,0 +1,602 @@
+/*
+ * bootstrap.c
+ *
+ * Population of new multimaster node by parallel copying of data from several live nodes.
+ *
+ * Cluster is locked for a short time to get consistent cut: all prepared transactions are completed,
+ * WAL position of each node is recorded and every donor exports its snapshot. After unlocking the cluster,
+ * tables are copied in binary format by several pairs of connections (donor -> this node), largest tables first.
+ * Indexes and constraints are created after the data is loaded and sequences are moved past the values used by donors.
+ * Finally replication origins of all nodes are advanced to the recorded positions, so logical receivers continue
+ * from the cut and transactions already present in the copied data are filtered out by MtmFilterTransaction.
+ */
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "libpq-fe.h"
+#include "catalog/pg_replication_origin.h"
+#include "catalog/pg_type.h"
+#include "replication/origin.h"
+#include "storage/lmgr.h"
+#include "utils/array.h"
+
+#include "multimaster.h"
+
+#define MTM_BOOTSTRAP_POLL_DELAY MSEC_TO_USEC(100)
+
+/*
+ * User tables which should be copied to the new node: local tables are not replicated.
+ */
+#define MTM_BOOTSTRAP_TABLES \
+	"select c.oid, c.oid::regclass::text as name, pg_relation_size(c.oid) as size from pg_class c join pg_namespace n on n.oid = c.relnamespace" \
+	" where c.relkind = 'r' and c.relpersistence = 'p'" \
+	" and n.nspname not in ('pg_catalog', 'information_schema', 'mtm') and n.nspname !~ '^pg_toast'" \
+	" and not exists (select 1 from mtm.local_tables l where l.rel_schema = n.nspname and l.rel_name = c.relname)"
+
+/*
+ * Sequences of user schemas. Sequences are not transactional, so their values read at donors after the snapshot
+ * are not smaller than values used by the copied data.
+ */
+#define MTM_BOOTSTRAP_SEQUENCES \
+	"select c.oid::regclass::text from pg_class c join pg_namespace n on n.oid = c.relnamespace" \
+	" where c.relkind = 'S' and c.relpersistence = 'p'" \
+	" and n.nspname not in ('pg_catalog', 'information_schema', 'mtm')"
+
+/*
+ * Indexes and constraints of copied tables. Statements are skipped if object already exists at new node,
+ * so it is possible to restore either only tables, either the whole schema before bootstrap.
+ * Foreign keys are created last (kind 1).
+ */
+#define MTM_BOOTSTRAP_DDL \
+	"with t as (" MTM_BOOTSTRAP_TABLES ")" \
+	" select 0 as kind, t.size, regexp_replace(pg_get_indexdef(i.indexrelid), '^CREATE (UNIQUE )?INDEX ', 'CREATE \\1INDEX IF NOT EXISTS ') as stmt" \
+	" from pg_index i join t on t.oid = i.indrelid" \
+	" where not exists (select 1 from pg_constraint c where c.conindid = i.indexrelid and c.contype in ('p', 'u', 'x'))" \
+	" union all" \
+	" select case when c.contype = 'f' then 1 else 0 end, t.size," \
+	" format('do %L', format('begin if not exists (select 1 from pg_constraint where conrelid = %L::regclass and conname = %L) then alter table %s add constraint %I %s; end if; end'," \
+	" c.conrelid::regclass::text, c.conname, c.conrelid::regclass, c.conname, pg_get_constraintdef(c.oid)))" \
+	" from pg_constraint c join t on t.oid = c.conrelid where c.contype in ('p', 'u', 'x', 'f')" \
+	" order by kind, size desc"
+
+typedef struct
+{
+	int     nodeId;
+	PGconn* conn;         /* connection holding transaction which snapshot is exported */
+	char*   snapshot;     /* identifier of exported snapshot */
+	csn_t   csn;          /* CSN snapshot of exporting transaction */
+} MtmBootstrapDonor;
+
+typedef struct
+{
+	MtmBootstrapDonor* donor;
+	PGconn* src;          /* connection to donor importing its snapshot */
+	PGconn* dst;          /* loopback connection to this node */
+	char*   table;        /* currently copied table or NULL if worker is idle */
+	int64   size;         /* number of bytes copied by this worker */
+} MtmBootstrapWorker;
+
+PG_FUNCTION_INFO_V1(mtm_bootstrap_node);
+
+static PGconn** MtmBootstrapConns;
+static int      MtmBootstrapNConns;
+
+static PGconn* MtmBootstrapConnect(int nodeId)
+{
+	char* connStr = psprintf("%s application_name=%s", Mtm->nodes[nodeId-1].con.connStr, MULTIMASTER_ADMIN);
+	PGconn* conn = PQconnectdb_safe(connStr, 0);
+	pfree(connStr);
+	MtmBootstrapConns[MtmBootstrapNConns++] = conn;
+	if (PQstatus(conn) != CONNECTION_OK) {
+		MTM_ELOG(ERROR, "Failed to connect to node %d: %s", nodeId, PQerrorMessage(conn));
+	}
+	return conn;
+}
+
+static void MtmBootstrapDisconnect(void)
+{
+	int i;
+	for (i = 0; i < MtmBootstrapNConns; i++) {
+		PQfinish(MtmBootstrapConns[i]);
+	}
+	MtmBootstrapNConns = 0;
+}
+
+static void MtmBootstrapCheckResult(PGconn* conn, PGresult* res, ExecStatusType expected, char const* sql)
+{
+	if (PQresultStatus(res) != expected) {
+		char* msg = pstrdup(res != NULL ? PQresultErrorMessage(res) : PQerrorMessage(conn));
+		PQclear(res);
+		MTM_ELOG(ERROR, "Bootstrap statement '%s' failed: %s", sql, msg);
+	}
+}
+
+static PGresult* MtmBootstrapQuery(PGconn* conn, char const* sql)
+{
+	PGresult* res = PQexec(conn, sql);
+	MtmBootstrapCheckResult(conn, res, PGRES_TUPLES_OK, sql);
+	return res;
+}
+
+static void MtmBootstrapExec(PGconn* conn, char const* sql)
+{
+	PQclear(MtmBootstrapQuery(conn, sql));
+}
+
+static void MtmBootstrapCommand(PGconn* conn, char const* sql)
+{
+	PGresult* res = PQexec(conn, sql);
+	MtmBootstrapCheckResult(conn, res, PGRES_COMMAND_OK, sql);
+	PQclear(res);
+}
+
+/*
+ * Wait until all prepared transactions are completed at the locked node and get its current WAL position.
+ * No new transactions can be prepared while cluster is locked, so all transactions committed before returned LSN
+ * are visible in snapshots taken after it and all transactions committed after it are received by logical replication.
+ */
+static lsn_t MtmBootstrapGetCutPosition(PGconn* conn, int nodeId)
+{
+	PGresult* res;
+	uint32 hi, lo;
+
+	while (true)
+	{
+		bool done;
+		res = MtmBootstrapQuery(conn, "select count(*) from pg_prepared_xacts");
+		done = atoi(PQgetvalue(res, 0, 0)) == 0;
+		PQclear(res);
+		if (done) {
+			break;
+		}
+		CHECK_FOR_INTERRUPTS();
+		MtmSleep(MTM_BOOTSTRAP_POLL_DELAY);
+	}
+	res = MtmBootstrapQuery(conn, "select pg_current_xlog_insert_location()");
+	if (sscanf(PQgetvalue(res, 0, 0), "%X/%X", &hi, &lo) != 2) {
+		PQclear(res);
+		MTM_ELOG(ERROR, "Failed to get WAL position of node %d", nodeId);
+	}
+	PQclear(res);
+	return ((lsn_t)hi << 32) | lo;
+}
+
+/*
+ * Wait until one of busy connections has input available.
+ */
+static void MtmBootstrapWait(PGconn** conns, bool* busy, int nConns)
+{
+	fd_set set;
+	struct timeval tv;
+	int max_fd = 0;
+	int i, rc;
+
+	FD_ZERO(&set);
+	for (i = 0; i < nConns; i++)
+	{
+		if (busy[i]) {
+			int sd = PQsocket(conns[i]);
+			FD_SET(sd, &set);
+			if (sd > max_fd) {
+				max_fd = sd;
+			}
+		}
+	}
+	/* Wake up periodically to handle interrupts */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	rc = select(max_fd+1, &set, NULL, NULL, &tv);
+	if (rc < 0 && errno != EINTR) {
+		MTM_ELOG(ERROR, "Failed to wait for bootstrap connections: %s", strerror(errno));
+	}
+	CHECK_FOR_INTERRUPTS();
+
+	for (i = 0; i < nConns; i++)
+	{
+		if (busy[i] && rc > 0 && FD_ISSET(PQsocket(conns[i]), &set) && !PQconsumeInput(conns[i])) {
+			MTM_ELOG(ERROR, "Failed to receive data during bootstrap: %s", PQerrorMessage(conns[i]));
+		}
+	}
+}
+
+static void MtmBootstrapStartCopy(MtmBootstrapWorker* w, char* table)
+{
+	char* sql = psprintf("copy %s from stdin (format binary)", table);
+	PGresult* res = PQexec(w->dst, sql);
+	MtmBootstrapCheckResult(w->dst, res, PGRES_COPY_IN, sql);
+	PQclear(res);
+	pfree(sql);
+
+	sql = psprintf("copy %s to stdout (format binary)", table);
+	res = PQexec(w->src, sql);
+	MtmBootstrapCheckResult(w->src, res, PGRES_COPY_OUT, sql);
+	PQclear(res);
+	pfree(sql);
+
+	MTM_LOG1("Start copying table %s from node %d", table, w->donor->nodeId);
+	w->table = table;
+}
+
+/*
+ * Pass all data available at donor connection to local connection.
+ * Returns true if copying of the table is completed.
+ */
+static bool MtmBootstrapPipe(MtmBootstrapWorker* w)
+{
+	while (true)
+	{
+		char* buf;
+		int len = PQgetCopyData(w->src, &buf, true);
+		if (len > 0) {
+			if (PQputCopyData(w->dst, buf, len) != 1) {
+				MTM_ELOG(ERROR, "Failed to load table %s: %s", w->table, PQerrorMessage(w->dst));
+			}
+			PQfreemem(buf);
+			w->size += len;
+		} else if (len == 0) {
+			return false;
+		} else if (len == -1) {
+			PGresult* res;
+			while ((res = PQgetResult(w->src)) != NULL) {
+				MtmBootstrapCheckResult(w->src, res, PGRES_COMMAND_OK, w->table);
+				PQclear(res);
+			}
+			if (PQputCopyEnd(w->dst, NULL) != 1) {
+				MTM_ELOG(ERROR, "Failed to load table %s: %s", w->table, PQerrorMessage(w->dst));
+			}
+			while ((res = PQgetResult(w->dst)) != NULL) {
+				MtmBootstrapCheckResult(w->dst, res, PGRES_COMMAND_OK, w->table);
+				PQclear(res);
+			}
+			MTM_LOG1("Table %s is copied from node %d", w->table, w->donor->nodeId);
+			w->table = NULL;
+			return true;
+		} else {
+			MTM_ELOG(ERROR, "Failed to copy table %s from node %d: %s", w->table, w->donor->nodeId, PQerrorMessage(w->src));
+		}
+	}
+}
+
+/*
+ * Copy tables by all workers. Tables are sorted by size in descending order,
+ * idle worker takes the next one.
+ */
+static void MtmBootstrapCopyTables(MtmBootstrapWorker* workers, int nWorkers, char** tables, int nTables)
+{
+	PGconn** conns = (PGconn**)palloc(sizeof(PGconn*)*nWorkers);
+	bool* busy = (bool*)palloc0(sizeof(bool)*nWorkers);
+	int nBusy = 0;
+	int next = 0;
+	int i;
+
+	for (i = 0; i < nWorkers; i++) {
+		conns[i] = workers[i].src;
+	}
+	while (true)
+	{
+		for (i = 0; i < nWorkers && next < nTables; i++) {
+			if (!busy[i]) {
+				MtmBootstrapStartCopy(&workers[i], tables[next++]);
+				busy[i] = true;
+				nBusy += 1;
+			}
+		}
+		if (nBusy == 0) {
+			break;
+		}
+		MtmBootstrapWait(conns, busy, nWorkers);
+		for (i = 0; i < nWorkers; i++) {
+			if (busy[i] && MtmBootstrapPipe(&workers[i])) {
+				busy[i] = false;
+				nBusy -= 1;
+			}
+		}
+	}
+	pfree(conns);
+	pfree(busy);
+}
+
+/*
+ * Execute statements in parallel using local connections of workers.
+ */
+static void MtmBootstrapRunStatements(MtmBootstrapWorker* workers, int nWorkers, char** stmts, int nStmts)
+{
+	PGconn** conns = (PGconn**)palloc(sizeof(PGconn*)*nWorkers);
+	bool* busy = (bool*)palloc0(sizeof(bool)*nWorkers);
+	int* current = (int*)palloc(sizeof(int)*nWorkers);
+	int nBusy = 0;
+	int next = 0;
+	int i;
+
+	for (i = 0; i < nWorkers; i++) {
+		conns[i] = workers[i].dst;
+	}
+	while (true)
+	{
+		for (i = 0; i < nWorkers && next < nStmts; i++) {
+			if (!busy[i]) {
+				if (!PQsendQuery(conns[i], stmts[next])) {
+					MTM_ELOG(ERROR, "Failed to send statement '%s': %s", stmts[next], PQerrorMessage(conns[i]));
+				}
+				current[i] = next++;
+				busy[i] = true;
+				nBusy += 1;
+			}
+		}
+		if (nBusy == 0) {
+			break;
+		}
+		MtmBootstrapWait(conns, busy, nWorkers);
+		for (i = 0; i < nWorkers; i++) {
+			while (busy[i] && !PQisBusy(conns[i])) {
+				PGresult* res = PQgetResult(conns[i]);
+				if (res == NULL) {
+					busy[i] = false;
+					nBusy -= 1;
+				} else {
+					MtmBootstrapCheckResult(conns[i], res, PGRES_COMMAND_OK, stmts[current[i]]);
+					PQclear(res);
+				}
+			}
+		}
+	}
+	pfree(conns);
+	pfree(busy);
+	pfree(current);
+}
+
+/*
+ * Move sequences of this node past the values used by all donors. Each node generates its own residue of values
+ * (see MtmInitializeSequence), but schema restored from the dump has start of the sequence of the dumped node,
+ * so the next value is chosen to have residue of this node.
+ */
+static void MtmBootstrapCopySequences(MtmBootstrapWorker* workers, int nDonors, char** seqs, int nSeqs)
+{
+	int i, j;
+	for (i = 0; i < nSeqs; i++)
+	{
+		PGresult* res;
+		int64 used = 0;
+		int64 step, next, shift;
+		char* sql = psprintf("select case when is_called then last_value else last_value - increment_by end from %s", seqs[i]);
+
+		for (j = 0; j < nDonors; j++) {
+			int64 value;
+			res = MtmBootstrapQuery(workers[j].src, sql);
+			value = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+			PQclear(res);
+			if (j == 0 || value > used) {
+				used = value;
+			}
+		}
+		pfree(sql);
+
+		sql = psprintf("select increment_by from %s", seqs[i]);
+		res = MtmBootstrapQuery(workers[0].dst, sql);
+		step = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+		PQclear(res);
+		pfree(sql);
+
+		if (step > 0) {
+			next = used + 1;
+			shift = ((MtmNodeId - next) % step + step) % step;
+		} else {
+			next = used - 1;
+			shift = -(((next - MtmNodeId) % -step - step) % -step);
+		}
+		sql = psprintf("select setval('%s', " INT64_FORMAT ", false)", seqs[i], next + shift);
+		MtmBootstrapExec(workers[0].dst, sql);
+		pfree(sql);
+	}
+	MTM_LOG1("%d sequences are copied", nSeqs);
+}
+
+/*
+ * Start receiving changes from the cut: transactions with smaller LSNs are filtered out by MtmFilterTransaction.
+ * Snapshot node becomes donor, so recovery is performed from it.
+ */
+static void MtmBootstrapFinish(lsn_t* cut, int snapshotNode)
+{
+	int i;
+
+	LockRelationOid(ReplicationOriginRelationId, RowExclusiveLock);
+	for (i = 0; i < Mtm->nAllNodes; i++)
+	{
+		if (i+1 != MtmNodeId) {
+			char* originName = psprintf(MULTIMASTER_SLOT_PATTERN, i + 1);
+			RepOriginId originId = replorigin_by_name(originName, false);
+			replorigin_advance(originId, cut[i], InvalidXLogRecPtr, true, true);
+			MtmLock(LW_EXCLUSIVE);
+			Mtm->nodes[i].restartLSN = cut[i];
+			MtmUnlock();
+			pfree(originName);
+		}
+	}
+	UnlockRelationOid(ReplicationOriginRelationId, RowExclusiveLock);
+
+	MtmLock(LW_EXCLUSIVE);
+	Mtm->donorNodeId = snapshotNode;
+	Mtm->bootstrapCompleted = true;
+	MtmWriteControlFile();
+	Mtm->bootstrapPending = false;
+	MtmUnlock();
+}
+
+static void MtmBootstrap(int snapshotNode, int* donorIds, int nDonors, int nWorkers)
+{
+	PGconn** conns = (PGconn**)palloc0(sizeof(PGconn*)*Mtm->nAllNodes);
+	lsn_t* cut = (lsn_t*)palloc0(sizeof(lsn_t)*Mtm->nAllNodes);
+	MtmBootstrapDonor* donors = (MtmBootstrapDonor*)palloc0(sizeof(MtmBootstrapDonor)*nDonors);
+	MtmBootstrapWorker* workers = (MtmBootstrapWorker*)palloc0(sizeof(MtmBootstrapWorker)*nWorkers);
+	PGconn* lockConn;
+	PGresult* res;
+	char** tables;
+	char** seqs;
+	char** stmts;
+	int nTables, nSeqs, nStmts, nIndexes;
+	int64 size = 0;
+	int i;
+
+	/* Get consistent cut of the cluster */
+	lockConn = MtmBootstrapConnect(snapshotNode);
+	MtmBootstrapCommand(lockConn, "begin");
+	MtmBootstrapExec(lockConn, "select mtm.lock_cluster()");
+	for (i = 0; i < Mtm->nAllNodes; i++) {
+		if (i+1 != MtmNodeId) {
+			conns[i] = (i+1 == snapshotNode) ? lockConn : MtmBootstrapConnect(i+1);
+			cut[i] = MtmBootstrapGetCutPosition(conns[i], i+1);
+			MTM_LOG1("Bootstrap position of node %d is %llx", i+1, (long64)cut[i]);
+		}
+	}
+	for (i = 0; i < nDonors; i++) {
+		MtmBootstrapDonor* donor = &donors[i];
+		donor->nodeId = donorIds[i];
+		donor->conn = MtmBootstrapConnect(donor->nodeId);
+		MtmBootstrapCommand(donor->conn, "begin isolation level repeatable read");
+		res = MtmBootstrapQuery(donor->conn, "select pg_export_snapshot(), mtm.get_snapshot()");
+		donor->snapshot = pstrdup(PQgetvalue(res, 0, 0));
+		donor->csn = strtoll(PQgetvalue(res, 0, 1), NULL, 10);
+		PQclear(res);
+	}
+	MtmBootstrapCommand(lockConn, "commit");
+	MTM_ELOG(NOTICE, "Cluster is unlocked, start copying data from %d nodes", nDonors);
+
+	/* Take list of tables and their indexes from snapshot of the first donor */
+	res = MtmBootstrapQuery(donors[0].conn, MTM_BOOTSTRAP_TABLES " order by size desc");
+	nTables = PQntuples(res);
+	tables = (char**)palloc(sizeof(char*)*nTables);
+	for (i = 0; i < nTables; i++) {
+		tables[i] = pstrdup(PQgetvalue(res, i, 1));
+	}
+	PQclear(res);
+
+	res = MtmBootstrapQuery(donors[0].conn, MTM_BOOTSTRAP_SEQUENCES);
+	nSeqs = PQntuples(res);
+	seqs = (char**)palloc(sizeof(char*)*Max(nSeqs, 1));
+	for (i = 0; i < nSeqs; i++) {
+		seqs[i] = pstrdup(PQgetvalue(res, i, 0));
+	}
+	PQclear(res);
+
+	res = MtmBootstrapQuery(donors[0].conn, MTM_BOOTSTRAP_DDL);
+	nStmts = PQntuples(res);
+	nIndexes = 0;
+	stmts = (char**)palloc(sizeof(char*)*nStmts);
+	for (i = 0; i < nStmts; i++) {
+		stmts[i] = pstrdup(PQgetvalue(res, i, 2));
+		if (atoi(PQgetvalue(res, i, 0)) == 0) {
+			nIndexes += 1;
+		}
+	}
+	PQclear(res);
+
+	/* Open connections of workers: each of them imports snapshot of its donor */
+	for (i = 0; i < nWorkers; i++) {
+		MtmBootstrapWorker* w = &workers[i];
+		char* sql;
+		w->donor = &donors[i % nDonors];
+		w->src = MtmBootstrapConnect(w->donor->nodeId);
+		MtmBootstrapCommand(w->src, "begin isolation level repeatable read");
+		sql = psprintf("set transaction snapshot '%s'", w->donor->snapshot);
+		MtmBootstrapCommand(w->src, sql);
+		pfree(sql);
+		sql = psprintf("select mtm.set_snapshot(%lld)", (long long)w->donor->csn);
+		MtmBootstrapExec(w->src, sql);
+		pfree(sql);
+
+		/* Data is loaded locally and should not be replicated. Foreign keys and triggers are not fired. */
+		w->dst = MtmBootstrapConnect(MtmNodeId);
+		MtmBootstrapExec(w->dst, "select mtm.stop_replication()");
+		MtmBootstrapCommand(w->dst, "set session_replication_role = replica");
+	}
+	/* Exporting transactions can be finished once snapshots are imported */
+	for (i = 0; i < nDonors; i++) {
+		MtmBootstrapCommand(donors[i].conn, "commit");
+	}
+
+	MtmBootstrapCopyTables(workers, nWorkers, tables, nTables);
+	MtmBootstrapCopySequences(workers, nDonors, seqs, nSeqs);
+	for (i = 0; i < nWorkers; i++) {
+		MtmBootstrapCommand(workers[i].src, "commit");
+		size += workers[i].size;
+	}
+	MTM_ELOG(NOTICE, "%d tables (" INT64_FORMAT " bytes) are copied, build %d indexes and %d foreign keys",
+			 nTables, size, nIndexes, nStmts - nIndexes);
+
+	/* Build indexes after load and then foreign keys which require them */
+	MtmBootstrapRunStatements(workers, nWorkers, stmts, nIndexes);
+	MtmBootstrapRunStatements(workers, nWorkers, stmts + nIndexes, nStmts - nIndexes);
+
+	MtmBootstrapFinish(cut, snapshotNode);
+	MTM_ELOG(NOTICE, "Node %d is populated from snapshot of node %d", MtmNodeId, snapshotNode);
+}
+
+/*
+ * mtm.bootstrap_node(snapshot_node, donors, workers) is executed at new node started with multimaster.wait_bootstrap.
+ */
+Datum
+mtm_bootstrap_node(PG_FUNCTION_ARGS)
+{
+	int snapshotNode = PG_GETARG_INT32(0);
+	int nWorkers = PG_GETARG_INT32(2);
+	int* donorIds;
+	int nDonors = 0;
+	int i;
+
+	if (!Mtm->bootstrapPending) {
+		MTM_ELOG(ERROR, "Node %d is not waiting for bootstrap: multimaster.wait_bootstrap is not set or node is already bootstrapped", MtmNodeId);
+	}
+	if (snapshotNode <= 0 || snapshotNode > Mtm->nAllNodes || snapshotNode == MtmNodeId) {
+		MTM_ELOG(ERROR, "Invalid snapshot node %d", snapshotNode);
+	}
+	if (nWorkers <= 0) {
+		MTM_ELOG(ERROR, "Number of bootstrap workers should be positive");
+	}
+	if (PG_ARGISNULL(1)) {
+		donorIds = (int*)palloc(sizeof(int)*Mtm->nAllNodes);
+		for (i = 0; i < Mtm->nAllNodes; i++) {
+			if (i+1 != MtmNodeId) {
+				donorIds[nDonors++] = i+1;
+			}
+		}
+	} else {
+		ArrayType* arr = PG_GETARG_ARRAYTYPE_P(1);
+		Datum* elems;
+		bool* nulls;
+		deconstruct_array(arr, INT4OID, sizeof(int32), true, 'i', &elems, &nulls, &nDonors);
+		donorIds = (int*)palloc(sizeof(int)*Max(nDonors, 1));
+		for (i = 0; i < nDonors; i++) {
+			donorIds[i] = nulls[i] ? 0 : DatumGetInt32(elems[i]);
+			if (donorIds[i] <= 0 || donorIds[i] > Mtm->nAllNodes || donorIds[i] == MtmNodeId) {
+				MTM_ELOG(ERROR, "Invalid donor node %d", donorIds[i]);
+			}
+		}
+	}
+	if (nDonors == 0) {
+		MTM_ELOG(ERROR, "No donor nodes are specified");
+	}
+	if (nWorkers < nDonors) {
+		nWorkers = nDonors;
+	}
+
+	MtmBootstrapConns = (PGconn**)palloc(sizeof(PGconn*)*(Mtm->nAllNodes + nDonors + nWorkers*2));
+	MtmBootstrapNConns = 0;
+	PG_TRY();
+	{
+		MtmBootstrap(snapshotNode, donorIds, nDonors, nWorkers);
+	}
+	PG_CATCH();
+	{
+		MtmBootstrapDisconnect();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	MtmBootstrapDisconnect();
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,189 @@
+/*
+ * latency.c
+ *
+ * Shared memory histograms of latencies of distributed commit phases.
+ */
+#include "postgres.h"
+#include "funcapi.h"
+#include "fmgr.h"
+#include "access/htup_details.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+
+#include "multimaster.h"
+#include "latency.h"
+
+#define Natts_mtm_latency_stats 9
+
+char const* const MtmLatencyPhaseMnem[] =
+{
+	"prepare",
+	"voting",
+	"precommit",
+	"commit_prepared",
+	"apply_queue",
+	"apply"
+};
+
+static MtmLatencyHistogram* MtmLatencyStats; /* [MtmMaxNodes][MTM_LATENCY_PHASES] */
+
+PG_FUNCTION_INFO_V1(mtm_get_latency_stats);
+PG_FUNCTION_INFO_V1(mtm_reset_latency_stats);
+
+Size MtmLatencyShmemSize(void)
+{
+	return sizeof(MtmLatencyHistogram)*MtmMaxNodes*MTM_LATENCY_PHASES;
+}
+
+void MtmLatencyShmemInit(void)
+{
+	bool found;
+	MtmLatencyStats = (MtmLatencyHistogram*)ShmemInitStruct("MtmLatencyStats", MtmLatencyShmemSize(), &found);
+	if (!found) {
+		MemSet(MtmLatencyStats, 0, MtmLatencyShmemSize());
+	}
+}
+
+static int MtmLatencyBucket(uint64 usec)
+{
+	int shift = 1;
+	if (usec < 2*MTM_LATENCY_SUB_BUCKETS) {
+		return (int)usec;
+	}
+	while ((usec >> shift) >= 2*MTM_LATENCY_SUB_BUCKETS) {
+		shift += 1;
+	}
+	return shift*MTM_LATENCY_SUB_BUCKETS + (int)(usec >> shift);
+}
+
+/* Largest value falling into the bucket */
+static uint64 MtmLatencyBucketBound(int bucket)
+{
+	int shift, top;
+	if (bucket < 2*MTM_LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+	shift = bucket/MTM_LATENCY_SUB_BUCKETS - 1;
+	top = bucket - shift*MTM_LATENCY_SUB_BUCKETS;
+	return (((uint64)top + 1) << shift) - 1;
+}
+
+void MtmLatencyRecord(MtmLatencyPhase phase, int nodeId, timestamp_t start, timestamp_t end)
+{
+	MtmLatencyHistogram* h;
+	uint64 usec = end > start ? end - start : 0; /* clocks of different processes are not monotonic */
+	uint64 max;
+
+	if (nodeId <= 0 || nodeId > MtmMaxNodes) {
+		return;
+	}
+	h = &MtmLatencyStats[(nodeId-1)*MTM_LATENCY_PHASES + phase];
+	pg_atomic_fetch_add_u64(&h->buckets[MtmLatencyBucket(usec)], 1);
+	pg_atomic_fetch_add_u64(&h->sum, usec);
+	pg_atomic_fetch_add_u64(&h->count, 1);
+	max = pg_atomic_read_u64(&h->max);
+	while (usec > max && !pg_atomic_compare_exchange_u64(&h->max, &max, usec));
+}
+
+/*
+ * Statistics is reset without locks, so values recorded concurrently with reset can be partly lost.
+ */
+void MtmLatencyReset(void)
+{
+	int i, j;
+	for (i = 0; i < MtmMaxNodes*MTM_LATENCY_PHASES; i++) {
+		MtmLatencyHistogram* h = &MtmLatencyStats[i];
+		pg_atomic_write_u64(&h->count, 0);
+		pg_atomic_write_u64(&h->sum, 0);
+		pg_atomic_write_u64(&h->max, 0);
+		for (j = 0; j < MTM_LATENCY_BUCKETS; j++) {
+			pg_atomic_write_u64(&h->buckets[j], 0);
+		}
+	}
+}
+
+static uint64 MtmLatencyPercentile(uint64* buckets, uint64 count, uint64 max, double q)
+{
+	uint64 target = (uint64)(count*q);
+	uint64 sum = 0;
+	int i;
+	for (i = 0; i < MTM_LATENCY_BUCKETS; i++) {
+		sum += buckets[i];
+		if (sum > target) {
+			uint64 bound = MtmLatencyBucketBound(i);
+			return bound < max ? bound : max;
+		}
+	}
+	return max;
+}
+
+typedef struct
+{
+	int       index;
+	TupleDesc desc;
+} MtmGetLatencyStatsCtx;
+
+Datum
+mtm_get_latency_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext* funcctx;
+	MtmGetLatencyStatsCtx* usrfctx;
+	MemoryContext oldcontext;
+	Datum values[Natts_mtm_latency_stats];
+	bool  nulls[Natts_mtm_latency_stats] = {false};
+	uint64 buckets[MTM_LATENCY_BUCKETS];
+	MtmLatencyHistogram* h;
+	uint64 count, max;
+	int i;
+
+	if (SRF_IS_FIRSTCALL()) {
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		usrfctx = (MtmGetLatencyStatsCtx*)palloc(sizeof(MtmGetLatencyStatsCtx));
+		get_call_result_type(fcinfo, NULL, &usrfctx->desc);
+		usrfctx->index = 0;
+		funcctx->user_fctx = usrfctx;
+		MemoryContextSwitchTo(oldcontext);
+	}
+	funcctx = SRF_PERCALL_SETUP();
+	usrfctx = (MtmGetLatencyStatsCtx*)funcctx->user_fctx;
+
+	/* Skip phases without samples */
+	while (usrfctx->index < Mtm->nAllNodes*MTM_LATENCY_PHASES
+		   && pg_atomic_read_u64(&MtmLatencyStats[usrfctx->index].count) == 0)
+	{
+		usrfctx->index += 1;
+	}
+	if (usrfctx->index == Mtm->nAllNodes*MTM_LATENCY_PHASES) {
+		SRF_RETURN_DONE(funcctx);
+	}
+	h = &MtmLatencyStats[usrfctx->index];
+
+	/* Histogram is updated concurrently, so use sum of buckets as number of samples */
+	count = 0;
+	for (i = 0; i < MTM_LATENCY_BUCKETS; i++) {
+		buckets[i] = pg_atomic_read_u64(&h->buckets[i]);
+		count += buckets[i];
+	}
+	max = pg_atomic_read_u64(&h->max);
+
+	values[0] = Int32GetDatum(usrfctx->index / MTM_LATENCY_PHASES + 1);
+	values[1] = CStringGetTextDatum(MtmLatencyPhaseMnem[usrfctx->index % MTM_LATENCY_PHASES]);
+	values[2] = Int64GetDatum(count);
+	values[3] = Int64GetDatum(count != 0 ? pg_atomic_read_u64(&h->sum) / count : 0);
+	values[4] = Int64GetDatum(MtmLatencyPercentile(buckets, count, max, 0.5));
+	values[5] = Int64GetDatum(MtmLatencyPercentile(buckets, count, max, 0.9));
+	values[6] = Int64GetDatum(MtmLatencyPercentile(buckets, count, max, 0.99));
+	values[7] = Int64GetDatum(MtmLatencyPercentile(buckets, count, max, 0.999));
+	values[8] = Int64GetDatum(max);
+	usrfctx->index += 1;
+
+	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(usrfctx->desc, values, nulls)));
+}
+
+Datum
+mtm_reset_latency_stats(PG_FUNCTION_ARGS)
+{
+	MtmLatencyReset();
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,47 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include "port/atomics.h"
+#include "bgwpool.h"
+
+/*
+ * Phases of distributed commit for which latency histograms are collected.
+ * Statistics is broken down by node: for phases of voting it is the node which vote is received,
+ * for apply phases it is the origin of transaction. Row of this node contains time spent locally.
+ */
+typedef enum
+{
+	MTM_LATENCY_PREPARE,          /* local prepare of transaction at coordinator */
+	MTM_LATENCY_VOTING,           /* from local prepare until PREPARED vote is received; this node: wait in Mtm2PCVoting */
+	MTM_LATENCY_PRECOMMIT,        /* from precommit until PRECOMMITTED vote is received; this node: local precommit */
+	MTM_LATENCY_COMMIT_PREPARED,  /* local commit of prepared transaction at coordinator */
+	MTM_LATENCY_APPLY_QUEUE,      /* time spent by received transaction in the queue of apply workers */
+	MTM_LATENCY_APPLY,            /* execution of received transaction by apply worker */
+	MTM_LATENCY_PHASES
+} MtmLatencyPhase;
+
+/*
+ * Log-linear histogram: each power of two is split into MTM_LATENCY_SUB_BUCKETS buckets,
+ * so relative error of reported percentiles doesn't exceed 1/MTM_LATENCY_SUB_BUCKETS.
+ * Values are in microseconds. Histogram is updated by atomic increments without locks.
+ */
+#define MTM_LATENCY_SUB_BUCKETS_LOG 2
+#define MTM_LATENCY_SUB_BUCKETS     (1 << MTM_LATENCY_SUB_BUCKETS_LOG)
+#define MTM_LATENCY_BUCKETS         (64 << MTM_LATENCY_SUB_BUCKETS_LOG)
+
+typedef struct
+{
+	pg_atomic_uint64 count;
+	pg_atomic_uint64 sum;
+	pg_atomic_uint64 max;
+	pg_atomic_uint64 buckets[MTM_LATENCY_BUCKETS];
+} MtmLatencyHistogram;
+
+extern char const* const MtmLatencyPhaseMnem[];
+
+extern Size MtmLatencyShmemSize(void);
+extern void MtmLatencyShmemInit(void);
+extern void MtmLatencyRecord(MtmLatencyPhase phase, int nodeId, timestamp_t start, timestamp_t end);
+extern void MtmLatencyReset(void);
+
+#endif
@@ -29,6 +29,18 @@ CREATE FUNCTION mtm.add_node(conn_str text) RETURNS void
 AS 'MODULE_PATHNAME','mtm_add_node'
 LANGUAGE C;
 
+-- Populate new node (started with multimaster.wait_bootstrap) by parallel copying of data from donor nodes.
+-- Cluster is locked by snapshot_node to get consistent cut, tables are distributed between workers which copy them from donors
+-- (all other nodes by default), indexes are built after load and replication is started from the cut.
+CREATE FUNCTION mtm.bootstrap_node(snapshot_node integer, donors integer[] default null, workers integer default 4) RETURNS void
+AS 'MODULE_PATHNAME','mtm_bootstrap_node'
+LANGUAGE C CALLED ON NULL INPUT;
+
+-- Block commit of distributed transactions at all nodes until end of current transaction
+CREATE FUNCTION mtm.lock_cluster() RETURNS void
+AS 'MODULE_PATHNAME','mtm_lock_cluster'
+LANGUAGE C;
+
 -- Create replication slot for the node which was previously stalled (its replicatoin slot was deleted)
 CREATE FUNCTION mtm.recover_node(node integer) RETURNS void
 AS 'MODULE_PATHNAME','mtm_recover_node'
@@ -45,6 +57,10 @@ CREATE FUNCTION mtm.get_snapshot() RETURNS bigint
 AS 'MODULE_PATHNAME','mtm_get_snapshot'
 LANGUAGE C;
 
+CREATE FUNCTION mtm.set_snapshot(csn bigint) RETURNS void
+AS 'MODULE_PATHNAME','mtm_set_snapshot'
+LANGUAGE C;
+
 CREATE FUNCTION mtm.get_csn(xid bigint) RETURNS bigint
 AS 'MODULE_PATHNAME','mtm_get_csn'
 LANGUAGE C;
@@ -53,14 +69,15 @@ CREATE FUNCTION mtm.get_last_csn() RETURNS bigint
 AS 'MODULE_PATHNAME','mtm_get_last_csn'
 LANGUAGE C;
 
-CREATE TYPE mtm.node_state AS ("id" integer, "enabled" bool, "connected" bool, "slot_active" bool, "stopped" bool, "catchUp" bool, "slotLag" bigint, "avgTransDelay" bigint, "lastStatusChange" timestamp, "oldestSnapshot" bigint, "SenderPid" integer, "SenderStartTime" timestamp, "ReceiverPid" integer, "ReceiverStartTime" timestamp, "connStr" text, "connectivityMask" bigint, "nHeartbeats" bigint);
+CREATE TYPE mtm.node_state AS ("id" integer, "enabled" bool, "connected" bool, "slot_active" bool, "stopped" bool, "catchUp" bool, "slotLag" bigint, "avgTransDelay" bigint, "lastStatusChange" timestamp, "oldestSnapshot" bigint, "SenderPid" integer, "SenderStartTime" timestamp, "ReceiverPid" integer, "ReceiverStartTime" timestamp, "connStr" text, "connectivityMask" bigint, "nHeartbeats" bigint, "receivedLSN" bigint, "appliedLSN" bigint, "applyLag" bigint, "applyRate" bigint, "arbiterQueueSize" bigint, "arbiterSendLatency" bigint);
 
 CREATE FUNCTION mtm.get_nodes_state() RETURNS SETOF mtm.node_state
 AS 'MODULE_PATHNAME','mtm_get_nodes_state'
 LANGUAGE C;
 
 CREATE TYPE mtm.cluster_state AS ("id" integer, "status" text, "disabledNodeMask" bigint, "disconnectedNodeMask" bigint, "catchUpNodeMask" bigint, "liveNodes" integer, "allNodes" integer, "nActiveQueries" integer, "nPendingQueries" integer, "queueSize" bigint, "transCount" bigint, "timeShift" bigint, "recoverySlot" integer,
-"xidHashSize" bigint, "gidHashSize" bigint, "oldestXid" bigint, "configChanges" integer, "stalledNodeMask" bigint, "stoppedNodeMask" bigint, "deadNodeMask" bigint, "lastStatusChange" timestamp);
+"xidHashSize" bigint, "gidHashSize" bigint, "oldestXid" bigint, "configChanges" integer, "stalledNodeMask" bigint, "stoppedNodeMask" bigint, "deadNodeMask" bigint, "lastStatusChange" timestamp,
+"maxClockSkew" bigint, "clockSkewViolations" bigint);
 
 CREATE TYPE mtm.trans_state AS ("status" text, "gid" text, "xid" bigint, "coordinator" integer, "gxid" bigint, "csn" timestamp, "snapshot" timestamp, "local" boolean, "prepared" boolean, "active" boolean, "twophase" boolean, "votingCompleted" boolean, "participants" bigint, "voted" bigint, "configChanges" integer);
 
@@ -80,6 +97,17 @@ CREATE FUNCTION mtm.collect_cluster_info() RETURNS SETOF mtm.cluster_state
 AS 'MODULE_PATHNAME','mtm_collect_cluster_info'
 LANGUAGE C;
 
+-- Latency of distributed commit phases (in microseconds) for each node
+CREATE TYPE mtm.latency_stats AS ("node" integer, "phase" text, "count" bigint, "avg" bigint, "p50" bigint, "p90" bigint, "p99" bigint, "p999" bigint, "max" bigint);
+
+CREATE FUNCTION mtm.get_latency_stats() RETURNS SETOF mtm.latency_stats
+AS 'MODULE_PATHNAME','mtm_get_latency_stats'
+LANGUAGE C;
+
+CREATE FUNCTION mtm.reset_latency_stats() RETURNS void
+AS 'MODULE_PATHNAME','mtm_reset_latency_stats'
+LANGUAGE C;
+
 CREATE FUNCTION mtm.make_table_local(relation regclass) RETURNS void
 AS 'MODULE_PATHNAME','mtm_make_table_local'
 LANGUAGE C;
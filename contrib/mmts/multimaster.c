@@ -7,6 +7,7 @@
 
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/select.h>
 #include <time.h>
 
 #include "postgres.h"
@@ -28,6 +29,7 @@
 #include "storage/lmgr.h"
 #include "storage/shmem.h"
 #include "storage/ipc.h"
+#include "storage/fd.h"
 #include "storage/procarray.h"
 #include "access/xlogdefs.h"
 #include "access/xact.h"
@@ -79,6 +81,9 @@
 #include "multimaster.h"
 #include "ddd.h"
 #include "state.h"
+#include "stream.h"
+#include "latency.h"
+#include "seqrange.h"
 
 typedef struct {
 	TransactionId xid;	  /* local transaction ID	*/
@@ -110,6 +115,40 @@ typedef enum
 #define MAX_WAIT_LOOPS	 10000 // 1000000
 #define STATUS_POLL_DELAY USECS_PER_SEC
 
+#define MTM_CSN_ARRAY_SIZE    (64*1024) /* number of slots in shared array of completed transactions */
+#define MTM_CSN_CACHE_SIZE    4096      /* number of entries in backend local cache of completed transactions */
+#define MTM_CSN_CACHE_MAX_AGE (1U << 30) /* maximal distance between XIDs in local cache, to be safe from wraparound */
+
+/*
+ * Status and CSN of completed (committed or aborted) transaction.
+ * Once transaction is completed, its CSN and status are never changed,
+ * so them can be cached without any synchronization with MtmXid2State.
+ */
+typedef struct
+{
+	pg_atomic_uint32 xid; /* InvalidTransactionId while slot is updated */
+	XidStatus status;
+	csn_t     csn;
+} MtmCSNSlot;
+
+typedef struct
+{
+	TransactionId xid;
+	XidStatus status;
+	csn_t     csn;
+} MtmCSNCacheEntry;
+
+/*
+ * State of distributed deadlock detection started by backend (see MtmDetectGlobalDeadLockForXid)
+ */
+typedef struct
+{
+	GlobalTransactionId gtid;   /* transaction waiting for lock */
+	csn_t         round;        /* identifier of the current round of probes */
+	csn_t         prevRound;    /* identifier of the previous round of probes */
+	volatile bool detected;     /* deadlock is reported by some node */
+} MtmDeadlockProbeSlot;
+
 void _PG_init(void);
 void _PG_fini(void);
 
@@ -123,6 +162,8 @@ PG_FUNCTION_INFO_V1(mtm_poll_node);
 PG_FUNCTION_INFO_V1(mtm_recover_node);
 PG_FUNCTION_INFO_V1(mtm_resume_node);
 PG_FUNCTION_INFO_V1(mtm_get_snapshot);
+PG_FUNCTION_INFO_V1(mtm_set_snapshot);
+PG_FUNCTION_INFO_V1(mtm_lock_cluster);
 PG_FUNCTION_INFO_V1(mtm_get_csn);
 PG_FUNCTION_INFO_V1(mtm_get_trans_by_gid);
 PG_FUNCTION_INFO_V1(mtm_get_trans_by_xid);
@@ -150,9 +191,12 @@ static void MtmEndTransaction(MtmCurrentTrans* x, bool commit);
 static bool MtmTwoPhaseCommit(MtmCurrentTrans* x);
 static TransactionId MtmGetOldestXmin(Relation rel, bool ignoreVacuum);
 static bool MtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot);
-static TransactionId MtmAdjustOldestXid(TransactionId xid);
+static int MtmAdjustOldestXid(TransactionId xid, int maxRemoved);
+static void MtmGcWorkerMain(Datum arg);
 static bool MtmDetectGlobalDeadLock(PGPROC* proc);
 static void MtmAddSubtransactions(MtmTransState* ts, TransactionId* subxids, int nSubxids);
+static void MtmPublishTransStatus(MtmTransState* ts);
+static void MtmForgetTransStatus(TransactionId xid);
 static char const* MtmGetName(void);
 static size_t MtmGetTransactionStateSize(void);
 static void	  MtmSerializeTransactionState(void* ctx);
@@ -170,8 +214,9 @@ static void MtmAddSubtransactions(MtmTransState* ts, TransactionId *subxids, int
 static void MtmShmemStartup(void);
 
 static BgwPool* MtmPoolConstructor(void);
-static bool MtmRunUtilityStmt(PGconn* conn, char const* sql, char **errmsg);
+static int  MtmRunUtilityStmt(PGconn** conns, int nNodes, char const* sql, bool* failed, char **errmsg);
 static void MtmBroadcastUtilityStmt(char const* sql, bool ignoreError, int forceOnNode);
+static void MtmReleaseBroadcastConnections(void);
 static void MtmProcessDDLCommand(char const* queryString, bool transactional);
 
 static void MtmLockCluster(void);
@@ -191,10 +236,17 @@ HTAB* MtmGid2State;
 static HTAB* MtmRemoteFunctions;
 static HTAB* MtmLocalTables;
 
+static MtmCSNSlot* MtmCSNArray;                 /* shared array of completed transactions indexed by XID */
+static TransactionId* MtmVisibilityWaitXid;     /* XID which visibility is waited by backend, indexed by pgprocno */
+static MtmDeadlockProbeSlot* MtmDeadlockProbes; /* state of distributed deadlock detection, indexed by pgprocno */
+static MtmCSNCacheEntry MtmCSNCache[MTM_CSN_CACHE_SIZE];
+static TransactionId MtmCSNCacheXmin;
+
 static bool MtmIsRecoverySession;
 
 static MtmCurrentTrans MtmTx;
 static dlist_head MtmLsnMapping = DLIST_STATIC_INIT(MtmLsnMapping);
+static MtmApplyWindow* MtmApplyWindows;         /* [MtmMaxNodes]: transactions applied in parallel during recovery */
 
 static TransactionManager MtmTM =
 {
@@ -253,6 +305,16 @@ int	  MtmMax2PCRatio;
 bool  MtmUseDtm;
 bool  MtmUseRDMA;
 bool  MtmPreserveCommitOrder;
+bool  MtmDependencyAwareApply;
+bool  MtmGroupCommit;
+int   MtmGroupCommitWindow;
+bool  MtmStreamLargeTransactions;
+bool  MtmParallelRecovery;
+bool  MtmReplicationCompression;
+bool  MtmColumnarInserts;
+int   MtmSequenceRange;
+int   MtmArbiterQueueSize;
+int   MtmMaxClockSkew;
 bool  MtmVolksWagenMode; /* Pretend to be normal postgres. This means skip some NOTICE's and use local sequences */
 bool  MtmMajorNode;
 char* MtmRefereeConnStr;
@@ -270,6 +332,7 @@ static bool	 MtmIgnoreTablesWithoutPk;
 static int	 MtmLockCount;
 static bool	 MtmBreakConnection;
 static bool  MtmBypass;
+static bool  MtmWaitBootstrap;
 static bool	 MtmClusterLocked;
 static bool	 MtmInsideTransaction;
 static bool  MtmReferee;
@@ -425,6 +488,94 @@ void MtmUnlockNode(int nodeId)
 	LWLockRelease((LWLockId)&Mtm->locks[nodeId]);
 }
 
+/*
+ * -------------------------------------------
+ * Partitioned transaction maps.
+ * Lock tranche layout: [0] - MtmLock, [1..MtmMaxNodes] - replication session locks,
+ * [MtmMaxNodes+1..2*MtmMaxNodes] - lock graph locks, then MTM_NUM_PARTITIONS locks for MtmXid2State
+ * followed by MTM_NUM_PARTITIONS locks for MtmGid2State.
+ * Insert/remove requires exclusive MtmLock and exclusive partition lock,
+ * lookup requires either MtmLock either shared partition lock.
+ * -------------------------------------------
+ */
+
+#define MTM_XID_PARTITION_LOCK_OFFSET (1 + MtmMaxNodes*2)
+#define MTM_GID_PARTITION_LOCK_OFFSET (MTM_XID_PARTITION_LOCK_OFFSET + MTM_NUM_PARTITIONS)
+
+LWLockId MtmLockXidPartition(TransactionId xid, LWLockMode mode)
+{
+	uint32 hashcode = get_hash_value(MtmXid2State, &xid);
+	LWLockId partitionLock = (LWLockId)&Mtm->locks[MTM_XID_PARTITION_LOCK_OFFSET + hashcode % MTM_NUM_PARTITIONS];
+	LWLockAcquire(partitionLock, mode);
+	return partitionLock;
+}
+
+LWLockId MtmLockGidPartition(char const* gid, LWLockMode mode)
+{
+	uint32 hashcode = get_hash_value(MtmGid2State, gid);
+	LWLockId partitionLock = (LWLockId)&Mtm->locks[MTM_GID_PARTITION_LOCK_OFFSET + hashcode % MTM_NUM_PARTITIONS];
+	LWLockAcquire(partitionLock, mode);
+	return partitionLock;
+}
+
+/*
+ * Insert new transaction state in MtmXid2State.
+ * New entry is initialized here, before it becomes visible to lock-free readers.
+ */
+static MtmTransState* MtmXid2StateEnter(TransactionId xid, bool* found)
+{
+	MtmTransState* ts;
+	LWLockId partitionLock;
+
+	Assert(MtmLockCount != 0);
+	partitionLock = MtmLockXidPartition(xid, LW_EXCLUSIVE);
+	ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_ENTER, found);
+	if (!*found) {
+		ts->status = TRANSACTION_STATUS_IN_PROGRESS;
+		ts->csn = INVALID_CSN;
+		ts->isEnqueued = false;
+		ts->isActive = false;
+	}
+	LWLockRelease(partitionLock);
+	return ts;
+}
+
+static void MtmXid2StateRemove(TransactionId xid)
+{
+	LWLockId partitionLock;
+
+	Assert(MtmLockCount != 0);
+	partitionLock = MtmLockXidPartition(xid, LW_EXCLUSIVE);
+	hash_search(MtmXid2State, &xid, HASH_REMOVE, NULL);
+	LWLockRelease(partitionLock);
+}
+
+static MtmTransMap* MtmGid2StateEnter(char const* gid, bool* found)
+{
+	MtmTransMap* tm;
+	LWLockId partitionLock;
+
+	Assert(MtmLockCount != 0);
+	partitionLock = MtmLockGidPartition(gid, LW_EXCLUSIVE);
+	tm = (MtmTransMap*)hash_search(MtmGid2State, gid, HASH_ENTER, found);
+	if (!*found) {
+		tm->state = NULL;
+		tm->status = TRANSACTION_STATUS_IN_PROGRESS;
+	}
+	LWLockRelease(partitionLock);
+	return tm;
+}
+
+static void MtmGid2StateRemove(char const* gid)
+{
+	LWLockId partitionLock;
+
+	Assert(MtmLockCount != 0);
+	partitionLock = MtmLockGidPartition(gid, LW_EXCLUSIVE);
+	hash_search(MtmGid2State, gid, HASH_REMOVE, NULL);
+	LWLockRelease(partitionLock);
+}
+
 /*
  * -------------------------------------------
  * System time manipulation functions
@@ -440,11 +591,11 @@ timestamp_t MtmGetSystemTime(void)
 }
 
 /*
- * Get adjusted system time: taking in account time shift
+ * Get adjusted system time: current reading of hybrid logical clock
  */
 timestamp_t MtmGetCurrentTime(void)
 {
-	return MtmGetSystemTime() + Mtm->timeShift;
+	return HLCNow(&Mtm->clock);
 }
 
 void MtmSleep(timestamp_t interval)
@@ -462,29 +613,33 @@ void MtmSleep(timestamp_t interval)
 }
 
 /**
- * Return ascending unique timestamp which is used as CSN
+ * Return ascending unique timestamp which is used as CSN.
+ * Clock is advanced using atomic operations, so it doesn't require MtmLock.
  */
 csn_t MtmAssignCSN()
 {
-	csn_t csn = MtmGetCurrentTime();
-	if (csn <= Mtm->csn) {
-		csn = ++Mtm->csn;
-	} else {
-		Mtm->csn = csn;
-	}
-	return csn;
+	return HLCTick(&Mtm->clock);
 }
 
 /**
- * "Adjust" system clock if we receive message from future
+ * Advance clock if we receive message from future.
+ * Skew exceeding multimaster.max_clock_skew is reported, but clock is still advanced: CSNs should be ascending.
  */
 csn_t MtmSyncClock(csn_t global_csn)
 {
-	csn_t local_csn;
-	while ((local_csn = MtmAssignCSN()) < global_csn) {
-		Mtm->timeShift += global_csn - local_csn;
+	static timestamp_t lastWarningTime;
+	hlc_t skew;
+
+	if (!HLCReceive(&Mtm->clock, global_csn, MSEC_TO_USEC(MtmMaxClockSkew), &skew)) {
+		timestamp_t now = MtmGetSystemTime();
+		if (now - lastWarningTime > USECS_PER_SEC) {
+			lastWarningTime = now;
+			MTM_ELOG(WARNING, "Clock of remote node is ahead of local clock by %lld usec", (long64)skew);
+		}
+		/* CSNs should be ascending, so skewed timestamp is still accepted */
+		HLCReceive(&Mtm->clock, global_csn, 0, NULL);
 	}
-	return local_csn;
+	return HLCTick(&Mtm->clock);
 }
 
 /*
@@ -562,8 +717,8 @@ csn_t MtmDistributedTransactionSnapshot(TransactionId xid, int nodeId, nodemask_
 {
 	csn_t snapshot = INVALID_CSN;
 	*participantsMask = 0;
-	MtmLock(LW_SHARED);
 	if (Mtm->status == MTM_ONLINE) {
+		LWLockId partitionLock = MtmLockXidPartition(xid, LW_SHARED);
 		MtmTransState* ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_FIND, NULL);
 		if (ts != NULL) {
 			*participantsMask = ts->participantsMask;
@@ -576,17 +731,15 @@ csn_t MtmDistributedTransactionSnapshot(TransactionId xid, int nodeId, nodemask_
 						 ts->gid, (long64)ts->xid, nodeId, ts->participantsMask);
 			}
 		}
+		LWLockRelease(partitionLock);
 	}
-	MtmUnlock();
 	return snapshot;
 }
 
 void MtmSetSnapshot(csn_t globalSnapshot)
 {
-	MtmLock(LW_EXCLUSIVE);
 	MtmSyncClock(globalSnapshot);
 	MtmTx.snapshot = globalSnapshot;
-	MtmUnlock();
 }
 
 
@@ -599,22 +752,139 @@ Snapshot MtmGetSnapshot(Snapshot snapshot)
 			LogLogicalMessage("S", (char*)&MtmTx.snapshot, sizeof(MtmTx.snapshot), true);
 		}
 	}
-	RecentGlobalDataXmin = RecentGlobalXmin = Mtm->oldestXid;
+	RecentGlobalDataXmin = RecentGlobalXmin = pg_atomic_read_u32(&Mtm->oldestXid);
 	return snapshot;
 }
 
 
+/*
+ * Horizon is published by GC worker, so no locks are needed here
+ */
 TransactionId MtmGetOldestXmin(Relation rel, bool ignoreVacuum)
 {
 	TransactionId xmin = PgGetOldestXmin(NULL, false); /* consider all backends */
-	if (TransactionIdIsValid(xmin)) {
-		MtmLock(LW_EXCLUSIVE);
-		xmin = MtmAdjustOldestXid(xmin);
-		MtmUnlock();
+	if (TransactionIdIsValid(xmin) && MtmUseDtm && !MtmVolksWagenMode) {
+		TransactionId oldestXid = pg_atomic_read_u32(&Mtm->oldestXid);
+		if (TransactionIdPrecedes(oldestXid, xmin)) {
+			xmin = oldestXid;
+		}
 	}
 	return xmin;
 }
 
+/*
+ * -------------------------------------------
+ * Cache of completed transactions.
+ * Most of tuples checked by MtmXidInMVCCSnapshot belong to already completed transactions,
+ * which status and CSN will never be changed. Such transactions are published in shared
+ * lock-free array (slot is chosen by XID) and are also remembered in backend local cache,
+ * so visibility check does not need to access MtmXid2State in most cases.
+ * Shared array is updated only under exclusive MtmLock, so there is always single writer.
+ * Backends waiting for completion of in-doubt transactions register themselves in
+ * MtmVisibilityWaitXid and are woken up through their latches when transaction is completed.
+ * -------------------------------------------
+ */
+
+static bool MtmCSNCacheLookup(TransactionId xid, XidStatus* status, csn_t* csn)
+{
+	MtmCSNCacheEntry* entry = &MtmCSNCache[xid % MTM_CSN_CACHE_SIZE];
+
+	/* Drop the whole cache before it can contain XIDs from different epochs */
+	if (pg_atomic_read_u32(&Mtm->oldestXid) - MtmCSNCacheXmin >= MTM_CSN_CACHE_MAX_AGE) {
+		memset(MtmCSNCache, 0, sizeof(MtmCSNCache));
+		MtmCSNCacheXmin = pg_atomic_read_u32(&Mtm->oldestXid);
+		return false;
+	}
+	if (entry->xid == xid) {
+		*status = entry->status;
+		*csn = entry->csn;
+		return true;
+	}
+	return false;
+}
+
+static void MtmCSNCacheInsert(TransactionId xid, XidStatus status, csn_t csn)
+{
+	MtmCSNCacheEntry* entry;
+
+	if (xid - MtmCSNCacheXmin >= MTM_CSN_CACHE_MAX_AGE) {
+		memset(MtmCSNCache, 0, sizeof(MtmCSNCache));
+		MtmCSNCacheXmin = pg_atomic_read_u32(&Mtm->oldestXid);
+		if (xid - MtmCSNCacheXmin >= MTM_CSN_CACHE_MAX_AGE) {
+			return;
+		}
+	}
+	entry = &MtmCSNCache[xid % MTM_CSN_CACHE_SIZE];
+	entry->xid = xid;
+	entry->status = status;
+	entry->csn = csn;
+}
+
+static bool MtmCSNArrayLookup(TransactionId xid, XidStatus* status, csn_t* csn)
+{
+	MtmCSNSlot* slot = &MtmCSNArray[xid % MTM_CSN_ARRAY_SIZE];
+	if (pg_atomic_read_u32(&slot->xid) == xid) {
+		pg_read_barrier();
+		*status = slot->status;
+		*csn = slot->csn;
+		pg_read_barrier();
+		/* Make sure that slot was not reused while we are reading it */
+		return pg_atomic_read_u32(&slot->xid) == xid;
+	}
+	return false;
+}
+
+/*
+ * Publish status of completed transaction and wakeup backends waiting for it.
+ * Should be called under exclusive MtmLock.
+ */
+static void MtmPublishTransStatus(MtmTransState* ts)
+{
+	MtmCSNSlot* slot = &MtmCSNArray[ts->xid % MTM_CSN_ARRAY_SIZE];
+	int i;
+
+	Assert(ts->status == TRANSACTION_STATUS_COMMITTED || ts->status == TRANSACTION_STATUS_ABORTED);
+
+	pg_atomic_write_u32(&slot->xid, InvalidTransactionId);
+	pg_write_barrier();
+	slot->status = ts->status;
+	slot->csn = ts->csn;
+	pg_write_barrier();
+	pg_atomic_write_u32(&slot->xid, ts->xid);
+
+	/* Pairs with registration of waiter in MtmXidInMVCCSnapshot */
+	pg_memory_barrier();
+	if (pg_atomic_read_u32(&Mtm->nVisibilityWaiters) != 0) {
+		for (i = 0; i < ProcGlobal->allProcCount; i++) {
+			if (MtmVisibilityWaitXid[i] == ts->xid) {
+				SetLatch(&ProcGlobal->allProcs[i].procLatch);
+			}
+		}
+	}
+}
+
+/*
+ * Remove transaction from shared array when it is removed from MtmXid2State.
+ * Should be called under exclusive MtmLock.
+ */
+static void MtmForgetTransStatus(TransactionId xid)
+{
+	MtmCSNSlot* slot = &MtmCSNArray[xid % MTM_CSN_ARRAY_SIZE];
+	if (pg_atomic_read_u32(&slot->xid) == xid) {
+		pg_atomic_write_u32(&slot->xid, InvalidTransactionId);
+	}
+}
+
+static void MtmSetVisibilityWaitXid(TransactionId xid)
+{
+	MtmVisibilityWaitXid[MyProc->pgprocno] = xid;
+	if (TransactionIdIsValid(xid)) {
+		pg_atomic_fetch_add_u32(&Mtm->nVisibilityWaiters, 1);
+	} else {
+		pg_atomic_fetch_sub_u32(&Mtm->nVisibilityWaiters, 1);
+	}
+}
+
 bool MtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 {
 #if TRACE_SLEEP_TIME
@@ -624,6 +894,11 @@ bool MtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 	static timestamp_t maxSleepTime;
 #endif
 	timestamp_t delay = MIN_WAIT_TIMEOUT;
+	LWLockId partitionLock;
+	XidStatus status;
+	csn_t csn;
+	bool found;
+	bool waiting = false;
 	int i;
 #if DEBUG_LEVEL > 1
 	timestamp_t start = MtmGetSystemTime();
@@ -631,10 +906,25 @@ bool MtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 
 	Assert(xid != InvalidTransactionId);
 
-	if (!MtmUseDtm || TransactionIdPrecedes(xid, Mtm->oldestXid)) {
+	if (!MtmUseDtm || TransactionIdPrecedes(xid, pg_atomic_read_u32(&Mtm->oldestXid))) {
 		return PgXidInMVCCSnapshot(xid, snapshot);
 	}
-	MtmLock(LW_SHARED);
+
+	found = MtmCSNCacheLookup(xid, &status, &csn);
+	if (!found && MtmCSNArrayLookup(xid, &status, &csn)) {
+		MtmCSNCacheInsert(xid, status, csn);
+		found = true;
+	}
+	if (found)
+	{
+		bool invisible = csn > MtmTx.snapshot || status != TRANSACTION_STATUS_COMMITTED;
+		MTM_LOG4("%d: tuple with xid=%lld(csn= %lld) is %s in snapshot %lld",
+				 MyProcPid, (long64)xid, csn, invisible ? "invisible" : "visible", MtmTx.snapshot);
+		return invisible;
+	}
+
+	/* Visibility check doesn't need MtmLock: entry can not be removed while we are holding partition lock */
+	partitionLock = MtmLockXidPartition(xid, LW_SHARED);
 
 #if TRACE_SLEEP_TIME
 	if (firstReportTime == 0) {
@@ -647,26 +937,55 @@ bool MtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 		MtmTransState* ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_FIND, NULL);
 		if (ts != NULL /*&& ts->status != TRANSACTION_STATUS_IN_PROGRESS*/)
 		{
-			if (ts->csn > MtmTx.snapshot) {
+			/*
+			 * CSN and status are updated under MtmLock, but without partition lock.
+			 * Writers change CSN only when transaction is in unknown state:
+			 * status is set to UNKNOWN before assigning new CSN and COMMITTED status is set after final CSN is assigned.
+			 * So rereading status is enough to get consistent pair.
+			 */
+			do {
+				status = ts->status;
+				pg_read_barrier();
+				csn = ts->csn;
+				pg_read_barrier();
+			} while (ts->status != status);
+
+			if (csn > MtmTx.snapshot) {
 				MTM_LOG4("%d: tuple with xid=%lld(csn=%lld) is invisible in snapshot %lld",
-						 MyProcPid, (long64)xid, ts->csn, MtmTx.snapshot);
+						 MyProcPid, (long64)xid, csn, MtmTx.snapshot);
 #if DEBUG_LEVEL > 1
 				if (MtmGetSystemTime() - start > USECS_PER_SEC) {
 					MTM_ELOG(WARNING, "Backend %d waits for transaction %s (%llu) status %lld usecs", MyProcPid, ts->gid, (long64)xid, MtmGetSystemTime() - start);
 				}
 #endif
-				MtmUnlock();
+				LWLockRelease(partitionLock);
+				if (waiting) {
+					MtmSetVisibilityWaitXid(InvalidTransactionId);
+				}
+				if (status == TRANSACTION_STATUS_COMMITTED || status == TRANSACTION_STATUS_ABORTED) {
+					MtmCSNCacheInsert(xid, status, csn);
+				}
 				return true;
 			}
-			if (ts->status == TRANSACTION_STATUS_UNKNOWN)
+			if (status == TRANSACTION_STATUS_UNKNOWN)
 			{
 				MTM_LOG3("%d: wait for in-doubt transaction %u in snapshot %llu", MyProcPid, xid, MtmTx.snapshot);
-				MtmUnlock();
+				LWLockRelease(partitionLock);
+				if (!waiting) {
+					/* Register before rechecking status, so that MtmPublishTransStatus will not miss us */
+					MtmSetVisibilityWaitXid(xid);
+					waiting = true;
+					LWLockAcquire(partitionLock, LW_SHARED);
+					continue;
+				}
 #if TRACE_SLEEP_TIME
 				{
 				timestamp_t delta, now = MtmGetCurrentTime();
 #endif
-				MtmSleep(delay);
+				if (WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, Max(USEC_TO_MSEC(delay), 1)) & WL_POSTMASTER_DEATH) {
+					proc_exit(1);
+				}
+				ResetLatch(&MyProc->procLatch);
 #if TRACE_SLEEP_TIME
 				delta = MtmGetCurrentTime() - now;
 				totalSleepTime += delta;
@@ -686,14 +1005,20 @@ bool MtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 				if (delay*2 <= MAX_WAIT_TIMEOUT) {
 					delay *= 2;
 				}
-				MtmLock(LW_SHARED);
+				LWLockAcquire(partitionLock, LW_SHARED);
 			}
 			else
 			{
-				bool invisible = ts->status != TRANSACTION_STATUS_COMMITTED;
+				bool invisible = status != TRANSACTION_STATUS_COMMITTED;
 				MTM_LOG4("%d: tuple with xid=%lld(csn= %lld) is %s in snapshot %lld",
-						 MyProcPid, (long64)xid, ts->csn, invisible ? "rollbacked" : "committed", MtmTx.snapshot);
-				MtmUnlock();
+						 MyProcPid, (long64)xid, csn, invisible ? "rollbacked" : "committed", MtmTx.snapshot);
+				LWLockRelease(partitionLock);
+				if (waiting) {
+					MtmSetVisibilityWaitXid(InvalidTransactionId);
+				}
+				if (status != TRANSACTION_STATUS_IN_PROGRESS) {
+					MtmCSNCacheInsert(xid, status, csn);
+				}
 #if DEBUG_LEVEL > 1
 				if (MtmGetSystemTime() - start > USECS_PER_SEC) {
 					MTM_ELOG(WARNING, "Backend %d waits for %s transaction %s (%llu) %lld usecs", MyProcPid, invisible ? "rollbacked" : "committed",
@@ -706,11 +1031,17 @@ bool MtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 		else
 		{
 			MTM_LOG4("%d: visibility check is skipped for transaction %llu in snapshot %llu", MyProcPid, (long64)xid, MtmTx.snapshot);
-			MtmUnlock();
+			LWLockRelease(partitionLock);
+			if (waiting) {
+				MtmSetVisibilityWaitXid(InvalidTransactionId);
+			}
 			return PgXidInMVCCSnapshot(xid, snapshot);
 		}
 	}
-	MtmUnlock();
+	LWLockRelease(partitionLock);
+	if (waiting) {
+		MtmSetVisibilityWaitXid(InvalidTransactionId);
+	}
 #if DEBUG_LEVEL > 1
 	MTM_ELOG(ERROR, "Failed to get status of XID %llu in %lld usec", (long64)xid, MtmGetSystemTime() - start);
 #else
@@ -720,35 +1051,37 @@ bool MtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 }
 
 
-
 /*
  * There can be different oldest XIDs at different cluster node.
  * We collect oldest CSNs from all nodes and choose minimum from them.
- * If no such XID can be located, then return previously observed oldest XID
+ * Transactions which are not visible in any snapshot are removed from the list and from the hash tables,
+ * but not more than maxRemoved of them: GC worker performs cleanup in slices to avoid holding MtmLock for a long time.
+ * Returns number of removed transactions. Should be called under exclusive MtmLock.
  */
-static TransactionId
-MtmAdjustOldestXid(TransactionId xid)
+static int
+MtmAdjustOldestXid(TransactionId xid, int maxRemoved)
 {
 	int i;
+	int nRemoved = 0;
 	csn_t oldestSnapshot = INVALID_CSN;
 	MtmTransState *prev = NULL;
 	MtmTransState *ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_FIND, NULL);
 	MTM_LOG2("%d: MtmAdjustOldestXid(%d): snapshot=%lld, csn=%lld, status=%d", MyProcPid, xid, ts != NULL ? ts->snapshot : 0, ts != NULL ? ts->csn : 0, ts != NULL ? ts->status : -1);
-	Mtm->gcCount = 0;
 
 	if (ts != NULL) {
 		oldestSnapshot = ts->snapshot;
 		Assert(oldestSnapshot != INVALID_CSN);
-		if (Mtm->nodes[MtmNodeId-1].oldestSnapshot < oldestSnapshot) {
-			Mtm->nodes[MtmNodeId-1].oldestSnapshot = oldestSnapshot;
+		if (pg_atomic_read_u64(&Mtm->nodes[MtmNodeId-1].oldestSnapshot) < oldestSnapshot) {
+			pg_atomic_write_u64(&Mtm->nodes[MtmNodeId-1].oldestSnapshot, oldestSnapshot);
 		} else {
-			oldestSnapshot = Mtm->nodes[MtmNodeId-1].oldestSnapshot;
+			oldestSnapshot = pg_atomic_read_u64(&Mtm->nodes[MtmNodeId-1].oldestSnapshot);
 		}
 		for (i = 0; i < Mtm->nAllNodes; i++) {
+			csn_t nodeOldestSnapshot = pg_atomic_read_u64(&Mtm->nodes[i].oldestSnapshot);
 			if (!BIT_CHECK(Mtm->disabledNodeMask, i)
-				&& Mtm->nodes[i].oldestSnapshot < oldestSnapshot)
+				&& nodeOldestSnapshot < oldestSnapshot)
 			{
-				oldestSnapshot = Mtm->nodes[i].oldestSnapshot;
+				oldestSnapshot = nodeOldestSnapshot;
 			}
 		}
 		if (oldestSnapshot > MtmVacuumDelay*USECS_PER_SEC) {
@@ -759,6 +1092,7 @@ MtmAdjustOldestXid(TransactionId xid)
 
 		for (ts = Mtm->transListHead;
 			 ts != NULL
+				 && nRemoved < maxRemoved
 				 && (ts->status == TRANSACTION_STATUS_ABORTED || ts->status == TRANSACTION_STATUS_COMMITTED)
 				 && ts->csn < oldestSnapshot
 				 && !ts->isPinned
@@ -768,8 +1102,10 @@ MtmAdjustOldestXid(TransactionId xid)
 			Assert(!ts->isActive);
 			if (prev != NULL) {
 				/* Remove information about too old transactions */
-				hash_search(MtmXid2State, &prev->xid, HASH_REMOVE, NULL);
-				hash_search(MtmGid2State, &prev->gid, HASH_REMOVE, NULL);
+				MtmForgetTransStatus(prev->xid);
+				MtmXid2StateRemove(prev->xid);
+				MtmGid2StateRemove(prev->gid);
+				nRemoved += 1;
 			}
 		}
 		if (ts != NULL) {
@@ -778,31 +1114,106 @@ MtmAdjustOldestXid(TransactionId xid)
 		}
 	}
 
-	if (MtmUseDtm && !MtmVolksWagenMode)
-	{
-		if (prev != NULL) {
-			MTM_LOG2("%d: MtmAdjustOldestXid: oldestXid=%d, prev->xid=%d, prev->status=%s, prev->snapshot=%lld, ts->xid=%d, ts->status=%d, ts->snapshot=%lld, oldestSnapshot=%lld",
-					 MyProcPid, xid, prev->xid, MtmTxnStatusMnem[prev->status], prev->snapshot, (ts ? ts->xid : 0), (ts ? ts->status : -1), (ts ? ts->snapshot : -1), oldestSnapshot);
-			Mtm->transListHead = prev;
-			Mtm->oldestXid = xid = prev->xid;
-		} else if (TransactionIdPrecedes(Mtm->oldestXid, xid)) {
-			xid = Mtm->oldestXid;
-		}
-	} else {
-		if (prev != NULL) {
-			MTM_LOG2("%d: MtmAdjustOldestXid: oldestXid=%d, prev->xid=%d, prev->status=%s, prev->snapshot=%lld, ts->xid=%d, ts->status=%d, ts->snapshot=%lld, oldestSnapshot=%lld",
-					 MyProcPid, xid, prev->xid, MtmTxnStatusMnem[prev->status], prev->snapshot, (ts ? ts->xid : 0), (ts ? ts->status : -1), (ts ? ts->snapshot : -1), oldestSnapshot);
-			Mtm->transListHead = prev;
+	if (prev != NULL) {
+		MTM_LOG2("%d: MtmAdjustOldestXid: oldestXid=%d, prev->xid=%d, prev->status=%s, prev->snapshot=%lld, ts->xid=%d, ts->status=%d, ts->snapshot=%lld, oldestSnapshot=%lld",
+				 MyProcPid, xid, prev->xid, MtmTxnStatusMnem[prev->status], prev->snapshot, (ts ? ts->xid : 0), (ts ? ts->status : -1), (ts ? ts->snapshot : -1), oldestSnapshot);
+		Mtm->transListHead = prev;
+		if (MtmUseDtm && !MtmVolksWagenMode) {
+			/* Publish new horizon: it is read by MtmGetOldestXmin without locks */
+			pg_atomic_write_u32(&Mtm->oldestXid, prev->xid);
 		}
 	}
+	return nRemoved;
+}
 
-	if (!MyReplicationSlot) {
-		MtmCheckSlots();
+/*
+ * -------------------------------------------
+ * Garbage collection of finished transactions.
+ * Transaction list and MtmXid2State/MtmGid2State hashes are trimmed by dedicated background worker,
+ * so user's backends never perform cleanup themselves. Worker is woken up by backends after
+ * multimaster.gc_period distributed transactions and also wakes up periodically by timeout.
+ * Entries of shared hash tables removed by GC are reused through dynahash freelists.
+ * -------------------------------------------
+ */
+
+#define MTM_GC_BATCH_SIZE 128   /* maximal number of transactions removed while holding MtmLock */
+#define MTM_GC_TIMEOUT    1000  /* msec */
+
+static BackgroundWorker MtmGcWorker = {
+	"mtm-gc",
+	BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION,
+	BgWorkerStart_ConsistentState,
+	MULTIMASTER_BGW_RESTART_TIMEOUT,
+	MtmGcWorkerMain
+};
+
+static volatile sig_atomic_t MtmGcStop;
+
+static void MtmGcSigTermHandler(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+	MtmGcStop = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void MtmWakeupGcWorker(void)
+{
+	int procno = Mtm->gcWorkerProcno;
+	if (procno >= 0) {
+		SetLatch(&ProcGlobal->allProcs[procno].procLatch);
 	}
+}
 
-	return xid;
+static void MtmCollectGarbage(void)
+{
+	TransactionId xmin = PgGetOldestXmin(NULL, false); /* consider all backends */
+	int nRemoved;
+
+	if (!TransactionIdIsValid(xmin)) {
+		return;
+	}
+	do {
+		MtmLock(LW_EXCLUSIVE);
+		Mtm->gcCount = 0;
+		nRemoved = MtmAdjustOldestXid(xmin, MTM_GC_BATCH_SIZE);
+		MtmUnlock();
+	} while (nRemoved == MTM_GC_BATCH_SIZE && !MtmGcStop);
 }
 
+static void MtmGcWorkerMain(Datum arg)
+{
+	pqsignal(SIGTERM, MtmGcSigTermHandler);
+	pqsignal(SIGHUP, PostgresSigHupHandler);
+
+	MtmBackgroundWorker = true;
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/* Connect to a database: it is needed to drop replication slots of lagging nodes */
+	BackgroundWorkerInitializeConnection(MtmDatabaseName, NULL);
+
+	Mtm->gcWorkerProcno = MyProc->pgprocno;
+
+	while (!MtmGcStop) {
+		int rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, MTM_GC_TIMEOUT);
+		if (rc & WL_POSTMASTER_DEATH) {
+			proc_exit(1);
+		}
+		ResetLatch(&MyProc->procLatch);
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		MtmCollectGarbage();
+		MtmCheckSlots();
+	}
+	Mtm->gcWorkerProcno = -1;
+}
 
 
 
@@ -810,7 +1221,7 @@ MtmAdjustOldestXid(TransactionId xid)
  * -------------------------------------------
  * Transaction list manipulation.
  * All distributed transactions are linked in L1-list ordered by transaction start time.
- * This list is inspected by MtmAdjustOldestXid and transactions which are not used in any snapshot at any node
+ * This list is inspected by GC worker and transactions which are not used in any snapshot at any node
  * are removed from the list and from the hash.
  * -------------------------------------------
  */
@@ -844,11 +1255,11 @@ static void MtmAddSubtransactions(MtmTransState* ts, TransactionId* subxids, int
 		bool found;
 		MtmTransState* sts;
 		Assert(TransactionIdIsValid(subxids[i]));
-		sts = (MtmTransState*)hash_search(MtmXid2State, &subxids[i], HASH_ENTER, &found);
+		sts = MtmXid2StateEnter(subxids[i], &found);
 		Assert(!found);
-		sts->isActive = false;
 		sts->isPinned = false;
 		sts->status = ts->status;
+		pg_write_barrier();
 		sts->csn = ts->csn;
 		sts->votingCompleted = true;
 		MtmTransactionListInsertAfter(ts, sts);
@@ -860,11 +1271,26 @@ void MtmAdjustSubtransactions(MtmTransState* ts)
 	int i;
 	int nSubxids = ts->nSubxids;
 	MtmTransState* sts = ts;
+	bool completed = ts->status == TRANSACTION_STATUS_COMMITTED || ts->status == TRANSACTION_STATUS_ABORTED;
 
+	if (completed) {
+		MtmPublishTransStatus(ts);
+	}
 	for (i = 0; i < nSubxids; i++) {
 		sts = sts->next;
-		sts->status = ts->status;
-		sts->csn = ts->csn;
+		/* Committed status should not be visible before CSN, see MtmXidInMVCCSnapshot */
+		if (ts->status == TRANSACTION_STATUS_COMMITTED) {
+			sts->csn = ts->csn;
+			pg_write_barrier();
+			sts->status = ts->status;
+		} else {
+			sts->status = ts->status;
+			pg_write_barrier();
+			sts->csn = ts->csn;
+		}
+		if (completed) {
+			MtmPublishTransStatus(sts);
+		}
 	}
 }
 
@@ -897,9 +1323,11 @@ MtmXactCallback(XactEvent event, void *arg)
 		break;
 	  case XACT_EVENT_COMMIT:
 		MtmEndTransaction(&MtmTx, true);
+		MtmReleaseBroadcastConnections();
 		break;
 	  case XACT_EVENT_ABORT:
 		MtmEndTransaction(&MtmTx, false);
+		MtmReleaseBroadcastConnections();
 		break;
 	  case XACT_EVENT_COMMIT_COMMAND:
 		if (!MtmTx.isTransactionBlock && !IsSubTransaction()) {
@@ -963,13 +1391,11 @@ static void
 MtmBeginTransaction(MtmCurrentTrans* x)
 {
 	if (x->snapshot == INVALID_CSN) {
-		TransactionId xmin = (Mtm->gcCount >= MtmGcPeriod) ? PgGetOldestXmin(NULL, false) : InvalidTransactionId; /* Get oldest xmin outside critical section */
-
 		Assert(!x->isActive);
-		MtmLock(LW_EXCLUSIVE);
-		if (TransactionIdIsValid(xmin) && Mtm->gcCount >= MtmGcPeriod) {
-			MtmAdjustOldestXid(xmin);
+		if (Mtm->gcCount >= MtmGcPeriod) {
+			MtmWakeupGcWorker();
 		}
+		MtmLock(LW_EXCLUSIVE);
 
 		x->xid = GetCurrentTransactionIdIfAny();
 		x->isReplicated = MtmIsLogicalReceiver;
@@ -1026,7 +1452,7 @@ static MtmTransState*
 MtmCreateTransState(MtmCurrentTrans* x)
 {
 	bool found;
-	MtmTransState* ts = (MtmTransState*)hash_search(MtmXid2State, &x->xid, HASH_ENTER, &found);
+	MtmTransState* ts = MtmXid2StateEnter(x->xid, &found);
 	ts->status = TRANSACTION_STATUS_IN_PROGRESS;
 	ts->snapshot = x->snapshot;
 	ts->isLocal = true;
@@ -1035,10 +1461,6 @@ MtmCreateTransState(MtmCurrentTrans* x)
 	ts->isPinned = false;
 	ts->votingCompleted = false;
 	ts->abortedByNode = 0;
-	if (!found) {
-		ts->isEnqueued = false;
-		ts->isActive = false;
-	}
 	if (TransactionIdIsValid(x->gtid.xid)) {
 		Assert(x->gtid.node != MtmNodeId);
 		ts->gtid = x->gtid;
@@ -1121,7 +1543,7 @@ MtmPrePrepareTransaction(MtmCurrentTrans* x)
 	MtmLock(LW_EXCLUSIVE);
 
 	Assert(*x->gid != '\0');
-	tm = (MtmTransMap*)hash_search(MtmGid2State, x->gid, HASH_ENTER, &found);
+	tm = MtmGid2StateEnter(x->gid, &found);
 	if (found && tm->status != TRANSACTION_STATUS_IN_PROGRESS) {
 		Assert(tm->status == TRANSACTION_STATUS_ABORTED);
 		MtmUnlock();
@@ -1135,6 +1557,7 @@ MtmPrePrepareTransaction(MtmCurrentTrans* x)
 	ts->snapshot = x->snapshot;
 	ts->csn = MtmAssignCSN();
 	ts->procno = MyProc->pgprocno;
+	ts->phaseStartTime = MtmGetSystemTime();
 	ts->votingCompleted = false;
 	ts->participantsMask = (((nodemask_t)1 << Mtm->nAllNodes) - 1) & ~Mtm->disabledNodeMask & ~((nodemask_t)1 << (MtmNodeId-1));
     ts->isLocal = x->isReplicated || !x->containsDML || (ts->participantsMask == 0);
@@ -1169,11 +1592,12 @@ bool MtmWatchdog(timestamp_t now)
 	bool allAlive = true;
 	for (i = 0; i < n; i++) {
 		if (i+1 != MtmNodeId && !BIT_CHECK(Mtm->disabledNodeMask, i)) {
-			if (Mtm->nodes[i].lastHeartbeat != 0
-				&& now > Mtm->nodes[i].lastHeartbeat + MSEC_TO_USEC(MtmHeartbeatRecvTimeout))
+			timestamp_t lastHeartbeat = pg_atomic_read_u64(&Mtm->nodes[i].lastHeartbeat);
+			if (lastHeartbeat != 0
+				&& now > lastHeartbeat + MSEC_TO_USEC(MtmHeartbeatRecvTimeout))
 			{
 				MTM_LOG1("[STATE] Node %i: Disconnect due to heartbeat timeout (%d msec)",
-					 i+1, (int)USEC_TO_MSEC(now - Mtm->nodes[i].lastHeartbeat));
+					 i+1, (int)USEC_TO_MSEC(now - lastHeartbeat));
 				MtmOnNodeDisconnect(i+1);
 				allAlive = false;
 			}
@@ -1201,6 +1625,7 @@ void MtmPrecommitTransaction(char const* gid)
 				MtmUnlock();
 			} else if (ts->status == TRANSACTION_STATUS_IN_PROGRESS) {
 				ts->status = TRANSACTION_STATUS_UNKNOWN;
+				pg_write_barrier(); /* see MtmXidInMVCCSnapshot */
 				ts->csn = MtmAssignCSN();
 				MtmAdjustSubtransactions(ts);
 				MtmUnlock();
@@ -1254,9 +1679,10 @@ MtmVotingCompleted(MtmTransState* ts)
 		&& (ts->participantsMask & ~Mtm->disabledNodeMask & ~ts->votedMask) == 0) /* all live participants voted */
 	{
 		if (ts->isPrepared) {
+			ts->status = TRANSACTION_STATUS_UNKNOWN;
+			pg_write_barrier(); /* see MtmXidInMVCCSnapshot */
 			ts->csn = MtmAssignCSN();
 			ts->votingCompleted = true;
-			ts->status = TRANSACTION_STATUS_UNKNOWN;
 			return true;
 		} else {
 			MTM_LOG2("Transaction %s is considered as prepared (status=%s participants=%llx disabled=%llx, voted=%llx)",
@@ -1267,9 +1693,11 @@ MtmVotingCompleted(MtmTransState* ts)
 				return true;
 			} else if (MtmUseDtm) {
 				ts->votedMask = 0;
+				ts->phaseStartTime = MtmGetSystemTime();
 				Assert(replorigin_session_origin == InvalidRepOriginId);
 				MtmUnlock();
 				SetPreparedTransactionState(ts->gid, MULTIMASTER_PRECOMMITTED);
+				MtmLatencyRecord(MTM_LATENCY_PRECOMMIT, MtmNodeId, ts->phaseStartTime, MtmGetSystemTime());
 				MtmLock(LW_EXCLUSIVE);
 				return false;
 			} else {
@@ -1344,6 +1772,7 @@ Mtm2PCVoting(MtmCurrentTrans* x, MtmTransState* ts)
 		}
 	}
 	x->status = ts->status;
+	MtmLatencyRecord(MTM_LATENCY_VOTING, MtmNodeId, start, MtmGetSystemTime());
 	MTM_LOG3("%d: Result of vote: %d", MyProcPid, MtmTxnStatusMnem[ts->status]);
 }
 
@@ -1390,6 +1819,9 @@ MtmPostPrepareTransaction(MtmCurrentTrans* x)
 		MtmResetTransaction();
 	} else {
 		if (!ts->isLocal)  {
+			timestamp_t now = MtmGetSystemTime();
+			MtmLatencyRecord(MTM_LATENCY_PREPARE, MtmNodeId, ts->phaseStartTime, now);
+			ts->phaseStartTime = now;
 			Mtm2PCVoting(x, ts);
 		} else {
 			ts->status = TRANSACTION_STATUS_UNKNOWN;
@@ -1437,10 +1869,12 @@ MtmPreCommitPreparedTransaction(MtmCurrentTrans* x)
 			ts->votingCompleted = false;
 			ts->votedMask = 0;
 			ts->procno = MyProc->pgprocno;
+			ts->phaseStartTime = MtmGetSystemTime();
 			MTM_LOG2("Coordinator of transaction %s sends MSG_PRECOMMIT", ts->gid);
 			Assert(replorigin_session_origin == InvalidRepOriginId);
 			MtmUnlock();
 			SetPreparedTransactionState(ts->gid, MULTIMASTER_PRECOMMITTED);
+			MtmLatencyRecord(MTM_LATENCY_PRECOMMIT, MtmNodeId, ts->phaseStartTime, MtmGetSystemTime());
 			MtmLock(LW_EXCLUSIVE);
 
 			Mtm2PCVoting(x, ts);
@@ -1550,6 +1984,7 @@ MtmEndTransaction(MtmCurrentTrans* x, bool commit)
 					ts->csn = MtmAssignCSN();
 				}
 				Mtm->lastCsn = ts->csn;
+				pg_write_barrier(); /* see MtmXidInMVCCSnapshot */
 				ts->status = TRANSACTION_STATUS_COMMITTED;
 				MtmAdjustSubtransactions(ts);
 			} else {
@@ -1571,11 +2006,7 @@ MtmEndTransaction(MtmCurrentTrans* x, bool commit)
 			if (ts == NULL) {
 				bool found;
 				Assert(TransactionIdIsValid(x->xid));
-				ts = (MtmTransState*)hash_search(MtmXid2State, &x->xid, HASH_ENTER, &found);
-				if (!found) {
-					ts->isEnqueued = false;
-					ts->isActive = false;
-				}
+				ts = MtmXid2StateEnter(x->xid, &found);
 				ts->status = TRANSACTION_STATUS_ABORTED;
 				ts->isLocal = true;
 				ts->isPrepared = false;
@@ -1622,7 +2053,7 @@ void MtmInitMessage(MtmArbiterMessage* msg, MtmMessageCode code)
 	msg->code = code;
 	msg->disabledNodeMask = Mtm->disabledNodeMask;
 	msg->connectivityMask = SELF_CONNECTIVITY_MASK;
-	msg->oldestSnapshot = Mtm->nodes[MtmNodeId-1].oldestSnapshot;
+	msg->oldestSnapshot = pg_atomic_read_u64(&Mtm->nodes[MtmNodeId-1].oldestSnapshot);
 	msg->lockReq = Mtm->originLockNodeMask != 0;
 	msg->locked = (Mtm->originLockNodeMask|Mtm->inducedLockNodeMask) != 0;
 }
@@ -1633,6 +2064,7 @@ void MtmInitMessage(MtmArbiterMessage* msg, MtmMessageCode code)
  */
 void MtmSendMessage(MtmArbiterMessage* msg)
 {
+	bool wakeup = false;
 	SpinLockAcquire(&Mtm->queueSpinlock);
 	{
 		MtmMessageQueue* mq = Mtm->freeQueue;
@@ -1651,9 +2083,14 @@ void MtmSendMessage(MtmArbiterMessage* msg)
 		if (sendQueue == NULL) {
 			/* signal semaphore only once for the whole list */
 			PGSemaphoreUnlock(&Mtm->sendSemaphore);
+			wakeup = true;
 		}
 	}
 	SpinLockRelease(&Mtm->queueSpinlock);
+	if (wakeup) {
+		/* sender may wait for sockets of peers rather than for semaphore */
+		MtmWakeupSender();
+	}
 }
 
 /*
@@ -1729,15 +2166,13 @@ static void	MtmLoadPreparedTransactions(void)
 	for (i = 0; i < n; i++) {
 		bool found;
 		char const* gid = pxacts[i].gid;
-		MtmTransMap* tm = (MtmTransMap*)hash_search(MtmGid2State, gid, HASH_ENTER, &found);
+		MtmTransMap* tm = MtmGid2StateEnter(gid, &found);
 		if (!found || tm->state == NULL) {
 			TransactionId xid = GetNewTransactionId(false);
-			MtmTransState* ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_ENTER, &found);
+			MtmTransState* ts = MtmXid2StateEnter(xid, &found);
 			MTM_LOG1("Recover prepared transaction %s (%llu) state=%s", gid, (long64)xid, pxacts[i].state_3pc);
 			MyPgXact->xid = InvalidTransactionId; /* dirty hack:((( */
 			Assert(!found);
-			ts->isEnqueued = false;
-			ts->isActive = false;
 			MtmActivateTransaction(ts);
 			ts->status = strcmp(pxacts[i].state_3pc, MULTIMASTER_PRECOMMITTED) == 0 ? TRANSACTION_STATUS_UNKNOWN : TRANSACTION_STATUS_IN_PROGRESS;
 			ts->isLocal = true;
@@ -1864,7 +2299,7 @@ XidStatus MtmExchangeGlobalTransactionStatus(char const* gid, XidStatus new_stat
 
 	Assert(gid[0]);
 	MtmLock(LW_EXCLUSIVE);
-	tm = (MtmTransMap*)hash_search(MtmGid2State, gid, HASH_ENTER, &found);
+	tm = MtmGid2StateEnter(gid, &found);
 	if (found) {
 		old_status = tm->status;
 		if (old_status != TRANSACTION_STATUS_ABORTED) {
@@ -1899,10 +2334,10 @@ csn_t MtmGetTransactionCSN(TransactionId xid)
 {
 	MtmTransState* ts;
 	csn_t csn;
-	MtmLock(LW_SHARED);
+	LWLockId partitionLock = MtmLockXidPartition(xid, LW_SHARED);
 	ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_FIND, NULL);
 	csn = ts ? ts->csn : INVALID_CSN;
-	MtmUnlock();
+	LWLockRelease(partitionLock);
 	return csn;
 }
 
@@ -2258,11 +2693,12 @@ MtmCreateXidMap(void)
 	memset(&info, 0, sizeof(info));
 	info.keysize = sizeof(TransactionId);
 	info.entrysize = sizeof(MtmTransState) + (MtmMaxNodes-1)*sizeof(TransactionId);
+	info.num_partitions = MTM_NUM_PARTITIONS;
 	htab = ShmemInitHash(
 		"MtmXid2State",
 		MTM_HASH_SIZE, MTM_HASH_SIZE,
 		&info,
-		HASH_ELEM | HASH_BLOBS
+		HASH_ELEM | HASH_BLOBS | HASH_PARTITION
 	);
 	return htab;
 }
@@ -2280,11 +2716,12 @@ MtmCreateGidMap(void)
 	memset(&info, 0, sizeof(info));
 	info.keysize = MULTIMASTER_MAX_GID_SIZE;
 	info.entrysize = sizeof(MtmTransMap);
+	info.num_partitions = MTM_NUM_PARTITIONS;
 	htab = ShmemInitHash(
 		"MtmGid2State",
 		MTM_MAP_SIZE, MTM_MAP_SIZE,
 		&info,
-		HASH_ELEM
+		HASH_ELEM | HASH_PARTITION
 	);
 	return htab;
 }
@@ -2362,6 +2799,8 @@ static void MtmLoadLocalTables(void)
  * In case of creating new cluster node using pg_basebackup this file is copied together will
  * all other PostgreSQL files and so new node will know ID of the cluster node from which it
  * is cloned. It is necessary to complete synchronization of new node with the rest of the cluster.
+ * Node populated by mtm.bootstrap_node() has "bootstrapped" mark after node id, so that replication
+ * is not delayed again after restart if multimaster.wait_bootstrap is still set.
  */
 static void MtmCheckControlFile(void)
 {
@@ -2382,19 +2821,47 @@ static void MtmCheckControlFile(void)
 		if (sscanf(sep+1, "%d", &Mtm->donorNodeId) != 1) {
 			MTM_ELOG(FATAL, "File mmts_control doesn't contain node id");
 		}
+		sep = strchr(sep+1, ':');
+		if (sep != NULL && strncmp(sep+1, "bootstrapped", 12) == 0) {
+			Mtm->bootstrapCompleted = true;
+			if (Mtm->bootstrapPending) {
+				MTM_ELOG(LOG, "Node %d is already populated by mtm.bootstrap_node(): ignore multimaster.wait_bootstrap", MtmNodeId);
+				Mtm->bootstrapPending = false;
+			}
+		}
 		fclose(f);
 	} else {
 		if (f != NULL) {
 			fclose(f);
 		}
-		f = fopen(controlFilePath, "w");
-		if (f == NULL) {
-			MTM_ELOG(FATAL, "Failed to create mmts_control file: %m");
-		}
 		Mtm->donorNodeId = MtmNodeId;
-		fprintf(f, "%s:%d\n", MtmClusterName, Mtm->donorNodeId);
+		MtmWriteControlFile();
+	}
+}
+
+/*
+ * Save ID of donor node in multimaster control file.
+ * Besides initialization, it is rewritten when node is populated by mtm.bootstrap_node(),
+ * so file is replaced atomically and durably.
+ */
+void MtmWriteControlFile(void)
+{
+	char controlFilePath[MAXPGPATH];
+	char tmpFilePath[MAXPGPATH];
+	FILE* f;
+	snprintf(controlFilePath, MAXPGPATH, "%s/global/mmts_control", DataDir);
+	snprintf(tmpFilePath, MAXPGPATH, "%s/global/mmts_control.tmp", DataDir);
+	f = fopen(tmpFilePath, "w");
+	if (f == NULL) {
+		MTM_ELOG(ERROR, "Failed to create mmts_control file: %m");
+	}
+	fprintf(f, "%s:%d%s\n", MtmClusterName, Mtm->donorNodeId, Mtm->bootstrapCompleted ? ":bootstrapped" : "");
+	if (fflush(f) != 0 || pg_fsync(fileno(f)) != 0) {
 		fclose(f);
+		MTM_ELOG(ERROR, "Failed to write mmts_control file: %m");
 	}
+	fclose(f);
+	durable_rename(tmpFilePath, controlFilePath, ERROR);
 }
 
 /*
@@ -2414,9 +2881,9 @@ static void MtmInitialize()
 		Mtm->status = MTM_DISABLED; //MTM_INITIALIZATION;
 		Mtm->recoverySlot = 0;
 		Mtm->locks = GetNamedLWLockTranche(MULTIMASTER_NAME);
-		Mtm->csn = MtmGetCurrentTime();
+		HLCInit(&Mtm->clock);
 		Mtm->lastCsn = INVALID_CSN;
-		Mtm->oldestXid = FirstNormalTransactionId;
+		pg_atomic_init_u32(&Mtm->oldestXid, FirstNormalTransactionId);
 		Mtm->nLiveNodes = 0; //MtmNodes;
 		Mtm->nAllNodes = MtmNodes;
 		Mtm->disabledNodeMask =  (((nodemask_t)1 << MtmNodes) - 1);
@@ -2436,24 +2903,27 @@ static void MtmInitialize()
 		Mtm->recoveredLSN = INVALID_LSN;
 		Mtm->nActiveTransactions = 0;
 		Mtm->nRunningTransactions = 0;
+		pg_atomic_init_u32(&Mtm->nVisibilityWaiters, 0);
 		Mtm->votingTransactions = NULL;
 		Mtm->transListHead = NULL;
 		Mtm->transListTail = &Mtm->transListHead;
 		Mtm->activeTransList.next = Mtm->activeTransList.prev = &Mtm->activeTransList;
 		Mtm->nReceivers = 0;
 		Mtm->nSenders = 0;
-		Mtm->timeShift = 0;
 		Mtm->transCount = 0;
 		Mtm->gcCount = 0;
+		Mtm->gcWorkerProcno = -1;
 		Mtm->nConfigChanges = 0;
 		Mtm->recoveryCount = 0;
 		Mtm->localTablesHashLoaded = false;
 		Mtm->preparedTransactionsLoaded = false;
+		Mtm->bootstrapPending = MtmWaitBootstrap;
+		Mtm->bootstrapCompleted = false;
 		Mtm->inject2PCError = 0;
 		Mtm->sendQueue = NULL;
 		Mtm->freeQueue = NULL;
 		for (i = 0; i < MtmNodes; i++) {
-			Mtm->nodes[i].oldestSnapshot = 0;
+			pg_atomic_init_u64(&Mtm->nodes[i].oldestSnapshot, 0);
 			Mtm->nodes[i].disabledNodeMask = 0;
 			Mtm->nodes[i].connectivityMask = (((nodemask_t)1 << MtmNodes) - 1);
 			Mtm->nodes[i].lockGraphUsed = 0;
@@ -2463,11 +2933,19 @@ static void MtmInitialize()
 			Mtm->nodes[i].lastStatusChangeTime = MtmGetSystemTime();
 			Mtm->nodes[i].con = MtmConnections[i];
 			Mtm->nodes[i].flushPos = 0;
-			Mtm->nodes[i].lastHeartbeat = 0;
+			pg_atomic_init_u64(&Mtm->nodes[i].lastHeartbeat, 0);
 			Mtm->nodes[i].restartLSN = INVALID_LSN;
 			Mtm->nodes[i].originId = InvalidRepOriginId;
 			Mtm->nodes[i].timeline = 0;
-			Mtm->nodes[i].nHeartbeats = 0;
+			pg_atomic_init_u64(&Mtm->nodes[i].nHeartbeats, 0);
+			Mtm->nodes[i].receivedLSN = INVALID_LSN;
+			pg_atomic_init_u64(&Mtm->nodes[i].appliedLSN, INVALID_LSN);
+			pg_atomic_init_u64(&Mtm->nodes[i].nAppliedTrans, 0);
+			Mtm->nodes[i].applyRate = 0;
+			Mtm->nodes[i].applyRateCount = 0;
+			Mtm->nodes[i].applyRateTime = 0;
+			Mtm->nodes[i].arbiterQueueSize = 0;
+			Mtm->nodes[i].arbiterSendLatency = 0;
 			Mtm->nodes[i].manualRecovery = false;
 			Mtm->nodes[i].slotDeleted = false;
 		}
@@ -2485,6 +2963,31 @@ static void MtmInitialize()
 	MtmXid2State = MtmCreateXidMap();
 	MtmGid2State = MtmCreateGidMap();
 	MtmLocalTables = MtmCreateLocalTableMap();
+	MtmCSNArray = (MtmCSNSlot*)ShmemInitStruct("MtmCSNArray", sizeof(MtmCSNSlot)*MTM_CSN_ARRAY_SIZE, &found);
+	if (!found) {
+		for (i = 0; i < MTM_CSN_ARRAY_SIZE; i++) {
+			pg_atomic_init_u32(&MtmCSNArray[i].xid, InvalidTransactionId);
+		}
+	}
+	MtmVisibilityWaitXid = (TransactionId*)ShmemInitStruct("MtmVisibilityWaitXid", sizeof(TransactionId)*ProcGlobal->allProcCount, &found);
+	if (!found) {
+		MemSet(MtmVisibilityWaitXid, 0, sizeof(TransactionId)*ProcGlobal->allProcCount);
+	}
+	MtmDeadlockProbes = (MtmDeadlockProbeSlot*)ShmemInitStruct("MtmDeadlockProbes", sizeof(MtmDeadlockProbeSlot)*ProcGlobal->allProcCount, &found);
+	if (!found) {
+		MemSet(MtmDeadlockProbes, 0, sizeof(MtmDeadlockProbeSlot)*ProcGlobal->allProcCount);
+	}
+	MtmApplyWindows = (MtmApplyWindow*)ShmemInitStruct("MtmApplyWindows", sizeof(MtmApplyWindow)*MtmMaxNodes, &found);
+	if (!found) {
+		for (i = 0; i < MtmMaxNodes; i++) {
+			SpinLockInit(&MtmApplyWindows[i].lock);
+			MtmApplyWindows[i].head = MtmApplyWindows[i].tail = 0;
+			MtmApplyWindows[i].lastLocalEnd = INVALID_LSN;
+		}
+	}
+	MtmStreamShmemInit();
+	MtmLatencyShmemInit();
+	MtmSeqShmemInit();
 	MtmDoReplication = true;
 	TM = &MtmTM;
 	LWLockRelease(AddinShmemInitLock);
@@ -2961,6 +3464,19 @@ _PG_init(void)
 		NULL
 	);
 
+	DefineCustomBoolVariable(
+		"multimaster.wait_bootstrap",
+		"Do not start replication until node is populated by mtm.bootstrap_node()",
+		NULL,
+		&MtmWaitBootstrap,
+		false,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
 	DefineCustomBoolVariable(
 		"multimaster.major_node",
 		"Node which forms a majority in case of partitioning in cliques with equal number of nodes",
@@ -2987,6 +3503,21 @@ _PG_init(void)
 		NULL
 	);
 
+	DefineCustomIntVariable(
+		"multimaster.sequence_range",
+		"Number of sequence values leased by node at once when monotonic sequences are enforced",
+		"Node leases range of values above values leased by other nodes and generates them without replication traffic",
+		&MtmSequenceRange,
+		1000,
+		1,
+		INT_MAX,
+		PGC_BACKEND,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
 	DefineCustomBoolVariable(
 		"multimaster.ignore_tables_without_pk",
 		"Do not replicate tables without primary key",
@@ -3053,19 +3584,142 @@ _PG_init(void)
 	);
 
 	DefineCustomBoolVariable(
-		"multimaster.preserve_commit_order",
-		"Transactions from one node will be committed in same order on all nodes",
-		NULL,
-		&MtmPreserveCommitOrder,
+		"multimaster.group_commit",
+		"Flush WAL of transactions prepared by executor workers once per batch of votes",
+		"Executor workers do not wait for flush of PREPARE records: arbiter sender performs single WAL flush before sending collected votes",
+		&MtmGroupCommit,
 		true,
 		PGC_BACKEND,
-		GUC_NO_SHOW_ALL,
+		0,
 		NULL,
 		NULL,
 		NULL
 	);
 
-	DefineCustomBoolVariable(
+	DefineCustomIntVariable(
+		"multimaster.group_commit_window",
+		"Time (microseconds) during which arbiter sender collects votes before flushing WAL and sending them",
+		NULL,
+		&MtmGroupCommitWindow,
+		0,
+		0,
+		USECS_PER_SEC,
+		PGC_BACKEND,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomBoolVariable(
+		"multimaster.parallel_recovery",
+		"Apply transactions received during recovery by executor workers",
+		"Transactions are scheduled according to their write sets, so conflicting transactions are applied in the order of their commit at donor",
+		&MtmParallelRecovery,
+		false,
+		PGC_BACKEND,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomBoolVariable(
+		"multimaster.replication_compression",
+		"Ask WAL senders of other nodes to compress replication messages using pglz",
+		NULL,
+		&MtmReplicationCompression,
+		false,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomBoolVariable(
+		"multimaster.columnar_inserts",
+		"Ask WAL senders of other nodes to transfer consecutive inserts into the same table as columnar batches",
+		"Columns of the batch are delta and dictionary encoded, batch is applied by heap_multi_insert",
+		&MtmColumnarInserts,
+		false,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"multimaster.arbiter_queue_size",
+		"Maximal size of arbiter messages queued for one node (bytes)",
+		"If socket of the node doesn't accept messages and queue exceeds this size, connection is considered to be stalled and is reestablished",
+		&MtmArbiterQueueSize,
+		16*1024*1024,
+		1024*1024,
+		INT_MAX,
+		PGC_SIGHUP,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"multimaster.max_clock_skew",
+		"Maximal allowed skew of clocks of cluster nodes (msec)",
+		"Hybrid logical clock is advanced to timestamps received from other nodes. If remote timestamp is ahead of local time by more than this value, warning is reported. Zero disables the check",
+		&MtmMaxClockSkew,
+		1000,
+		0,
+		INT_MAX,
+		PGC_SIGHUP,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomBoolVariable(
+		"multimaster.stream_large_transactions",
+		"Start apply of transaction larger than spill threshold before it is completely received",
+		NULL,
+		&MtmStreamLargeTransactions,
+		false,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomBoolVariable(
+		"multimaster.dependency_aware_apply",
+		"Schedule applied transactions according to their write sets",
+		"Transactions updating different tuples are applied in parallel, conflicting transactions are applied sequentially by the same worker",
+		&MtmDependencyAwareApply,
+		true,
+		PGC_BACKEND,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomBoolVariable(
+		"multimaster.preserve_commit_order",
+		"Transactions from one node will be committed in same order on all nodes",
+		NULL,
+		&MtmPreserveCommitOrder,
+		true,
+		PGC_BACKEND,
+		GUC_NO_SHOW_ALL,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomBoolVariable(
 		"multimaster.volkswagen_mode",
 		"Pretend to be normal postgres. This means skip some NOTICE's and use local sequences. Default false.",
 		NULL,
@@ -3257,13 +3911,16 @@ _PG_init(void)
 	 * the postmaster process.)	 We'll allocate or attach to the shared
 	 * resources in mtm_shmem_startup().
 	 */
-	RequestAddinShmemSpace(MTM_SHMEM_SIZE + MtmQueueSize);
-	RequestNamedLWLockTranche(MULTIMASTER_NAME, 1 + MtmMaxNodes*2);
+	RequestAddinShmemSpace(MTM_SHMEM_SIZE + MtmQueueSize + MtmStreamShmemSize() + MtmLatencyShmemSize() + MtmSeqShmemSize());
+	RequestNamedLWLockTranche(MULTIMASTER_NAME, 1 + MtmMaxNodes*2 + MTM_NUM_PARTITIONS*2);
+	RequestNamedLWLockTranche(MTM_SEQ_TRANCHE, 1);
 
 	BgwPoolStart(MtmWorkers, MtmPoolConstructor);
 
 	MtmArbiterInitialize();
 
+	RegisterBackgroundWorker(&MtmGcWorker);
+
 	/*
 	 * Install hooks.
 	 */
@@ -3391,6 +4048,16 @@ MtmReplicationMode MtmGetReplicationMode(int nodeId, sig_atomic_t volatile* shut
 		Mtm->preparedTransactionsLoaded = true;
 	}
 
+	/* Do not receive anything until node is populated by mtm.bootstrap_node() */
+	while (Mtm->bootstrapPending)
+	{
+		MtmUnlock();
+		if (*shutdown)
+			return REPLMODE_EXIT;
+		MtmSleep(STATUS_POLL_DELAY);
+		MtmLock(LW_EXCLUSIVE);
+	}
+
 	/* Await until node is connected and both receiver and sender are in clique */
 	while (BIT_CHECK(EFFECTIVE_CONNECTIVITY_MASK, nodeId - 1) ||
 			BIT_CHECK(EFFECTIVE_CONNECTIVITY_MASK, MtmNodeId - 1))
@@ -3628,6 +4295,138 @@ lsn_t MtmGetFlushPosition(int nodeId)
 	return Mtm->nodes[nodeId-1].flushPos;
 }
 
+/*
+ * Find position of transaction in the window of transactions applied in parallel.
+ * Entries are ordered by end LSN, so binary search is used. Returns false if transaction is not tracked.
+ * Window lock should be held.
+ */
+static bool MtmApplyWindowFind(MtmApplyWindow* w, lsn_t endLsn, uint64* pos)
+{
+	uint64 l = w->head, r = w->tail;
+	while (l < r) {
+		uint64 m = (l + r) / 2;
+		lsn_t lsn = w->endLSN[m % MTM_APPLY_WINDOW_SIZE];
+		if (lsn == endLsn) {
+			*pos = m;
+			return true;
+		}
+		if (lsn < endLsn) {
+			l = m + 1;
+		} else {
+			r = m;
+		}
+	}
+	return false;
+}
+
+/*
+ * Move head of the window past completed transactions.
+ * Returns end LSN of the last transaction passed by head (and maximal end of their local commit records)
+ * or INVALID_LSN if head was not moved. Window lock should be held.
+ */
+static lsn_t MtmApplyWindowAdvance(MtmApplyWindow* w, lsn_t* localEnd)
+{
+	lsn_t endLsn = INVALID_LSN;
+	while (w->head < w->tail && w->completed[w->head % MTM_APPLY_WINDOW_SIZE]) {
+		size_t i = w->head++ % MTM_APPLY_WINDOW_SIZE;
+		endLsn = w->endLSN[i];
+		w->lastLocalEnd = Max(w->lastLocalEnd, w->localEnd[i]);
+	}
+	*localEnd = w->lastLocalEnd;
+	return endLsn;
+}
+
+/*
+ * Forget transactions of previous replication session. Called by receiver.
+ */
+void MtmApplyWindowReset(int nodeId)
+{
+	MtmApplyWindow* w = &MtmApplyWindows[nodeId-1];
+	SpinLockAcquire(&w->lock);
+	w->head = w->tail = 0;
+	w->lastLocalEnd = INVALID_LSN;
+	SpinLockRelease(&w->lock);
+}
+
+/*
+ * Register transaction scheduled for parallel recovery. Called by receiver in the order of the stream.
+ * Returns false if the window is full.
+ */
+bool MtmApplyWindowAdd(int nodeId, lsn_t endLsn)
+{
+	MtmApplyWindow* w = &MtmApplyWindows[nodeId-1];
+	bool added = false;
+	SpinLockAcquire(&w->lock);
+	if (w->tail - w->head < MTM_APPLY_WINDOW_SIZE) {
+		size_t i = w->tail % MTM_APPLY_WINDOW_SIZE;
+		Assert(w->head == w->tail || w->endLSN[(w->tail - 1) % MTM_APPLY_WINDOW_SIZE] < endLsn);
+		w->endLSN[i] = endLsn;
+		w->localEnd[i] = INVALID_LSN;
+		w->completed[i] = false;
+		w->tail += 1;
+		added = true;
+	}
+	SpinLockRelease(&w->lock);
+	return added;
+}
+
+bool MtmApplyWindowIsEmpty(int nodeId)
+{
+	MtmApplyWindow* w = &MtmApplyWindows[nodeId-1];
+	bool empty;
+	SpinLockAcquire(&w->lock);
+	empty = w->head == w->tail;
+	SpinLockRelease(&w->lock);
+	return empty;
+}
+
+/*
+ * Check that all transactions preceding this one in the stream are completed.
+ * Not tracked transactions are applied in the order of the stream.
+ */
+bool MtmApplyWindowIsFirst(int nodeId, lsn_t endLsn)
+{
+	MtmApplyWindow* w = &MtmApplyWindows[nodeId-1];
+	uint64 pos;
+	bool first;
+	SpinLockAcquire(&w->lock);
+	first = !MtmApplyWindowFind(w, endLsn, &pos) || pos == w->head;
+	SpinLockRelease(&w->lock);
+	return first;
+}
+
+static void MtmPushLsnMapping(int node_id, lsn_t local_end, lsn_t remote_end)
+{
+	MtmFlushPosition* flushpos = (MtmFlushPosition *) MemoryContextAlloc(TopMemoryContext, sizeof(MtmFlushPosition));
+	flushpos->node_id = node_id;
+	flushpos->local_end = local_end;
+	flushpos->remote_end = remote_end;
+	dlist_push_tail(&MtmLsnMapping, &flushpos->node);
+}
+
+/*
+ * Consider all transactions in the window completed. Called by receiver when executor workers are idle,
+ * so not completed transactions are the ones which failed to apply: they are passed by flush position
+ * in the same way as when receiver applies transactions itself.
+ */
+void MtmApplyWindowCompleteAll(int nodeId)
+{
+	MtmApplyWindow* w = &MtmApplyWindows[nodeId-1];
+	lsn_t endLsn, localEnd;
+	uint64 pos;
+
+	SpinLockAcquire(&w->lock);
+	for (pos = w->head; pos < w->tail; pos++) {
+		w->completed[pos % MTM_APPLY_WINDOW_SIZE] = true;
+	}
+	endLsn = MtmApplyWindowAdvance(w, &localEnd);
+	SpinLockRelease(&w->lock);
+
+	if (endLsn != INVALID_LSN) {
+		MtmPushLsnMapping(nodeId, localEnd, endLsn);
+	}
+}
+
 /**
  * Keep track of progress of WAL writer.
  * We need to notify WAL senders at other nodes which logical records
@@ -3637,21 +4436,37 @@ lsn_t MtmGetFlushPosition(int nodeId)
  * their poistions in local WAL log with current flush position.
  * The records which are flushed to the disk by WAL writer are removed from the list
  * and mapping ing mtm->nodes[].flushPos is updated for this node.
+ * Transactions applied in parallel during recovery are mapped only when all preceding transactions
+ * are completed: the reported position is the end of the contiguous prefix of applied transactions.
+ * Returns end LSN of the applied part of the stream which is added to the mapping or INVALID_LSN.
  */
-void  MtmUpdateLsnMapping(int node_id, lsn_t end_lsn)
+lsn_t MtmUpdateLsnMapping(int node_id, lsn_t end_lsn)
 {
 	dlist_mutable_iter iter;
 	MtmFlushPosition* flushpos;
 	lsn_t local_flush = GetFlushRecPtr();
-	MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
 
 	if (end_lsn != INVALID_LSN) {
-		/* Track commit lsn */
-		flushpos = (MtmFlushPosition *) palloc(sizeof(MtmFlushPosition));
-		flushpos->node_id = node_id;
-		flushpos->local_end = XactLastCommitEnd;
-		flushpos->remote_end = end_lsn;
-		dlist_push_tail(&MtmLsnMapping, &flushpos->node);
+		MtmApplyWindow* w = &MtmApplyWindows[node_id-1];
+		lsn_t local_end = XactLastCommitEnd;
+		uint64 pos;
+
+		SpinLockAcquire(&w->lock);
+		if (MtmApplyWindowFind(w, end_lsn, &pos)) {
+			size_t i = pos % MTM_APPLY_WINDOW_SIZE;
+			w->completed[i] = true;
+			w->localEnd[i] = local_end;
+			end_lsn = MtmApplyWindowAdvance(w, &local_end);
+		} else {
+			/* Commit records of transactions applied by workers are not necessarily flushed yet */
+			local_end = Max(local_end, w->lastLocalEnd);
+		}
+		SpinLockRelease(&w->lock);
+
+		if (end_lsn != INVALID_LSN) {
+			/* Track commit lsn */
+			MtmPushLsnMapping(node_id, local_end, end_lsn);
+		}
 	}
 	MtmLock(LW_EXCLUSIVE);
 	dlist_foreach_modify(iter, &MtmLsnMapping)
@@ -3659,8 +4474,8 @@ void  MtmUpdateLsnMapping(int node_id, lsn_t end_lsn)
 		flushpos = dlist_container(MtmFlushPosition, node, iter.cur);
 		if (flushpos->local_end <= local_flush)
 		{
-			if (Mtm->nodes[node_id-1].flushPos < flushpos->remote_end) {
-				Mtm->nodes[node_id-1].flushPos = flushpos->remote_end;
+			if (Mtm->nodes[flushpos->node_id-1].flushPos < flushpos->remote_end) {
+				Mtm->nodes[flushpos->node_id-1].flushPos = flushpos->remote_end;
 			}
 			dlist_delete(iter.cur);
 			pfree(flushpos);
@@ -3669,7 +4484,7 @@ void  MtmUpdateLsnMapping(int node_id, lsn_t end_lsn)
 		}
 	}
 	MtmUnlock();
-	MemoryContextSwitchTo(old_context);
+	return end_lsn;
 }
 
 
@@ -3920,7 +4735,9 @@ mtm_add_node(PG_FUNCTION_ARGS)
 		Mtm->nodes[nodeId].transDelay = 0;
 		Mtm->nodes[nodeId].lastStatusChangeTime = MtmGetSystemTime();
 		Mtm->nodes[nodeId].flushPos = 0;
-		Mtm->nodes[nodeId].oldestSnapshot = 0;
+		pg_atomic_init_u64(&Mtm->nodes[nodeId].oldestSnapshot, 0);
+		pg_atomic_init_u64(&Mtm->nodes[nodeId].lastHeartbeat, 0);
+		pg_atomic_init_u64(&Mtm->nodes[nodeId].nHeartbeats, 0);
 
 		BIT_SET(Mtm->disabledNodeMask, nodeId);
 		Mtm->nConfigChanges += 1;
@@ -3977,6 +4794,24 @@ mtm_get_snapshot(PG_FUNCTION_ARGS)
 	PG_RETURN_INT64(MtmTx.snapshot);
 }
 
+Datum
+mtm_set_snapshot(PG_FUNCTION_ARGS)
+{
+	MtmSetSnapshot(PG_GETARG_INT64(0));
+	PG_RETURN_VOID();
+}
+
+/*
+ * Block commit of distributed transactions at all nodes until end of current transaction.
+ * Used by mtm.bootstrap_node() to get consistent cut of the cluster.
+ */
+Datum
+mtm_lock_cluster(PG_FUNCTION_ARGS)
+{
+	MtmLockCluster();
+	PG_RETURN_VOID();
+}
+
 
 Datum
 mtm_get_last_csn(PG_FUNCTION_ARGS)
@@ -3990,13 +4825,14 @@ mtm_get_csn(PG_FUNCTION_ARGS)
 	TransactionId xid = PG_GETARG_INT64(0);
 	MtmTransState* ts;
 	csn_t csn = INVALID_CSN;
+	LWLockId partitionLock;
 
-	MtmLock(LW_SHARED);
+	partitionLock = MtmLockXidPartition(xid, LW_SHARED);
 	ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_FIND, NULL);
 	if (ts != NULL) {
 		csn = ts->csn;
 	}
-	MtmUnlock();
+	LWLockRelease(partitionLock);
 
 	return csn;
 }
@@ -4046,7 +4882,7 @@ mtm_get_nodes_state(PG_FUNCTION_ARGS)
 
 	usrfctx->values[7] = Int64GetDatum(Mtm->transCount ? Mtm->nodes[usrfctx->nodeId-1].transDelay/Mtm->transCount : 0);
 	usrfctx->values[8] = TimestampTzGetDatum(time_t_to_timestamptz(Mtm->nodes[usrfctx->nodeId-1].lastStatusChangeTime/USECS_PER_SEC));
-	usrfctx->values[9] = Int64GetDatum(Mtm->nodes[usrfctx->nodeId-1].oldestSnapshot);
+	usrfctx->values[9] = Int64GetDatum(pg_atomic_read_u64(&Mtm->nodes[usrfctx->nodeId-1].oldestSnapshot));
 
 	usrfctx->values[10] = Int32GetDatum(Mtm->nodes[usrfctx->nodeId-1].senderPid);
 	usrfctx->values[11] = TimestampTzGetDatum(time_t_to_timestamptz(Mtm->nodes[usrfctx->nodeId-1].senderStartTime/USECS_PER_SEC));
@@ -4063,7 +4899,18 @@ mtm_get_nodes_state(PG_FUNCTION_ARGS)
 
 	usrfctx->values[14] = CStringGetTextDatum(Mtm->nodes[usrfctx->nodeId-1].con.connStr);
 	usrfctx->values[15] = Int64GetDatum(Mtm->nodes[usrfctx->nodeId-1].connectivityMask);
-	usrfctx->values[16] = Int64GetDatum(Mtm->nodes[usrfctx->nodeId-1].nHeartbeats);
+	usrfctx->values[16] = Int64GetDatum(pg_atomic_read_u64(&Mtm->nodes[usrfctx->nodeId-1].nHeartbeats));
+	usrfctx->values[17] = Int64GetDatum(Mtm->nodes[usrfctx->nodeId-1].receivedLSN);
+	usrfctx->values[18] = Int64GetDatum(pg_atomic_read_u64(&Mtm->nodes[usrfctx->nodeId-1].appliedLSN));
+	lag = (int64)(Mtm->nodes[usrfctx->nodeId-1].receivedLSN - pg_atomic_read_u64(&Mtm->nodes[usrfctx->nodeId-1].appliedLSN));
+	usrfctx->values[19] = Int64GetDatum(lag > 0 ? lag : 0);
+	usrfctx->values[20] = Int64GetDatum(Mtm->nodes[usrfctx->nodeId-1].applyRate);
+	/* Nothing is received from the node itself */
+	usrfctx->nulls[17] = usrfctx->nulls[18] = usrfctx->nulls[19] = usrfctx->nulls[20] = (usrfctx->nodeId == MtmNodeId);
+	usrfctx->values[21] = Int64GetDatum(Mtm->nodes[usrfctx->nodeId-1].arbiterQueueSize);
+	usrfctx->values[22] = Int64GetDatum(Mtm->nodes[usrfctx->nodeId-1].arbiterSendLatency);
+	/* Arbiter doesn't send messages to itself */
+	usrfctx->nulls[21] = usrfctx->nulls[22] = (usrfctx->nodeId == MtmNodeId);
 	usrfctx->nodeId += 1;
 
 	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(usrfctx->desc, usrfctx->values, usrfctx->nulls)));
@@ -4125,11 +4972,12 @@ mtm_get_trans_by_xid(PG_FUNCTION_ARGS)
 	bool	  nulls[Natts_mtm_trans_state] = {false};
 	TransactionId xid = PG_GETARG_INT64(0);
 	MtmTransState* ts;
+	LWLockId partitionLock;
 
-	MtmLock(LW_SHARED);
+	partitionLock = MtmLockXidPartition(xid, LW_SHARED);
 	ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_FIND, NULL);
 	if (ts == NULL) {
-		MtmUnlock();
+		LWLockRelease(partitionLock);
 		PG_RETURN_NULL();
 	}
 
@@ -4147,7 +4995,7 @@ mtm_get_trans_by_xid(PG_FUNCTION_ARGS)
 	values[11] = BoolGetDatum(ts->votingCompleted);
 	values[12] = Int64GetDatum(ts->participantsMask);
 	values[13] = Int64GetDatum(ts->votedMask);
-	MtmUnlock();
+	LWLockRelease(partitionLock);
 
 	get_call_result_type(fcinfo, NULL, &desc);
 	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(desc, values, nulls)));
@@ -4168,20 +5016,22 @@ mtm_get_cluster_state(PG_FUNCTION_ARGS)
 	values[4] = Int64GetDatum(Mtm->originLockNodeMask);
 	values[5] = Int32GetDatum(Mtm->nLiveNodes);
 	values[6] = Int32GetDatum(Mtm->nAllNodes);
-	values[7] = Int32GetDatum((int)Mtm->pool.active);
-	values[8] = Int32GetDatum((int)Mtm->pool.pending);
+	values[7] = Int32GetDatum((int)pg_atomic_read_u32(&Mtm->pool.active));
+	values[8] = Int32GetDatum((int)pg_atomic_read_u32(&Mtm->pool.pending));
 	values[9] = Int64GetDatum(BgwPoolGetQueueSize(&Mtm->pool));
 	values[10] = Int64GetDatum(Mtm->transCount);
-	values[11] = Int64GetDatum(Mtm->timeShift);
+	values[11] = Int64GetDatum(HLCGetShift(&Mtm->clock));
 	values[12] = Int32GetDatum(Mtm->recoverySlot);
 	values[13] = Int64GetDatum(hash_get_num_entries(MtmXid2State));
 	values[14] = Int64GetDatum(hash_get_num_entries(MtmGid2State));
-	values[15] = Int64GetDatum(Mtm->oldestXid);
+	values[15] = Int64GetDatum(pg_atomic_read_u32(&Mtm->oldestXid));
 	values[16] = Int32GetDatum(Mtm->nConfigChanges);
 	values[17] = Int64GetDatum(Mtm->stalledNodeMask);
 	values[18] = Int64GetDatum(Mtm->stoppedNodeMask);
 	values[19] = Int64GetDatum(Mtm->deadNodeMask);
 	values[20] = TimestampTzGetDatum(time_t_to_timestamptz(Mtm->nodes[MtmNodeId-1].lastStatusChangeTime/USECS_PER_SEC));
+	values[21] = Int64GetDatum(pg_atomic_read_u64(&Mtm->clock.maxSkew));
+	values[22] = Int64GetDatum(pg_atomic_read_u64(&Mtm->clock.nSkewViolations));
 
 	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(desc, values, nulls)));
 }
@@ -4416,28 +5266,21 @@ Datum mtm_inject_2pc_error(PG_FUNCTION_ARGS)
  */
 
 /*
- * Execute statement with specified parameters and check its result
+ * Extract error message from result of failed utility statement
  */
-static bool MtmRunUtilityStmt(PGconn* conn, char const* sql, char **errmsg)
+static char* MtmUtilityErrorMessage(PGresult* result)
 {
-	PGresult *result = PQexec(conn, sql);
-	int status = PQresultStatus(result);
+	char *errstr = PQresultErrorMessage(result);
+	int errlen = strlen(errstr);
+	char *errmsg = NULL;
 
-	bool ret = status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK;
+	if (errlen > 9) {
+		errmsg = palloc0(errlen);
 
-	if (!ret) {
-		char *errstr = PQresultErrorMessage(result);
-		int errlen = strlen(errstr);
-		if (errlen > 9) {
-			*errmsg = palloc0(errlen);
-
-			/* Strip "ERROR:  " from beginning and "\n" from end of error string */
-			strncpy(*errmsg, errstr + 8, errlen - 1 - 8);
-		}
+		/* Strip "ERROR:  " from beginning and "\n" from end of error string */
+		strncpy(errmsg, errstr + 8, errlen - 1 - 8);
 	}
-
-	PQclear(result);
-	return ret;
+	return errmsg;
 }
 
 static void
@@ -4475,94 +5318,260 @@ MtmNoticeReceiver(void *i, const PGresult *res)
 	pfree(stripped_notice);
 }
 
+/*
+ * Connections used to broadcast utility statements.
+ * libpq connection can not be shared between processes, so each backend keeps its own pool:
+ * connection to the node is established on first broadcast and reused by other broadcasts of the same
+ * transaction until it is broken or connection string of the node is changed. Connections are closed
+ * at the end of transaction, so idle backends do not hold connections to all nodes.
+ */
+typedef struct
+{
+	PGconn* conn;
+	char*   connStr;  /* connection string used to establish connection */
+	int     node;     /* index of node, passed to notice receiver */
+} MtmBroadcastConnection;
+
+static MtmBroadcastConnection* MtmBroadcastConnections;
+
+static void MtmCloseBroadcastConnection(int node)
+{
+	MtmBroadcastConnection* bc = &MtmBroadcastConnections[node];
+
+	if (bc->conn != NULL) {
+		PQfinish(bc->conn);
+		bc->conn = NULL;
+	}
+	if (bc->connStr != NULL) {
+		pfree(bc->connStr);
+		bc->connStr = NULL;
+	}
+}
+
+static void MtmReleaseBroadcastConnections(void)
+{
+	int i;
+	if (MtmBroadcastConnections != NULL) {
+		for (i = 0; i < MtmMaxNodes; i++) {
+			MtmCloseBroadcastConnection(i);
+		}
+	}
+}
+
+/*
+ * Get connection to the node from the pool or establish new one.
+ * Caller should check status of returned connection.
+ */
+static PGconn* MtmGetBroadcastConnection(int node)
+{
+	MtmBroadcastConnection* bc;
+	char* connStr = psprintf("%s application_name=%s", Mtm->nodes[node].con.connStr, MULTIMASTER_BROADCAST_SERVICE);
+
+	if (MtmBroadcastConnections == NULL) {
+		MtmBroadcastConnections = (MtmBroadcastConnection*)MemoryContextAllocZero(TopMemoryContext, sizeof(MtmBroadcastConnection)*MtmMaxNodes);
+	}
+	bc = &MtmBroadcastConnections[node];
+	if (bc->conn != NULL) {
+		/*
+		 * PQconsumeInput detects connections closed by the server (for example because of node restart)
+		 * while they were idle in the pool.
+		 */
+		if (strcmp(bc->connStr, connStr) == 0
+			&& PQconsumeInput(bc->conn)
+			&& PQstatus(bc->conn) == CONNECTION_OK
+			&& PQtransactionStatus(bc->conn) == PQTRANS_IDLE)
+		{
+			pfree(connStr);
+			return bc->conn;
+		}
+		MTM_LOG1("Reestablish broadcast connection to node %d", node+1);
+		MtmCloseBroadcastConnection(node);
+	}
+	bc->conn = PQconnectdb_safe(connStr, 0);
+	bc->connStr = MemoryContextStrdup(TopMemoryContext, connStr);
+	bc->node = node;
+	PQsetNoticeReceiver(bc->conn, MtmNoticeReceiver, &bc->node);
+	pfree(connStr);
+	return bc->conn;
+}
+
+/*
+ * Remember failure of utility statement at the node. Error message is reported for the first failed node.
+ */
+static void MtmUtilityStmtFailed(int node, bool* failed, int* failedNode, char** errmsg, char* msg)
+{
+	if (failed != NULL) {
+		failed[node] = true;
+	}
+	if (*failedNode < 0) {
+		*failedNode = node;
+		*errmsg = msg;
+	}
+}
+
+/*
+ * Send statement to all nodes at once and wait until it is completed at all of them,
+ * so latency of the step is determined by the slowest node rather than by sum of latencies of all nodes.
+ * If failed is not NULL, statement is not sent to nodes at which previous steps have failed
+ * and nodes at which this statement fails are marked in it.
+ * Returns index of first node at which statement has failed or -1 if it succeeded everywhere.
+ */
+static int MtmRunUtilityStmt(PGconn** conns, int nNodes, char const* sql, bool* failed, char **errmsg)
+{
+	bool* busy = (bool*)palloc0(sizeof(bool)*nNodes);
+	int nBusy = 0;
+	int failedNode = -1;
+	int i;
+
+	for (i = 0; i < nNodes; i++)
+	{
+		if (conns[i] != NULL && (failed == NULL || !failed[i]))
+		{
+			if (PQsendQuery(conns[i], sql)) {
+				busy[i] = true;
+				nBusy += 1;
+			} else {
+				MtmUtilityStmtFailed(i, failed, &failedNode, errmsg, pstrdup(PQerrorMessage(conns[i])));
+			}
+		}
+	}
+	while (nBusy != 0)
+	{
+		fd_set set;
+		struct timeval tv;
+		int max_fd = 0;
+		int rc;
+
+		FD_ZERO(&set);
+		for (i = 0; i < nNodes; i++)
+		{
+			if (busy[i]) {
+				int sd = PQsocket(conns[i]);
+				FD_SET(sd, &set);
+				if (sd > max_fd) {
+					max_fd = sd;
+				}
+			}
+		}
+		/* Wake up periodically to handle interrupts */
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		rc = select(max_fd+1, &set, NULL, NULL, &tv);
+		if (rc < 0 && errno != EINTR) {
+			MTM_ELOG(ERROR, "Failed to wait for broadcast results: %s", strerror(errno));
+		}
+		CHECK_FOR_INTERRUPTS();
+		if (rc <= 0) {
+			continue;
+		}
+		for (i = 0; i < nNodes; i++)
+		{
+			if (!busy[i] || !FD_ISSET(PQsocket(conns[i]), &set)) {
+				continue;
+			}
+			if (!PQconsumeInput(conns[i])) {
+				MtmUtilityStmtFailed(i, failed, &failedNode, errmsg, pstrdup(PQerrorMessage(conns[i])));
+				busy[i] = false;
+				nBusy -= 1;
+				continue;
+			}
+			while (!PQisBusy(conns[i]))
+			{
+				PGresult* result = PQgetResult(conns[i]);
+				int status;
+
+				if (result == NULL) {
+					busy[i] = false;
+					nBusy -= 1;
+					break;
+				}
+				status = PQresultStatus(result);
+				if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+					MtmUtilityStmtFailed(i, failed, &failedNode, errmsg, MtmUtilityErrorMessage(result));
+				}
+				PQclear(result);
+			}
+		}
+	}
+	pfree(busy);
+	return failedNode;
+}
+
+/*
+ * Execute statement at all enabled nodes in separate transactions.
+ * If ignoreError is true, failure at one node doesn't affect execution of the statement at other nodes,
+ * otherwise transactions are rolled back at all nodes and error is reported.
+ */
 static void MtmBroadcastUtilityStmt(char const* sql, bool ignoreError, int forceOnNode)
 {
 	int i = 0;
 	nodemask_t disabledNodeMask = Mtm->disabledNodeMask;
 	int failedNode = -1;
 	char const* errorMsg = NULL;
-	PGconn **conns = palloc0(sizeof(PGconn*)*Mtm->nAllNodes);
-	char* utility_errmsg;
 	int nNodes = Mtm->nAllNodes;
+	PGconn **conns = palloc0(sizeof(PGconn*)*nNodes);
+	bool* failed = palloc0(sizeof(bool)*nNodes);
+	char* utility_errmsg = NULL;
 
 	for (i = 0; i < nNodes; i++)
 	{
 		if (!BIT_CHECK(disabledNodeMask, i) || (i + 1 == forceOnNode))
 		{
-			conns[i] = PQconnectdb_safe(psprintf("%s application_name=%s", Mtm->nodes[i].con.connStr, MULTIMASTER_BROADCAST_SERVICE), 0);
+			conns[i] = MtmGetBroadcastConnection(i);
 			if (PQstatus(conns[i]) != CONNECTION_OK)
 			{
-				if (ignoreError)
+				char* connErrMsg = pstrdup(PQerrorMessage(conns[i]));
+				MtmCloseBroadcastConnection(i);
+				conns[i] = NULL;
+				if (!ignoreError)
 				{
-					PQfinish(conns[i]);
-					conns[i] = NULL;
-				} else {
-					failedNode = i;
-					do {
-						PQfinish(conns[i]);
-					} while (--i >= 0);
-					MTM_ELOG(ERROR, "Failed to establish connection '%s' to node %d, error = %s", Mtm->nodes[failedNode].con.connStr, failedNode+1, PQerrorMessage(conns[i]));
+					MTM_ELOG(ERROR, "Failed to establish connection '%s' to node %d, error = %s", Mtm->nodes[i].con.connStr, i+1, connErrMsg);
 				}
 			}
-			PQsetNoticeReceiver(conns[i], MtmNoticeReceiver, &i);
 		}
 	}
-	Assert(i == nNodes);
 
-	for (i = 0; i < nNodes; i++)
+	failedNode = MtmRunUtilityStmt(conns, nNodes, "BEGIN TRANSACTION", failed, &utility_errmsg);
+	if (failedNode >= 0)
 	{
-		if (conns[i])
+		errorMsg = psprintf(MTM_TAG "Failed to start transaction at node %d", failedNode+1);
+	}
+	if (failedNode < 0 || ignoreError)
+	{
+		/* Nodes at which transaction was not started are skipped */
+		failedNode = MtmRunUtilityStmt(conns, nNodes, sql, failed, &utility_errmsg);
+		if (failedNode >= 0)
 		{
-			if (!MtmRunUtilityStmt(conns[i], "BEGIN TRANSACTION", &utility_errmsg) && !ignoreError)
-			{
-				errorMsg = MTM_TAG "Failed to start transaction at node %d";
-				failedNode = i;
-				break;
-			}
-			if (!MtmRunUtilityStmt(conns[i], sql, &utility_errmsg) && !ignoreError)
-			{
-				if (i + 1 == MtmNodeId)
-					errorMsg = psprintf(MTM_TAG "%s", utility_errmsg);
-				else
-				{
-					MTM_ELOG(ERROR, "%s", utility_errmsg);
-					errorMsg = MTM_TAG "Failed to run command at node %d";
-				}
-
-				failedNode = i;
-				break;
-			}
+			errorMsg = utility_errmsg != NULL
+				? psprintf(MTM_TAG "%s", utility_errmsg)
+				: psprintf(MTM_TAG "Failed to run command at node %d", failedNode+1);
 		}
 	}
 	if (failedNode >= 0 && !ignoreError)
+	{
+		MtmRunUtilityStmt(conns, nNodes, "ROLLBACK TRANSACTION", NULL, &utility_errmsg);
+	}
+	else
 	{
 		for (i = 0; i < nNodes; i++)
 		{
-			if (conns[i])
-			{
-				MtmRunUtilityStmt(conns[i], "ROLLBACK TRANSACTION", &utility_errmsg);
-			}
-		}
-	} else {
-		for (i = 0; i < nNodes; i++)
-		{
-			if (conns[i] && !MtmRunUtilityStmt(conns[i], "COMMIT TRANSACTION", &utility_errmsg) && !ignoreError)
+			if (failed[i])
 			{
-				errorMsg = MTM_TAG "Commit failed at node %d";
-				failedNode = i;
+				MTM_ELOG(WARNING, "Failed to run '%s' at node %d", sql, i+1);
 			}
 		}
-	}
-	for (i = 0; i < nNodes; i++)
-	{
-		if (conns[i])
+		/* COMMIT rolls back transactions at nodes where statement has failed */
+		failedNode = MtmRunUtilityStmt(conns, nNodes, "COMMIT TRANSACTION", NULL, &utility_errmsg);
+		if (failedNode >= 0)
 		{
-			PQfinish(conns[i]);
+			errorMsg = psprintf(MTM_TAG "Commit failed at node %d", failedNode+1);
 		}
 	}
+	pfree(failed);
+	pfree(conns);
 	if (!ignoreError && failedNode >= 0)
 	{
-		elog(ERROR, errorMsg, failedNode+1);
+		elog(ERROR, "%s", errorMsg);
 	}
 }
 
@@ -4612,8 +5621,10 @@ static bool MtmTwoPhaseCommit(MtmCurrentTrans* x)
 					FinishPreparedTransaction(x->gid, false);
 					MTM_ELOG(ERROR, "Transaction %s (%llu) is aborted on node %d. Check its log to see error details.", x->gid, (long64)x->xid, ts->abortedByNode);
 				} else {
+					timestamp_t start = MtmGetSystemTime();
 					TXFINISH("%s COMMIT, MtmTwoPhase", x->gid);
 					FinishPreparedTransaction(x->gid, true);
+					MtmLatencyRecord(MTM_LATENCY_COMMIT_PREPARED, MtmNodeId, start, MtmGetSystemTime());
 					MTM_TXTRACE(x, "MtmTwoPhaseCommit Committed");
 					MTM_LOG2("Distributed transaction %s (%lld) is committed at %lld with LSN=%lld", x->gid, (long64)x->xid, MtmGetCurrentTime(), (long64)GetXLogInsertRecPtr());
 				}
@@ -5376,14 +6387,29 @@ MtmExecutorFinish(QueryDesc *queryDesc)
 	}
 }
 
+/*
+ * Values of sequences are taken from ranges leased by this node (see seqrange.c).
+ * If there is no room to track the sequence, its position is replicated with each value.
+ */
 static void MtmSeqNextvalHook(Oid seqid, int64 next)
 {
 	if (MtmMonotonicSequences)
 	{
-		MtmSeqPosition pos;
-		pos.seqid = seqid;
-		pos.next = next;
-		LogLogicalMessage("N", (char*)&pos, sizeof(pos), true);
+		int64 start;
+		if (MtmSeqNextval(seqid, next, &start))
+		{
+			if (start != 0)
+			{
+				AdjustSequence(seqid, start);
+			}
+		}
+		else
+		{
+			MtmSeqPosition pos;
+			pos.seqid = seqid;
+			pos.next = next;
+			LogLogicalMessage("N", (char*)&pos, sizeof(pos), true);
+		}
 	}
 }
 
@@ -5393,13 +6419,28 @@ static void MtmSeqNextvalHook(Oid seqid, int64 next)
  * -------------------------------------------
  */
 
-void MtmExecute(void* work, int size)
+void MtmExecute(void* work, int size, BgwPoolWriteSet* ws)
 {
+	BgwPoolFragment fragment;
+	fragment.data = work;
+	fragment.size = size;
+	MtmExecuteFragments(&fragment, 1, ws);
+}
+
+void MtmExecuteFragments(BgwPoolFragment* fragments, int nFragments, BgwPoolWriteSet* ws)
+{
+	static BgwPoolWriteSet barrier = { true, 0 };
+
 	if (Mtm->status == MTM_RECOVERY) {
-		/* During recovery apply changes sequentially to preserve commit order */
-		MtmExecutor(work, size);
+		if (MtmParallelRecovery) {
+			/* Order of all transactions applied during recovery is controlled by their write sets */
+			BgwPoolScheduleExecuteFragments(&Mtm->pool, fragments, nFragments, ws != NULL ? ws : &barrier);
+		} else {
+			/* During recovery apply changes sequentially to preserve commit order */
+			BgwPoolExecuteFragmentsInline(&Mtm->pool, fragments, nFragments);
+		}
 	} else {
-		BgwPoolExecute(&Mtm->pool, work, size);
+		BgwPoolScheduleExecuteFragments(&Mtm->pool, fragments, nFragments, MtmDependencyAwareApply ? ws : NULL);
 	}
 }
 
@@ -5413,14 +6454,36 @@ MtmPoolConstructor(void)
  * -------------------------------------------
  * Deadlock detection
  * -------------------------------------------
+ * Distributed deadlocks are detected by chasing edges of global wait-for graph (Chandy-Misra-Haas algorithm).
+ * Backend waiting for lock longer than deadlock_timeout finds transactions which it transitively waits for at this node.
+ * Those of them which are blocked by other nodes (coordinator waits for votes of participants, replica waits for
+ * decision of coordinator) are reported to these nodes by MSG_DEADLOCK_PROBE arbiter messages. Node receiving probe
+ * continues the walk in its own lock graph and forwards probe further, until it either reaches the initiator
+ * (and MSG_DEADLOCK is sent to the node of the waiting backend) or dies out.
+ * So lock graphs are not shipped between nodes and deadlock detection doesn't write WAL.
+ * Local lock graph is still saved in shared memory for mtm_dump_lock_graph().
+ * -------------------------------------------
  */
 
+#define MTM_MAX_DEADLOCK_PROBE_HOPS 64  /* probe is dropped after visiting this number of nodes */
+#define MTM_DEADLOCK_PROBE_HISTORY  256 /* number of recently handled probes remembered to suppress duplicates */
+
+/*
+ * Local lock graph: sequences of waiting transaction, transactions holding conflicting locks
+ * and terminating zero GTID (see MtmSerializeLock). Local XIDs are stored in parallel array.
+ */
+typedef struct
+{
+	ByteBuffer gtids;
+	ByteBuffer xids;
+} MtmLockGraph;
+
 static void
 MtmGetGtid(TransactionId xid, GlobalTransactionId* gtid)
 {
 	MtmTransState* ts;
+	LWLockId partitionLock = MtmLockXidPartition(xid, LW_SHARED);
 
-	MtmLock(LW_SHARED);
 	ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_FIND, NULL);
 	if (ts != NULL) {
 		*gtid = ts->gtid;
@@ -5428,14 +6491,20 @@ MtmGetGtid(TransactionId xid, GlobalTransactionId* gtid)
 		gtid->node = MtmNodeId;
 		gtid->xid = xid;
 	}
-	MtmUnlock();
+	LWLockRelease(partitionLock);
 }
 
+static void
+MtmLockGraphAppend(MtmLockGraph* graph, GlobalTransactionId* gtid, TransactionId xid)
+{
+	ByteBufferAppend(&graph->gtids, gtid, sizeof(*gtid));
+	ByteBufferAppend(&graph->xids, &xid, sizeof(xid));
+}
 
 static void
 MtmSerializeLock(PROCLOCK* proclock, void* arg)
 {
-	ByteBuffer* buf = (ByteBuffer*)arg;
+	MtmLockGraph* graph = (MtmLockGraph*)arg;
 	LOCK* lock = proclock->tag.myLock;
 	PGPROC* proc = proclock->tag.myProc;
 	GlobalTransactionId gtid;
@@ -5451,7 +6520,7 @@ MtmSerializeLock(PROCLOCK* proclock, void* arg)
 
 			MtmGetGtid(srcPgXact->xid, &gtid);	/* waiting transaction */
 
-			ByteBufferAppend(buf, &gtid, sizeof(gtid));
+			MtmLockGraphAppend(graph, &gtid, srcPgXact->xid);
 
 			proclock = (PROCLOCK *) SHMQueueNext(procLocks, procLocks,
 												 offsetof(PROCLOCK, lockLink));
@@ -5467,7 +6536,7 @@ MtmSerializeLock(PROCLOCK* proclock, void* arg)
 							{
 								MTM_LOG3("%d: %u(%u) waits for %u(%u)", MyProcPid, srcPgXact->xid, proc->pid, dstPgXact->xid, proclock->tag.myProc->pid);
 								MtmGetGtid(dstPgXact->xid, &gtid); /* transaction holding lock */
-								ByteBufferAppend(buf, &gtid, sizeof(gtid));
+								MtmLockGraphAppend(graph, &gtid, dstPgXact->xid);
 								break;
 							}
 						}
@@ -5478,7 +6547,289 @@ MtmSerializeLock(PROCLOCK* proclock, void* arg)
 			}
 			gtid.node = 0;
 			gtid.xid = 0;
-			ByteBufferAppend(buf, &gtid, sizeof(gtid)); /* end of lock owners list */
+			MtmLockGraphAppend(graph, &gtid, InvalidTransactionId); /* end of lock owners list */
+		}
+	}
+}
+
+/*
+ * Collect local lock graph. Backend performing deadlock check already holds all lock manager partition locks,
+ * other callers should ask to obtain them.
+ */
+static void
+MtmBuildLockGraph(MtmLockGraph* graph, bool lockPartitions)
+{
+	int i;
+
+	ByteBufferAlloc(&graph->gtids);
+	ByteBufferAlloc(&graph->xids);
+	if (lockPartitions) {
+		for (i = 0; i < NUM_LOCK_PARTITIONS; i++) {
+			LWLockAcquire(LockHashPartitionLockByIndex(i), LW_SHARED);
+		}
+	}
+	EnumerateLocks(MtmSerializeLock, graph);
+	if (lockPartitions) {
+		for (i = NUM_LOCK_PARTITIONS; --i >= 0;) {
+			LWLockRelease(LockHashPartitionLockByIndex(i));
+		}
+	}
+	/* Graph is not replicated any more, but is still available for diagnostic */
+	MtmUpdateLockGraph(MtmNodeId, graph->gtids.data, graph->gtids.used);
+}
+
+static void
+MtmFreeLockGraph(MtmLockGraph* graph)
+{
+	ByteBufferFree(&graph->gtids);
+	ByteBufferFree(&graph->xids);
+}
+
+static bool
+MtmIsReachedTransaction(GlobalTransactionId* gtids, int* reached, int nReached, GlobalTransactionId* gtid)
+{
+	int i;
+	for (i = 0; i < nReached; i++) {
+		if (EQUAL_GTID(gtids[reached[i]], *gtid)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Find transactions which are transitively waited by "target" transaction at this node.
+ * Indexes of their entries in the lock graph are returned in "reached" (target itself is not included).
+ * Returns true if "initiator" is reached, which means deadlock.
+ */
+static bool
+MtmFindWaitedTransactions(MtmLockGraph* graph, GlobalTransactionId* target, GlobalTransactionId* initiator, int** reached, int* nReached)
+{
+	GlobalTransactionId* gtids = (GlobalTransactionId*)graph->gtids.data;
+	int n = graph->gtids.used / sizeof(GlobalTransactionId);
+	bool changed = true;
+	int i;
+
+	*reached = (int*)palloc(Max(n, 1)*sizeof(int));
+	*nReached = 0;
+
+	while (changed) {
+		changed = false;
+		for (i = 0; i < n; i++) {
+			bool waitedByTarget = EQUAL_GTID(gtids[i], *target) || MtmIsReachedTransaction(gtids, *reached, *nReached, &gtids[i]);
+			while (gtids[++i].node != 0) {
+				if (waitedByTarget
+					&& !EQUAL_GTID(gtids[i], *target)
+					&& !MtmIsReachedTransaction(gtids, *reached, *nReached, &gtids[i]))
+				{
+					if (EQUAL_GTID(gtids[i], *initiator)) {
+						return true;
+					}
+					(*reached)[(*nReached)++] = i;
+					changed = true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+static bool
+MtmIsWaitingForLocalLock(MtmLockGraph* graph, GlobalTransactionId* gtid)
+{
+	GlobalTransactionId* gtids = (GlobalTransactionId*)graph->gtids.data;
+	int n = graph->gtids.used / sizeof(GlobalTransactionId);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (EQUAL_GTID(gtids[i], *gtid)) {
+			return true;
+		}
+		while (gtids[++i].node != 0);
+	}
+	return false;
+}
+
+/*
+ * Find local XID of global transaction. Should not be called by backend performing deadlock check,
+ * because it can not wait for MtmLock while holding lock manager partition locks.
+ */
+static TransactionId
+MtmGetLocalXid(MtmLockGraph* graph, GlobalTransactionId* gtid)
+{
+	GlobalTransactionId* gtids = (GlobalTransactionId*)graph->gtids.data;
+	TransactionId* xids = (TransactionId*)graph->xids.data;
+	int n = graph->gtids.used / sizeof(GlobalTransactionId);
+	TransactionId xid = InvalidTransactionId;
+	MtmL2List* l;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (EQUAL_GTID(gtids[i], *gtid)) {
+			return xids[i];
+		}
+	}
+	if (gtid->node == MtmNodeId) {
+		return gtid->xid;
+	}
+	MtmLock(LW_SHARED);
+	for (l = Mtm->activeTransList.next; l != &Mtm->activeTransList; l = l->next) {
+		MtmTransState* ts = MtmGetActiveTransaction(l);
+		if (EQUAL_GTID(ts->gtid, *gtid)) {
+			xid = ts->xid;
+			break;
+		}
+	}
+	MtmUnlock();
+	return xid;
+}
+
+/*
+ * Nodes which block 2PC of the transaction: coordinator waits for votes of participants and
+ * replica waits for decision of coordinator. Transaction state is inspected without MtmLock,
+ * because backend performing deadlock check can not wait for it. Stale information can only cause
+ * extra or missed probe, which is corrected by the next round of detection.
+ */
+static nodemask_t
+MtmGetBlockingNodes(TransactionId xid)
+{
+	MtmTransState* ts;
+	nodemask_t mask = 0;
+	LWLockId partitionLock = MtmLockXidPartition(xid, LW_SHARED);
+
+	ts = (MtmTransState*)hash_search(MtmXid2State, &xid, HASH_FIND, NULL);
+	if (ts != NULL && ts->isActive) {
+		if (ts->gtid.node == MtmNodeId) {
+			mask = ts->participantsMask;
+		} else {
+			BIT_SET(mask, ts->gtid.node-1);
+		}
+	}
+	LWLockRelease(partitionLock);
+	return mask & ~Mtm->disabledNodeMask & ~((nodemask_t)1 << (MtmNodeId-1));
+}
+
+static void
+MtmSendDeadlockProbe(MtmArbiterMessage* probe, GlobalTransactionId* gtid, TransactionId xid)
+{
+	nodemask_t mask = MtmGetBlockingNodes(xid);
+	int i;
+
+	for (i = 0; mask != 0; i++, mask >>= 1) {
+		if (mask & 1) {
+			probe->probeTarget = *gtid;
+			probe->node = i+1;
+			MTM_LOG2("Send deadlock probe for %d:%llu waiting for %d:%llu to node %d",
+					 probe->probeInitiator.node, (long64)probe->probeInitiator.xid, gtid->node, (long64)gtid->xid, i+1);
+			MtmSendMessage(probe);
+		}
+	}
+}
+
+/*
+ * Send probes for transactions reached in the local lock graph which are not waiting for local locks
+ */
+static void
+MtmSendDeadlockProbes(MtmArbiterMessage* probe, MtmLockGraph* graph, int* reached, int nReached)
+{
+	GlobalTransactionId* gtids = (GlobalTransactionId*)graph->gtids.data;
+	TransactionId* xids = (TransactionId*)graph->xids.data;
+	int i;
+
+	for (i = 0; i < nReached; i++) {
+		if (!MtmIsWaitingForLocalLock(graph, &gtids[reached[i]])) {
+			MtmSendDeadlockProbe(probe, &gtids[reached[i]], xids[reached[i]]);
+		}
+	}
+}
+
+/*
+ * Handle probe received by arbiter: continue walk of wait-for graph from the target transaction
+ */
+void
+MtmHandleDeadlockProbe(MtmArbiterMessage* msg)
+{
+	static struct {
+		GlobalTransactionId initiator;
+		GlobalTransactionId target;
+		csn_t round;
+	} history[MTM_DEADLOCK_PROBE_HISTORY];
+	static int historyPos;
+
+	MtmLockGraph graph;
+	MtmArbiterMessage probe;
+	int* reached;
+	int nReached;
+	bool hasDeadlock;
+	int i;
+
+	if (msg->probeHops > MTM_MAX_DEADLOCK_PROBE_HOPS) {
+		return;
+	}
+	for (i = 0; i < MTM_DEADLOCK_PROBE_HISTORY; i++) {
+		if (history[i].round == msg->csn
+			&& EQUAL_GTID(history[i].initiator, msg->probeInitiator)
+			&& EQUAL_GTID(history[i].target, msg->probeTarget))
+		{
+			return;
+		}
+	}
+	history[historyPos].initiator = msg->probeInitiator;
+	history[historyPos].target = msg->probeTarget;
+	history[historyPos].round = msg->csn;
+	historyPos = (historyPos + 1) % MTM_DEADLOCK_PROBE_HISTORY;
+
+	MtmBuildLockGraph(&graph, true);
+	hasDeadlock = MtmFindWaitedTransactions(&graph, &msg->probeTarget, &msg->probeInitiator, &reached, &nReached);
+	if (!hasDeadlock) {
+		MtmInitMessage(&probe, MSG_DEADLOCK_PROBE);
+		probe.csn = msg->csn;
+		probe.probeInitiator = msg->probeInitiator;
+		probe.probeNode = msg->probeNode;
+		probe.probeHops = msg->probeHops + 1;
+		if (!MtmIsWaitingForLocalLock(&graph, &msg->probeTarget)) {
+			TransactionId xid = MtmGetLocalXid(&graph, &msg->probeTarget);
+			if (TransactionIdIsValid(xid)) {
+				MtmSendDeadlockProbe(&probe, &msg->probeTarget, xid);
+			}
+		}
+		MtmSendDeadlockProbes(&probe, &graph, reached, nReached);
+	}
+	pfree(reached);
+	MtmFreeLockGraph(&graph);
+
+	if (hasDeadlock) {
+		MTM_ELOG(LOG, "Distributed deadlock of transaction %d:%llu is detected by probe from node %d",
+				 msg->probeInitiator.node, (long64)msg->probeInitiator.xid, msg->node);
+		msg->code = MSG_DEADLOCK;
+		if (msg->probeNode == MtmNodeId) {
+			MtmHandleDeadlock(msg);
+		} else {
+			MtmInitMessage(&probe, MSG_DEADLOCK);
+			probe.csn = msg->csn;
+			probe.probeInitiator = msg->probeInitiator;
+			probe.probeNode = msg->probeNode;
+			probe.probeHops = msg->probeHops;
+			probe.node = msg->probeNode;
+			MtmSendMessage(&probe);
+		}
+	}
+}
+
+/*
+ * Handle deadlock report: mark the waiting backend, deadlock is reported to it by the next check
+ */
+void
+MtmHandleDeadlock(MtmArbiterMessage* msg)
+{
+	int i;
+	for (i = 0; i < ProcGlobal->allProcCount; i++) {
+		MtmDeadlockProbeSlot* slot = &MtmDeadlockProbes[i];
+		if (EQUAL_GTID(slot->gtid, msg->probeInitiator)
+			&& (slot->round == msg->csn || slot->prevRound == msg->csn))
+		{
+			slot->detected = true;
+			SetLatch(&ProcGlobal->allProcs[i].procLatch);
 		}
 	}
 }
@@ -5488,41 +6839,45 @@ MtmDetectGlobalDeadLockForXid(TransactionId xid)
 {
 	bool hasDeadlock = false;
 	if (TransactionIdIsValid(xid)) {
-		ByteBuffer buf;
-		MtmGraph graph;
+		MtmDeadlockProbeSlot* slot = &MtmDeadlockProbes[MyProc->pgprocno];
 		GlobalTransactionId gtid;
-		int i;
-
-		ByteBufferAlloc(&buf);
-		EnumerateLocks(MtmSerializeLock, &buf);
 
-		Assert(replorigin_session_origin == InvalidRepOriginId);
-		XLogFlush(LogLogicalMessage("L", buf.data, buf.used, false));
-
-		MtmGraphInit(&graph);
-		MtmGraphAdd(&graph, (GlobalTransactionId*)buf.data, buf.used/sizeof(GlobalTransactionId));
-		ByteBufferFree(&buf);
-		for (i = 0; i < Mtm->nAllNodes; i++) {
-			if (i+1 != MtmNodeId && !BIT_CHECK(Mtm->disabledNodeMask, i)) {
-				size_t lockGraphSize;
-				void* lockGraphData;
-				MtmLockNode(i + 1 + MtmMaxNodes, LW_SHARED);
-				lockGraphSize = Mtm->nodes[i].lockGraphUsed;
-				lockGraphData = palloc(lockGraphSize);
-				memcpy(lockGraphData, Mtm->nodes[i].lockGraphData, lockGraphSize);
-				MtmUnlockNode(i + 1 + MtmMaxNodes);
-
-				if (lockGraphData == NULL) {
-					return true;
-				} else {
-					MtmGraphAdd(&graph, (GlobalTransactionId*)lockGraphData, lockGraphSize/sizeof(GlobalTransactionId));
-				}
+		MtmGetGtid(xid, &gtid);
+		if (EQUAL_GTID(slot->gtid, gtid) && slot->detected) {
+			hasDeadlock = true;
+		} else {
+			MtmLockGraph graph;
+			MtmArbiterMessage probe;
+			int* reached;
+			int nReached;
+
+			if (!EQUAL_GTID(slot->gtid, gtid)) {
+				slot->gtid = gtid;
+				slot->round = 0;
 			}
+			/* Replies to the previous round are still accepted: round trip of probes can be longer than deadlock_timeout */
+			slot->prevRound = slot->round;
+			slot->round = MtmGetSystemTime();
+
+			MtmBuildLockGraph(&graph, false);
+			hasDeadlock = MtmFindWaitedTransactions(&graph, &gtid, &gtid, &reached, &nReached);
+			if (!hasDeadlock) {
+				MtmInitMessage(&probe, MSG_DEADLOCK_PROBE);
+				probe.csn = slot->round;
+				probe.probeInitiator = gtid;
+				probe.probeNode = MtmNodeId;
+				probe.probeHops = 1;
+				MtmSendDeadlockProbes(&probe, &graph, reached, nReached);
+			}
+			pfree(reached);
+			MtmFreeLockGraph(&graph);
 		}
-		MtmGetGtid(xid, &gtid);
-		hasDeadlock = MtmGraphFindLoop(&graph, &gtid);
 		MTM_ELOG(LOG, "Distributed deadlock check by backend %d for %u:%llu = %d", MyProcPid, gtid.node, (long64)gtid.xid, hasDeadlock);
-		if (!hasDeadlock) {
+		if (hasDeadlock) {
+			slot->gtid.node = 0;
+			slot->gtid.xid = InvalidTransactionId;
+			slot->detected = false;
+		} else {
 			/* There is no deadlock loop in graph, but deadlock can be caused by lack of apply workers: if all of them are busy, then some transactions
 			 * can not be appied just because there are no vacant workers and it cause additional dependency between transactions which is not
 			 * refelected in lock graph
@@ -5533,6 +6888,7 @@ MtmDetectGlobalDeadLockForXid(TransactionId xid)
 				MTM_ELOG(WARNING, "Apply workers were blocked more than %d msec",
 					 (int)USEC_TO_MSEC(MtmGetSystemTime() - lastPeekTime));
 			} else {
+				/* Wait for results of probes: deadlock reported by other nodes is detected by the next check */
 				MTM_LOG1("Enable deadlock timeout in backend %d for transaction %llu", MyProcPid, (long64)xid);
 				enable_timeout_after(DEADLOCK_TIMEOUT, DeadlockTimeout);
 			}
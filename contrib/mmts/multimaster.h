@@ -6,6 +6,8 @@
 #include "bkb.h"
 
 #include "access/clog.h"
+#include "access/hlc.h"
+#include "port/atomics.h"
 #include "pglogical_output/hooks.h"
 #include "commands/vacuum.h"
 #include "libpq-fe.h"
@@ -77,6 +79,14 @@
 
 #define MULTIMASTER_DEFAULT_ARBITER_PORT 5433
 
+/*
+ * Xid->state and gid->state maps are partitioned (like the lock manager tables).
+ * Entries are inserted and removed only under exclusive MtmLock plus exclusive partition lock,
+ * so lookups can be done either under MtmLock either under shared partition lock.
+ */
+#define MTM_NUM_PARTITIONS_LOG2          4
+#define MTM_NUM_PARTITIONS               (1 << MTM_NUM_PARTITIONS_LOG2)
+
 #define MB ((size_t)1024*1024)
 
 #define USEC_TO_MSEC(t) ((t)/1000)
@@ -91,8 +101,8 @@
 #define Anum_mtm_local_tables_rel_name	 2
 
 #define Natts_mtm_trans_state   15
-#define Natts_mtm_nodes_state   17
-#define Natts_mtm_cluster_state 21
+#define Natts_mtm_nodes_state   23
+#define Natts_mtm_cluster_state 23
 
 typedef ulong64 csn_t; /* commit serial number */
 #define INVALID_CSN  ((csn_t)-1)
@@ -134,7 +144,10 @@ typedef enum
 	MSG_STATUS,
 	MSG_HEARTBEAT,
 	MSG_POLL_REQUEST,
-	MSG_POLL_STATUS
+	MSG_POLL_STATUS,
+	MSG_DEADLOCK_PROBE,
+	MSG_DEADLOCK,
+	MSG_SEQUENCE_RANGE
 } MtmMessageCode;
 
 typedef enum
@@ -170,8 +183,36 @@ typedef struct
 	nodemask_t     disabledNodeMask; /* Bitmask of disabled nodes at the sender of message */
 	nodemask_t     connectivityMask; /* Connectivity bitmask at the sender of message */
 	pgid_t         gid;    /* Global transaction identifier */
+	GlobalTransactionId probeInitiator; /* MSG_DEADLOCK_PROBE/MSG_DEADLOCK: transaction which backend started deadlock detection */
+	GlobalTransactionId probeTarget;    /* MSG_DEADLOCK_PROBE: transaction at destination node which initiator transitively waits for */
+	int            probeNode;           /* MSG_DEADLOCK_PROBE/MSG_DEADLOCK: node of the backend waiting for lock */
+	int            probeHops;           /* MSG_DEADLOCK_PROBE: number of nodes visited by probe */
+	uint32         seqKey;              /* MSG_SEQUENCE_RANGE: hash of qualified name of the sequence */
+	int64          seqBase;             /* MSG_SEQUENCE_RANGE: first value of the leased range */
+	int64          seqEnd;              /* MSG_SEQUENCE_RANGE: last value of the leased range */
 } MtmArbiterMessage;
 
+#define MTM_ARBITER_PROTOCOL_VERSION 4
+
+#define MTM_BATCH_LOCK_REQ 0x01
+#define MTM_BATCH_LOCKED   0x02
+
+/*
+ * Arbiter messages are sent to the node in batches. Node-level fields of messages are sent once in batch header,
+ * followed by compact records with transaction-level fields (see MtmEncodeMessage).
+ */
+typedef struct
+{
+	uint8          version;          /* MTM_ARBITER_PROTOCOL_VERSION */
+	uint8          node;             /* Sender node ID */
+	uint8          flags;            /* MTM_BATCH_LOCK_REQ, MTM_BATCH_LOCKED */
+	uint8          reserved;
+	uint32         size;             /* Total size of batch including header */
+	csn_t          oldestSnapshot;   /* Oldest snapshot used by active transactions at this node */
+	nodemask_t     disabledNodeMask; /* Bitmask of disabled nodes at the sender of message */
+	nodemask_t     connectivityMask; /* Connectivity bitmask at the sender of message */
+} MtmArbiterBatchHeader;
+
 /*
  * Abort logical message is send by replica when error is happen while applying prepared transaction.
  * In this case we do not have prepared transaction and can not do abort-prepared.
@@ -199,9 +240,10 @@ typedef struct
 
 typedef struct
 {
-	int used;
-	int size;
-	MtmArbiterMessage* data;
+	int    used;
+	int    size;
+	char*  data;
+	csn_t  lastCsn;   /* CSN of last encoded message in the current batch */
 } MtmBuffer;
 
 typedef struct
@@ -227,20 +269,28 @@ typedef struct
 	timestamp_t lastStatusChangeTime;
 	timestamp_t receiverStartTime;
 	timestamp_t senderStartTime;
-	timestamp_t lastHeartbeat;
+	pg_atomic_uint64 lastHeartbeat;    /* Updated by arbiter receiver without MtmLock */
 	nodemask_t  disabledNodeMask;      /* Bitmask of disabled nodes received from this node */
 	nodemask_t  connectivityMask;      /* Connectivity mask at this node */
 	int         senderPid;
 	int         receiverPid;
 	lsn_t       flushPos;
-	csn_t       oldestSnapshot;        /* Oldest snapshot used by active transactions at this node */
+	pg_atomic_uint64 oldestSnapshot;   /* Oldest snapshot used by active transactions at this node */
 	lsn_t       restartLSN;
 	RepOriginId originId;
 	int         timeline;
 	void*       lockGraphData;
 	int         lockGraphAllocated;
 	int         lockGraphUsed;
-	uint64      nHeartbeats;
+	pg_atomic_uint64 nHeartbeats;
+	lsn_t       receivedLSN;           /* WAL position of the node reported in last message received from it */
+	pg_atomic_uint64 appliedLSN;       /* End LSN of last applied transaction received from this node */
+	pg_atomic_uint64 nAppliedTrans;    /* Number of applied transactions received from this node */
+	uint64      applyRate;             /* Applied transactions per second, updated by receiver */
+	uint64      applyRateCount;        /* Value of nAppliedTrans at the moment of last update of applyRate */
+	timestamp_t applyRateTime;         /* Time of last update of applyRate */
+	uint64      arbiterQueueSize;      /* Size of arbiter messages queued for this node but not yet written to socket, updated by sender */
+	timestamp_t arbiterSendLatency;    /* Average time between queuing of arbiter message and writing it to socket */
 	bool		manualRecovery;
 	bool		slotDeleted;			/* Signalizes that node is already deleted our slot and
 										 * recovery from that node isn't possible.
@@ -277,6 +327,7 @@ typedef struct MtmTransState
 	nodemask_t     participantsMask;   /* Mask of nodes involved in transaction */
 	nodemask_t     votedMask;          /* Mask of voted nodes */
 	int			   abortedByNode;      /* Store info about node on which this tx was aborted */
+	timestamp_t    phaseStartTime;     /* Start of current 2PC phase at coordinator, used to collect latency statistics */
 	TransactionId  xids[1];            /* [Mtm->nAllNodes]: transaction ID at replicas */
 } MtmTransState;
 
@@ -294,7 +345,7 @@ typedef struct
 	volatile slock_t queueSpinlock;    /* spinlock used to protect sender queue */
 	PGSemaphoreData sendSemaphore;     /* semaphore used to notify mtm-sender about new responses to coordinator */
 	LWLockPadded *locks;               /* multimaster lock tranche */
-	TransactionId oldestXid;           /* XID of oldest transaction visible by any active transaction (local or global) */
+	pg_atomic_uint32 oldestXid;        /* XID of oldest transaction visible by any active transaction (local or global), published by GC worker */
 	nodemask_t disabledNodeMask;       /* Bitmask of disabled nodes */
 	nodemask_t clique;                 /* Bitmask of nodes that are connected and we allowed to connect/send wal/receive wal with them */
 	bool       refereeGrant;           /* Referee allowed us to work with half of the nodes */
@@ -320,21 +371,24 @@ typedef struct
     int    nSenders;                   /* Number of started WAL senders (used to determine moment when recovery) */
 	int    nActiveTransactions;        /* Number of active 2PC transactions */
 	int    nRunningTransactions;       /* Number of all running transactions */
+	pg_atomic_uint32 nVisibilityWaiters; /* Number of backends waiting for completion of in-doubt transactions */
 	int    nConfigChanges;             /* Number of cluster configuration changes */
 	int    recoveryCount;              /* Number of completed recoveries */
 	int    donorNodeId;                /* Cluster node from which this node was populated */
-	int64  timeShift;                  /* Local time correction */
-	csn_t  csn;                        /* Last obtained timestamp: used to provide unique ascending CSNs based on system time */
+	bool   bootstrapPending;           /* Replication is delayed until node is populated by mtm.bootstrap_node() */
+	bool   bootstrapCompleted;         /* Node is populated by mtm.bootstrap_node(): it is persisted in mmts_control */
+	HLCState clock;                    /* Hybrid logical clock used to provide unique ascending CSNs based on system time */
 	csn_t  lastCsn;                    /* CSN of last committed transaction */
 	MtmTransState* votingTransactions; /* L1-list of replicated transactions notifications to coordinator.
 									 	 This list is used to pass information to mtm-sender BGW */
     MtmTransState* transListHead;      /* L1 list of all finished transactions present in xid2state hash.
-									 	  It is cleanup by MtmGetOldestXmin */
+									 	  It is cleanup by GC worker */
     MtmTransState** transListTail;     /* Tail of L1 list of all finished transactions, used to append new elements.
 								  		  This list is expected to be in CSN ascending order, by strict order may be violated */
 	MtmL2List activeTransList;         /* List of active transactions */
 	ulong64 transCount;                /* Counter of transactions performed by this node */
 	ulong64 gcCount;                   /* Number of global transactions performed since last GC */
+	int     gcWorkerProcno;            /* pgprocno of GC worker or -1 if it is not started */
 	MtmMessageQueue* sendQueue;        /* Messages to be sent by arbiter sender */
 	MtmMessageQueue* freeQueue;        /* Free messages */
 	lsn_t recoveredLSN;           /* LSN at the moment of recovery completion */
@@ -350,6 +404,25 @@ typedef struct MtmFlushPosition
 	lsn_t      remote_end;
 } MtmFlushPosition;
 
+#define MTM_APPLY_WINDOW_SIZE 1024 /* maximal number of transactions scheduled for parallel recovery but not yet reported as flushed */
+
+/*
+ * Transactions received from the node which are applied by executor workers during parallel recovery.
+ * Workers complete them out of order, so only the end LSN of the contiguous prefix of completed transactions
+ * can be reported to the donor: a transaction past the first not completed one is lost if the node crashes.
+ * Entries are ordered by endLSN (the order of transactions in the replication stream).
+ */
+typedef struct
+{
+	slock_t lock;
+	uint64  head;                                 /* position of the first not completed transaction */
+	uint64  tail;                                 /* position of the next scheduled transaction */
+	lsn_t   lastLocalEnd;                         /* maximal end of local commit record of transactions before head */
+	lsn_t   endLSN[MTM_APPLY_WINDOW_SIZE];         /* end LSN of the transaction in the stream of the node */
+	lsn_t   localEnd[MTM_APPLY_WINDOW_SIZE];       /* end of local commit record of completed transaction */
+	bool    completed[MTM_APPLY_WINDOW_SIZE];
+} MtmApplyWindow;
+
 
 typedef struct MtmSeqPosition
 {
@@ -379,6 +452,16 @@ extern int   MtmHeartbeatRecvTimeout;
 extern bool  MtmUseRDMA;
 extern bool  MtmUseDtm;
 extern bool  MtmPreserveCommitOrder;
+extern bool  MtmDependencyAwareApply;
+extern bool  MtmGroupCommit;
+extern int   MtmGroupCommitWindow;
+extern bool  MtmStreamLargeTransactions;
+extern bool  MtmParallelRecovery;
+extern bool  MtmReplicationCompression;
+extern bool  MtmColumnarInserts;
+extern int   MtmSequenceRange;
+extern int   MtmArbiterQueueSize;
+extern int   MtmMaxClockSkew;
 extern HTAB* MtmXid2State;
 extern HTAB* MtmGid2State;
 extern VacuumStmt* MtmVacuumStmt;
@@ -395,6 +478,7 @@ extern char* MtmRefereeConnStr;
 
 
 extern void  MtmArbiterInitialize(void);
+extern void  MtmWakeupSender(void);
 extern void  MtmStartReceivers(void);
 extern void  MtmStartReceiver(int nodeId, bool dynamic);
 extern csn_t MtmDistributedTransactionSnapshot(TransactionId xid, int nodeId, nodemask_t* participantsMask);
@@ -402,7 +486,8 @@ extern csn_t MtmAssignCSN(void);
 extern csn_t MtmSyncClock(csn_t csn);
 extern void  MtmJoinTransaction(GlobalTransactionId* gtid, csn_t snapshot, nodemask_t participantsMask);
 extern MtmReplicationMode MtmGetReplicationMode(int nodeId, sig_atomic_t volatile* shutdown);
-extern void  MtmExecute(void* work, int size);
+extern void  MtmExecute(void* work, int size, BgwPoolWriteSet* ws);
+extern void  MtmExecuteFragments(BgwPoolFragment* fragments, int nFragments, BgwPoolWriteSet* ws);
 extern void  MtmExecutor(void* work, size_t size);
 extern void  MtmSend2PCMessage(MtmTransState* ts, MtmMessageCode cmd);
 extern void  MtmSendMessage(MtmArbiterMessage* msg);
@@ -411,6 +496,8 @@ extern void  MtmLock(LWLockMode mode);
 extern void  MtmUnlock(void);
 extern void  MtmDeepUnlock(void);
 extern void  MtmLockNode(int nodeId, LWLockMode mode);
+extern LWLockId MtmLockXidPartition(TransactionId xid, LWLockMode mode);
+extern LWLockId MtmLockGidPartition(char const* gid, LWLockMode mode);
 extern bool  MtmTryLockNode(int nodeId, LWLockMode mode);
 extern void  MtmUnlockNode(int nodeId);
 extern void  MtmStopNode(int nodeId, bool dropSlot);
@@ -432,12 +519,19 @@ extern bool  MtmRecoveryCaughtUp(int nodeId, lsn_t walEndPtr);
 extern void  MtmCheckRecoveryCaughtUp(int nodeId, lsn_t slotLSN);
 extern void  MtmMakeTableLocal(char const* schema, char const* name);
 extern void  MtmHandleApplyError(void);
-extern void  MtmUpdateLsnMapping(int nodeId, lsn_t endLsn);
+extern lsn_t MtmUpdateLsnMapping(int nodeId, lsn_t endLsn);
+extern void  MtmApplyWindowReset(int nodeId);
+extern bool  MtmApplyWindowAdd(int nodeId, lsn_t endLsn);
+extern bool  MtmApplyWindowIsEmpty(int nodeId);
+extern bool  MtmApplyWindowIsFirst(int nodeId, lsn_t endLsn);
+extern void  MtmApplyWindowCompleteAll(int nodeId);
 extern lsn_t MtmGetFlushPosition(int nodeId);
 extern bool MtmWatchdog(timestamp_t now);
 extern void MtmCheckHeartbeat(void);
 extern void MtmResetTransaction(void);
 extern void MtmUpdateLockGraph(int nodeId, void const* messageBody, int messageSize);
+extern void MtmHandleDeadlockProbe(MtmArbiterMessage* msg);
+extern void MtmHandleDeadlock(MtmArbiterMessage* msg);
 extern void MtmReleaseRecoverySlot(int nodeId);
 extern PGconn *PQconnectdb_safe(const char *conninfo, int timeout);
 extern void MtmBeginSession(int nodeId);
@@ -455,5 +549,6 @@ extern void MtmSetSnapshot(csn_t snapshot);
 extern void MtmRefereeInitialize(void);
 extern void MtmPollStatusOfPreparedTransactionsForDisabledNode(int disabledNodeId, bool commitPrecommited);
 extern int MtmGetNumberOfVotingNodes(void);
+extern void MtmWriteControlFile(void);
 
 #endif
@@ -52,12 +52,18 @@
 #include "utils/memutils.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/rel.h"
 #include "parser/parse_relation.h"
 
 #include "multimaster.h"
 #include "pglogical_relid_map.h"
 #include "spill.h"
 #include "state.h"
+#include "stream.h"
+#include "latency.h"
+#include "pglogical_codec.h"
 
 typedef struct TupleData
 {
@@ -67,15 +73,49 @@ typedef struct TupleData
 } TupleData;
 
 
+/*
+ * Scan key for search of tuple in index. Operators are looked up once,
+ * only arguments and null flags are assigned for each applied row.
+ */
+typedef struct MtmIndexScanKey
+{
+	int			nkeys;
+	AttrNumber	attnos[INDEX_MAX_KEYS];	/* table attribute of each key column */
+	ScanKeyData	keys[INDEX_MAX_KEYS];
+} MtmIndexScanKey;
+
+/*
+ * Executor state of relation cached across rows of applied transaction: opened indexes,
+ * tuple slots and prebuilt scan keys. Cache is released at the end of transaction,
+ * entry is rebuilt if relation is invalidated.
+ */
+typedef struct MtmApplyRelState
+{
+	Oid				relid;			/* hash key */
+	bool			valid;			/* cleared by relcache invalidation callback */
+	Relation		rel;
+	EState		   *estate;
+	TupleTableSlot *newslot;
+	TupleTableSlot *oldslot;
+	MtmIndexScanKey **uniqueKeys;	/* keys of unique indexes of result relation or NULL if index can not be used */
+	Relation		replidx;		/* replica identity index or NULL */
+	MtmIndexScanKey	replidxKey;
+} MtmApplyRelState;
+
+#define MTM_INSERT_BATCH_SIZE 1000	/* maximal number of consecutive inserted tuples passed to heap_multi_insert */
+
 static Relation read_rel(StringInfo s, LOCKMODE mode);
 static void read_tuple_parts(StringInfo s, Relation rel, TupleData *tup);
-static EState* create_rel_estate(Relation rel);
 static bool find_pkey_tuple(ScanKey skey, Relation rel, Relation idxrel,
                             TupleTableSlot *slot, bool lock, LockTupleMode mode);
-static void build_index_scan_keys(EState *estate, ScanKey *scan_keys, TupleData *tup);
-static bool build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, TupleData *tup);
+static void prepare_index_scan_key(MtmIndexScanKey *key, Relation rel, Relation idxrel);
+static bool fill_index_scan_key(ScanKey skey, MtmIndexScanKey *key, TupleData *tup);
 static void UserTableUpdateOpenIndexes(EState *estate, TupleTableSlot *slot);
-static void UserTableUpdateIndexes(EState *estate, TupleTableSlot *slot);
+
+static MtmApplyRelState *get_rel_state(Relation rel);
+static void flush_remote_inserts(void);
+static void release_rel_states(void);
+static void reset_rel_states(void);
 
 static bool process_remote_begin(StringInfo s);
 static bool process_remote_message(StringInfo s);
@@ -86,6 +126,14 @@ static void process_remote_delete(StringInfo s, Relation rel);
 
 static bool          GucAltered; /* transaction is setting some GUC variables */
 
+static MemoryContext MtmApplyCacheContext;
+static MemoryContext MtmInsertBatchContext;
+static MemoryContext MtmApplyBufferContext; /* buffers for chunks of spilled and streamed transactions, reset by MtmExecutor */
+static HTAB*         MtmApplyRelStates;
+static MtmApplyRelState* MtmInsertBatchRel;
+static HeapTuple     MtmInsertBatch[MTM_INSERT_BATCH_SIZE];
+static int           MtmInsertBatchSize;
+
 /*
  * Search the index 'idxrel' for a tuple identified by 'skey' in 'rel'.
  *
@@ -171,55 +219,11 @@ retry:
 	return found;
 }
 
-static void
-build_index_scan_keys(EState *estate, ScanKey *scan_keys, TupleData *tup)
-{
-	ResultRelInfo *relinfo;
-	int i;
-
-	relinfo = estate->es_result_relation_info;
-
-	/* build scankeys for each index */
-	for (i = 0; i < relinfo->ri_NumIndices; i++)
-	{
-		IndexInfo  *ii = relinfo->ri_IndexRelationInfo[i];
-
-		/*
-		 * Only unique indexes are of interest here, and we can't deal with
-		 * expression indexes so far. FIXME: predicates should be handled
-		 * better.
-		 */
-		if (!ii->ii_Unique || ii->ii_Expressions != NIL)
-		{
-			scan_keys[i] = NULL;
-			continue;
-		}
-
-		scan_keys[i] = palloc(ii->ii_NumIndexAttrs * sizeof(ScanKeyData));
-
-		/*
-		 * Only return index if we could build a key without NULLs.
-		 */
-		if (build_index_scan_key(scan_keys[i],
-								  relinfo->ri_RelationDesc,
-								  relinfo->ri_IndexRelationDescs[i],
-								  tup))
-		{
-			pfree(scan_keys[i]);
-			scan_keys[i] = NULL;
-			continue;
-		}
-	}
-}
-
 /*
- * Setup a ScanKey for a search in the relation 'rel' for a tuple 'key' that
- * is setup to match 'rel' (*NOT* idxrel!).
- *
- * Returns whether any column contains NULLs.
+ * Setup a template of ScanKey for a search in the relation 'rel' using index 'idxrel'.
  */
-static bool
-build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, TupleData *tup)
+static void
+prepare_index_scan_key(MtmIndexScanKey *key, Relation rel, Relation idxrel)
 {
 	int			attoff;
 	Datum		indclassDatum;
@@ -227,7 +231,6 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, TupleData *tup
 	bool		isnull;
 	oidvector  *opclass;
 	int2vector  *indkey;
-	bool		hasnulls = false;
 
 	indclassDatum = SysCacheGetAttr(INDEXRELID, idxrel->rd_indextuple,
 									Anum_pg_index_indclass, &isnull);
@@ -239,8 +242,9 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, TupleData *tup
 	Assert(!isnull);
 	indkey = (int2vector *) DatumGetPointer(indkeyDatum);
 
+	key->nkeys = IndexRelationGetNumberOfKeyAttributes(idxrel);
 
-	for (attoff = 0; attoff < IndexRelationGetNumberOfKeyAttributes(idxrel); attoff++)
+	for (attoff = 0; attoff < key->nkeys; attoff++)
 	{
 		Oid			operator;
 		Oid			opfamily;
@@ -264,11 +268,33 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, TupleData *tup
 		regop = get_opcode(operator);
 
 		/* FIXME: convert type? */
-		ScanKeyInit(&skey[attoff],
+		ScanKeyInit(&key->keys[attoff],
 					pkattno,
 					BTEqualStrategyNumber,
 					regop,
-					tup->values[mainattno - 1]);
+					(Datum) 0);
+		key->attnos[attoff] = mainattno;
+	}
+}
+
+/*
+ * Setup a ScanKey for a search of tuple 'tup' using prepared template 'key'.
+ *
+ * Returns whether any column contains NULLs.
+ */
+static bool
+fill_index_scan_key(ScanKey skey, MtmIndexScanKey *key, TupleData *tup)
+{
+	int			attoff;
+	bool		hasnulls = false;
+
+	memcpy(skey, key->keys, key->nkeys * sizeof(ScanKeyData));
+
+	for (attoff = 0; attoff < key->nkeys; attoff++)
+	{
+		int			mainattno = key->attnos[attoff];
+
+		skey[attoff].sk_argument = tup->values[mainattno - 1];
 
 		if (tup->isnull[mainattno - 1])
 		{
@@ -279,18 +305,6 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, TupleData *tup
 	return hasnulls;
 }
 
-static void
-UserTableUpdateIndexes(EState *estate, TupleTableSlot *slot)
-{
-	/* HOT update does not require index inserts */
-	if (HeapTupleIsHeapOnly(slot->tts_tuple))
-		return;
-
-	ExecOpenIndices(estate->es_result_relation_info, false);
-	UserTableUpdateOpenIndexes(estate, slot);
-	ExecCloseIndices(estate->es_result_relation_info);
-}
-
 static void
 UserTableUpdateOpenIndexes(EState *estate, TupleTableSlot *slot)
 {
@@ -316,24 +330,216 @@ UserTableUpdateOpenIndexes(EState *estate, TupleTableSlot *slot)
 	list_free(recheckIndexes);
 }
 
-static EState *
-create_rel_estate(Relation rel)
+static void
+MtmApplyRelcacheCallback(Datum arg, Oid relid)
+{
+	MtmApplyRelState *rs;
+
+	if (MtmApplyRelStates == NULL)
+		return;
+
+	if (relid == InvalidOid)
+	{
+		HASH_SEQ_STATUS status;
+
+		hash_seq_init(&status, MtmApplyRelStates);
+		while ((rs = (MtmApplyRelState *) hash_seq_search(&status)) != NULL)
+			rs->valid = false;
+	}
+	else
+	{
+		rs = (MtmApplyRelState *) hash_search(MtmApplyRelStates, &relid, HASH_FIND, NULL);
+		if (rs != NULL)
+			rs->valid = false;
+	}
+}
+
+static void
+close_rel_state(MtmApplyRelState *rs)
+{
+	if (MtmInsertBatchRel == rs)
+		flush_remote_inserts();
+
+	if (rs->replidx != NULL)
+		index_close(rs->replidx, NoLock);
+
+	ExecCloseIndices(rs->estate->es_result_relation_info);
+	ExecResetTupleTable(rs->estate->es_tupleTable, true);
+	FreeExecutorState(rs->estate);
+	RelationDecrementReferenceCount(rs->rel);
+}
+
+/*
+ * Get cached executor state of relation or build new one.
+ */
+static MtmApplyRelState *
+get_rel_state(Relation rel)
+{
+	Oid			relid = RelationGetRelid(rel);
+	MtmApplyRelState *rs;
+	ResultRelInfo *relinfo;
+	MemoryContext old_context;
+	bool		found;
+	int			i;
+
+	if (MtmApplyCacheContext == NULL)
+	{
+		MtmApplyCacheContext = AllocSetContextCreate(TopMemoryContext,
+													 "ApplyCacheContext",
+													 ALLOCSET_DEFAULT_MINSIZE,
+													 ALLOCSET_DEFAULT_INITSIZE,
+													 ALLOCSET_DEFAULT_MAXSIZE);
+		MtmInsertBatchContext = AllocSetContextCreate(TopMemoryContext,
+													  "InsertBatchContext",
+													  ALLOCSET_DEFAULT_MINSIZE,
+													  ALLOCSET_DEFAULT_INITSIZE,
+													  ALLOCSET_DEFAULT_MAXSIZE);
+		CacheRegisterRelcacheCallback(MtmApplyRelcacheCallback, (Datum) 0);
+	}
+	if (MtmApplyRelStates == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(MtmApplyRelState);
+		ctl.hcxt = MtmApplyCacheContext;
+		MtmApplyRelStates = hash_create("MtmApplyRelStates", 16, &ctl,
+										HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	rs = (MtmApplyRelState *) hash_search(MtmApplyRelStates, &relid, HASH_ENTER, &found);
+	if (found)
+	{
+		if (rs->valid && rs->rel == rel)
+			return rs;
+		close_rel_state(rs);
+	}
+
+	old_context = MemoryContextSwitchTo(MtmApplyCacheContext);
+
+	RelationIncrementReferenceCount(rel);
+	rs->rel = rel;
+	rs->valid = true;
+
+	rs->estate = CreateExecutorState();
+	relinfo = makeNode(ResultRelInfo);
+	relinfo->ri_RangeTableIndex = 1;		/* dummy */
+	relinfo->ri_RelationDesc = rel;
+	relinfo->ri_TrigInstrument = NULL;
+	rs->estate->es_result_relations = relinfo;
+	rs->estate->es_num_result_relations = 1;
+	rs->estate->es_result_relation_info = relinfo;
+
+	rs->newslot = ExecInitExtraTupleSlot(rs->estate);
+	rs->oldslot = ExecInitExtraTupleSlot(rs->estate);
+	ExecSetSlotDescriptor(rs->newslot, RelationGetDescr(rel));
+	ExecSetSlotDescriptor(rs->oldslot, RelationGetDescr(rel));
+
+	ExecOpenIndices(relinfo, false);
+
+	/*
+	 * Only unique indexes are of interest for conflict detection, and we can't
+	 * deal with expression indexes so far. FIXME: predicates should be handled
+	 * better.
+	 */
+	rs->uniqueKeys = palloc0(Max(relinfo->ri_NumIndices, 1) * sizeof(MtmIndexScanKey *));
+	for (i = 0; i < relinfo->ri_NumIndices; i++)
+	{
+		IndexInfo  *ii = relinfo->ri_IndexRelationInfo[i];
+
+		if (!ii->ii_Unique || ii->ii_Expressions != NIL)
+			continue;
+
+		rs->uniqueKeys[i] = palloc(sizeof(MtmIndexScanKey));
+		prepare_index_scan_key(rs->uniqueKeys[i], rel, relinfo->ri_IndexRelationDescs[i]);
+	}
+
+	/* lookup replica identity index used to locate updated and deleted tuples */
+	if (rel->rd_indexvalid == 0)
+		RelationGetIndexList(rel);
+	if (OidIsValid(rel->rd_replidindex))
+	{
+		rs->replidx = index_open(rel->rd_replidindex, RowExclusiveLock);
+		Assert(rs->replidx->rd_index->indisunique);
+		prepare_index_scan_key(&rs->replidxKey, rel, rs->replidx);
+	}
+	else
+		rs->replidx = NULL;
+
+	MemoryContextSwitchTo(old_context);
+	return rs;
+}
+
+/*
+ * Insert tuples collected by process_remote_insert using heap_multi_insert
+ */
+static void
+flush_remote_inserts(void)
 {
-	EState	   *estate;
-	ResultRelInfo *resultRelInfo;
+	MtmApplyRelState *rs = MtmInsertBatchRel;
+	int			i;
+
+	if (MtmInsertBatchSize == 0)
+		return;
+
+	PushActiveSnapshot(GetTransactionSnapshot());
 
-	estate = CreateExecutorState();
+	heap_multi_insert(rs->rel, MtmInsertBatch, MtmInsertBatchSize,
+					  GetCurrentCommandId(true), 0, NULL);
 
-	resultRelInfo = makeNode(ResultRelInfo);
-	resultRelInfo->ri_RangeTableIndex = 1;		/* dummy */
-	resultRelInfo->ri_RelationDesc = rel;
-	resultRelInfo->ri_TrigInstrument = NULL;
+	for (i = 0; i < MtmInsertBatchSize; i++)
+	{
+		ExecStoreTuple(MtmInsertBatch[i], rs->newslot, InvalidBuffer, false);
+		UserTableUpdateOpenIndexes(rs->estate, rs->newslot);
+		ExecClearTuple(rs->newslot);
+		ResetPerTupleExprContext(rs->estate);
+	}
+
+	PopActiveSnapshot();
 
-	estate->es_result_relations = resultRelInfo;
-	estate->es_num_result_relations = 1;
-	estate->es_result_relation_info = resultRelInfo;
+	MtmInsertBatchSize = 0;
+	MtmInsertBatchRel = NULL;
+	MemoryContextReset(MtmInsertBatchContext);
 
-	return estate;
+	CommandCounterIncrement();
+}
+
+/*
+ * Close relations cached by transaction. Should be called before commit or prepare of transaction.
+ */
+static void
+release_rel_states(void)
+{
+	HASH_SEQ_STATUS status;
+	MtmApplyRelState *rs;
+
+	flush_remote_inserts();
+
+	if (MtmApplyRelStates == NULL)
+		return;
+
+	hash_seq_init(&status, MtmApplyRelStates);
+	while ((rs = (MtmApplyRelState *) hash_seq_search(&status)) != NULL)
+		close_rel_state(rs);
+
+	reset_rel_states();
+}
+
+/*
+ * Forget about cached relations after abort of transaction: resources are already released by resource owner.
+ */
+static void
+reset_rel_states(void)
+{
+	MtmInsertBatchSize = 0;
+	MtmInsertBatchRel = NULL;
+	MtmApplyRelStates = NULL;
+	if (MtmApplyCacheContext != NULL)
+	{
+		MemoryContextReset(MtmInsertBatchContext);
+		MemoryContextReset(MtmApplyCacheContext);
+	}
 }
 
 static bool
@@ -499,6 +705,77 @@ process_remote_message(StringInfo s)
 	return standalone;
 }
 	
+/*
+ * Convert transferred value of the attribute to datum
+ */
+static void
+read_tuple_attr(TupleData *tup, int i, Form_pg_attribute att, char kind, const char *data, int len)
+{
+	switch (kind)
+	{
+		case 'n': /* null */
+			/* already marked as null */
+			tup->values[i] = 0xdeadbeef;
+			break;
+		case 'u': /* unchanged column */
+			tup->isnull[i] = true;
+			tup->changed[i] = false;
+			tup->values[i] = 0xdeadbeef; /* make bad usage more obvious */
+			break;
+
+		case 'b': /* binary format */
+			tup->isnull[i] = false;
+			if (att->attbyval)
+				tup->values[i] = fetch_att(data, true, len);
+			else
+				tup->values[i] = PointerGetDatum(data);
+			break;
+		case 's': /* send/recv format */
+			{
+				Oid typreceive;
+				Oid typioparam;
+				StringInfoData buf;
+
+				tup->isnull[i] = false;
+
+				getTypeBinaryInputInfo(att->atttypid,
+									   &typreceive, &typioparam);
+
+				/* create StringInfo pointing into the bigger buffer */
+				initStringInfo(&buf);
+				/* and data */
+				buf.data = (char *) data;
+				buf.len = len;
+				tup->values[i] = OidReceiveFunctionCall(
+					typreceive, &buf, typioparam, att->atttypmod);
+
+				if (buf.len != buf.cursor)
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+							 MTM_ERRMSG("incorrect binary data format")));
+				break;
+			}
+		case 't': /* text format */
+			{
+				Oid typinput;
+				Oid typioparam;
+
+				tup->isnull[i] = false;
+
+				getTypeInputInfo(att->atttypid, &typinput, &typioparam);
+				/* and data */
+				tup->values[i] = OidInputFunctionCall(
+					typinput, (char *) data, typioparam, att->atttypmod);
+			}
+			break;
+		default:
+			MTM_ELOG(ERROR, "unknown column type '%c'", kind);
+	}
+
+	if (att->attisdropped && !tup->isnull[i])
+		MTM_ELOG(ERROR, "data for dropped column");
+}
+
 static void
 read_tuple_parts(StringInfo s, Relation rel, TupleData *tup)
 {
@@ -526,86 +803,20 @@ read_tuple_parts(StringInfo s, Relation rel, TupleData *tup)
 	{
 		Form_pg_attribute att = desc->attrs[i];
 		char		kind;
-		const char *data;
-		int			len;
+		const char *data = NULL;
+		int			len = 0;
 
 		if (att->atttypid == InvalidOid) { 
 			continue;
 		}
 
 		kind = pq_getmsgbyte(s);
-
-		switch (kind)
+		if (kind != 'n' && kind != 'u')
 		{
-			case 'n': /* null */
-				/* already marked as null */
-				tup->values[i] = 0xdeadbeef;
-				break;
-			case 'u': /* unchanged column */
-				tup->isnull[i] = true;
-				tup->changed[i] = false;
-				tup->values[i] = 0xdeadbeef; /* make bad usage more obvious */
-				break;
-
-			case 'b': /* binary format */
-				tup->isnull[i] = false;
-				len = pq_getmsgint(s, 4); /* read length */
-
-				data = pq_getmsgbytes(s, len);
-
-				/* and data */
-				if (att->attbyval)
-					tup->values[i] = fetch_att(data, true, len);
-				else
-					tup->values[i] = PointerGetDatum(data);
-				break;
-			case 's': /* send/recv format */
-				{
-					Oid typreceive;
-					Oid typioparam;
-					StringInfoData buf;
-
-					tup->isnull[i] = false;
-					len = pq_getmsgint(s, 4); /* read length */
-
-					getTypeBinaryInputInfo(att->atttypid,
-										   &typreceive, &typioparam);
-
-					/* create StringInfo pointing into the bigger buffer */
-					initStringInfo(&buf);
-					/* and data */
-					buf.data = (char *) pq_getmsgbytes(s, len);
-					buf.len = len;
-					tup->values[i] = OidReceiveFunctionCall(
-						typreceive, &buf, typioparam, att->atttypmod);
-
-					if (buf.len != buf.cursor)
-						ereport(ERROR,
-								(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
-								 MTM_ERRMSG("incorrect binary data format")));
-					break;
-				}
-			case 't': /* text format */
-				{
-					Oid typinput;
-					Oid typioparam;
-
-					tup->isnull[i] = false;
-					len = pq_getmsgint(s, 4); /* read length */
-
-					getTypeInputInfo(att->atttypid, &typinput, &typioparam);
-					/* and data */
-					data = (char *) pq_getmsgbytes(s, len);
-					tup->values[i] = OidInputFunctionCall(
-						typinput, (char *) data, typioparam, att->atttypmod);
-				}
-				break;
-			default:
-				MTM_ELOG(ERROR, "unknown column type '%c'", kind);
+			len = pq_getmsgint(s, 4); /* read length */
+			data = pq_getmsgbytes(s, len);
 		}
-
-		if (att->attisdropped && !tup->isnull[i])
-			MTM_ELOG(ERROR, "data for dropped column");
+		read_tuple_attr(tup, i, att, kind, data, len);
 	}
 }
 
@@ -651,6 +862,24 @@ read_rel(StringInfo s, LOCKMODE mode)
 	return heap_open(local_relid, NoLock);
 }
 
+/*
+ * Advance position of the stream from the node which is already applied and count applied transactions:
+ * it is used to report apply lag and rate in mtm.get_nodes_state().
+ * Position is the end of the contiguous prefix of applied transactions, but it can be advanced by several workers concurrently.
+ */
+static void
+MtmAdvanceAppliedLSN(int nodeId, lsn_t end_lsn, bool newTrans)
+{
+	MtmNodeInfo* node = &Mtm->nodes[nodeId-1];
+	uint64 applied = pg_atomic_read_u64(&node->appliedLSN);
+
+	while (applied < end_lsn && !pg_atomic_compare_exchange_u64(&node->appliedLSN, &applied, end_lsn));
+
+	if (newTrans) {
+		pg_atomic_fetch_add_u64(&node->nAppliedTrans, 1);
+	}
+}
+
 static void
 process_remote_commit(StringInfo in)
 {
@@ -677,6 +906,13 @@ process_remote_commit(StringInfo in)
 	origin_lsn = pq_getmsgint64(in);
 
 	replorigin_session_origin_lsn = origin_node == MtmReplicationNodeId ? end_lsn : origin_lsn;
+	if (!MtmApplyWindowIsFirst(MtmReplicationNodeId, end_lsn)) {
+		/*
+		 * Preceding transaction of the stream is still applied by another worker: replication origin should not
+		 * be moved past it, otherwise it will not be received again after crash
+		 */
+		replorigin_session_origin_lsn = INVALID_LSN;
+	}
 	Assert(replorigin_session_origin == InvalidRepOriginId);
 
 	switch (event)
@@ -689,6 +925,10 @@ process_remote_commit(StringInfo in)
 			MtmBeginSession(origin_node);
 			MtmPrecommitTransaction(gid);
 			MtmEndSession(origin_node, true);
+			if (Mtm->status == MTM_RECOVERY) {
+				/* Complete it in the window of transactions applied in parallel */
+				MtmUpdateLsnMapping(MtmReplicationNodeId, end_lsn);
+			}
 			return;
 		}
 		case PGLOGICAL_COMMIT:
@@ -779,35 +1019,30 @@ process_remote_commit(StringInfo in)
 	if (Mtm->status == MTM_RECOVERY) { 
 		MTM_LOG1("Recover transaction %s event=%d", gid,  event);
 	}
-	MtmUpdateLsnMapping(MtmReplicationNodeId, end_lsn);
+	end_lsn = MtmUpdateLsnMapping(MtmReplicationNodeId, end_lsn);
+	MtmAdvanceAppliedLSN(MtmReplicationNodeId, end_lsn, event == PGLOGICAL_COMMIT || event == PGLOGICAL_PREPARE);
 }
 
 static void
-process_remote_insert(StringInfo s, Relation rel)
+apply_remote_insert(Relation rel, TupleData *new_tuple)
 {
-	EState *estate;
-	TupleData new_tuple;
-	TupleTableSlot *newslot;
-	TupleTableSlot *oldslot;
+	MtmApplyRelState *rs;
 	ResultRelInfo *relinfo;
-	ScanKey	*index_keys;
-	int	i;
+	MemoryContext old_context;
+	HeapTuple	tup;
+	int			i;
 
-	PushActiveSnapshot(GetTransactionSnapshot());
+	rs = get_rel_state(rel);
+	relinfo = rs->estate->es_result_relation_info;
 
-	estate = create_rel_estate(rel);
-	newslot = ExecInitExtraTupleSlot(estate);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(newslot, RelationGetDescr(rel));
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel));
+	/* Consecutive inserts into the same relation are performed by one heap_multi_insert */
+	if (MtmInsertBatchRel != rs)
+		flush_remote_inserts();
 
-	read_tuple_parts(s, rel, &new_tuple);
-	{
-		HeapTuple tup;
-		tup = heap_form_tuple(RelationGetDescr(rel),
-							  new_tuple.values, new_tuple.isnull);
-		ExecStoreTuple(tup, newslot, InvalidBuffer, true);
-	}
+	old_context = MemoryContextSwitchTo(MtmInsertBatchContext);
+	tup = heap_form_tuple(RelationGetDescr(rel),
+						  new_tuple->values, new_tuple->isnull);
+	MemoryContextSwitchTo(old_context);
 
 	// if (rel->rd_rel->relkind != RELKIND_RELATION) // RELKIND_MATVIEW
 	// 	MTM_ELOG(ERROR, "unexpected relkind '%c' rel \"%s\"",
@@ -815,43 +1050,29 @@ process_remote_insert(StringInfo s, Relation rel)
 
 	/* debug output */
 #ifdef VERBOSE_INSERT
-	log_tuple("INSERT:%s", RelationGetDescr(rel), newslot->tts_tuple);
+	log_tuple("INSERT:%s", RelationGetDescr(rel), tup);
 #endif
 
+	PushActiveSnapshot(GetTransactionSnapshot());
+
 	/*
-	 * Search for conflicting tuples.
+	 * Search for conflicting tuples: do a SnapshotDirty search using unique indexes.
+	 * Conflicts between tuples of the same batch are detected by index insertion.
 	 */
-	ExecOpenIndices(estate->es_result_relation_info, false);
-	relinfo = estate->es_result_relation_info;
-	index_keys = palloc0(relinfo->ri_NumIndices * sizeof(ScanKeyData*));
-
-	build_index_scan_keys(estate, index_keys, &new_tuple);
-
-	/* do a SnapshotDirty search for conflicting tuples */
 	for (i = 0; i < relinfo->ri_NumIndices; i++)
 	{
-		IndexInfo  *ii = relinfo->ri_IndexRelationInfo[i];
+		ScanKeyData skey[INDEX_MAX_KEYS];
 		bool found = false;
 
-		/*
-		 * Only unique indexes are of interest here, and we can't deal with
-		 * expression indexes so far. FIXME: predicates should be handled
-		 * better.
-		 *
-		 * NB: Needs to match expression in build_index_scan_key
-		 */
-		if (!ii->ii_Unique || ii->ii_Expressions != NIL)
-			continue;
-
-		if (index_keys[i] == NULL)
+		/* Only return index if we could build a key without NULLs. */
+		if (rs->uniqueKeys[i] == NULL || fill_index_scan_key(skey, rs->uniqueKeys[i], new_tuple))
 			continue;
 
-		Assert(ii->ii_Expressions == NIL);
-
 		/* if conflict: wait */
-		found = find_pkey_tuple(index_keys[i],
+		found = find_pkey_tuple(skey,
 								rel, relinfo->ri_IndexRelationDescs[i],
-								oldslot, true, LockTupleExclusive);
+								rs->oldslot, true, LockTupleExclusive);
+		ExecClearTuple(rs->oldslot);
 
 		/* alert if there's more than one conflicting unique key */
 		if (found)
@@ -865,39 +1086,93 @@ process_remote_insert(StringInfo s, Relation rel)
 		CHECK_FOR_INTERRUPTS();
 	}
 
-	simple_heap_insert(rel, newslot->tts_tuple);
-    UserTableUpdateOpenIndexes(estate, newslot);
-
-	ExecCloseIndices(estate->es_result_relation_info);
-
-	if (ActiveSnapshotSet())
-		PopActiveSnapshot();
+	PopActiveSnapshot();
 
 	if (strcmp(RelationGetRelationName(rel), MULTIMASTER_LOCAL_TABLES_TABLE) == 0 &&
 		strcmp(get_namespace_name(RelationGetNamespace(rel)), MULTIMASTER_SCHEMA_NAME) == 0)
 	{
-		MtmMakeTableLocal((char*)DatumGetPointer(new_tuple.values[0]), (char*)DatumGetPointer(new_tuple.values[1]));
+		MtmMakeTableLocal((char*)DatumGetPointer(new_tuple->values[0]), (char*)DatumGetPointer(new_tuple->values[1]));
 	}
-		
-    ExecResetTupleTable(estate->es_tupleTable, true);
-    FreeExecutorState(estate);
-	   
-	CommandCounterIncrement();
+
+	MtmInsertBatchRel = rs;
+	MtmInsertBatch[MtmInsertBatchSize++] = tup;
+	if (MtmInsertBatchSize == MTM_INSERT_BATCH_SIZE)
+		flush_remote_inserts();
+}
+
+static void
+process_remote_insert(StringInfo s, Relation rel)
+{
+	TupleData	new_tuple;
+
+	read_tuple_parts(s, rel, &new_tuple);
+	apply_remote_insert(rel, &new_tuple);
+}
+
+/*
+ * Apply columnar batch of inserts (multimaster.columnar_inserts): rows are decoded one by one
+ * and added to the same heap_multi_insert batch as separately transferred inserts.
+ */
+static void
+process_remote_batch(StringInfo s, Relation rel)
+{
+	TupleDesc	desc = RelationGetDescr(rel);
+	TupleData	new_tuple;
+	MtmBatch	batch;
+	MtmBatchCell *cells;
+	MemoryContext row_context;
+	MemoryContext old_context;
+	int			i, j;
+
+	MtmBatchRead(&batch, s);
+
+	if (desc->natts < batch.natts)
+		MTM_ELOG(ERROR, "tuple natts mismatch, %u vs %u", desc->natts, batch.natts);
+
+	cells = (MtmBatchCell*)palloc(batch.natts * sizeof(MtmBatchCell));
+	row_context = AllocSetContextCreate(CurrentMemoryContext,
+										"BatchRowContext",
+										ALLOCSET_DEFAULT_MINSIZE,
+										ALLOCSET_DEFAULT_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE);
+
+	while (MtmBatchNextRow(&batch, cells))
+	{
+		memset(new_tuple.isnull, 1, sizeof(new_tuple.isnull));
+		memset(new_tuple.changed, 1, sizeof(new_tuple.changed));
+
+		old_context = MemoryContextSwitchTo(row_context);
+		for (i = 0, j = 0; i < desc->natts; i++)
+		{
+			Form_pg_attribute att = desc->attrs[i];
+
+			if (att->atttypid == InvalidOid)
+				continue;
+			if (j == batch.natts)
+				MTM_ELOG(ERROR, "tuple natts mismatch, %u vs %u", desc->natts, batch.natts);
+
+			read_tuple_attr(&new_tuple, i, att, cells[j].kind, cells[j].data, cells[j].len);
+			j += 1;
+		}
+		MemoryContextSwitchTo(old_context);
+
+		apply_remote_insert(rel, &new_tuple);
+		MemoryContextReset(row_context);
+	}
+	MemoryContextDelete(row_context);
+	pfree(cells);
+	pfree(batch.columns);
 }
 
 static void
 process_remote_update(StringInfo s, Relation rel)
 {
 	char		action;
-	EState	   *estate;
-	TupleTableSlot *newslot;
-	TupleTableSlot *oldslot;
+	MtmApplyRelState *rs;
 	bool		pkey_sent;
 	bool		found_tuple;
 	TupleData   old_tuple;
 	TupleData   new_tuple;
-	Oid			idxoid;
-	Relation	idxrel;
 	ScanKeyData skey[INDEX_MAX_KEYS];
 	HeapTuple	remote_tuple = NULL;
 
@@ -908,11 +1183,7 @@ process_remote_update(StringInfo s, Relation rel)
 		MTM_ELOG(ERROR, "expected action 'N' or 'K', got %c",
 			 action);
 
-	estate = create_rel_estate(rel);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel));
-	newslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(newslot, RelationGetDescr(rel));
+	rs = get_rel_state(rel);
 
 	if (action == 'K')
 	{
@@ -935,47 +1206,38 @@ process_remote_update(StringInfo s, Relation rel)
 	/* read new tuple */
 	read_tuple_parts(s, rel, &new_tuple);
 
-	/* lookup index to build scankey */
-	if (rel->rd_indexvalid == 0)
-		RelationGetIndexList(rel);
-	idxoid = rel->rd_replidindex;
-	if (!OidIsValid(idxoid))
+	if (rs->replidx == NULL)
 	{
 		MTM_ELOG(ERROR, "could not find primary key for table with oid %u",
 			 RelationGetRelid(rel));
 		return;
 	}
 
-	/* open index, so we can build scan key for row */
-	idxrel = index_open(idxoid, RowExclusiveLock);
-
-	Assert(idxrel->rd_index->indisunique);
-
 	/* Use columns from the new tuple if the key didn't change. */
-	build_index_scan_key(skey, rel, idxrel,
-						 pkey_sent ? &old_tuple : &new_tuple);
+	fill_index_scan_key(skey, &rs->replidxKey,
+						pkey_sent ? &old_tuple : &new_tuple);
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
 	/* look for tuple identified by the (old) primary key */
-	found_tuple = find_pkey_tuple(skey, rel, idxrel, oldslot, true,
+	found_tuple = find_pkey_tuple(skey, rel, rs->replidx, rs->oldslot, true,
 						pkey_sent ? LockTupleExclusive : LockTupleNoKeyExclusive);
 
 	if (found_tuple)
 	{
-		remote_tuple = heap_modify_tuple(oldslot->tts_tuple,
+		remote_tuple = heap_modify_tuple(rs->oldslot->tts_tuple,
 										 RelationGetDescr(rel),
 										 new_tuple.values,
 										 new_tuple.isnull,
 										 new_tuple.changed);
 
-		ExecStoreTuple(remote_tuple, newslot, InvalidBuffer, true);
+		ExecStoreTuple(remote_tuple, rs->newslot, InvalidBuffer, true);
 
 #ifdef VERBOSE_UPDATE
 		{
 			StringInfoData o;
 			initStringInfo(&o);
-			tuple_to_stringinfo(&o, RelationGetDescr(rel), oldslot->tts_tuple, false);
+			tuple_to_stringinfo(&o, RelationGetDescr(rel), rs->oldslot->tts_tuple, false);
 			appendStringInfo(&o, " to");
 			tuple_to_stringinfo(&o, RelationGetDescr(rel), remote_tuple, false);
 			MTM_LOG1("%lu: UPDATE: %s", GetCurrentTransactionId(), o.data);
@@ -983,8 +1245,8 @@ process_remote_update(StringInfo s, Relation rel)
 		}
 #endif
 
-        simple_heap_update(rel, &oldslot->tts_tuple->t_self, newslot->tts_tuple);
-        UserTableUpdateIndexes(estate, newslot);
+        simple_heap_update(rel, &rs->oldslot->tts_tuple->t_self, rs->newslot->tts_tuple);
+        UserTableUpdateOpenIndexes(rs->estate, rs->newslot);
 	}
 	else
 	{
@@ -996,12 +1258,10 @@ process_remote_update(StringInfo s, Relation rel)
 	}
     
 	PopActiveSnapshot();
-    
-	/* release locks upon commit */
-	index_close(idxrel, NoLock);
-    
-	ExecResetTupleTable(estate->es_tupleTable, true);
-	FreeExecutorState(estate);
+
+	ExecClearTuple(rs->newslot);
+	ExecClearTuple(rs->oldslot);
+	ResetPerTupleExprContext(rs->estate);
 
 	CommandCounterIncrement();
 }
@@ -1009,34 +1269,22 @@ process_remote_update(StringInfo s, Relation rel)
 static void
 process_remote_delete(StringInfo s, Relation rel)
 {
-	EState	   *estate;
+	MtmApplyRelState *rs;
 	TupleData   oldtup;
-	TupleTableSlot *oldslot;
-	Oid			idxoid;
-	Relation	idxrel;
 	ScanKeyData skey[INDEX_MAX_KEYS];
 	bool		found_old;
 
-	estate = create_rel_estate(rel);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel));
+	rs = get_rel_state(rel);
 
 	read_tuple_parts(s, rel, &oldtup);
 
-	/* lookup index to build scankey */
-	if (rel->rd_indexvalid == 0)
-		RelationGetIndexList(rel);
-	idxoid = rel->rd_replidindex;
-	if (!OidIsValid(idxoid))
+	if (rs->replidx == NULL)
 	{
 		MTM_ELOG(ERROR, "could not find primary key for table with oid %u",
 			 RelationGetRelid(rel));
 		return;
 	}
 
-	/* Now open the primary key index */
-	idxrel = index_open(idxoid, RowExclusiveLock);
-
 	if (rel->rd_rel->relkind != RELKIND_RELATION)
 		MTM_ELOG(ERROR, "unexpected relkind '%c' rel \"%s\"",
 			 rel->rd_rel->relkind, RelationGetRelationName(rel));
@@ -1046,21 +1294,21 @@ process_remote_delete(StringInfo s, Relation rel)
 		HeapTuple tup;
 		tup = heap_form_tuple(RelationGetDescr(rel),
 							  oldtup.values, oldtup.isnull);
-		ExecStoreTuple(tup, oldslot, InvalidBuffer, true);
+		ExecStoreTuple(tup, rs->oldslot, InvalidBuffer, true);
 	}
-	log_tuple("DELETE old-key:%s", RelationGetDescr(rel), oldslot->tts_tuple);
+	log_tuple("DELETE old-key:%s", RelationGetDescr(rel), rs->oldslot->tts_tuple);
 #endif
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
-	build_index_scan_key(skey, rel, idxrel, &oldtup);
+	fill_index_scan_key(skey, &rs->replidxKey, &oldtup);
 
 	/* try to find tuple via a (candidate|primary) key */
-	found_old = find_pkey_tuple(skey, rel, idxrel, oldslot, true, LockTupleExclusive);
+	found_old = find_pkey_tuple(skey, rel, rs->replidx, rs->oldslot, true, LockTupleExclusive);
 
 	if (found_old)
 	{
-		simple_heap_delete(rel, &oldslot->tts_tuple->t_self);
+		simple_heap_delete(rel, &rs->oldslot->tts_tuple->t_self);
 	}
 	else
 	{
@@ -1072,10 +1320,7 @@ process_remote_delete(StringInfo s, Relation rel)
 
 	PopActiveSnapshot();
 
-	index_close(idxrel, NoLock);
-
-	ExecResetTupleTable(estate->es_tupleTable, true);
-	FreeExecutorState(estate);
+	ExecClearTuple(rs->oldslot);
 
 	CommandCounterIncrement();
 }
@@ -1087,8 +1332,11 @@ void MtmExecutor(void* work, size_t size)
 	int spill_file = -1;
 	int save_cursor = 0;
 	int save_len = 0;
+	char* save_data = NULL;
+	MtmStream* volatile stream = NULL;
 	MemoryContext old_context;
 	MemoryContext top_context;
+	timestamp_t start = MtmGetSystemTime();
 
     s.data = work;
     s.len = size;
@@ -1101,6 +1349,13 @@ void MtmExecutor(void* work, size_t size)
 												ALLOCSET_DEFAULT_MINSIZE,
 												ALLOCSET_DEFAULT_INITSIZE,
 												ALLOCSET_DEFAULT_MAXSIZE);
+    }
+    if (MtmApplyBufferContext == NULL) {
+        MtmApplyBufferContext = AllocSetContextCreate(TopMemoryContext,
+													  "ApplyBufferContext",
+													  ALLOCSET_DEFAULT_MINSIZE,
+													  ALLOCSET_DEFAULT_INITSIZE,
+													  ALLOCSET_DEFAULT_MAXSIZE);
     }
 	top_context = MemoryContextSwitchTo(MtmApplyContext);
 	replorigin_session_origin = InvalidRepOriginId;
@@ -1108,8 +1363,36 @@ void MtmExecutor(void* work, size_t size)
     {    
 		bool inside_transaction = true;
         do { 
-            char action = pq_getmsgbyte(&s);
+            char action;
+
+			if (stream != NULL && s.cursor == s.len) {
+				/* Get next message of streamed transaction: rest of transaction may be redirected to the spill file */
+				uint32 len;
+				if (spill_file >= 0) {
+					MtmReadSpillFile(spill_file, (char*)&len, sizeof len);
+				} else {
+					MtmStreamRead(stream, &len, sizeof len);
+				}
+				if (s.data == work) {
+					s.data = MemoryContextAlloc(MtmApplyBufferContext, len);
+					s.maxlen = len;
+				} else if ((int)len > s.maxlen) {
+					s.data = repalloc(s.data, len);
+					s.maxlen = len;
+				}
+				if (spill_file >= 0) {
+					MtmReadSpillFile(spill_file, s.data, len);
+				} else {
+					MtmStreamRead(stream, s.data, len);
+				}
+				s.cursor = 0;
+				s.len = len;
+			}
+			action = pq_getmsgbyte(&s);
 			old_context = MemoryContextSwitchTo(MtmApplyContext);
+
+			if (action != 'I' && action != 'X')
+				flush_remote_inserts();
 	
             MTM_LOG2("%d: REMOTE process action %c", MyProcPid, action);
 #if 0
@@ -1126,6 +1409,7 @@ void MtmExecutor(void* work, size_t size)
                 /* COMMIT */
             case 'C':
   			    close_rel(rel);
+				release_rel_states();
                 process_remote_commit(&s);
 				inside_transaction = false;
                 break;
@@ -1133,6 +1417,10 @@ void MtmExecutor(void* work, size_t size)
             case 'I':
 			    process_remote_insert(&s, rel);
                 break;
+                /* columnar batch of INSERTs */
+            case 'X':
+			    process_remote_batch(&s, rel);
+                break;
                 /* UPDATE */
             case 'U':
                 process_remote_update(&s, rel);
@@ -1156,7 +1444,8 @@ void MtmExecutor(void* work, size_t size)
  		    case '(':
 			{
 			    size_t size = pq_getmsgint(&s, 4);    
-				s.data = MemoryContextAlloc(TopMemoryContext, size);
+				save_data = s.data;
+				s.data = MemoryContextAlloc(MtmApplyBufferContext, size);
 				save_cursor = s.cursor;
 				save_len = s.len;
 				s.cursor = 0;
@@ -1164,10 +1453,29 @@ void MtmExecutor(void* work, size_t size)
 				MtmReadSpillFile(spill_file, s.data, size);
 				break;
 			}
+			case 'T':
+			{
+				/* Transaction is streamed by receiver: following messages are read from the stream */
+				int node_id = pq_getmsgint(&s, 4);
+				Assert(stream == NULL);
+				stream = MtmGetStream(node_id);
+				MtmStreamAttach(stream);
+				break;
+			}
+			case 'S':
+			{
+				/* Rest of streamed transaction is written to the spill file: wait until it is completely received */
+				int node_id = pq_getmsgint(&s, 4);
+				int file_id = pq_getmsgint(&s, 4);
+				Assert(stream != NULL && spill_file < 0);
+				MtmStreamWaitCompletion(stream);
+				spill_file = MtmOpenSpillFile(node_id, file_id);
+				break;
+			}
   		    case ')':
 			{
   			    pfree(s.data);
-				s.data = work;
+				s.data = save_data;
   			    s.cursor = save_cursor;
 				s.len = save_len;
 				break;
@@ -1192,6 +1500,7 @@ void MtmExecutor(void* work, size_t size)
 			{
   			    close_rel(rel);
 				rel = NULL;
+				release_rel_states();
 				inside_transaction = !process_remote_message(&s);
 				break;
 			}
@@ -1207,9 +1516,20 @@ void MtmExecutor(void* work, size_t size)
 			MemoryContextSwitchTo(old_context);
 			MemoryContextResetAndDeleteChildren(MtmApplyContext);
         } while (inside_transaction);
+		release_rel_states();
+		if (stream != NULL) {
+			MtmStreamDetach(stream, false);
+		}
+		if (BgwPoolItemEnqueueTime != 0) {
+			MtmLatencyRecord(MTM_LATENCY_APPLY_QUEUE, MtmReplicationNodeId, BgwPoolItemEnqueueTime, start);
+		}
+		MtmLatencyRecord(MTM_LATENCY_APPLY, MtmReplicationNodeId, start, MtmGetSystemTime());
     }
     PG_CATCH();
     {
+		if (stream != NULL) {
+			MtmStreamDetach(stream, true);
+		}
 		old_context = MemoryContextSwitchTo(MtmApplyContext);
 		MtmHandleApplyError();
 		MemoryContextSwitchTo(old_context);
@@ -1218,13 +1538,13 @@ void MtmExecutor(void* work, size_t size)
 		MTM_LOG1("%d: REMOTE begin abort transaction %llu", MyProcPid, (long64)MtmGetCurrentTransactionId());
 		MtmEndSession(MtmReplicationNodeId, false);
         AbortCurrentTransaction();
+		reset_rel_states();
 		Assert(!MtmTransIsActive());
 		MTM_LOG2("%d: REMOTE end abort transaction %llu", MyProcPid, (long64)MtmGetCurrentTransactionId());
     }
     PG_END_TRY();
-	if (s.data != work) { 
-		pfree(s.data);
-	}
+	/* Release buffers also when transaction is aborted in the middle of spilled chunk or streamed message */
+	MemoryContextReset(MtmApplyBufferContext);
 #if 0 /* spill file is expecrted to be closed by tranaction commit or rollback */
 	if (spill_file >= 0) { 
 		MtmCloseSpillFile(spill_file);
@@ -0,0 +1,393 @@
+/*
+ * pglogical_codec.c
+ *
+ * Compact encoding of replication stream: columnar batches of inserted tuples and pglz compression of messages.
+ *
+ * Batch record is 'X', number of columns (int16), number of rows (int32) followed by length (int32) and
+ * encoded values of each column. Each value starts with a kind byte:
+ *   'n', 'u'           - null or unchanged toast value, as in the tuple record
+ *   'b', 's', 't'      - literal value: length (int32) and data, as in the tuple record
+ *   'd'                - integer value: zigzag varint delta from the previous literal or delta value of the column
+ *   'p'                - varint index of one of MTM_BATCH_DICT_SIZE recently sent distinct values of the column
+ * Binary values of length 1, 2, 4 or 8 are considered integers, other literals not longer than
+ * MTM_BATCH_DICT_MAX_LEN are placed in the dictionary. Encoder and decoder maintain the same state of the column,
+ * so no extra information is transferred.
+ *
+ * Compressed message is 'z', size of the original message (int32) and its pglz compressed data.
+ */
+#include "postgres.h"
+#include "common/pg_lzcompress.h"
+#include "libpq/pqformat.h"
+
+#include "pglogical_codec.h"
+
+static bool
+MtmBatchIsInteger(char kind, int len)
+{
+	return kind == 'b' && (len == 1 || len == 2 || len == 4 || len == 8);
+}
+
+static int64
+MtmBatchGetInteger(char const* data, int len)
+{
+	switch (len) {
+	  case 1:
+		return *(int8 const*)data;
+	  case 2:
+	  {
+		int16 val;
+		memcpy(&val, data, sizeof val);
+		return val;
+	  }
+	  case 4:
+	  {
+		int32 val;
+		memcpy(&val, data, sizeof val);
+		return val;
+	  }
+	  default:
+	  {
+		int64 val;
+		memcpy(&val, data, sizeof val);
+		return val;
+	  }
+	}
+}
+
+static void
+MtmBatchSetInteger(char* data, int len, int64 val)
+{
+	switch (len) {
+	  case 1:
+		*(int8*)data = (int8)val;
+		break;
+	  case 2:
+	  {
+		int16 v = (int16)val;
+		memcpy(data, &v, sizeof v);
+		break;
+	  }
+	  case 4:
+	  {
+		int32 v = (int32)val;
+		memcpy(data, &v, sizeof v);
+		break;
+	  }
+	  default:
+		memcpy(data, &val, sizeof val);
+	}
+}
+
+static void
+MtmBatchSendVarint(StringInfo buf, uint64 val)
+{
+	while (val >= 0x80) {
+		appendStringInfoCharMacro(buf, (char)(val | 0x80));
+		val >>= 7;
+	}
+	appendStringInfoCharMacro(buf, (char)val);
+}
+
+static uint64
+MtmBatchGetVarint(StringInfo buf)
+{
+	uint64 val = 0;
+	int shift = 0;
+	int b;
+
+	do {
+		if (shift > 63) {
+			elog(ERROR, "Invalid varint in columnar batch");
+		}
+		b = pq_getmsgbyte(buf);
+		val |= (uint64)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	return val;
+}
+
+/*
+ * Map signed delta to unsigned value, so that deltas with small absolute value have short varint representation
+ */
+static uint64
+MtmBatchZigzag(uint64 delta)
+{
+	return (delta << 1) ^ (uint64)((int64)delta >> 63);
+}
+
+static uint64
+MtmBatchUnzigzag(uint64 val)
+{
+	return (val >> 1) ^ (uint64)-(int64)(val & 1);
+}
+
+static void
+MtmBatchDictAdd(MtmBatchColumn* col, char kind, int len, int offs, char const* data)
+{
+	MtmBatchDictEntry* e = &col->dict[col->nextDict];
+
+	e->kind = kind;
+	e->len = len;
+	e->offs = offs;
+	e->data = data;
+	col->nextDict = (col->nextDict + 1) % MTM_BATCH_DICT_SIZE;
+	if (col->nDict < MTM_BATCH_DICT_SIZE) {
+		col->nDict += 1;
+	}
+}
+
+static void
+MtmBatchEncodeCell(MtmBatchColumn* col, MtmBatchCell* cell)
+{
+	StringInfo buf = &col->buf;
+	int i;
+
+	if (cell->kind == 'n' || cell->kind == 'u') {
+		appendStringInfoCharMacro(buf, cell->kind);
+		return;
+	}
+	if (MtmBatchIsInteger(cell->kind, cell->len)) {
+		int64 val = MtmBatchGetInteger(cell->data, cell->len);
+		if (col->prevLen == cell->len) {
+			appendStringInfoCharMacro(buf, 'd');
+			MtmBatchSendVarint(buf, MtmBatchZigzag((uint64)val - (uint64)col->prev));
+			col->prev = val;
+			return;
+		}
+		col->prev = val;
+		col->prevLen = cell->len;
+	} else if (cell->len <= MTM_BATCH_DICT_MAX_LEN) {
+		for (i = 0; i < col->nDict; i++) {
+			MtmBatchDictEntry* e = &col->dict[i];
+			if (e->kind == cell->kind && e->len == cell->len && memcmp(buf->data + e->offs, cell->data, cell->len) == 0) {
+				appendStringInfoCharMacro(buf, 'p');
+				MtmBatchSendVarint(buf, i);
+				return;
+			}
+		}
+		MtmBatchDictAdd(col, cell->kind, cell->len, buf->len + 1 + 4, NULL);
+	}
+	appendStringInfoCharMacro(buf, cell->kind);
+	pq_sendint(buf, cell->len, 4);
+	appendBinaryStringInfo(buf, cell->data, cell->len);
+}
+
+static void
+MtmBatchDecodeCell(MtmBatchColumn* col, MtmBatchCell* cell)
+{
+	StringInfo buf = &col->buf;
+	char kind = pq_getmsgbyte(buf);
+
+	switch (kind) {
+	  case 'n':
+	  case 'u':
+		cell->kind = kind;
+		cell->len = 0;
+		cell->data = NULL;
+		break;
+	  case 'd':
+		if (col->prevLen == 0) {
+			elog(ERROR, "Delta without base value in columnar batch");
+		}
+		col->prev = (int64)((uint64)col->prev + MtmBatchUnzigzag(MtmBatchGetVarint(buf)));
+		MtmBatchSetInteger((char*)&col->scratch, col->prevLen, col->prev);
+		cell->kind = 'b';
+		cell->len = col->prevLen;
+		cell->data = (char const*)&col->scratch;
+		break;
+	  case 'p':
+	  {
+		uint64 i = MtmBatchGetVarint(buf);
+		MtmBatchDictEntry* e;
+		if (i >= (uint64)col->nDict) {
+			elog(ERROR, "Invalid dictionary reference %llu in columnar batch", (long long unsigned)i);
+		}
+		e = &col->dict[i];
+		cell->kind = e->kind;
+		cell->len = e->len;
+		cell->data = e->data;
+		break;
+	  }
+	  case 'b':
+	  case 's':
+	  case 't':
+		cell->kind = kind;
+		cell->len = pq_getmsgint(buf, 4);
+		cell->data = pq_getmsgbytes(buf, cell->len);
+		if (MtmBatchIsInteger(kind, cell->len)) {
+			col->prev = MtmBatchGetInteger(cell->data, cell->len);
+			col->prevLen = cell->len;
+		} else if (cell->len <= MTM_BATCH_DICT_MAX_LEN) {
+			MtmBatchDictAdd(col, kind, cell->len, 0, cell->data);
+		}
+		break;
+	  default:
+		elog(ERROR, "Unknown value kind '%c' in columnar batch", kind);
+	}
+}
+
+static void
+MtmBatchResetColumn(MtmBatchColumn* col)
+{
+	col->prevLen = 0;
+	col->nDict = 0;
+	col->nextDict = 0;
+}
+
+/*
+ * Create encoder of batch. Columns are allocated in the current memory context.
+ */
+MtmBatch*
+MtmBatchCreate(int natts)
+{
+	MtmBatch* batch = (MtmBatch*)palloc0(sizeof(MtmBatch));
+	int i;
+
+	batch->natts = natts;
+	batch->columns = (MtmBatchColumn*)palloc0(natts * sizeof(MtmBatchColumn));
+	for (i = 0; i < natts; i++) {
+		initStringInfo(&batch->columns[i].buf);
+	}
+	return batch;
+}
+
+void
+MtmBatchFree(MtmBatch* batch)
+{
+	int i;
+
+	for (i = 0; i < batch->natts; i++) {
+		pfree(batch->columns[i].buf.data);
+	}
+	pfree(batch->columns);
+	pfree(batch);
+}
+
+void
+MtmBatchAddRow(MtmBatch* batch, MtmBatchCell* cells)
+{
+	int i;
+
+	for (i = 0; i < batch->natts; i++) {
+		MtmBatchColumn* col = &batch->columns[i];
+		int len = col->buf.len;
+		MtmBatchEncodeCell(col, &cells[i]);
+		batch->size += col->buf.len - len;
+	}
+	batch->nrows += 1;
+}
+
+/*
+ * Write batch record to the output stream and make batch empty
+ */
+void
+MtmBatchWrite(StringInfo out, MtmBatch* batch)
+{
+	int i;
+
+	pq_sendbyte(out, 'X');
+	pq_sendint(out, batch->natts, 2);
+	pq_sendint(out, batch->nrows, 4);
+	enlargeStringInfo(out, batch->size + batch->natts*4);
+	for (i = 0; i < batch->natts; i++) {
+		MtmBatchColumn* col = &batch->columns[i];
+		pq_sendint(out, col->buf.len, 4);
+		appendBinaryStringInfo(out, col->buf.data, col->buf.len);
+		resetStringInfo(&col->buf);
+		MtmBatchResetColumn(col);
+	}
+	batch->nrows = 0;
+	batch->size = 0;
+}
+
+/*
+ * Prepare decoding of batch record following 'X' in the message. Decoded values point to the message,
+ * so it should not be released until all rows are processed.
+ */
+void
+MtmBatchRead(MtmBatch* batch, StringInfo s)
+{
+	int i;
+
+	batch->natts = pq_getmsgint(s, 2);
+	batch->nrows = pq_getmsgint(s, 4);
+	batch->row = 0;
+	batch->size = 0;
+	batch->columns = (MtmBatchColumn*)palloc(batch->natts * sizeof(MtmBatchColumn));
+	for (i = 0; i < batch->natts; i++) {
+		MtmBatchColumn* col = &batch->columns[i];
+		col->buf.len = pq_getmsgint(s, 4);
+		col->buf.data = (char*)pq_getmsgbytes(s, col->buf.len);
+		col->buf.maxlen = -1;
+		col->buf.cursor = 0;
+		MtmBatchResetColumn(col);
+	}
+}
+
+/*
+ * Decode values of the next row of the batch. Value restored from delta is valid until the next call.
+ */
+bool
+MtmBatchNextRow(MtmBatch* batch, MtmBatchCell* cells)
+{
+	int i;
+
+	if (batch->row == batch->nrows) {
+		return false;
+	}
+	for (i = 0; i < batch->natts; i++) {
+		MtmBatchDecodeCell(&batch->columns[i], &cells[i]);
+	}
+	batch->row += 1;
+	return true;
+}
+
+/*
+ * Append compressed representation of the message to the output buffer.
+ * Returns false if message is too small or can not be compressed.
+ */
+bool
+MtmCompressMessage(StringInfo out, char const* msg, int len)
+{
+	int32 size;
+
+	if (len < MTM_COMPRESS_MIN_SIZE) {
+		return false;
+	}
+	/* compressed data is placed after header, which is written when size of data is known */
+	enlargeStringInfo(out, 1 + 4 + PGLZ_MAX_OUTPUT(len));
+	size = pglz_compress(msg, len, out->data + out->len + 1 + 4, PGLZ_strategy_default);
+	if (size < 0) {
+		return false;
+	}
+	pq_sendbyte(out, 'z');
+	pq_sendint(out, len, 4);
+	out->len += size;
+	out->data[out->len] = '\0';
+	return true;
+}
+
+/*
+ * Restore original message from the compressed one. Returned buffer is allocated in the current memory context.
+ */
+char*
+MtmDecompressMessage(char const* msg, int len, int* rawLen)
+{
+	StringInfoData s;
+	char* raw;
+	int32 size;
+
+	s.data = (char*)msg;
+	s.len = len;
+	s.maxlen = -1;
+	s.cursor = 1; /* skip 'z' */
+
+	size = pq_getmsgint(&s, 4);
+	raw = (char*)palloc(size);
+	if (pglz_decompress(msg + s.cursor, len - s.cursor, raw, size) != size) {
+		elog(ERROR, "Failed to decompress replication message of size %d", size);
+	}
+	*rawLen = size;
+	return raw;
+}
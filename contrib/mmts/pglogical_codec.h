@@ -0,0 +1,65 @@
+#ifndef __PGLOGICAL_CODEC_H__
+#define __PGLOGICAL_CODEC_H__
+
+#include "lib/stringinfo.h"
+
+#define MTM_BATCH_MAX_ROWS      1000          /* maximal number of rows in columnar batch */
+#define MTM_BATCH_MAX_SIZE      (1024*1024)   /* maximal size of encoded columns of the batch */
+#define MTM_BATCH_DICT_SIZE     32            /* number of recent distinct values remembered for each column */
+#define MTM_BATCH_DICT_MAX_LEN  256           /* longer values are not placed in the dictionary */
+#define MTM_COMPRESS_MIN_SIZE   256           /* smaller messages are not compressed */
+
+/*
+ * Value of a column: kind is 'n' (null), 'u' (unchanged toast), 'b', 's' or 't' as in the tuple record,
+ * data and len are not used for null and unchanged values.
+ */
+typedef struct
+{
+	char        kind;
+	int         len;
+	char const* data;
+} MtmBatchCell;
+
+typedef struct
+{
+	char        kind;
+	int         len;
+	int         offs;     /* encoder: offset of the value in the column buffer */
+	char const* data;     /* decoder: pointer to the value in the received message */
+} MtmBatchDictEntry;
+
+typedef struct
+{
+	StringInfoData buf;   /* encoded values of the column */
+	int64  prev;          /* previous value of integer column */
+	int    prevLen;       /* length of previous integer value, 0 if there is none */
+	int    nDict;         /* number of used dictionary entries */
+	int    nextDict;      /* dictionary entry to be replaced next */
+	int64  scratch;       /* decoder: value restored from delta */
+	MtmBatchDictEntry dict[MTM_BATCH_DICT_SIZE];
+} MtmBatchColumn;
+
+/*
+ * Consecutive inserts into the same relation transferred in column-major layout
+ */
+typedef struct
+{
+	int natts;            /* number of live attributes */
+	int nrows;
+	int row;              /* decoder: number of rows already returned */
+	int size;             /* encoder: total size of encoded columns */
+	MtmBatchColumn* columns;
+} MtmBatch;
+
+extern MtmBatch* MtmBatchCreate(int natts);
+extern void MtmBatchFree(MtmBatch* batch);
+extern void MtmBatchAddRow(MtmBatch* batch, MtmBatchCell* cells);
+extern void MtmBatchWrite(StringInfo out, MtmBatch* batch);
+
+extern void MtmBatchRead(MtmBatch* batch, StringInfo s);
+extern bool MtmBatchNextRow(MtmBatch* batch, MtmBatchCell* cells);
+
+extern bool MtmCompressMessage(StringInfo out, char const* msg, int len);
+extern char* MtmDecompressMessage(char const* msg, int len, int* rawLen);
+
+#endif
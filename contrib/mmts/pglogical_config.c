@@ -74,7 +74,9 @@ enum {
 	PARAM_PG_VERSION,
 	PARAM_FORWARD_CHANGESETS,
 	PARAM_HOOKS_SETUP_FUNCTION,
-	PARAM_NO_TXINFO
+	PARAM_NO_TXINFO,
+	PARAM_MTM_COMPRESSION,
+	PARAM_MTM_COLUMNAR_INSERTS
 } OutputPluginParamKey;
 
 typedef struct {
@@ -102,6 +104,8 @@ static OutputPluginParam param_lookup[] = {
 	{"forward_changesets", PARAM_FORWARD_CHANGESETS},
 	{"hooks.setup_function", PARAM_HOOKS_SETUP_FUNCTION},
 	{"no_txinfo", PARAM_NO_TXINFO},
+	{"mtm_compression", PARAM_MTM_COMPRESSION},
+	{"mtm_columnar_inserts", PARAM_MTM_COLUMNAR_INSERTS},
 	{NULL, PARAM_UNRECOGNISED}
 };
 
@@ -253,6 +257,16 @@ process_parameters_v1(List *options, PGLogicalOutputData *data)
 				data->client_no_txinfo = DatumGetBool(val);
 				break;
 
+			case PARAM_MTM_COMPRESSION:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_mtm_compression = DatumGetBool(val);
+				break;
+
+			case PARAM_MTM_COLUMNAR_INSERTS:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_mtm_columnar_inserts = DatumGetBool(val);
+				break;
+
 			case PARAM_UNRECOGNISED:
 				ereport(DEBUG1,
 						(MTM_ERRMSG("Unrecognised pglogical parameter %s ignored", elem->defname)));
@@ -16,6 +16,7 @@
 #include "pglogical_output.h"
 #include "pglogical_proto.h"
 #include "pglogical_hooks.h"
+#include "pglogical_codec.h"
 
 #include "access/hash.h"
 #include "access/sysattr.h"
@@ -81,20 +82,48 @@ static bool startup_message_sent = false;
 
 #define OUTPUT_BUFFER_SIZE (16*1024*1024) 
 
+static int MtmOutputDataOffset; /* offset of message data in ctx->out after header written by OutputPluginPrepareWrite */
+
+static void MtmOutputPluginPrepare(LogicalDecodingContext *ctx, bool last_write)
+{
+	OutputPluginPrepareWrite(ctx, last_write);
+	MtmOutputDataOffset = ctx->out->len;
+}
+
+/*
+ * Send prepared message, replacing its data with compressed one if receiver asked for compression
+ */
+static void MtmOutputPluginSend(LogicalDecodingContext *ctx, bool last_write)
+{
+	PGLogicalOutputData* data = (PGLogicalOutputData*)ctx->output_plugin_private;
+	StringInfo out = ctx->out;
+
+	if (data->client_mtm_compression && out->len - MtmOutputDataOffset >= MTM_COMPRESS_MIN_SIZE) {
+		StringInfoData buf;
+		initStringInfo(&buf);
+		if (MtmCompressMessage(&buf, out->data + MtmOutputDataOffset, out->len - MtmOutputDataOffset)) {
+			out->len = MtmOutputDataOffset;
+			appendBinaryStringInfo(out, buf.data, buf.len);
+		}
+		pfree(buf.data);
+	}
+	OutputPluginWrite(ctx, last_write);
+}
+
 void MtmOutputPluginWrite(LogicalDecodingContext *ctx, bool last_write, bool flush)
 {
 	if (flush) {
-		OutputPluginWrite(ctx, last_write);
+		MtmOutputPluginSend(ctx, last_write);
 	}
 }
 
 void MtmOutputPluginPrepareWrite(LogicalDecodingContext *ctx, bool last_write, bool flush)
 {
 	if (!ctx->prepared_write) { 
-		OutputPluginPrepareWrite(ctx, last_write);
+		MtmOutputPluginPrepare(ctx, last_write);
 	} else if (flush || ctx->out->len > OUTPUT_BUFFER_SIZE) {
-		OutputPluginWrite(ctx, false);
-		OutputPluginPrepareWrite(ctx, last_write);
+		MtmOutputPluginSend(ctx, false);
+		MtmOutputPluginPrepare(ctx, last_write);
 	}
 }
 
@@ -459,6 +488,9 @@ pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	PGLogicalOutputData* data = (PGLogicalOutputData*)ctx->output_plugin_private;
 
 	if (data->api) { 
+		/* Inserts accumulated by protocol belong to the data message of the transaction, not to commit message */
+		if (data->api->write_batch)
+			data->api->write_batch(ctx->out, data);
 		MtmOutputPluginPrepareWrite(ctx, true, true);
 		data->api->write_commit(ctx->out, data, txn, commit_lsn);
 		MtmOutputPluginWrite(ctx, true, true);
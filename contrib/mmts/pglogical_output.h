@@ -85,6 +85,8 @@ typedef struct PGLogicalOutputData
 	bool	client_forward_changesets_set;
 	bool	client_forward_changesets;
 	bool	client_no_txinfo;
+	bool	client_mtm_compression;      /* compress messages larger than MTM_COMPRESS_MIN_SIZE */
+	bool	client_mtm_columnar_inserts; /* send consecutive inserts as columnar batches */
 
 	/* hooks */
 	List *hooks_setup_funcname;
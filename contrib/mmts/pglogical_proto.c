@@ -38,6 +38,7 @@
 
 #include "multimaster.h"
 #include "pglogical_relid_map.h"
+#include "pglogical_codec.h"
 
 static int MtmTransactionRecords;
 static bool MtmIsFilteredTxn;
@@ -45,6 +46,9 @@ static TransactionId MtmCurrentXid;
 static bool DDLInProgress = false;
 static Oid MtmSenderTID; /* transaction identifier for WAL sender */
 static Oid MtmLastRelId; /* last relation ID sent to the receiver in this transaction */
+static MtmBatch* MtmSenderBatch; /* inserts into MtmSenderBatchRelId not yet written to the output stream */
+static Oid MtmSenderBatchRelId;
+static MemoryContext MtmSenderBatchContext;
 
 static void pglogical_write_rel(StringInfo out, PGLogicalOutputData *data, Relation rel);
 
@@ -61,8 +65,14 @@ static void pglogical_write_update(StringInfo out, PGLogicalOutputData *data,
 static void pglogical_write_delete(StringInfo out, PGLogicalOutputData *data,
 							Relation rel, HeapTuple oldtuple);
 
+static void pglogical_batch_insert(StringInfo out, PGLogicalOutputData *data,
+								   Relation rel, HeapTuple newtuple);
+static void pglogical_write_batch(StringInfo out, PGLogicalOutputData *data);
+
 static void pglogical_write_tuple(StringInfo out, PGLogicalOutputData *data,
 								  Relation rel, HeapTuple tuple);
+static void pglogical_write_attr(StringInfo out, PGLogicalOutputData *data,
+								 Form_pg_attribute att, Datum value, bool isnull);
 static char decide_datum_transfer(Form_pg_attribute att,
 								  Form_pg_type typclass,
 								  bool allow_internal_basetypes,
@@ -102,6 +112,8 @@ pglogical_write_rel(StringInfo out, PGLogicalOutputData *data, Relation rel)
 	}
 	MtmLastRelId = relid;
 
+	pglogical_write_batch(out, data);
+
 	pq_sendbyte(out, 'R');		/* sending RELATION */	
 	pq_sendint(out, relid, sizeof relid); /* use Oid as relation identifier */
 	
@@ -209,6 +221,7 @@ static void
 pglogical_write_message(StringInfo out, LogicalDecodingContext *ctx,
 						const char *prefix, Size sz, const char *message)
 {
+	pglogical_write_batch(out, ctx->output_plugin_private);
 	MtmLastRelId = InvalidOid;
 	switch (*prefix) { 
 	  case 'L':
@@ -380,6 +393,12 @@ pglogical_write_insert(StringInfo out, PGLogicalOutputData *data,
 	}
 
 	MtmTransactionRecords += 1;
+
+	/* Receiver asked to collect consecutive inserts into the same relation in columnar batch */
+	if (data->client_mtm_columnar_inserts) {
+		pglogical_batch_insert(out, data, rel, newtuple);
+		return;
+	}
 	pq_sendbyte(out, 'I');		/* action INSERT */
 	pglogical_write_tuple(out, data, rel, newtuple);
 
@@ -403,6 +422,7 @@ pglogical_write_update(StringInfo out, PGLogicalOutputData *data,
 	}
 
 	MtmTransactionRecords += 1;
+	pglogical_write_batch(out, data);
 
 	MTM_LOG3("%d: pglogical_write_update confirmed_flush=%llx", MyProcPid, (long64)MyReplicationSlot->data.confirmed_flush);
 
@@ -436,10 +456,99 @@ pglogical_write_delete(StringInfo out, PGLogicalOutputData *data,
 	}
 
 	MtmTransactionRecords += 1;
+	pglogical_write_batch(out, data);
 	pq_sendbyte(out, 'D');		/* action DELETE */
 	pglogical_write_tuple(out, data, rel, oldtuple);
 }
 
+/*
+ * Add inserted tuple to the columnar batch. Batch is written to the output stream when it is full
+ * or before any other record.
+ */
+static void
+pglogical_batch_insert(StringInfo out, PGLogicalOutputData *data,
+					   Relation rel, HeapTuple newtuple)
+{
+	TupleDesc	desc = RelationGetDescr(rel);
+	Datum		values[MaxTupleAttributeNumber];
+	bool		isnull[MaxTupleAttributeNumber];
+	MtmBatchCell *cells;
+	StringInfoData buf;
+	int			i;
+	int			nliveatts = 0;
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		if (!desc->attrs[i]->attisdropped)
+			nliveatts++;
+	}
+
+	if (MtmSenderBatch != NULL && (MtmSenderBatchRelId != RelationGetRelid(rel) || MtmSenderBatch->natts != nliveatts))
+	{
+		pglogical_write_batch(out, data);
+		if (MtmSenderBatch->natts != nliveatts)
+		{
+			MtmBatchFree(MtmSenderBatch);
+			MtmSenderBatch = NULL;
+		}
+	}
+	if (MtmSenderBatch == NULL)
+	{
+		MemoryContext old_context;
+		if (MtmSenderBatchContext == NULL)
+		{
+			MtmSenderBatchContext = AllocSetContextCreate(TopMemoryContext,
+														  "SenderBatchContext",
+														  ALLOCSET_DEFAULT_MINSIZE,
+														  ALLOCSET_DEFAULT_INITSIZE,
+														  ALLOCSET_DEFAULT_MAXSIZE);
+		}
+		old_context = MemoryContextSwitchTo(MtmSenderBatchContext);
+		MtmSenderBatch = MtmBatchCreate(nliveatts);
+		MemoryContextSwitchTo(old_context);
+	}
+	MtmSenderBatchRelId = RelationGetRelid(rel);
+
+	/* Encode attributes in the same way as in tuple record and split them into cells */
+	initStringInfo(&buf);
+	heap_deform_tuple(newtuple, desc, values, isnull);
+	for (i = 0; i < desc->natts; i++)
+	{
+		if (!desc->attrs[i]->attisdropped)
+			pglogical_write_attr(&buf, data, desc->attrs[i], values[i], isnull[i]);
+	}
+	cells = (MtmBatchCell*)palloc(nliveatts * sizeof(MtmBatchCell));
+	for (i = 0; i < nliveatts; i++)
+	{
+		cells[i].kind = pq_getmsgbyte(&buf);
+		if (cells[i].kind != 'n' && cells[i].kind != 'u')
+		{
+			cells[i].len = pq_getmsgint(&buf, 4);
+			cells[i].data = pq_getmsgbytes(&buf, cells[i].len);
+		}
+	}
+	MtmBatchAddRow(MtmSenderBatch, cells);
+	pfree(cells);
+	pfree(buf.data);
+
+	if (MtmSenderBatch->nrows >= MTM_BATCH_MAX_ROWS || MtmSenderBatch->size >= MTM_BATCH_MAX_SIZE)
+		pglogical_write_batch(out, data);
+}
+
+/*
+ * Write inserts accumulated in the columnar batch to the output stream
+ */
+static void
+pglogical_write_batch(StringInfo out, PGLogicalOutputData *data)
+{
+	if (MtmSenderBatch != NULL && MtmSenderBatch->nrows != 0)
+	{
+		MTM_LOG3("%d: pglogical_write_batch relid=%d rows=%d size=%d", MyProcPid, MtmSenderBatchRelId,
+				 MtmSenderBatch->nrows, MtmSenderBatch->size);
+		MtmBatchWrite(out, MtmSenderBatch);
+	}
+}
+
 /*
  * Most of the brains for startup message creation lives in
  * pglogical_config.c, so this presently just sends the set of key/value pairs.
@@ -497,114 +606,123 @@ pglogical_write_tuple(StringInfo out, PGLogicalOutputData *data,
 
 	for (i = 0; i < desc->natts; i++)
 	{
-		HeapTuple	typtup;
-		Form_pg_type typclass;
-		Form_pg_attribute att = desc->attrs[i];
-		char		transfer_type;
-
 		/* skip dropped columns */
-		if (att->attisdropped)
-			continue;
-
-		if (isnull[i])
-		{
-			pq_sendbyte(out, 'n');	/* null column */
-			continue;
-		}
-		else if (att->attlen == -1 && VARATT_IS_EXTERNAL_ONDISK(values[i]))
-		{
-			pq_sendbyte(out, 'u');	/* unchanged toast column */
+		if (desc->attrs[i]->attisdropped)
 			continue;
-		}
 
-		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
-		if (!HeapTupleIsValid(typtup))
-			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
-		typclass = (Form_pg_type) GETSTRUCT(typtup);
-
-		transfer_type = decide_datum_transfer(att, typclass,
-											  data->allow_internal_basetypes,
-											  data->allow_binary_basetypes);
-			
-        pq_sendbyte(out, transfer_type);
-		switch (transfer_type)
-		{
-			case 'b':	/* internal-format binary data follows */
+		pglogical_write_attr(out, data, desc->attrs[i], values[i], isnull[i]);
+	}
+}
 
-				/* pass by value */
-				if (att->attbyval)
-				{
-					pq_sendint(out, att->attlen, 4); /* length */
+/*
+ * Write value of the attribute: transfer kind followed by length and data.
+ */
+static void
+pglogical_write_attr(StringInfo out, PGLogicalOutputData *data,
+					 Form_pg_attribute att, Datum value, bool isnull)
+{
+	HeapTuple	typtup;
+	Form_pg_type typclass;
+	char		transfer_type;
 
-					enlargeStringInfo(out, att->attlen);
-					store_att_byval(out->data + out->len, values[i],
-									att->attlen);
-					out->len += att->attlen;
-					out->data[out->len] = '\0';
-				}
-				/* fixed length non-varlena pass-by-reference type */
-				else if (att->attlen > 0)
-				{
-					pq_sendint(out, att->attlen, 4); /* length */
+	if (isnull)
+	{
+		pq_sendbyte(out, 'n');	/* null column */
+		return;
+	}
+	else if (att->attlen == -1 && VARATT_IS_EXTERNAL_ONDISK(value))
+	{
+		pq_sendbyte(out, 'u');	/* unchanged toast column */
+		return;
+	}
 
-					appendBinaryStringInfo(out, DatumGetPointer(values[i]),
-										   att->attlen);
-				}
-				/* varlena type */
-				else if (att->attlen == -1)
-				{
-					char *data = DatumGetPointer(values[i]);
+	typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
+	if (!HeapTupleIsValid(typtup))
+		elog(ERROR, "cache lookup failed for type %u", att->atttypid);
+	typclass = (Form_pg_type) GETSTRUCT(typtup);
 
-					/* send indirect datums inline */
-					if (VARATT_IS_EXTERNAL_INDIRECT(values[i]))
-					{
-						struct varatt_indirect redirect;
-						VARATT_EXTERNAL_GET_POINTER(redirect, data);
-						data = (char *) redirect.pointer;
-					}
+	transfer_type = decide_datum_transfer(att, typclass,
+										  data->allow_internal_basetypes,
+										  data->allow_binary_basetypes);
 
-					Assert(!VARATT_IS_EXTERNAL(data));
+	pq_sendbyte(out, transfer_type);
+	switch (transfer_type)
+	{
+		case 'b':	/* internal-format binary data follows */
+
+			/* pass by value */
+			if (att->attbyval)
+			{
+				pq_sendint(out, att->attlen, 4); /* length */
+
+				enlargeStringInfo(out, att->attlen);
+				store_att_byval(out->data + out->len, value,
+								att->attlen);
+				out->len += att->attlen;
+				out->data[out->len] = '\0';
+			}
+			/* fixed length non-varlena pass-by-reference type */
+			else if (att->attlen > 0)
+			{
+				pq_sendint(out, att->attlen, 4); /* length */
 
-					pq_sendint(out, VARSIZE_ANY(data), 4); /* length */
+				appendBinaryStringInfo(out, DatumGetPointer(value),
+									   att->attlen);
+			}
+			/* varlena type */
+			else if (att->attlen == -1)
+			{
+				char *data = DatumGetPointer(value);
 
-					appendBinaryStringInfo(out, data, VARSIZE_ANY(data));
+				/* send indirect datums inline */
+				if (VARATT_IS_EXTERNAL_INDIRECT(value))
+				{
+					struct varatt_indirect redirect;
+					VARATT_EXTERNAL_GET_POINTER(redirect, data);
+					data = (char *) redirect.pointer;
 				}
-				else
-					elog(ERROR, "unsupported tuple type");
 
-				break;
+				Assert(!VARATT_IS_EXTERNAL(data));
 
-			case 's': /* binary send/recv data follows */
-				{
-					bytea	   *outputbytes;
-					int			len;
+				pq_sendint(out, VARSIZE_ANY(data), 4); /* length */
 
-					outputbytes = OidSendFunctionCall(typclass->typsend,
-													  values[i]);
+				appendBinaryStringInfo(out, data, VARSIZE_ANY(data));
+			}
+			else
+				elog(ERROR, "unsupported tuple type");
 
-					len = VARSIZE(outputbytes) - VARHDRSZ;
-					pq_sendint(out, len, 4); /* length */
-					pq_sendbytes(out, VARDATA(outputbytes), len); /* data */
-					pfree(outputbytes);
-				}
-				break;
+			break;
 
-			default:
-				{
-					char   	   *outputstr;
-					int			len;
-
-					outputstr =	OidOutputFunctionCall(typclass->typoutput,
-													  values[i]);
-					len = strlen(outputstr) + 1;
-					pq_sendint(out, len, 4); /* length */
-					appendBinaryStringInfo(out, outputstr, len); /* data */
-					pfree(outputstr);
-				}
-		}
+		case 's': /* binary send/recv data follows */
+			{
+				bytea	   *outputbytes;
+				int			len;
+
+				outputbytes = OidSendFunctionCall(typclass->typsend,
+												  value);
 
-		ReleaseSysCache(typtup);
+				len = VARSIZE(outputbytes) - VARHDRSZ;
+				pq_sendint(out, len, 4); /* length */
+				pq_sendbytes(out, VARDATA(outputbytes), len); /* data */
+				pfree(outputbytes);
+			}
+			break;
+
+		default:
+			{
+				char   	   *outputstr;
+				int			len;
+
+				outputstr =	OidOutputFunctionCall(typclass->typoutput,
+												  value);
+				len = strlen(outputstr) + 1;
+				pq_sendint(out, len, 4); /* length */
+				appendBinaryStringInfo(out, outputstr, len); /* data */
+				pfree(outputstr);
+			}
 	}
+
+	ReleaseSysCache(typtup);
 }
 
 /*
@@ -656,6 +774,7 @@ pglogical_init_api(PGLogicalProtoType typ)
     res->write_insert = pglogical_write_insert;
     res->write_update = pglogical_write_update;
     res->write_delete = pglogical_write_delete;
+    res->write_batch = pglogical_write_batch;
     res->write_caughtup = pglogical_write_caughtup;
 	res->setup_hooks = MtmSetupReplicationHooks;
     res->write_startup_message = write_startup_message;
@@ -37,6 +37,8 @@ typedef void (*pglogical_write_update_fn)(StringInfo out, struct PGLogicalOutput
 typedef void (*pglogical_write_delete_fn)(StringInfo out, struct PGLogicalOutputData *data,
 							 Relation rel, HeapTuple oldtuple);
 
+typedef void (*pglogical_write_batch_fn)(StringInfo out, struct PGLogicalOutputData *data);
+
 typedef void (*pglogical_write_caughtup_fn)(StringInfo out, struct PGLogicalOutputData *data,
 											XLogRecPtr wal_end_ptr);
 
@@ -54,6 +56,7 @@ typedef struct PGLogicalProtoAPI
 	pglogical_write_insert_fn	write_insert;
 	pglogical_write_update_fn	write_update;
 	pglogical_write_delete_fn	write_delete;
+	pglogical_write_batch_fn	write_batch;
 	pglogical_write_caughtup_fn	write_caughtup;
 	pglogical_setup_hooks_fn    setup_hooks;
 	write_startup_message_fn	write_startup_message;
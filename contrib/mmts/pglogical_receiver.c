@@ -24,6 +24,11 @@
 #include "access/xact.h"
 #include "access/clog.h"
 #include "access/transam.h"
+#include "access/hash.h"
+#include "access/heapam.h"
+#include "access/sysattr.h"
+#include "catalog/namespace.h"
+#include "nodes/makefuncs.h"
 #include "lib/stringinfo.h"
 #include "libpq/pqformat.h"
 #include "pgstat.h"
@@ -34,6 +39,9 @@
 #include "utils/guc.h"
 #include "utils/snapmgr.h"
 #include "utils/memutils.h"
+#include "utils/hsearch.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
 #include "executor/spi.h"
 #include "replication/origin.h"
 #include "utils/portal.h"
@@ -43,6 +51,8 @@
 #include "multimaster.h"
 #include "spill.h"
 #include "state.h"
+#include "stream.h"
+#include "pglogical_codec.h"
 
 #define ERRCODE_DUPLICATE_OBJECT_STR  "42710"
 #define RECEIVER_SUSPEND_TIMEOUT (1*USECS_PER_SEC)
@@ -66,6 +76,58 @@ lsn_t MtmSenderWalEnd;
 static void fe_sendint64(int64 i, char *buf);
 static int64 fe_recvint64(char *buf);
 
+/*
+ * Replica identity key of relation: indexes of key columns among live attributes of transferred tuple
+ */
+typedef struct
+{
+	Oid  remote_relid;
+	Oid  local_relid;                /* relation OID at this node: it is used in keys to detect conflicts between nodes */
+	int  nKeyAtts;                   /* -1 if relation has no replica identity key: relation itself is used as key */
+	int  keyAtts[INDEX_MAX_KEYS];
+} MtmRelationKey;
+
+static HTAB* MtmRelationKeys;        /* remote relation OID -> replica identity key */
+static MtmRelationKey* MtmCurrentRelation;
+static bool MtmRelationKeysStale;    /* received DDL is not applied yet, so local catalog can not be used to resolve keys */
+static BgwPoolWriteSet MtmWriteSet;  /* write set of currently received transaction */
+
+typedef struct
+{
+	pgid_t          gid;
+	BgwPoolWriteSet ws;
+} MtmRecoveryPreparedTxn;
+
+static HTAB* MtmRecoveryPrepared;    /* GID -> write set of transaction prepared during recovery */
+
+#define MTM_SPILL_BUFFER_SIZE (64*1024) /* messages smaller than this size are combined in single write to the spill file */
+
+/*
+ * Messages of currently received transaction. Buffers returned by PQgetCopyData are kept until transaction
+ * is passed to the apply queue, so messages are gathered directly into the queue without accumulating them
+ * in intermediate buffer. Apply worker then copies the item to its local memory and releases the queue slots
+ * before execution (see BgwPoolExecuteItem).
+ */
+typedef struct
+{
+	ByteBuffer fragments;  /* BgwPoolFragment for each message */
+	ByteBuffer copybufs;   /* buffers to be released by PQfreemem */
+	ByteBuffer rawbufs;    /* decompressed messages to be released by pfree */
+	size_t     size;       /* total size of messages */
+} MtmTransMessages;
+
+/*
+ * Transaction which size exceeds MtmTransSpillThreshold is streamed to the spill file as it is received.
+ * File is split into chunks not larger than MtmTransSpillThreshold, each chunk is loaded by apply worker at once.
+ */
+typedef struct
+{
+	int            file;       /* spill file descriptor or -1 if transaction is not spilled */
+	size_t         chunkSize;  /* size of current chunk */
+	ByteBuffer     buf;        /* write buffer combining small messages */
+	StringInfoData info;       /* message passed to the apply queue: spill file identifier and sizes of chunks */
+} MtmSpillState;
+
 static void
 receiver_raw_sigterm(SIGNAL_ARGS)
 {
@@ -197,6 +259,550 @@ feTimestampDifference(int64 start_time, int64 stop_time,
 	}
 }
 
+/*
+ * -------------------------------------------
+ * Write set of received transaction
+ * -------------------------------------------
+ */
+
+static MtmRelationKey*
+MtmResolveRelationKey(Oid remote_relid, char const* nspname, char const* relname)
+{
+	MtmRelationKey* rk;
+	bool found;
+
+	if (MtmRelationKeys == NULL) {
+		HASHCTL info;
+		MemSet(&info, 0, sizeof(info));
+		info.keysize = sizeof(Oid);
+		info.entrysize = sizeof(MtmRelationKey);
+		MtmRelationKeys = hash_create("MtmRelationKeys", 256, &info, HASH_ELEM | HASH_BLOBS);
+	}
+	rk = (MtmRelationKey*)hash_search(MtmRelationKeys, &remote_relid, nspname != NULL ? HASH_ENTER : HASH_FIND, &found);
+	if (rk != NULL && !found) {
+		MemoryContext ctx = CurrentMemoryContext;
+		bool startTx = !IsTransactionState();
+		Oid  relid;
+
+		rk->nKeyAtts = -1;
+		rk->local_relid = remote_relid;
+		if (startTx) {
+			StartTransactionCommand();
+		}
+		relid = RangeVarGetRelid(makeRangeVar((char*)nspname, (char*)relname, -1), NoLock, true);
+		if (OidIsValid(relid)) {
+			Relation rel = heap_open(relid, AccessShareLock);
+			TupleDesc desc = RelationGetDescr(rel);
+			Bitmapset* idattrs = RelationGetIndexAttrBitmap(rel, INDEX_ATTR_BITMAP_IDENTITY_KEY);
+			rk->local_relid = relid;
+			if (!bms_is_empty(idattrs) && rel->rd_rel->relreplident != REPLICA_IDENTITY_FULL) {
+				int i, live = 0;
+				rk->nKeyAtts = 0;
+				for (i = 0; i < desc->natts; i++) {
+					if (desc->attrs[i]->attisdropped) {
+						continue;
+					}
+					if (bms_is_member(i + 1 - FirstLowInvalidHeapAttributeNumber, idattrs) && rk->nKeyAtts < INDEX_MAX_KEYS) {
+						rk->keyAtts[rk->nKeyAtts++] = live;
+					}
+					live += 1;
+				}
+			}
+			heap_close(rel, AccessShareLock);
+		}
+		if (startTx) {
+			CommitTransactionCommand();
+		}
+		MemoryContextSwitchTo(ctx);
+	}
+	return rk;
+}
+
+/*
+ * Replica identity keys are resolved using local catalog, so them can not be cached across received DDL.
+ * Until DDL is applied by the pool all transactions are scheduled as barriers (them would wait for DDL anyway),
+ * then cache is flushed.
+ */
+static bool
+MtmRelationKeysAreStale(void)
+{
+	if (MtmRelationKeysStale) {
+		if (BgwPoolHasActiveBarrier(&Mtm->pool)) {
+			return true;
+		}
+		if (MtmRelationKeys != NULL) {
+			hash_destroy(MtmRelationKeys);
+			MtmRelationKeys = NULL;
+		}
+		MtmCurrentRelation = NULL;
+		MtmRelationKeysStale = false;
+	}
+	return false;
+}
+
+static void
+MtmWriteSetAddKey(BgwPoolWriteSet* ws, uint32 key)
+{
+	if (ws->nKeys != 0 && ws->keys[ws->nKeys-1] == key) {
+		return;
+	}
+	if (ws->nKeys == BGW_POOL_MAX_WRITE_SET) {
+		ws->barrier = true;
+	} else {
+		ws->keys[ws->nKeys++] = key;
+	}
+}
+
+static uint32
+MtmWriteSetHashAttr(uint32 key, char kind, char const* data, int len)
+{
+	return ((key << 1) | (key >> 31)) ^ (data != NULL ? DatumGetUInt32(hash_any((unsigned char const*)data, len)) : (uint32)kind);
+}
+
+/*
+ * Calculate hash of replica identity key of transferred tuple
+ */
+static void
+MtmWriteSetAddTuple(BgwPoolWriteSet* ws, StringInfo s)
+{
+	MtmRelationKey* rk = MtmCurrentRelation;
+	uint32 key;
+	int i, k = 0, natts;
+
+	if (rk == NULL) {
+		ws->barrier = true;
+		return;
+	}
+	key = DatumGetUInt32(hash_uint32(rk->local_relid));
+	if (pq_getmsgbyte(s) != 'T') {
+		ws->barrier = true;
+		return;
+	}
+	natts = pq_getmsgint(s, 2);
+	for (i = 0; i < natts; i++) {
+		char kind = pq_getmsgbyte(s);
+		char const* data = NULL;
+		int len = 0;
+		if (kind != 'n' && kind != 'u') {
+			len = pq_getmsgint(s, 4);
+			data = pq_getmsgbytes(s, len);
+		}
+		if (k < rk->nKeyAtts && rk->keyAtts[k] == i) {
+			key = MtmWriteSetHashAttr(key, kind, data, len);
+			k += 1;
+		}
+	}
+	MtmWriteSetAddKey(ws, key);
+}
+
+/*
+ * Calculate hashes of replica identity keys of tuples of columnar batch
+ */
+static void
+MtmWriteSetAddBatch(BgwPoolWriteSet* ws, StringInfo s)
+{
+	MtmRelationKey* rk = MtmCurrentRelation;
+	MtmBatch batch;
+	MtmBatchCell* cells;
+	int k;
+
+	MtmBatchRead(&batch, s);
+	if (rk == NULL || (rk->nKeyAtts != 0 && rk->keyAtts[rk->nKeyAtts-1] >= batch.natts)) {
+		ws->barrier = true;
+	} else {
+		cells = (MtmBatchCell*)palloc(batch.natts * sizeof(MtmBatchCell));
+		while (MtmBatchNextRow(&batch, cells)) {
+			uint32 key = DatumGetUInt32(hash_uint32(rk->local_relid));
+			for (k = 0; k < rk->nKeyAtts; k++) {
+				MtmBatchCell* cell = &cells[rk->keyAtts[k]];
+				key = MtmWriteSetHashAttr(key, cell->kind, cell->data, cell->len);
+			}
+			MtmWriteSetAddKey(ws, key);
+		}
+		pfree(cells);
+	}
+	pfree(batch.columns);
+}
+
+/*
+ * Update write set of the currently received transaction with the received message.
+ * Message contains sequence of records, there is no need to parse the rest of the message once write set
+ * becomes a barrier.
+ */
+static void
+MtmWriteSetAddMessage(BgwPoolWriteSet* ws, char const* stmt, int len)
+{
+	StringInfoData s;
+
+	s.data = (char*)stmt;
+	s.len = len;
+	s.maxlen = -1;
+	s.cursor = 0;
+
+	if (ws->barrier && stmt[0] != 'B') {
+		return;
+	}
+	do {
+		char action = pq_getmsgbyte(&s);
+		switch (action) {
+		  case 'B':
+			ws->barrier = MtmRelationKeysAreStale();
+			ws->nKeys = 0;
+			MtmCurrentRelation = NULL;
+			s.cursor += 4 + 8 + 8 + 8; /* node, xid, csn, participants mask */
+			break;
+		  case 'R':
+		  {
+			Oid  remote_relid = pq_getmsgint(&s, 4);
+			int  nspnamelen = pq_getmsgbyte(&s);
+			char const* nspname = nspnamelen != 0 ? pq_getmsgbytes(&s, nspnamelen) : NULL;
+			int  relnamelen = pq_getmsgbyte(&s);
+			char const* relname = relnamelen != 0 ? pq_getmsgbytes(&s, relnamelen) : NULL;
+			MtmCurrentRelation = MtmResolveRelationKey(remote_relid, nspname, relname);
+			break;
+		  }
+		  case 'I':
+		  case 'D':
+			MtmWriteSetAddTuple(ws, &s);
+			break;
+		  case 'X':
+			MtmWriteSetAddBatch(ws, &s);
+			break;
+		  case 'U':
+		  {
+			char kind = pq_getmsgbyte(&s);
+			if (kind == 'K') {
+				MtmWriteSetAddTuple(ws, &s);
+				kind = ws->barrier ? 0 : pq_getmsgbyte(&s);
+			}
+			if (kind == 'N') {
+				MtmWriteSetAddTuple(ws, &s);
+			} else {
+				ws->barrier = true;
+			}
+			break;
+		  }
+		  case 'M':
+		  {
+			char prefix = pq_getmsgbyte(&s);
+			int  size = pq_getmsgint(&s, 4);
+			pq_getmsgbytes(&s, size);
+			if (prefix == 'S') { /* snapshot */
+				break;
+			}
+			if (prefix == 'D') {
+				/* DDL can change replica identity of relations */
+				MtmRelationKeysStale = true;
+			}
+			ws->barrier = true;
+			break;
+		  }
+		  case 'N': /* sequence adjustment */
+			s.cursor += 8;
+			break;
+		  case 'C':
+			return;
+		  default:
+			ws->barrier = true;
+		}
+	} while (!ws->barrier && s.cursor < s.len);
+}
+
+/*
+ * Complete write set of transaction received during recovery for parallel apply.
+ * All records of two-phase transaction (PREPARE, COMMIT PREPARED, ABORT PREPARED) include hash of GID
+ * in their write sets, so them are applied in the same order as received. COMMIT PREPARED and ABORT PREPARED
+ * also inherit write set of the prepared transaction, so them are not reordered with conflicting transactions.
+ */
+static void
+MtmRecoveryWriteSet(BgwPoolWriteSet* ws, char const* stmt, int len)
+{
+	int event = stmt[1];
+	int gidPos = 1 + 1 + 1 + 8 + 8 + 8 + 1 + 8; /* 'C', event, node, commit_lsn, end_lsn, commit_time, origin_node, origin_lsn */
+	char const* gid;
+	MtmRecoveryPreparedTxn* ptx;
+	bool found;
+
+	if (event == PGLOGICAL_COMMIT) {
+		if (ws->nKeys == 0) {
+			ws->barrier = true;
+		}
+		return;
+	}
+	if (event == PGLOGICAL_COMMIT_PREPARED) {
+		gidPos += 8; /* csn */
+	}
+	if (gidPos >= len) {
+		ws->barrier = true;
+		return;
+	}
+	gid = stmt + gidPos;
+
+	if (MtmRecoveryPrepared == NULL) {
+		HASHCTL info;
+		MemSet(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgid_t);
+		info.entrysize = sizeof(MtmRecoveryPreparedTxn);
+		MtmRecoveryPrepared = hash_create("MtmRecoveryPrepared", 256, &info, HASH_ELEM);
+	}
+	switch (event) {
+	  case PGLOGICAL_PREPARE:
+		ptx = (MtmRecoveryPreparedTxn*)hash_search(MtmRecoveryPrepared, gid, HASH_ENTER, &found);
+		ptx->ws = *ws;
+		break;
+	  case PGLOGICAL_COMMIT_PREPARED:
+	  case PGLOGICAL_ABORT_PREPARED:
+		ptx = (MtmRecoveryPreparedTxn*)hash_search(MtmRecoveryPrepared, gid, HASH_FIND, NULL);
+		if (ptx != NULL) {
+			*ws = ptx->ws;
+			hash_search(MtmRecoveryPrepared, gid, HASH_REMOVE, NULL);
+		} else {
+			/* transaction was prepared before start of recovery */
+			ws->barrier = true;
+		}
+		break;
+	  default:
+		break;
+	}
+	MtmWriteSetAddKey(ws, DatumGetUInt32(hash_any((unsigned char const*)gid, strlen(gid))));
+}
+
+/*
+ * Wait until all transactions scheduled for parallel recovery are completed.
+ * Transactions which failed to apply are then considered completed, as if receiver applied them itself.
+ */
+static void
+MtmRecoveryWaitIdle(int nodeId)
+{
+	BgwPoolWaitIdle(&Mtm->pool);
+	if (!Mtm->pool.shutdown) {
+		MtmApplyWindowCompleteAll(nodeId);
+	}
+}
+
+/*
+ * Register transaction scheduled for parallel recovery, so that flush position reported to the donor
+ * does not pass it until it is applied
+ */
+static void
+MtmRecoveryScheduleCommit(int nodeId, char const* stmt, int len)
+{
+	StringInfoData s;
+	lsn_t end_lsn;
+
+	s.data = (char*)stmt;
+	s.len = len;
+	s.maxlen = -1;
+	s.cursor = 1 + 1 + 1 + 8; /* 'C', event, node, commit_lsn */
+	end_lsn = pq_getmsgint64(&s);
+
+	while (!MtmApplyWindowAdd(nodeId, end_lsn) && !Mtm->pool.shutdown) {
+		/* Too many transactions are applied out of order */
+		MtmRecoveryWaitIdle(nodeId);
+	}
+}
+
+/*
+ * Recalculate rate of applying transactions received from the node (transactions per second)
+ * not more frequently than once per second
+ */
+static void
+MtmUpdateApplyRate(int nodeId)
+{
+	MtmNodeInfo* node = &Mtm->nodes[nodeId-1];
+	timestamp_t now = MtmGetSystemTime();
+	timestamp_t elapsed = now - node->applyRateTime;
+
+	if (elapsed >= USECS_PER_SEC) {
+		uint64 count = pg_atomic_read_u64(&node->nAppliedTrans);
+		if (node->applyRateTime != 0) {
+			node->applyRate = (count - node->applyRateCount) * USECS_PER_SEC / elapsed;
+		}
+		node->applyRateCount = count;
+		node->applyRateTime = now;
+	}
+}
+
+#define MtmTransMessagesCount(tm) ((tm)->fragments.used / sizeof(BgwPoolFragment))
+
+static void
+MtmTransMessagesAppend(MtmTransMessages* tm, char* copybuf, char* rawbuf, char* data, int size)
+{
+	BgwPoolFragment fragment;
+	fragment.data = data;
+	fragment.size = size;
+	ByteBufferAppend(&tm->fragments, &fragment, sizeof fragment);
+	ByteBufferAppend(&tm->copybufs, &copybuf, sizeof copybuf);
+	if (rawbuf != NULL) {
+		ByteBufferAppend(&tm->rawbufs, &rawbuf, sizeof rawbuf);
+	}
+	tm->size += size;
+}
+
+static void
+MtmTransMessagesReset(MtmTransMessages* tm)
+{
+	char** copybufs = (char**)tm->copybufs.data;
+	char** rawbufs = (char**)tm->rawbufs.data;
+	int i, n = tm->copybufs.used / sizeof(char*);
+
+	for (i = 0; i < n; i++) {
+		PQfreemem(copybufs[i]);
+	}
+	n = tm->rawbufs.used / sizeof(char*);
+	for (i = 0; i < n; i++) {
+		pfree(rawbufs[i]);
+	}
+	ByteBufferReset(&tm->fragments);
+	ByteBufferReset(&tm->copybufs);
+	ByteBufferReset(&tm->rawbufs);
+	tm->size = 0;
+}
+
+static void
+MtmSpillFlush(MtmSpillState* spill)
+{
+	MtmSpillToFile(spill->file, spill->buf.data, spill->buf.used);
+	ByteBufferReset(&spill->buf);
+}
+
+static void
+MtmSpillWrite(MtmSpillState* spill, char* data, int size)
+{
+	if (spill->buf.used + size > MTM_SPILL_BUFFER_SIZE) {
+		MtmSpillFlush(spill);
+	}
+	if (size >= MTM_SPILL_BUFFER_SIZE) {
+		MtmSpillToFile(spill->file, data, size);
+	} else {
+		ByteBufferAppend(&spill->buf, data, size);
+	}
+	spill->chunkSize += size;
+}
+
+static void
+MtmSpillEndChunk(MtmSpillState* spill)
+{
+	MtmSpillWrite(spill, ")", 1);
+	pq_sendbyte(&spill->info, '(');
+	pq_sendint(&spill->info, spill->chunkSize, 4);
+	spill->chunkSize = 0;
+}
+
+/*
+ * Write message to the spill file, starting new chunk if current one becomes larger than spill threshold
+ */
+static void
+MtmSpillMessage(MtmSpillState* spill, int nodeId, char* data, int size)
+{
+	if (spill->file < 0) {
+		int file_id;
+		spill->file = MtmCreateSpillFile(nodeId, &file_id);
+		pq_sendbyte(&spill->info, 'F');
+		pq_sendint(&spill->info, nodeId, 4);
+		pq_sendint(&spill->info, file_id, 4);
+	} else if (spill->chunkSize + size + 1 >= (size_t)MtmTransSpillThreshold*MB) {
+		MtmSpillEndChunk(spill);
+	}
+	MtmSpillWrite(spill, data, size);
+}
+
+/*
+ * Close spill file. If transaction is completed, then last chunk is terminated and
+ * spill->info contains message which should be passed to the apply queue.
+ */
+static void
+MtmSpillClose(MtmSpillState* spill, bool completed)
+{
+	if (completed) {
+		MtmSpillEndChunk(spill);
+		MtmSpillFlush(spill);
+	}
+	MtmCloseSpillFile(spill->file);
+	spill->file = -1;
+	spill->chunkSize = 0;
+	ByteBufferReset(&spill->buf);
+}
+
+/*
+ * Pass message of streamed transaction to apply worker. If stream is full and apply worker is not yet attached to it,
+ * then this and all following messages of the transaction are written to the spill file in the same format
+ * (length followed by message) and apply worker is redirected to this file.
+ */
+static void
+MtmStreamMessage(MtmStream* stream, MtmSpillState* spill, int nodeId, char* data, int size)
+{
+	uint32 len = size;
+	if (spill->file < 0) {
+		StringInfoData redirect;
+		int file_id;
+
+		if (MtmStreamHasSpace(stream, sizeof len + size)) {
+			MtmStreamWrite(stream, &len, sizeof len);
+			MtmStreamWrite(stream, data, size);
+			return;
+		}
+		spill->file = MtmCreateSpillFile(nodeId, &file_id);
+		initStringInfo(&redirect);
+		pq_sendbyte(&redirect, 'S');
+		pq_sendint(&redirect, nodeId, 4);
+		pq_sendint(&redirect, file_id, 4);
+		/* Space for this message is reserved in the stream, see MTM_STREAM_RESERVE */
+		len = redirect.len;
+		MtmStreamWrite(stream, &len, sizeof len);
+		MtmStreamWrite(stream, redirect.data, redirect.len);
+		pfree(redirect.data);
+		len = size;
+	}
+	MtmSpillWrite(spill, (char*)&len, sizeof len);
+	MtmSpillWrite(spill, data, size);
+}
+
+/*
+ * Whole transaction is passed to apply worker
+ */
+static void
+MtmStreamEnd(MtmStream* stream, MtmSpillState* spill)
+{
+	if (spill->file >= 0) {
+		MtmSpillFlush(spill);
+		MtmSpillClose(spill, false);
+	}
+	MtmStreamComplete(stream);
+}
+
+/*
+ * Start apply of large transaction before it is completely received: schedule work item which makes
+ * apply worker read the rest of transaction from the stream and pass messages received so far to it.
+ * Write set of transaction is not known yet, so it is scheduled as barrier.
+ * Returns NULL if the stream is still used by apply of previous transaction.
+ */
+static MtmStream*
+MtmStreamTransaction(int nodeId, MtmTransMessages* tm, MtmSpillState* spill)
+{
+	MtmStream* stream = MtmGetStream(nodeId);
+	BgwPoolFragment* fragments = (BgwPoolFragment*)tm->fragments.data;
+	int i, n = MtmTransMessagesCount(tm);
+	StringInfoData work;
+
+	if (!MtmStreamBegin(stream)) {
+		return NULL;
+	}
+	initStringInfo(&work);
+	pq_sendbyte(&work, 'T');
+	pq_sendint(&work, nodeId, 4);
+
+	MtmWriteSet.barrier = true;
+	BgwPoolScheduleExecute(&Mtm->pool, work.data, work.len, MtmDependencyAwareApply ? &MtmWriteSet : NULL);
+	pfree(work.data);
+
+	for (i = 0; i < n; i++) {
+		MtmStreamMessage(stream, spill, nodeId, fragments[i].data, fragments[i].size);
+	}
+	MtmTransMessagesReset(tm);
+	return stream;
+}
+
 static char const* const MtmReplicationModeName[] =
 {
 	"exit",
@@ -216,11 +822,13 @@ pglogical_receiver_main(Datum main_arg)
 	PGresult *res;
 	MtmReplicationMode mode;
 
-	ByteBuffer buf;
+	MtmTransMessages tm;
+	MtmSpillState spill;
+	MtmStream* stream = NULL;
 	/* Buffer for COPY data */
 	char	*copybuf = NULL;
-	int spill_file = -1;
-	StringInfoData spill_info;
+	/* Decompressed message */
+	char	*rawbuf = NULL;
 	char *slotName;
 	char* connString = psprintf("replication=database %s", Mtm->nodes[nodeId-1].con.connStr);
 	static PortalData fakePortal;
@@ -228,13 +836,19 @@ pglogical_receiver_main(Datum main_arg)
 
 	MtmBackgroundWorker = true;
 
-	ByteBufferAlloc(&buf);
+	ByteBufferAlloc(&tm.fragments);
+	ByteBufferAlloc(&tm.copybufs);
+	ByteBufferAlloc(&tm.rawbufs);
+	tm.size = 0;
+	ByteBufferAlloc(&spill.buf);
+	spill.file = -1;
+	spill.chunkSize = 0;
 
 	slotName = psprintf(MULTIMASTER_SLOT_PATTERN, MtmNodeId);
 
 	MtmIsLogicalReceiver = true;
 
-	initStringInfo(&spill_info);
+	initStringInfo(&spill.info);
 
 	/* Register functions for SIGTERM/SIGHUP management */
 	pqsignal(SIGHUP, receiver_raw_sighup);
@@ -310,6 +924,22 @@ pglogical_receiver_main(Datum main_arg)
 		timeline = Mtm->nodes[nodeId-1].timeline;
 		count = Mtm->recoveryCount;
 
+		/* Replication is restarted from transaction boundary, so drop partially received transaction */
+		MtmTransMessagesReset(&tm);
+		if (spill.file >= 0) {
+			MtmSpillClose(&spill, false);
+			resetStringInfo(&spill.info);
+		}
+		if (stream != NULL) {
+			MtmStreamAbort(stream);
+			stream = NULL;
+		}
+		/* Transactions scheduled for parallel recovery should not be received once again while they are applied */
+		if (!MtmApplyWindowIsEmpty(nodeId)) {
+			MtmRecoveryWaitIdle(nodeId);
+		}
+		MtmApplyWindowReset(nodeId);
+
 		/* Establish connection to remote server */
 		conn = PQconnectdb_safe(connString, 0);
 		status = PQstatus(conn);
@@ -358,7 +988,7 @@ pglogical_receiver_main(Datum main_arg)
 		MTM_LOG1("Start replication on slot %s from node %d at position %llx, mode %s, recovered lsn %llx",
 				 slotName, nodeId, originStartPos, MtmReplicationModeName[mode], Mtm->recoveredLSN);
 
-		appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %x/%x (\"startup_params_format\" '1', \"max_proto_version\" '%d',  \"min_proto_version\" '%d', \"forward_changesets\" '1', \"mtm_replication_mode\" '%s', \"mtm_restart_pos\" '%llx', \"mtm_recovered_pos\" '%llx')",
+		appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %x/%x (\"startup_params_format\" '1', \"max_proto_version\" '%d',  \"min_proto_version\" '%d', \"forward_changesets\" '1', \"mtm_replication_mode\" '%s', \"mtm_restart_pos\" '%llx', \"mtm_recovered_pos\" '%llx', \"mtm_compression\" '%d', \"mtm_columnar_inserts\" '%d')",
 						  slotName,
 						  (uint32) (originStartPos >> 32),
 						  (uint32) originStartPos,
@@ -366,7 +996,9 @@ pglogical_receiver_main(Datum main_arg)
 						  MULTIMASTER_MIN_PROTO_VERSION,
 						  MtmReplicationModeName[mode],
 						  originStartPos,
-						  Mtm->recoveredLSN
+						  Mtm->recoveredLSN,
+						  MtmReplicationCompression,
+						  MtmColumnarInserts
 			);
 		res = PQexec(conn, query->data);
 		if (PQresultStatus(res) != PGRES_COPY_BOTH)
@@ -449,6 +1081,11 @@ pglogical_receiver_main(Datum main_arg)
 					PQfreemem(copybuf);
 					copybuf = NULL;
 				}
+				if (rawbuf != NULL)
+				{
+					pfree(rawbuf);
+					rawbuf = NULL;
+				}
 
 				rc = PQgetCopyData(conn, &copybuf, 1);
 				if (rc <= 0) {
@@ -501,7 +1138,8 @@ pglogical_receiver_main(Datum main_arg)
 					{
 						int64 now = feGetCurrentTimestamp();
 
-						MtmUpdateLsnMapping(nodeId, walEnd);
+						/* Transactions received before walEnd may be still applied by workers */
+						MtmUpdateLsnMapping(nodeId, MtmApplyWindowIsEmpty(nodeId) ? walEnd : INVALID_LSN);
 						/* Leave if feedback is not sent properly */
 						if (!sendFeedback(conn, now, nodeId)) {
 							goto OnError;
@@ -526,6 +1164,7 @@ pglogical_receiver_main(Datum main_arg)
 
 				/* WAL position of the end of this message at WAL sender */
 				MtmSenderWalEnd = walEnd;
+				Mtm->nodes[nodeId-1].receivedLSN = walEnd;
 
 				/*ereport(LOG, (MTM_ERRMSG("%s: receive message %c length %d", worker_proc, copybuf[hdr_len], rc - hdr_len)));*/
 
@@ -535,48 +1174,90 @@ pglogical_receiver_main(Datum main_arg)
 				{
 					int msg_len = rc - hdr_len;
 					stmt = copybuf + hdr_len;
-					MTM_LOG3("Receive message %c from node %d", stmt[0], nodeId);
-					if (buf.used + msg_len + 1 >= MtmTransSpillThreshold*MB) {
-						if (spill_file < 0) {
-							int file_id;
-							spill_file = MtmCreateSpillFile(nodeId, &file_id);
-							pq_sendbyte(&spill_info, 'F');
-							pq_sendint(&spill_info, nodeId, 4);
-							pq_sendint(&spill_info, file_id, 4);
-						}
-						ByteBufferAppend(&buf, ")", 1);
-						pq_sendbyte(&spill_info, '(');
-						pq_sendint(&spill_info, buf.used, 4);
-						MtmSpillToFile(spill_file, buf.data, buf.used);
-						ByteBufferReset(&buf);
+					if (stmt[0] == 'z') {
+						/* Message compressed by sender (multimaster.replication_compression) */
+						MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+						rawbuf = MtmDecompressMessage(stmt, msg_len, &msg_len);
+						MemoryContextSwitchTo(oldContext);
+						stmt = rawbuf;
 					}
+					MTM_LOG3("Receive message %c from node %d", stmt[0], nodeId);
 					if (stmt[0] == 'Z' || (stmt[0] == 'M' && (stmt[1] == 'L' || stmt[1] == 'A' || stmt[1] == 'C'))) {
 						MTM_LOG3("Process '%c' message from %d", stmt[1], nodeId);
+						if (Mtm->status == MTM_RECOVERY && MtmParallelRecovery) {
+							/* Message applied by receiver itself should not overtake transactions scheduled before it */
+							MtmRecoveryWaitIdle(nodeId);
+						}
 						if (stmt[0] == 'M' && stmt[1] == 'C') { /* concurrent DDL should be executed by parallel workers */
-							MtmExecute(stmt, msg_len);
+							MtmExecute(stmt, msg_len, NULL);
 						} else {
 							MtmExecutor(stmt, msg_len); /* all other messages can be processed by receiver itself */
 						}
 					} else {
-						ByteBufferAppend(&buf, stmt, msg_len);
+						if (MtmDependencyAwareApply || MtmParallelRecovery) {
+							MtmWriteSetAddMessage(&MtmWriteSet, stmt, msg_len);
+						}
+						if (stream == NULL && spill.file < 0 && tm.size + msg_len + 1 >= (size_t)MtmTransSpillThreshold*MB) {
+							if (MtmStreamLargeTransactions && Mtm->status != MTM_RECOVERY) {
+								/* Transaction is too large: start to apply it in parallel with receiving */
+								stream = MtmStreamTransaction(nodeId, &tm, &spill);
+							}
+							if (stream == NULL) {
+								/* Transaction is too large: move messages received so far to the spill file */
+								BgwPoolFragment* fragments = (BgwPoolFragment*)tm.fragments.data;
+								int n = MtmTransMessagesCount(&tm);
+								for (i = 0; i < n; i++) {
+									MtmSpillMessage(&spill, nodeId, fragments[i].data, fragments[i].size);
+								}
+								MtmTransMessagesReset(&tm);
+							}
+						}
+						if (stream != NULL) {
+							if (stmt[0] != 'C') { /* commit is passed to the stream after filtering */
+								MtmStreamMessage(stream, &spill, nodeId, stmt, msg_len);
+							}
+						} else if (spill.file >= 0) {
+							MtmSpillMessage(&spill, nodeId, stmt, msg_len);
+						} else {
+							/* Keep buffer until transaction is passed to the apply queue */
+							MtmTransMessagesAppend(&tm, copybuf, rawbuf, stmt, msg_len);
+							copybuf = NULL;
+							rawbuf = NULL;
+						}
 						if (stmt[0] == 'C') /* commit */
 						{
+							/* Transactions without updates (commit of prepared transaction,...) are not scheduled */
+							BgwPoolWriteSet* ws = NULL;
+							if (Mtm->status == MTM_RECOVERY && MtmParallelRecovery) {
+								MtmRecoveryWriteSet(&MtmWriteSet, stmt, msg_len);
+								ws = &MtmWriteSet;
+							} else {
+								if (MtmRecoveryPrepared != NULL) {
+									hash_destroy(MtmRecoveryPrepared);
+									MtmRecoveryPrepared = NULL;
+								}
+								if (MtmDependencyAwareApply && (MtmWriteSet.barrier || MtmWriteSet.nKeys != 0)) {
+									ws = &MtmWriteSet;
+								}
+							}
 							if (!MtmFilterTransaction(stmt, msg_len))
 							{
-								if (spill_file >= 0) {
-									ByteBufferAppend(&buf, ")", 1);
-									pq_sendbyte(&spill_info, '(');
-									pq_sendint(&spill_info, buf.used, 4);
-									MtmSpillToFile(spill_file, buf.data, buf.used);
-									MtmCloseSpillFile(spill_file);
-									MtmExecute(spill_info.data, spill_info.len);
-									spill_file = -1;
-									resetStringInfo(&spill_info);
+								if (Mtm->status == MTM_RECOVERY && MtmParallelRecovery) {
+									MtmRecoveryScheduleCommit(nodeId, stmt, msg_len);
+								}
+								if (stream != NULL) {
+									/* Transaction is already being applied */
+									MtmStreamMessage(stream, &spill, nodeId, stmt, msg_len);
+									MtmStreamEnd(stream, &spill);
+								} else if (spill.file >= 0) {
+									MtmSpillClose(&spill, true);
+									MtmExecute(spill.info.data, spill.info.len, ws);
+									resetStringInfo(&spill.info);
 								} else {
-									if (MtmPreserveCommitOrder && buf.used == msg_len) {
+									if (MtmPreserveCommitOrder && MtmTransMessagesCount(&tm) == 1 && ws == NULL) {
 										/* Perform commit-prepared and rollback-prepared requested directly in receiver */
 										timestamp_t stop, start = MtmGetSystemTime();
-										MtmExecutor(buf.data, buf.used);
+										MtmExecutor(stmt, msg_len);
 										stop = MtmGetSystemTime();
 										if (stop - start > USECS_PER_SEC) {
 											elog(WARNING, "Commit of prepared transaction takes %lld usec, flags=%x", stop - start, stmt[1]);
@@ -584,15 +1265,23 @@ pglogical_receiver_main(Datum main_arg)
 									} else {
 										/* all other commits should be applied in place */
 										// Assert(stmt[1] == PGLOGICAL_PREPARE || stmt[1] == PGLOGICAL_COMMIT || stmt[1] == PGLOGICAL_PRECOMMIT_PREPARED);
-										MtmExecute(buf.data, buf.used);
+										MtmExecuteFragments((BgwPoolFragment*)tm.fragments.data, MtmTransMessagesCount(&tm), ws);
 									}
 								}
-							} else if (spill_file >= 0) {
-								MtmCloseSpillFile(spill_file);
-								resetStringInfo(&spill_info);
-								spill_file = -1;
+							} else if (stream != NULL) {
+								if (spill.file >= 0) {
+									MtmSpillClose(&spill, false);
+								}
+								MtmStreamAbort(stream);
+							} else if (spill.file >= 0) {
+								MtmSpillClose(&spill, false);
+								resetStringInfo(&spill.info);
 							}
-							ByteBufferReset(&buf);
+							stream = NULL;
+							MtmTransMessagesReset(&tm);
+							MtmWriteSet.barrier = false;
+							MtmWriteSet.nKeys = 0;
+							MtmUpdateApplyRate(nodeId);
 						}
 					}
 				}
@@ -645,6 +1334,7 @@ pglogical_receiver_main(Datum main_arg)
 					int64 now = feGetCurrentTimestamp();
 
 					MtmUpdateLsnMapping(nodeId, INVALID_LSN);
+					MtmUpdateApplyRate(nodeId);
 					sendFeedback(conn, now, nodeId);
 				}
 				else if (r < 0 && errno == EINTR)
@@ -698,7 +1388,14 @@ pglogical_receiver_main(Datum main_arg)
 		MtmReleaseRecoverySlot(nodeId);
 		MtmSleep(RECEIVER_SUSPEND_TIMEOUT);
 	}
-	ByteBufferFree(&buf);
+	if (stream != NULL) {
+		MtmStreamAbort(stream);
+	}
+	MtmTransMessagesReset(&tm);
+	ByteBufferFree(&tm.fragments);
+	ByteBufferFree(&tm.copybufs);
+	ByteBufferFree(&tm.rawbufs);
+	ByteBufferFree(&spill.buf);
 	/* Restart this bgworker */
 	proc_exit(1);
 }
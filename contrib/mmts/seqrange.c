@@ -0,0 +1,171 @@
+/*
+ * seqrange.c
+ *
+ * Cluster-wide allocation of sequence values by ranges.
+ *
+ * With multimaster.monotonic_sequences each node leases contiguous range of multimaster.sequence_range
+ * own values of the sequence above all ranges leased in the cluster so far and broadcasts the lease
+ * through arbiter (MSG_SEQUENCE_RANGE). Values are then generated locally without any replication
+ * traffic until the range is exhausted. When ranges leased concurrently by different nodes overlap,
+ * lease with smaller CSN (and node id in case of equal CSNs) wins and the other node abandons its range,
+ * so the next value obtained at this node is taken from a new range above the winner.
+ */
+#include "postgres.h"
+#include "access/hash.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "multimaster.h"
+#include "seqrange.h"
+
+typedef struct
+{
+	Oid    seqid;
+	uint32 key;
+} MtmSeqKeyEntry;
+
+static HTAB* MtmSeqRanges;
+static LWLock* MtmSeqLock;
+static HTAB* MtmSeqKeys; /* backend local cache of sequence keys */
+
+Size MtmSeqShmemSize(void)
+{
+	return hash_estimate_size(MTM_MAX_SEQUENCES, sizeof(MtmSeqRange));
+}
+
+void MtmSeqShmemInit(void)
+{
+	HASHCTL info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint32);
+	info.entrysize = sizeof(MtmSeqRange);
+	MtmSeqRanges = ShmemInitHash("MtmSeqRanges", MTM_MAX_SEQUENCES, MTM_MAX_SEQUENCES, &info, HASH_ELEM | HASH_BLOBS);
+	MtmSeqLock = &GetNamedLWLockTranche(MTM_SEQ_TRANCHE)->lock;
+}
+
+static uint32 MtmSeqKey(Oid seqid)
+{
+	MtmSeqKeyEntry* entry;
+	bool found;
+
+	if (MtmSeqKeys == NULL) {
+		HASHCTL info;
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(Oid);
+		info.entrysize = sizeof(MtmSeqKeyEntry);
+		info.hcxt = TopMemoryContext;
+		MtmSeqKeys = hash_create("MtmSeqKeys", 64, &info, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+	entry = (MtmSeqKeyEntry*)hash_search(MtmSeqKeys, &seqid, HASH_ENTER, &found);
+	if (!found) {
+		char* name = psprintf("%s.%s", get_namespace_name(get_rel_namespace(seqid)), get_rel_name(seqid));
+		entry->key = DatumGetUInt32(hash_any((unsigned char*)name, strlen(name)));
+		pfree(name);
+	}
+	return entry->key;
+}
+
+static MtmSeqRange* MtmSeqGetRange(uint32 key)
+{
+	bool found;
+	MtmSeqRange* r = (MtmSeqRange*)hash_search(MtmSeqRanges, &key, HASH_ENTER_NULL, &found);
+	if (r != NULL && !found) {
+		r->high = 0;
+		r->localBase = 1;
+		r->localEnd = 0;
+		r->leaseCsn = 0;
+	}
+	return r;
+}
+
+static void MtmSeqBroadcastRange(uint32 key, int64 base, int64 end, csn_t csn)
+{
+	MtmArbiterMessage msg;
+	int i;
+
+	MtmInitMessage(&msg, MSG_SEQUENCE_RANGE);
+	msg.csn = csn;
+	msg.seqKey = key;
+	msg.seqBase = base;
+	msg.seqEnd = end;
+
+	for (i = 0; i < Mtm->nAllNodes; i++)
+	{
+		if (i+1 != MtmNodeId && !BIT_CHECK(Mtm->disabledNodeMask, i))
+		{
+			msg.node = i+1;
+			MtmSendMessage(&msg);
+		}
+	}
+}
+
+/*
+ * Called for each value obtained from the sequence. Returns false if sequence can not be tracked (too many sequences),
+ * in this case caller should fall back to replication of sequence position. If new range is leased,
+ * start of the range is returned in "start" and the sequence should be advanced to it, otherwise "start" is zero.
+ */
+bool MtmSeqNextval(Oid seqid, int64 next, int64* start)
+{
+	uint32 key = MtmSeqKey(seqid);
+	MtmSeqRange* r;
+	int64 base;
+	int64 end;
+	csn_t csn;
+
+	*start = 0;
+	LWLockAcquire(MtmSeqLock, LW_EXCLUSIVE);
+	r = MtmSeqGetRange(key);
+	if (r == NULL) {
+		LWLockRelease(MtmSeqLock);
+		return false;
+	}
+	if (next >= r->localBase && next <= r->localEnd) {
+		LWLockRelease(MtmSeqLock);
+		return true;
+	}
+	/* Lease is exhausted or was abandoned: take next range above all known ranges */
+	base = Max(next, r->high + 1);
+	end = base + (int64)MtmSequenceRange*MtmMaxNodes - 1;
+	csn = MtmAssignCSN();
+	r->localBase = base;
+	r->localEnd = end;
+	r->leaseCsn = csn;
+	r->high = end;
+	LWLockRelease(MtmSeqLock);
+
+	MTM_LOG2("Node %d leases range [%lld, %lld] of sequence %u", MtmNodeId, (long64)base, (long64)end, seqid);
+	MtmSeqBroadcastRange(key, base, end, csn);
+	if (base > next) {
+		*start = base;
+	}
+	return true;
+}
+
+/*
+ * Handle lease of the range by other node. Called by arbiter receiver.
+ */
+void MtmSeqRangeReceived(MtmArbiterMessage* msg)
+{
+	MtmSeqRange* r;
+
+	LWLockAcquire(MtmSeqLock, LW_EXCLUSIVE);
+	r = MtmSeqGetRange(msg->seqKey);
+	if (r != NULL) {
+		if (r->high < msg->seqEnd) {
+			r->high = msg->seqEnd;
+		}
+		if (r->localBase <= msg->seqEnd && msg->seqBase <= r->localEnd
+			&& (msg->csn < r->leaseCsn || (msg->csn == r->leaseCsn && msg->node < MtmNodeId)))
+		{
+			MTM_LOG1("Abandon range [%lld, %lld] of sequence %x overlapping with range of node %d",
+					 (long64)r->localBase, (long64)r->localEnd, msg->seqKey, msg->node);
+			r->localBase = 1;
+			r->localEnd = 0;
+		}
+	}
+	LWLockRelease(MtmSeqLock);
+}
@@ -0,0 +1,29 @@
+#ifndef __SEQRANGE_H__
+#define __SEQRANGE_H__
+
+#include "multimaster.h"
+
+#define MTM_SEQ_TRANCHE      "mtm_sequences"
+#define MTM_MAX_SEQUENCES    1024   /* number of sequences for which ranges are tracked */
+
+/*
+ * Ranges of values of the sequence. Sequence is identified by hash of its qualified name, because OIDs of
+ * the same sequence are different at different nodes. Values generated by the node always have residue
+ * MtmNodeId modulo MtmMaxNodes (see MtmInitializeSequence), so ranges leased by different nodes
+ * may overlap without producing duplicates.
+ */
+typedef struct
+{
+	uint32 key;         /* hash of qualified name of the sequence */
+	int64  high;        /* upper bound of ranges leased in the cluster */
+	int64  localBase;   /* range leased by this node */
+	int64  localEnd;    /* localEnd < localBase if there is no valid lease */
+	csn_t  leaseCsn;    /* time of the lease: earlier lease wins when ranges of nodes overlap */
+} MtmSeqRange;
+
+extern Size MtmSeqShmemSize(void);
+extern void MtmSeqShmemInit(void);
+extern bool MtmSeqNextval(Oid seqid, int64 next, int64* start);
+extern void MtmSeqRangeReceived(MtmArbiterMessage* msg);
+
+#endif
@@ -244,7 +244,7 @@ MtmStateProcessEvent(MtmEvent ev)
 				Mtm->recoveredLSN = GetXLogInsertRecPtr();
 				Mtm->nConfigChanges += 1;
 				for (i = 0; i < Mtm->nAllNodes; i++)
-					Mtm->nodes[i].lastHeartbeat = 0; /* defuse watchdog until first heartbeat is received */
+					pg_atomic_write_u64(&Mtm->nodes[i].lastHeartbeat, 0); /* defuse watchdog until first heartbeat is received */
 			}
 			break;
 
@@ -271,7 +271,7 @@ void MtmDisableNode(int nodeId)
 	Mtm->nConfigChanges += 1;
 	Mtm->nodes[nodeId-1].timeline += 1;
 	Mtm->nodes[nodeId-1].lastStatusChangeTime = MtmGetSystemTime();
-	Mtm->nodes[nodeId-1].lastHeartbeat = 0; /* defuse watchdog until first heartbeat is received */
+	pg_atomic_write_u64(&Mtm->nodes[nodeId-1].lastHeartbeat, 0); /* defuse watchdog until first heartbeat is received */
 
 	if (Mtm->status == MTM_ONLINE) {
 		/* Make decision about prepared transaction status only in quorum */
@@ -296,7 +296,7 @@ void MtmEnableNode(int nodeId)
 		BIT_SET(Mtm->recoveredNodeMask, nodeId-1);
 		Mtm->nConfigChanges += 1;
 		Mtm->nodes[nodeId-1].lastStatusChangeTime = MtmGetSystemTime();
-		Mtm->nodes[nodeId-1].lastHeartbeat = 0; /* defuse watchdog until first heartbeat is received */
+		pg_atomic_write_u64(&Mtm->nodes[nodeId-1].lastHeartbeat, 0); /* defuse watchdog until first heartbeat is received */
 		if (nodeId != MtmNodeId) {
 			Mtm->nLiveNodes += 1;
 		}
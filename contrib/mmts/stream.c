@@ -0,0 +1,216 @@
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+
+#include "multimaster.h"
+#include "stream.h"
+
+#define MTM_STREAM_WAIT_TIMEOUT 1000 /* msec */
+
+static MtmStream* MtmStreams;
+
+Size MtmStreamShmemSize(void)
+{
+	return MtmStreamLargeTransactions ? sizeof(MtmStream)*MtmMaxNodes : 0;
+}
+
+void MtmStreamShmemInit(void)
+{
+	bool found;
+	int i;
+
+	if (!MtmStreamLargeTransactions) {
+		return;
+	}
+	MtmStreams = (MtmStream*)ShmemInitStruct("MtmStreams", sizeof(MtmStream)*MtmMaxNodes, &found);
+	if (!found) {
+		for (i = 0; i < MtmMaxNodes; i++) {
+			pg_atomic_init_u64(&MtmStreams[i].head, 0);
+			pg_atomic_init_u64(&MtmStreams[i].tail, 0);
+			pg_atomic_init_u32(&MtmStreams[i].active, 0);
+			MtmStreams[i].producer = -1;
+			MtmStreams[i].consumer = -1;
+			MtmStreams[i].aborted = false;
+			MtmStreams[i].completed = false;
+			MtmStreams[i].failed = false;
+		}
+	}
+}
+
+MtmStream* MtmGetStream(int node_id)
+{
+	Assert(MtmStreams != NULL);
+	return &MtmStreams[node_id-1];
+}
+
+static void MtmStreamWakeup(int procno)
+{
+	if (procno >= 0) {
+		SetLatch(&ProcGlobal->allProcs[procno].procLatch);
+	}
+}
+
+static void MtmStreamWait(void)
+{
+	if (WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, MTM_STREAM_WAIT_TIMEOUT) & WL_POSTMASTER_DEATH) {
+		proc_exit(1);
+	}
+	ResetLatch(&MyProc->procLatch);
+	CHECK_FOR_INTERRUPTS();
+}
+
+/*
+ * Start streaming of new transaction.
+ * Returns false if apply worker has not yet completed previous transaction passed through this stream:
+ * receiver should not wait for it, because apply worker may wait for transactions received after it.
+ */
+bool MtmStreamBegin(MtmStream* stream)
+{
+	stream->producer = MyProc->pgprocno;
+	pg_memory_barrier();
+	if (pg_atomic_read_u32(&stream->active) != 0) {
+		return false;
+	}
+	pg_atomic_write_u64(&stream->head, 0);
+	pg_atomic_write_u64(&stream->tail, 0);
+	stream->consumer = -1;
+	stream->aborted = false;
+	stream->completed = false;
+	stream->failed = false;
+	pg_write_barrier();
+	pg_atomic_write_u32(&stream->active, 1);
+	return true;
+}
+
+/*
+ * Check if data of the specified size can be written to the stream without waiting for apply worker
+ * which is not yet attached. MTM_STREAM_RESERVE bytes are left for the message redirecting apply worker to the spill file.
+ */
+bool MtmStreamHasSpace(MtmStream* stream, size_t size)
+{
+	uint64 head = pg_atomic_read_u64(&stream->head);
+	uint64 tail = pg_atomic_read_u64(&stream->tail);
+	pg_memory_barrier();
+	return stream->consumer >= 0 || MTM_STREAM_BUFFER_SIZE - (size_t)(tail - head) >= size + MTM_STREAM_RESERVE;
+}
+
+/*
+ * Append data to the stream, waiting for free space in the buffer.
+ * If apply worker has failed, then data is silently discarded: transaction is already aborted.
+ */
+void MtmStreamWrite(MtmStream* stream, void const* data, size_t size)
+{
+	char const* src = (char const*)data;
+
+	while (size != 0 && !stream->failed) {
+		uint64 head = pg_atomic_read_u64(&stream->head);
+		uint64 tail = pg_atomic_read_u64(&stream->tail);
+		size_t available = MTM_STREAM_BUFFER_SIZE - (size_t)(tail - head);
+		size_t offs = tail % MTM_STREAM_BUFFER_SIZE;
+		size_t n;
+
+		if (available == 0) {
+			MtmStreamWait();
+			continue;
+		}
+		n = Min(Min(size, available), MTM_STREAM_BUFFER_SIZE - offs);
+		memcpy(&stream->data[offs], src, n);
+		pg_write_barrier();
+		pg_atomic_write_u64(&stream->tail, tail + n);
+		MtmStreamWakeup(stream->consumer);
+		src += n;
+		size -= n;
+	}
+}
+
+/*
+ * Whole transaction is written to the stream or to the spill file
+ */
+void MtmStreamComplete(MtmStream* stream)
+{
+	pg_memory_barrier();
+	stream->completed = true;
+	pg_memory_barrier();
+	MtmStreamWakeup(stream->consumer);
+}
+
+/*
+ * Receiver is not able to deliver rest of the transaction (for example because of lost connection).
+ */
+void MtmStreamAbort(MtmStream* stream)
+{
+	stream->aborted = true;
+	pg_memory_barrier();
+	MtmStreamWakeup(stream->consumer);
+}
+
+void MtmStreamAttach(MtmStream* stream)
+{
+	Assert(pg_atomic_read_u32(&stream->active) != 0);
+	stream->consumer = MyProc->pgprocno;
+	pg_memory_barrier();
+	MtmStreamWakeup(stream->producer);
+}
+
+/*
+ * Read data from the stream, waiting for it to be received. Throws error if transaction is aborted by receiver.
+ */
+void MtmStreamRead(MtmStream* stream, void* data, size_t size)
+{
+	char* dst = (char*)data;
+
+	while (size != 0) {
+		uint64 head = pg_atomic_read_u64(&stream->head);
+		uint64 tail = pg_atomic_read_u64(&stream->tail);
+		size_t offs = head % MTM_STREAM_BUFFER_SIZE;
+		size_t n;
+
+		if (stream->aborted) {
+			MTM_ELOG(ERROR, "Streaming of transaction was interrupted by receiver");
+		}
+		if (tail == head) {
+			MtmStreamWait();
+			continue;
+		}
+		pg_read_barrier();
+		n = Min(Min(size, (size_t)(tail - head)), MTM_STREAM_BUFFER_SIZE - offs);
+		memcpy(dst, &stream->data[offs], n);
+		pg_memory_barrier();
+		pg_atomic_write_u64(&stream->head, head + n);
+		MtmStreamWakeup(stream->producer);
+		dst += n;
+		size -= n;
+	}
+}
+
+/*
+ * Wait until receiver gets the whole transaction. Throws error if transaction is aborted by receiver.
+ */
+void MtmStreamWaitCompletion(MtmStream* stream)
+{
+	while (!stream->completed) {
+		if (stream->aborted) {
+			MTM_ELOG(ERROR, "Streaming of transaction was interrupted by receiver");
+		}
+		MtmStreamWait();
+	}
+	pg_read_barrier();
+}
+
+/*
+ * Apply worker has completed or aborted streamed transaction
+ */
+void MtmStreamDetach(MtmStream* stream, bool failed)
+{
+	if (failed) {
+		stream->failed = true;
+	}
+	stream->consumer = -1;
+	pg_memory_barrier();
+	pg_atomic_write_u32(&stream->active, 0);
+	MtmStreamWakeup(stream->producer);
+}
@@ -0,0 +1,46 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include "port/atomics.h"
+
+#define MTM_STREAM_BUFFER_SIZE (1024*1024) /* size of ring buffer used to pass large transaction to apply worker */
+#define MTM_STREAM_RESERVE     64          /* space kept for the message redirecting apply worker to the spill file */
+
+/*
+ * Single-producer/single-consumer pipe through which receiver passes large transaction to apply worker
+ * while transaction is still being received. There is one stream per node, because receiver
+ * gets transactions from the node one after another.
+ * Until apply worker is attached to the stream it may wait for completion of preceding transactions, which in turn
+ * may wait for messages received after this transaction. So receiver never waits for free space in the stream before
+ * apply worker is attached: if stream becomes full, rest of the transaction is written to the spill file, which is
+ * read by apply worker once transaction is completely received.
+ */
+typedef struct
+{
+	pg_atomic_uint64 head;      /* number of bytes consumed by apply worker */
+	pg_atomic_uint64 tail;      /* number of bytes written by receiver */
+	pg_atomic_uint32 active;    /* stream is used by apply worker */
+	int              producer;  /* pgprocno of receiver */
+	int              consumer;  /* pgprocno of apply worker or -1 if it is not yet started */
+	volatile bool    aborted;   /* receiver has dropped transaction */
+	volatile bool    completed; /* receiver has received the whole transaction */
+	volatile bool    failed;    /* apply worker has failed to apply transaction */
+	char             data[MTM_STREAM_BUFFER_SIZE];
+} MtmStream;
+
+extern Size       MtmStreamShmemSize(void);
+extern void       MtmStreamShmemInit(void);
+extern MtmStream* MtmGetStream(int node_id);
+
+extern bool MtmStreamBegin(MtmStream* stream);
+extern bool MtmStreamHasSpace(MtmStream* stream, size_t size);
+extern void MtmStreamWrite(MtmStream* stream, void const* data, size_t size);
+extern void MtmStreamComplete(MtmStream* stream);
+extern void MtmStreamAbort(MtmStream* stream);
+
+extern void MtmStreamAttach(MtmStream* stream);
+extern void MtmStreamRead(MtmStream* stream, void* data, size_t size);
+extern void MtmStreamWaitCompletion(MtmStream* stream);
+extern void MtmStreamDetach(MtmStream* stream, bool failed);
+
+#endif
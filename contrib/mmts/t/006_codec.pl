@@ -0,0 +1,114 @@
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 7;
+
+my $cluster = new Cluster(3);
+$cluster->init();
+$cluster->configure();
+foreach my $node (@{$cluster->{nodes}})
+{
+	$node->append_conf("postgresql.conf", qq(
+		multimaster.columnar_inserts = on
+		multimaster.replication_compression = on
+	));
+}
+$cluster->start();
+
+# XXX: create extension on start and poll_untill status is Online
+sleep(10);
+
+$cluster->psql(0, 'postgres', "create extension multimaster;");
+
+# Check that content of the table is the same at all nodes
+sub check_table
+{
+	my ($table, $name) = @_;
+	my $sql = "select count(*) || ':' || coalesce(md5(string_agg(t::text, ',' order by t::text)), '')
+			   from $table t;";
+	my ($first, $current);
+
+	$cluster->psql(0, 'postgres', $sql, stdout => \$first);
+	foreach my $i (1 .. 2)
+	{
+		$cluster->psql($i, 'postgres', $sql, stdout => \$current);
+		if ($current ne $first)
+		{
+			note("node 0 has $first, node $i has $current");
+			fail($name);
+			return;
+		}
+	}
+	note("$table: $first");
+	ok($first ne '' && $first !~ /^0:/, $name);
+}
+
+###############################################################################
+# Columnar batches: integer columns are delta/zigzag encoded
+###############################################################################
+
+$cluster->psql(0, 'postgres', "
+	create table ints(id int primary key, i2 int2, i8 int8, f8 float8);
+	insert into ints select g, (g * 7919) % 65536 - 32768, case when g % 2 = 0 then g else -g end * 1000000007::int8,
+		g / 3.0 from generate_series(1, 5000) g;
+	insert into ints values (5001, -32768, -9223372036854775808, 0), (5002, 32767, 9223372036854775807, -0.5),
+		(5003, 0, 0, null), (5004, null, null, 1e300);");
+check_table('ints', "delta and zigzag encoded integers are replicated");
+
+###############################################################################
+# Columnar batches: recently sent values are dictionary encoded
+###############################################################################
+
+$cluster->psql(0, 'postgres', "
+	create table dict(id int primary key, few text, many text, long text);
+	insert into dict select g, 'value ' || g % 5, 'value ' || g % 100,
+		case when g % 2 = 0 then repeat('long value ' || g % 3, 30) end from generate_series(1, 3000) g;");
+check_table('dict', "dictionary encoded values are replicated");
+
+###############################################################################
+# Columnar batches: rows with mixed nulls and types in the same transaction
+###############################################################################
+
+$cluster->psql(0, 'postgres', "
+	create table mixed(id bigint primary key, b bool, t text, n numeric, ts timestamp, a int[]);
+	begin;
+	insert into mixed select g, g % 2 = 0, case when g % 4 = 0 then null else 'row ' || g end,
+		g * 1.5, '2017-01-01'::timestamp + g * interval '1 hour', array[g, -g] from generate_series(1, 2000) g;
+	insert into ints values (6000, 1, 1, 1);
+	insert into mixed values (3000, null, null, null, null, null);
+	commit;");
+check_table('mixed', "batches interleaved with other relations are replicated");
+check_table('ints', "single row inserts after batch are replicated");
+
+###############################################################################
+# Compression: large messages are pglz compressed
+###############################################################################
+
+$cluster->psql(0, 'postgres', "
+	create table big(id int primary key, doc text);
+	insert into big select g, repeat('compressible ' || g, 1000) from generate_series(1, 50) g;
+	update big set doc = doc || 'updated' where id % 2 = 0;
+	delete from big where id % 5 = 0;");
+check_table('big', "compressed inserts, updates and deletes are replicated");
+
+###############################################################################
+# Compression: unchanged toasted values in updates
+###############################################################################
+
+$cluster->psql(0, 'postgres', "
+	create table toasted(id int primary key, v int, doc text);
+	alter table toasted alter column doc set storage external;
+	insert into toasted select g, 0, repeat(md5(g::text), 200) from generate_series(1, 20) g;
+	update toasted set v = id * 2;");
+check_table('toasted', "updates with unchanged toasted values are replicated");
+
+###############################################################################
+# Changes made at other nodes
+###############################################################################
+
+$cluster->psql(1, 'postgres', "insert into dict select g, 'node 2', null, null from generate_series(3001, 4000) g;");
+$cluster->psql(2, 'postgres', "insert into dict select g, null, 'node 3', repeat('x', 10000) from generate_series(4001, 4100) g;");
+check_table('dict', "batches from all nodes are replicated");
+
+$cluster->stop();
@@ -0,0 +1,113 @@
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 5;
+
+my $cluster = new Cluster(3);
+$cluster->init();
+$cluster->configure();
+foreach my $node (@{$cluster->{nodes}})
+{
+	# Smallest possible queue, so that it is filled up by transactions parked
+	# until completion of their predecessors
+	$node->append_conf("postgresql.conf", qq(
+		multimaster.queue_size = 1048576
+		multimaster.workers = 4
+		multimaster.dependency_aware_apply = on
+	));
+}
+$cluster->start();
+
+# XXX: create extension on start and poll_untill status is Online
+sleep(10);
+
+$cluster->psql(0, 'postgres', "create extension multimaster;");
+
+sub check_table
+{
+	my ($table, $name) = @_;
+	my $sql = "select count(*) || ':' || coalesce(md5(string_agg(t::text, ',' order by t::text)), '')
+			   from $table t;";
+	my ($first, $current);
+
+	$cluster->psql(0, 'postgres', $sql, stdout => \$first);
+	foreach my $i (1 .. 2)
+	{
+		$cluster->psql($i, 'postgres', $sql, stdout => \$current);
+		if ($current ne $first)
+		{
+			note("node 0 has $first, node $i has $current");
+			fail($name);
+			return;
+		}
+	}
+	note("$table: $first");
+	ok($first ne '' && $first !~ /^0:/, $name);
+}
+
+$cluster->psql(0, 'postgres', "
+	create table hot(id int primary key, v int);
+	insert into hot select g, 0 from generate_series(1, 10) g;
+	create table wide(id serial primary key, doc text);");
+
+my $dir = TestLib::tempdir();
+open(my $script, '>', "$dir/hot.pgb") or die "cannot create script: $!";
+print $script q(
+\set id random(1, 10)
+update hot set v = v + 1 where id = :id;
+insert into wide(doc) select repeat(md5(random()::text), 500);
+);
+close($script);
+open($script, '>', "$dir/wide.pgb") or die "cannot create script: $!";
+print $script q(
+insert into wide(doc) select repeat(md5(random()::text), 1000);
+);
+close($script);
+
+###############################################################################
+# Conflicting transactions with large rows do not fit in the queue together
+###############################################################################
+
+# Hot rows are updated only at the first node: its transactions are not
+# aborted by conflicts, but are parked by the receivers of other nodes
+my @clients = (
+	$cluster->pgbench_async(0, '-n', -c => 8, -j => 2, -t => 200, -f => "$dir/hot.pgb"),
+	$cluster->pgbench_async(1, '-n', -c => 2, -j => 2, -t => 100, -f => "$dir/wide.pgb"),
+	$cluster->pgbench_async(2, '-n', -c => 2, -j => 2, -t => 100, -f => "$dir/wide.pgb"));
+$cluster->pgbench_await($_) foreach @clients;
+
+# pgbench returns only after all its transactions are committed at all nodes
+check_table('hot', "conflicting updates are applied in the same order at all nodes");
+check_table('wide', "large rows applied through small queue are replicated");
+
+my $total;
+$cluster->psql(1, 'postgres', "select sum(v) from hot", stdout => \$total);
+is($total, 8 * 200, "no updates are lost");
+
+###############################################################################
+# Replica identity changed by DDL received in the same stream
+###############################################################################
+
+# Key column is dropped: key resolved before the DDL would point to the
+# updated column, so updates of the same row would not be detected as conflicting
+$cluster->psql(0, 'postgres', "
+	create table rekeyed(id int primary key, v int, k int not null);
+	insert into rekeyed select g, 0, g % 10 from generate_series(1, 10) g;");
+open($script, '>', "$dir/rekeyed.pgb") or die "cannot create script: $!";
+print $script q(
+\set k random(0, 9)
+update rekeyed set v = v + 1 where k = :k;
+);
+close($script);
+$cluster->pgbench(0, '-n', -c => 4, -j => 2, -t => 50, -f => "$dir/rekeyed.pgb");
+$cluster->psql(0, 'postgres', "
+	alter table rekeyed drop column id;
+	alter table rekeyed add primary key (k);");
+$cluster->pgbench(0, '-n', -c => 8, -j => 2, -t => 200, -f => "$dir/rekeyed.pgb");
+
+check_table('rekeyed', "transactions following DDL are applied in the same order at all nodes");
+$cluster->psql(2, 'postgres', "select sum(v) from rekeyed", stdout => \$total);
+is($total, 4 * 50 + 8 * 200, "no updates following DDL are lost");
+
+$cluster->stop();
@@ -0,0 +1,63 @@
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 4;
+use IPC::Run;
+
+my $cluster = new Cluster(3);
+$cluster->init();
+$cluster->configure();
+$cluster->start();
+
+# XXX: create extension on start and poll_untill status is Online
+sleep(10);
+
+$cluster->psql(0, 'postgres', "create extension multimaster;");
+
+# Each node generates its own values of the serial column
+$cluster->psql(0, 'postgres', "create table s(id serial primary key, node int);");
+foreach my $i (0 .. 2)
+{
+	$cluster->psql($i, 'postgres', "insert into s(node) select $i + 1 from generate_series(1, 100);");
+}
+
+###############################################################################
+# Populate new node from snapshot of the cluster
+###############################################################################
+
+my $node = $cluster->add_bootstrap_node();
+$cluster->psql(0, 'postgres', "select mtm.add_node('$node->{mmconnstr}');");
+$node->start();
+
+my $schema;
+IPC::Run::run([ 'pg_dump', '--schema-only', '--section=pre-data',
+	'-h', $cluster->{nodes}->[0]->host(), '-p', $cluster->{nodes}->[0]->port(), 'postgres' ], '>', \$schema)
+  or BAIL_OUT("pg_dump failed");
+my $rc = $node->psql('postgres', "select mtm.stop_replication();\n$schema\nselect mtm.bootstrap_node(1, '{2,3}', 2);");
+is($rc, 0, "new node is bootstrapped");
+
+$node->poll_query_until('postgres', "select status = 'Online' from mtm.get_cluster_state()")
+  or BAIL_OUT("new node is not online");
+
+###############################################################################
+# Sequence continues after values copied from donors
+###############################################################################
+
+my ($out, $err);
+$rc = $node->psql('postgres', "insert into s(node) select 4 from generate_series(1, 100);",
+	stdout => \$out, stderr => \$err);
+note($err) if $err ne '';
+is($rc, 0, "insert into serial table at bootstrapped node");
+
+$cluster->psql(1, 'postgres', "insert into s(node) select 2 from generate_series(1, 100);");
+
+my $sql = "select count(*) || ':' || count(distinct id) || ':' || md5(string_agg(id::text, ',' order by id)) from s;";
+my ($first, $current);
+$cluster->psql(0, 'postgres', $sql, stdout => \$first);
+$node->psql('postgres', $sql, stdout => \$current);
+note("s: $first");
+like($first, qr/^500:500:/, "values of sequences are unique");
+is($current, $first, "bootstrapped node has the same data");
+
+$cluster->stop();
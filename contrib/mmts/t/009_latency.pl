@@ -0,0 +1,62 @@
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 5;
+
+my $cluster = new Cluster(3);
+$cluster->init();
+$cluster->configure();
+$cluster->start();
+
+# XXX: create extension on start and poll_untill status is Online
+sleep(10);
+
+$cluster->psql(0, 'postgres', "create extension multimaster;");
+$cluster->psql(0, 'postgres', "create table t(id int primary key, v int);");
+$cluster->psql($_, 'postgres', "select mtm.reset_latency_stats();") foreach (0 .. 2);
+
+###############################################################################
+# Single sample is reported exactly
+###############################################################################
+
+# Percentiles are bounds of histogram buckets clipped by the maximum, so all
+# of them are equal to the only recorded value
+my $single = "select string_agg(phase || ':' || count || ':' || (avg = max and p50 = max and p90 = max and p99 = max and p999 = max), ',' order by phase)
+			  from mtm.get_latency_stats() where node = %d and phase in (%s);";
+my $out;
+
+$cluster->psql(0, 'postgres', "insert into t values (1, 0);");
+$cluster->psql(0, 'postgres', sprintf($single, 1, "'prepare', 'commit_prepared'"), stdout => \$out);
+is($out, "commit_prepared:1:t,prepare:1:t", "coordinator phases of single transaction");
+
+$cluster->psql(0, 'postgres', sprintf($single, 2, "'voting'") . sprintf($single, 3, "'voting'"), stdout => \$out);
+is($out, "voting:1:t\nvoting:1:t", "votes of single transaction are broken down by node");
+
+$cluster->{nodes}->[1]->poll_query_until('postgres',
+	"select count(*) = 2 from mtm.get_latency_stats() where node = 1 and phase in ('apply_queue', 'apply')")
+  or BAIL_OUT("transaction is not applied");
+$cluster->psql(1, 'postgres', sprintf($single, 1, "'apply_queue', 'apply'"), stdout => \$out);
+is($out, "apply:1:t,apply_queue:1:t", "apply phases are broken down by origin node");
+
+###############################################################################
+# Percentiles of many samples
+###############################################################################
+
+my $dir = TestLib::tempdir();
+open(my $script, '>', "$dir/update.pgb") or die "cannot create script: $!";
+print $script q(
+update t set v = v + 1 where id = 1;
+);
+close($script);
+$cluster->pgbench(0, '-n', -c => 4, -j => 2, -t => 50, -f => "$dir/update.pgb");
+
+$cluster->psql(0, 'postgres', "select count || ':' || (p50 <= p90 and p90 <= p99 and p99 <= p999 and p999 <= max and avg <= max)
+							   from mtm.get_latency_stats() where node = 1 and phase = 'prepare';", stdout => \$out);
+is($out, "201:t", "percentiles are ordered and bounded by maximum");
+
+$cluster->psql(0, 'postgres', "select mtm.reset_latency_stats();");
+$cluster->psql(0, 'postgres', "select count(*) from mtm.get_latency_stats();", stdout => \$out);
+is($out, "0", "statistics are reset");
+
+$cluster->stop();
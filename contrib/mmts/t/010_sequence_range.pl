@@ -0,0 +1,77 @@
+use strict;
+use warnings;
+use Cluster;
+use TestLib;
+use Test::More tests => 5;
+
+my $cluster = new Cluster(3);
+$cluster->init();
+$cluster->configure();
+foreach my $node (@{$cluster->{nodes}})
+{
+	# Small ranges, so that each node leases many of them
+	$node->append_conf("postgresql.conf", qq(
+		multimaster.monotonic_sequences = on
+		multimaster.sequence_range = 10
+	));
+}
+$cluster->start();
+
+# XXX: create extension on start and poll_untill status is Online
+sleep(10);
+
+$cluster->psql(0, 'postgres', "create extension multimaster;");
+$cluster->psql(0, 'postgres', "create table s(id serial primary key, node int, batch int, n int);");
+
+###############################################################################
+# Nodes take turns
+###############################################################################
+
+foreach my $batch (1 .. 2)
+{
+	foreach my $i (0 .. 2)
+	{
+		$cluster->psql($i, 'postgres', "insert into s(node, batch, n) select $i + 1, $batch, g from generate_series(1, 100) g;");
+		# let other nodes receive the leases through arbiter
+		sleep(1);
+	}
+}
+
+my $out;
+$cluster->psql(0, 'postgres', "select count(*) || ':' || count(distinct id) from s;", stdout => \$out);
+is($out, "600:600", "values of sequence are unique");
+
+$cluster->psql(0, 'postgres', "select count(*) from s where id % 6 <> node % 6;", stdout => \$out);
+is($out, "0", "each node generates values with its own residue");
+
+$cluster->psql(0, 'postgres', "select count(*) from (select id, lag(id) over (partition by node order by batch, n) prev from s) x
+							   where id <= prev;", stdout => \$out);
+is($out, "0", "values generated by each node are increasing");
+
+# Each batch needs new leases, which are taken above the ranges leased by the
+# preceding batches. Only the values remaining in the previous lease of the node
+# and the value which has triggered the new lease can be below them.
+$cluster->psql(0, 'postgres', "select max(below) <= 10 from
+							   (select count(*) filter (where id < (select max(id) from s p where p.batch * 3 + p.node < s.batch * 3 + s.node)) below
+								from s group by batch, node) x;", stdout => \$out);
+is($out, "t", "values follow the order of batches");
+
+###############################################################################
+# Concurrent leases
+###############################################################################
+
+my $dir = TestLib::tempdir();
+open(my $script, '>', "$dir/insert.pgb") or die "cannot create script: $!";
+print $script q(
+insert into s(node, batch, n) select current_setting('multimaster.node_id')::int, 3, 0;
+);
+close($script);
+
+my @clients = map { $cluster->pgbench_async($_, '-n', -c => 4, -j => 2, -t => 100, -f => "$dir/insert.pgb") } (0 .. 2);
+$cluster->pgbench_await($_) foreach @clients;
+
+$cluster->psql(1, 'postgres', "select count(*) || ':' || count(distinct id) || ':' || count(*) filter (where id % 6 <> node % 6) from s;",
+			   stdout => \$out);
+is($out, "1800:1800:0", "overlapping leases do not produce duplicates");
+
+$cluster->stop();
@@ -121,6 +121,7 @@ static DtmState* dtm;
 
 static TransactionId DtmNextXid;
 static SnapshotData DtmSnapshot = { HeapTupleSatisfiesMVCC };
+static uint64 DtmSnapshotVersion; /* version of DtmSnapshot at arbiter, 0 if none */
 static bool DtmHasGlobalSnapshot;
 static int DtmLocalXidReserve;
 static CommandId DtmCurcid;
@@ -632,7 +633,7 @@ static Snapshot DtmGetSnapshot(Snapshot snapshot)
 	if (TransactionIdIsValid(DtmNextXid) && snapshot != &CatalogSnapshotData)
 	{
 		if (!DtmHasGlobalSnapshot && (snapshot != DtmLastSnapshot || DtmCurcid != GetCurrentCommandId(false))) {
-			ArbiterGetSnapshot(DtmNextXid, &DtmSnapshot, &dtm->minXid);
+			ArbiterGetSnapshot(DtmNextXid, &DtmSnapshot, &dtm->minXid, &DtmSnapshotVersion);
         }
 		DtmLastSnapshot = snapshot;
 		DtmMergeWithGlobalSnapshot(snapshot);
@@ -1041,7 +1042,7 @@ void MMBeginTransaction(void)
 		elog(ERROR, "DTM is not properly initialized, please check that pg_dtm plugin was added to shared_preload_libraries list in postgresql.conf");
     Assert(!RecoveryInProgress());
     XTM_INFO("%d: Try to start global transaction\n", getpid());
-	DtmNextXid = ArbiterStartTransaction(&DtmSnapshot, &dtm->minXid, dtm->nNodes);
+	DtmNextXid = ArbiterStartTransaction(&DtmSnapshot, &dtm->minXid, &DtmSnapshotVersion, dtm->nNodes);
 	if (!TransactionIdIsValid(DtmNextXid))
 		elog(ERROR, "Arbiter was not able to assign XID");
 	XTM_INFO("%d: Start global transaction %d, dtm->minXid=%d\n", getpid(), DtmNextXid, dtm->minXid);
@@ -1061,7 +1062,7 @@ void MMJoinTransaction(TransactionId xid)
 		elog(ERROR, "Arbiter was not able to assign XID");
     DtmVoted = false;
 
-	ArbiterGetSnapshot(DtmNextXid, &DtmSnapshot, &dtm->minXid);
+	ArbiterGetSnapshot(DtmNextXid, &DtmSnapshot, &dtm->minXid, &DtmSnapshotVersion);
 	XTM_INFO("%d: Join global transaction %d, dtm->minXid=%d\n", getpid(), DtmNextXid, dtm->minXid);
 
 	DtmHasGlobalSnapshot = true;
@@ -49,9 +49,15 @@ typedef struct
 {
 	LWLockId hashLock;
 	LWLockId xidLock;
+	LWLockId snapshotLock;
 	TransactionId minXid;  /* XID of oldest transaction visible by any active transaction (local or global) */
 	TransactionId nextXid; /* next XID for local transaction */
 	size_t nReservedXids;  /* number of XIDs reserved for local transactions */
+	uint64 snapshotVersion; /* version of global snapshot most recently received by backends of this node, 0 if none */
+	TransactionId snapshotXmin;
+	TransactionId snapshotXmax;
+	int snapshotXcnt;
+	TransactionId snapshotXip[1]; /* DTM_MAX_GLOBAL_XIDS */
 } DtmState;
 
 typedef struct
@@ -64,6 +70,7 @@ typedef struct
 
 #define DTM_SHMEM_SIZE (1024*1024)
 #define DTM_HASH_SIZE  1003
+#define DTM_MAX_GLOBAL_XIDS 1024 /* larger global snapshots do not fit in arbiter response */
 
 void _PG_init(void);
 void _PG_fini(void);
@@ -104,6 +111,7 @@ static Snapshot CurrentTransactionSnapshot;
 
 static TransactionId DtmNextXid;
 static SnapshotData DtmSnapshot = { HeapTupleSatisfiesMVCC };
+static uint64 DtmSnapshotVersion; /* version of DtmSnapshot at arbiter, 0 if none */
 static bool DtmHasGlobalSnapshot;
 static bool DtmGlobalXidAssigned;
 static int DtmLocalXidReserve;
@@ -216,13 +224,80 @@ static bool TransactionIdIsInDoubt(TransactionId xid)
 	return false;
 }
 
+/*
+ * Global snapshots are shared by all backends of the node: before asking arbiter for a snapshot backend takes
+ * the one most recently received by any backend, so that arbiter has to send only the changes made since then
+ * (nothing if no global transaction began or finished).
+ */
+static void DtmLoadSharedSnapshot(void)
+{
+	if (dtm->snapshotVersion == DtmSnapshotVersion)
+		return;
+
+	LWLockAcquire(dtm->snapshotLock, LW_SHARED);
+	if (dtm->snapshotVersion != 0 && dtm->snapshotVersion != DtmSnapshotVersion)
+	{
+		ArbiterInitSnapshot(&DtmSnapshot);
+		DtmSnapshot.xmin = dtm->snapshotXmin;
+		DtmSnapshot.xmax = dtm->snapshotXmax;
+		DtmSnapshot.xcnt = dtm->snapshotXcnt;
+		memcpy(DtmSnapshot.xip, dtm->snapshotXip, dtm->snapshotXcnt*sizeof(TransactionId));
+		DtmSnapshotVersion = dtm->snapshotVersion;
+	}
+	LWLockRelease(dtm->snapshotLock);
+}
+
+static void DtmStoreSharedSnapshot(void)
+{
+	if (dtm->snapshotVersion == DtmSnapshotVersion || DtmSnapshot.xcnt > DTM_MAX_GLOBAL_XIDS)
+		return;
+
+	LWLockAcquire(dtm->snapshotLock, LW_EXCLUSIVE);
+	dtm->snapshotXmin = DtmSnapshot.xmin;
+	dtm->snapshotXmax = DtmSnapshot.xmax;
+	dtm->snapshotXcnt = DtmSnapshot.xcnt;
+	memcpy(dtm->snapshotXip, DtmSnapshot.xip, DtmSnapshot.xcnt*sizeof(TransactionId));
+	dtm->snapshotVersion = DtmSnapshotVersion;
+	LWLockRelease(dtm->snapshotLock);
+}
+
+/*
+ * Merge unordered local xids with sorted global xids, leaving only distinct xids preceding xmax.
+ * Local array should have enough space for both. Local xids are usually much less numerous than global ones,
+ * so only them are sorted and then arrays are merged in one pass.
+ */
+static int DtmMergeXids(TransactionId* local, int nLocal, TransactionId* global, int nGlobal, TransactionId xmax)
+{
+	int i, j, n;
+	TransactionId xid;
+
+	qsort(local, nLocal, sizeof(TransactionId), xidComparator);
+
+	/* merge from the tail, so that no local xid is overwritten before it is moved */
+	i = nLocal - 1;
+	j = nGlobal - 1;
+	for (n = nLocal + nGlobal - 1; j >= 0; n--)
+	{
+		if (i >= 0 && local[i] > global[j])
+			local[n] = local[i--];
+		else
+			local[n] = global[j--];
+	}
+
+	xid = InvalidTransactionId;
+	for (i = 0, n = 0; i < nLocal + nGlobal && local[i] < xmax; i++)
+		if (local[i] != xid)
+			local[n++] = xid = local[i];
+	return n;
+}
+
 /* Merge local and global snapshots.
  * Produce most restricted (conservative) snapshot which treate transaction as in-progress if is is marked as in-progress
  * either in local, either in global snapshots
  */
 static void DtmMergeWithGlobalSnapshot(Snapshot dst)
 {
-	int i, j, n;
+	int i;
 	TransactionId xid;
 	Snapshot src = &DtmSnapshot;
 
@@ -255,31 +330,13 @@ GetLocalSnapshot:
 	if (src->xcnt + dst->subxcnt + dst->xcnt <= GetMaxSnapshotXidCount())
 	{
 		Assert(dst->subxcnt == 0);
-		memcpy(dst->xip + dst->xcnt, src->xip, src->xcnt*sizeof(TransactionId));
-		n = dst->xcnt + src->xcnt;
-
-		qsort(dst->xip, n, sizeof(TransactionId), xidComparator);
-		xid = InvalidTransactionId;
-
-		for (i = 0, j = 0; i < n && dst->xip[i] < dst->xmax; i++)
-			if (dst->xip[i] != xid)
-				dst->xip[j++] = xid = dst->xip[i];
-		dst->xcnt = j;
+		dst->xcnt = DtmMergeXids(dst->xip, dst->xcnt, src->xip, src->xcnt, dst->xmax);
 	}
 	else
 	{
 		Assert(src->xcnt + dst->subxcnt + dst->xcnt <= GetMaxSnapshotSubxidCount());
 		memcpy(dst->subxip + dst->subxcnt, dst->xip, dst->xcnt*sizeof(TransactionId));
-		memcpy(dst->subxip + dst->subxcnt + dst->xcnt, src->xip, src->xcnt*sizeof(TransactionId));
-		n = dst->xcnt + dst->subxcnt + src->xcnt;
-
-		qsort(dst->subxip, n, sizeof(TransactionId), xidComparator);
-		xid = InvalidTransactionId;
-
-		for (i = 0, j = 0; i < n && dst->subxip[i] < dst->xmax; i++)
-			if (dst->subxip[i] != xid)
-				dst->subxip[j++] = xid = dst->subxip[i];
-		dst->subxcnt = j;
+		dst->subxcnt = DtmMergeXids(dst->subxip, dst->subxcnt + dst->xcnt, src->xip, src->xcnt, dst->xmax);
 		dst->xcnt = 0;
 	}
 	DumpSnapshot(dst, "merged");
@@ -625,7 +682,9 @@ static Snapshot DtmGetSnapshot(Snapshot snapshot)
 	if (TransactionIdIsValid(DtmNextXid) && snapshot != &CatalogSnapshotData)
 	{		
 		if (!DtmHasGlobalSnapshot && (snapshot != DtmLastSnapshot || DtmCurcid != GetCurrentCommandId(false))) {
-			ArbiterGetSnapshot(DtmNextXid, &DtmSnapshot, &dtm->minXid);
+			DtmLoadSharedSnapshot();
+			ArbiterGetSnapshot(DtmNextXid, &DtmSnapshot, &dtm->minXid, &DtmSnapshotVersion);
+			DtmStoreSharedSnapshot();
 		}
 		DtmLastSnapshot = snapshot;
 		DtmMergeWithGlobalSnapshot(snapshot);
@@ -729,13 +788,15 @@ static void DtmInitialize()
 	static HASHCTL info;
 
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
-	dtm = ShmemInitStruct("dtm", sizeof(DtmState), &found);
+	dtm = ShmemInitStruct("dtm", offsetof(DtmState, snapshotXip) + DTM_MAX_GLOBAL_XIDS*sizeof(TransactionId), &found);
 	if (!found)
 	{
 		dtm->hashLock = LWLockAssign();
 		dtm->xidLock = LWLockAssign();
+		dtm->snapshotLock = LWLockAssign();
 		dtm->nReservedXids = 0;
 		dtm->minXid = InvalidTransactionId;
+		dtm->snapshotVersion = 0;
 		RegisterXactCallback(DtmXactCallback, NULL);
 		RegisterSubXactCallback(DtmSubXactCallback, NULL);
 	}
@@ -832,7 +893,7 @@ _PG_init(void)
 	 * resources in imcs_shmem_startup().
 	 */
 	RequestAddinShmemSpace(DTM_SHMEM_SIZE);
-	RequestAddinLWLocks(2);
+	RequestAddinLWLocks(3);
 
 	DefineCustomIntVariable(
 		"dtm.local_xid_reserve",
@@ -947,9 +1008,10 @@ dtm_begin_transaction(PG_FUNCTION_ARGS)
 		elog(ERROR, "dtm_begin/join_transaction should be called only once for global transaction");
 	if (dtm == NULL)
 		elog(ERROR, "DTM is not properly initialized, please check that pg_dtm plugin was added to shared_preload_libraries list in postgresql.conf");
-	DtmNextXid = ArbiterStartTransaction(&DtmSnapshot, &dtm->minXid, 0);
+	DtmNextXid = ArbiterStartTransaction(&DtmSnapshot, &dtm->minXid, &DtmSnapshotVersion, 0);
 	if (!TransactionIdIsValid(DtmNextXid))
 		elog(ERROR, "Arbiter was not able to assign XID");
+	DtmStoreSharedSnapshot();
 	XTM_INFO("%d: Start global transaction %d, dtm->minXid=%d\n", getpid(), DtmNextXid, dtm->minXid);
 
 	DtmHasGlobalSnapshot = true;
@@ -967,7 +1029,9 @@ Datum dtm_join_transaction(PG_FUNCTION_ARGS)
 	if (!TransactionIdIsValid(DtmNextXid))
 		elog(ERROR, "Arbiter was not able to assign XID");
 
-	ArbiterGetSnapshot(DtmNextXid, &DtmSnapshot, &dtm->minXid);
+	DtmLoadSharedSnapshot();
+	ArbiterGetSnapshot(DtmNextXid, &DtmSnapshot, &dtm->minXid, &DtmSnapshotVersion);
+	DtmStoreSharedSnapshot();
 	XTM_INFO("%d: Join global transaction %d, dtm->minXid=%d\n", getpid(), DtmNextXid, dtm->minXid);
 
 	DtmHasGlobalSnapshot = true;
@@ -17,9 +17,13 @@
 #include "storage/lmgr.h"
 #include "storage/shmem.h"
 #include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "postmaster/autovacuum.h"
 #include "access/xlogdefs.h"
 #include "access/xact.h"
 #include "access/xtm.h"
+#include "access/hlc.h"
 #include "access/transam.h"
 #include "access/subtrans.h"
 #include "access/xlog.h"
@@ -39,6 +43,16 @@
 #define MAX_GTID_SIZE  16
 #define HASH_PER_ELEM_OVERHEAD 64
 
+#define DTM_TRANCHE_NAME    "pg_tsdtm"
+#define DTM_NUM_PARTITIONS  16        /* must be power of two */
+#define DTM_LIST_LOCK       (&local->locks[0].lock)
+#define DTM_XID_PARTITION_LOCK_OFFSET  1
+#define DTM_GTID_PARTITION_LOCK_OFFSET (DTM_XID_PARTITION_LOCK_OFFSET + DTM_NUM_PARTITIONS)
+#define DTM_NUM_LOCKS       (DTM_GTID_PARTITION_LOCK_OFFSET + DTM_NUM_PARTITIONS)
+
+#define DTM_CSN_CACHE_SIZE    4096      /* number of entries in backend local cache of completed transactions */
+#define DTM_CSN_CACHE_MAX_AGE (1U << 30) /* maximal distance between XIDs in local cache, to be safe from wraparound */
+
 #define USEC 1000000
 
 #define TRACE_SLEEP_TIME 1
@@ -59,12 +73,14 @@ typedef struct DtmTransStatus
 /* State of DTM node */
 typedef struct
 {
-	cid_t		cid;			/* last assigned CSN; used to provide unique
-								 * ascending CSNs */
+	HLCState	clock;			/* hybrid logical clock used to provide
+								 * unique ascending CSNs */
 	TransactionId oldest_xid;	/* XID of oldest transaction visible by any
 								 * active transaction (local or global) */
-	long		time_shift;		/* correction to system time */
-	volatile slock_t lock;		/* spinlock to protect access to hash table  */
+	LWLockPadded *locks;		/* list lock followed by partition locks of
+								 * xid2status and gtid2xid */
+	pg_atomic_uint32 n_waiters; /* number of backends waiting for in-doubt
+								 * transactions */
 	DtmTransStatus *trans_list_head;	/* L1 list of finished transactions
 										 * present in xid2status hash table.
 										 * This list is used to perform
@@ -81,6 +97,14 @@ typedef struct
 	int			nSubxids;
 }	DtmTransId;
 
+/* Backend local cache of completed transactions */
+typedef struct
+{
+	TransactionId xid;
+	XidStatus	status;
+	cid_t		cid;
+}	DtmCSNCacheEntry;
+
 
 #define DTM_TRACE(x)
 /* #define DTM_TRACE(x) fprintf x */
@@ -89,9 +113,13 @@ static shmem_startup_hook_type prev_shmem_startup_hook;
 static HTAB *xid2status;
 static HTAB *gtid2xid;
 static DtmNodeState *local;
+static TransactionId *wait_xid;	/* XID which completion is waited by
+								 * backend, indexed by pgprocno */
+static DtmCSNCacheEntry csn_cache[DTM_CSN_CACHE_SIZE];
+static TransactionId csn_cache_xmin;
 static DtmCurrentTrans dtm_tx;
-static uint64 totalSleepInterrupts;
 static int	DtmVacuumDelay;
+static int	DtmMaxClockSkew;
 static bool DtmRecordCommits;
 
 static Snapshot DtmGetSnapshot(Snapshot snapshot);
@@ -132,74 +160,46 @@ static void dtm_shmem_startup(void);
 static Size dtm_memsize(void);
 static void dtm_xact_callback(XactEvent event, void *arg);
 static timestamp_t dtm_get_current_time();
-static void dtm_sleep(timestamp_t interval);
 static cid_t dtm_get_cid();
-static cid_t dtm_sync(cid_t cid);
+static cid_t dtm_sync(cid_t cid, int elevel);
 
 /*
  *	Time manipulation functions
  */
 
-/* Get current time with microscond resolution */
+/* Get current time with microscond resolution: reading of hybrid logical clock */
 static timestamp_t
 dtm_get_current_time()
 {
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-	return (timestamp_t) tv.tv_sec * USEC + tv.tv_usec + local->time_shift;
-}
-
-/* Sleep for specified amount of time */
-static void
-dtm_sleep(timestamp_t interval)
-{
-	struct timespec ts;
-	struct timespec rem;
-
-	ts.tv_sec = 0;
-	ts.tv_nsec = interval * 1000;
-
-	while (nanosleep(&ts, &rem) < 0)
-	{
-		totalSleepInterrupts += 1;
-		Assert(errno == EINTR);
-		ts = rem;
-	}
+	return HLCNow(&local->clock);
 }
 
 /* Get unique ascending CSN.
- * This function is called inside critical section
+ * Clock is advanced atomically, so this function doesn't require any lock
  */
 static cid_t
 dtm_get_cid()
 {
-	cid_t		cid = dtm_get_current_time();
-
-	if (cid <= local->cid)
-	{
-		cid = ++local->cid;
-	}
-	else
-	{
-		local->cid = cid;
-	}
-	return cid;
+	return HLCTick(&local->clock);
 }
 
 /*
- * Adjust system time
+ * Advance clock to the CSN received from other node.
+ * Skew exceeding dtm.max_clock_skew is reported with specified level, clock is advanced only if it is below ERROR.
+ * Should not be called inside critical section.
  */
 static cid_t
-dtm_sync(cid_t global_cid)
+dtm_sync(cid_t global_cid, int elevel)
 {
-	cid_t		local_cid;
+	hlc_t		skew;
 
-	while ((local_cid = dtm_get_cid()) < global_cid)
+	if (!HLCReceive(&local->clock, global_cid, (hlc_t) DtmMaxClockSkew * 1000, &skew))
 	{
-		local->time_shift += global_cid - local_cid;
+		elog(elevel, "Clock skew %lu usec exceeds dtm.max_clock_skew", (unsigned long) skew);
+		/* Timestamp is rejected only if error is reported, otherwise it still has to be accepted */
+		HLCReceive(&local->clock, global_cid, 0, NULL);
 	}
-	return local_cid;
+	return dtm_get_cid();
 }
 
 void
@@ -219,6 +219,7 @@ _PG_init(void)
 		return;
 
 	RequestAddinShmemSpace(dtm_memsize());
+	RequestNamedLWLockTranche(DTM_TRANCHE_NAME, DTM_NUM_LOCKS);
 
 	DefineCustomIntVariable(
 							"dtm.vacuum_delay",
@@ -235,6 +236,21 @@ _PG_init(void)
 							NULL
 		);
 
+	DefineCustomIntVariable(
+							"dtm.max_clock_skew",
+					"Maximal allowed skew of clocks of cluster nodes (msec)",
+							"Global transaction which snapshot is ahead of local time by more than this value is rejected. Zero disables the check",
+							&DtmMaxClockSkew,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL
+		);
+
 	DefineCustomBoolVariable(
 							 "dtm.record_commits",
 							 "Store information about committed global transactions in pg_committed_xacts table",
@@ -276,6 +292,10 @@ dtm_memsize(void)
 
 	size = MAXALIGN(sizeof(DtmNodeState));
 	size = add_size(size, (sizeof(DtmTransId) + sizeof(DtmTransStatus) + HASH_PER_ELEM_OVERHEAD * 2) * DTM_HASH_INIT_SIZE);
+	/* wait_xid: MaxBackends is not yet known here */
+	size = add_size(size, mul_size(sizeof(TransactionId),
+								   MaxConnections + autovacuum_max_workers + 1 + max_worker_processes +
+								   max_prepared_xacts + NUM_AUXILIARY_PROCS));
 
 	return size;
 }
@@ -463,6 +483,170 @@ DtmGetName(void)
 	return "pg_tsdtm";
 }
 
+
+/*
+ * Locking.
+ * xid2status and gtid2xid are partitioned hash tables: each partition is
+ * protected by its own LWLock, so lookups of different transactions don't
+ * contend with each other. Insert and remove of xid2status entries and changes
+ * of their status and CSN are done under exclusive list lock (protecting list
+ * of finished transactions) and exclusive partition lock, so lookup requires
+ * either list lock either shared partition lock. Visibility check takes only
+ * shared partition lock, unless result is found in backend local cache.
+ * Entries of gtid2xid are accessed only under their partition lock.
+ */
+
+static LWLock *
+DtmXidPartitionLock(TransactionId xid)
+{
+	uint32		hashcode = get_hash_value(xid2status, &xid);
+
+	return &local->locks[DTM_XID_PARTITION_LOCK_OFFSET + hashcode % DTM_NUM_PARTITIONS].lock;
+}
+
+static LWLock *
+DtmGtidPartitionLock(GlobalTransactionId gtid)
+{
+	uint32		hashcode = get_hash_value(gtid2xid, gtid);
+
+	return &local->locks[DTM_GTID_PARTITION_LOCK_OFFSET + hashcode % DTM_NUM_PARTITIONS].lock;
+}
+
+/*
+ * Wakeup backends waiting for completion of transaction.
+ * Should be called after status or CSN of in-doubt transaction is changed.
+ */
+static void
+DtmWakeWaiters(TransactionId xid)
+{
+	int			i;
+
+	/* Pairs with registration of waiter in DtmXidInMVCCSnapshot */
+	pg_memory_barrier();
+	if (pg_atomic_read_u32(&local->n_waiters) != 0)
+	{
+		for (i = 0; i < ProcGlobal->allProcCount; i++)
+		{
+			if (wait_xid[i] == xid)
+			{
+				SetLatch(&ProcGlobal->allProcs[i].procLatch);
+			}
+		}
+	}
+}
+
+static void
+DtmSetWaitXid(TransactionId xid)
+{
+	wait_xid[MyProc->pgprocno] = xid;
+	if (TransactionIdIsValid(xid))
+	{
+		pg_atomic_fetch_add_u32(&local->n_waiters, 1);
+	}
+	else
+	{
+		pg_atomic_fetch_sub_u32(&local->n_waiters, 1);
+	}
+}
+
+/*
+ * Insert transaction in xid2status. New entry is initialized before it
+ * becomes visible to readers. Existing entry is left unchanged.
+ * Should be called under exclusive list lock.
+ */
+static DtmTransStatus *
+DtmTransStatusInsert(TransactionId xid, XidStatus status, cid_t cid, int nSubxids, bool *found)
+{
+	LWLock	   *partitionLock = DtmXidPartitionLock(xid);
+	DtmTransStatus *ts;
+
+	LWLockAcquire(partitionLock, LW_EXCLUSIVE);
+	ts = (DtmTransStatus *) hash_search(xid2status, &xid, HASH_ENTER, found);
+	if (!*found)
+	{
+		ts->status = status;
+		ts->cid = cid;
+		ts->nSubxids = nSubxids;
+		ts->next = NULL;
+	}
+	LWLockRelease(partitionLock);
+	return ts;
+}
+
+/*
+ * Set status and CSN of transaction and its subtransactions following it in the list.
+ * Should be called under exclusive list lock.
+ */
+static void
+DtmSetTreeStatus(DtmTransStatus * ts, XidStatus status, cid_t cid)
+{
+	int			i,
+				n = ts->nSubxids;
+
+	for (i = 0; i <= n; i++, ts = ts->next)
+	{
+		LWLock	   *partitionLock = DtmXidPartitionLock(ts->xid);
+
+		LWLockAcquire(partitionLock, LW_EXCLUSIVE);
+		ts->status = status;
+		ts->cid = cid;
+		LWLockRelease(partitionLock);
+		DtmWakeWaiters(ts->xid);
+	}
+}
+
+/*
+ * Copy state of global transaction
+ */
+static bool
+DtmGetTransId(GlobalTransactionId gtid, DtmTransId * result)
+{
+	LWLock	   *partitionLock = DtmGtidPartitionLock(gtid);
+	DtmTransId *id;
+
+	LWLockAcquire(partitionLock, LW_SHARED);
+	id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_FIND, NULL);
+	if (id != NULL)
+	{
+		*result = *id;
+	}
+	LWLockRelease(partitionLock);
+	return id != NULL;
+}
+
+static void
+DtmSetTransId(GlobalTransactionId gtid, TransactionId xid)
+{
+	LWLock	   *partitionLock = DtmGtidPartitionLock(gtid);
+	DtmTransId *id;
+
+	LWLockAcquire(partitionLock, LW_EXCLUSIVE);
+	id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_ENTER, NULL);
+	id->xid = xid;
+	id->nSubxids = 0;
+	id->subxids = 0;
+	LWLockRelease(partitionLock);
+}
+
+/*
+ * Remove global transaction from gtid2xid and return its XID
+ */
+static TransactionId
+DtmRemoveTransId(GlobalTransactionId gtid)
+{
+	LWLock	   *partitionLock = DtmGtidPartitionLock(gtid);
+	DtmTransId *id;
+	TransactionId xid;
+
+	LWLockAcquire(partitionLock, LW_EXCLUSIVE);
+	id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_REMOVE, NULL);
+	Assert(id != NULL);
+	xid = id->xid;
+	free(id->subxids);
+	LWLockRelease(partitionLock);
+	return xid;
+}
+
 static void
 DtmTransactionListAppend(DtmTransStatus * ts)
 {
@@ -487,7 +671,9 @@ DtmTransactionListInsertAfter(DtmTransStatus * after, DtmTransStatus * ts)
  * Seince we do not have centralized aribiter, we have to rely in DtmVacuumDelay.
  * This function takes XID which PostgreSQL consider to be the latest and try to find XID which
  * is older than it more than DtmVacuumDelay.
- * If no such XID can be located, then return previously observed oldest XID
+ * If no such XID can be located, then return previously observed oldest XID.
+ * Cleanup is performed by one backend at a time: if list lock is busy, oldest XID found by
+ * the previous cleanup is returned.
  */
 static TransactionId
 DtmAdjustOldestXid(TransactionId xid)
@@ -496,31 +682,37 @@ DtmAdjustOldestXid(TransactionId xid)
 	{
 		DtmTransStatus *ts,
 				   *prev = NULL;
-		timestamp_t now = dtm_get_current_time();
-		timestamp_t cutoff_time = now - DtmVacuumDelay * USEC;
+		LWLock	   *partitionLock = DtmXidPartitionLock(xid);
+		timestamp_t cutoff_time = dtm_get_current_time() - DtmVacuumDelay * USEC;
 
-		SpinLockAcquire(&local->lock);
+		LWLockAcquire(partitionLock, LW_SHARED);
 		ts = (DtmTransStatus *) hash_search(xid2status, &xid, HASH_FIND, NULL);
 		if (ts != NULL)
 		{
 			cutoff_time = ts->cid - DtmVacuumDelay * USEC;
+		}
+		LWLockRelease(partitionLock);
 
+		if (ts != NULL && LWLockConditionalAcquire(DTM_LIST_LOCK, LW_EXCLUSIVE))
+		{
 			for (ts = local->trans_list_head; ts != NULL && ts->cid < cutoff_time; prev = ts, ts = ts->next)
 			{
 				if (prev != NULL)
+				{
+					partitionLock = DtmXidPartitionLock(prev->xid);
+					LWLockAcquire(partitionLock, LW_EXCLUSIVE);
 					hash_search(xid2status, &prev->xid, HASH_REMOVE, NULL);
+					LWLockRelease(partitionLock);
+				}
 			}
+			if (prev != NULL)
+			{
+				local->trans_list_head = prev;
+				local->oldest_xid = prev->xid;
+			}
+			LWLockRelease(DTM_LIST_LOCK);
 		}
-		if (prev != NULL)
-		{
-			local->trans_list_head = prev;
-			local->oldest_xid = xid = prev->xid;
-		}
-		else
-		{
-			xid = local->oldest_xid;
-		}
-		SpinLockRelease(&local->lock);
+		xid = local->oldest_xid;
 	}
 	return xid;
 }
@@ -542,18 +734,79 @@ DtmGetOldestXmin(Relation rel, bool ignoreVacuum)
 	return xmin;
 }
 
+/*
+ * Status and CSN of committed or aborted transaction are never changed,
+ * so they are remembered in backend local cache.
+ */
+static bool
+DtmCSNCacheLookup(TransactionId xid, XidStatus *status, cid_t *cid)
+{
+	DtmCSNCacheEntry *entry = &csn_cache[xid % DTM_CSN_CACHE_SIZE];
+
+	/* Drop the whole cache before it can contain XIDs from different epochs */
+	if (local->oldest_xid - csn_cache_xmin >= DTM_CSN_CACHE_MAX_AGE)
+	{
+		memset(csn_cache, 0, sizeof(csn_cache));
+		csn_cache_xmin = local->oldest_xid;
+		return false;
+	}
+	if (entry->xid == xid)
+	{
+		*status = entry->status;
+		*cid = entry->cid;
+		return true;
+	}
+	return false;
+}
+
+static void
+DtmCSNCacheInsert(TransactionId xid, XidStatus status, cid_t cid)
+{
+	DtmCSNCacheEntry *entry;
+
+	if (status != TRANSACTION_STATUS_COMMITTED && status != TRANSACTION_STATUS_ABORTED)
+	{
+		return;
+	}
+	if (xid - csn_cache_xmin >= DTM_CSN_CACHE_MAX_AGE)
+	{
+		memset(csn_cache, 0, sizeof(csn_cache));
+		csn_cache_xmin = local->oldest_xid;
+		if (xid - csn_cache_xmin >= DTM_CSN_CACHE_MAX_AGE)
+		{
+			return;
+		}
+	}
+	entry = &csn_cache[xid % DTM_CSN_CACHE_SIZE];
+	entry->xid = xid;
+	entry->status = status;
+	entry->cid = cid;
+}
+
 /*
  * Check tuple bisibility based on CSN of current transaction.
  * If there is no niformation about transaction with this XID, then use standard PostgreSQL visibility rules.
+ * Backend waiting for in-doubt transaction registers itself in wait_xid and sleeps on its latch
+ * until status or CSN of the transaction is changed. Timeout is used only as a safety net.
  */
 bool
 DtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 {
 	timestamp_t delay = MIN_WAIT_TIMEOUT;
+	LWLock	   *partitionLock;
+	XidStatus	status;
+	cid_t		cid;
+	bool		waiting = false;
 
 	Assert(xid != InvalidTransactionId);
 
-	SpinLockAcquire(&local->lock);
+	if (DtmCSNCacheLookup(xid, &status, &cid))
+	{
+		return cid > dtm_tx.snapshot || status == TRANSACTION_STATUS_ABORTED;
+	}
+
+	partitionLock = DtmXidPartitionLock(xid);
+	LWLockAcquire(partitionLock, LW_SHARED);
 
 	while (true)
 	{
@@ -561,31 +814,53 @@ DtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 
 		if (ts != NULL)
 		{
-			if (ts->cid > dtm_tx.snapshot)
+			status = ts->status;
+			cid = ts->cid;
+			if (cid > dtm_tx.snapshot)
 			{
 				DTM_TRACE((stderr, "%d: tuple with xid=%d(csn=%lld) is invisibile in snapshot %lld\n",
-						   getpid(), xid, ts->cid, dtm_tx.snapshot));
-				SpinLockRelease(&local->lock);
+						   getpid(), xid, cid, dtm_tx.snapshot));
+				LWLockRelease(partitionLock);
+				if (waiting)
+					DtmSetWaitXid(InvalidTransactionId);
+				DtmCSNCacheInsert(xid, status, cid);
 				return true;
 			}
-			if (ts->status == TRANSACTION_STATUS_IN_PROGRESS)
+			if (status == TRANSACTION_STATUS_IN_PROGRESS)
 			{
 				DTM_TRACE((stderr, "%d: wait for in-doubt transaction %u in snapshot %lu\n", getpid(), xid, dtm_tx.snapshot));
-				SpinLockRelease(&local->lock);
-
-				dtm_sleep(delay);
+				LWLockRelease(partitionLock);
 
-				if (delay * 2 <= MAX_WAIT_TIMEOUT)
-					delay *= 2;
-				SpinLockAcquire(&local->lock);
+				if (!waiting)
+				{
+					/* Register before rechecking status, so that DtmWakeWaiters will not miss us */
+					DtmSetWaitXid(xid);
+					waiting = true;
+				}
+				else
+				{
+					if (WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+								  Max(delay / 1000, 1)) & WL_POSTMASTER_DEATH)
+					{
+						proc_exit(1);
+					}
+					ResetLatch(&MyProc->procLatch);
+
+					if (delay * 2 <= MAX_WAIT_TIMEOUT)
+						delay *= 2;
+				}
+				LWLockAcquire(partitionLock, LW_SHARED);
 			}
 			else
 			{
-				bool		invisible = ts->status == TRANSACTION_STATUS_ABORTED;
+				bool		invisible = status == TRANSACTION_STATUS_ABORTED;
 
 				DTM_TRACE((stderr, "%d: tuple with xid=%d(csn= %lld) is %s in snapshot %lld\n",
-						   getpid(), xid, ts->cid, invisible ? "rollbacked" : "committed", dtm_tx.snapshot));
-				SpinLockRelease(&local->lock);
+						   getpid(), xid, cid, invisible ? "rollbacked" : "committed", dtm_tx.snapshot));
+				LWLockRelease(partitionLock);
+				if (waiting)
+					DtmSetWaitXid(InvalidTransactionId);
+				DtmCSNCacheInsert(xid, status, cid);
 				return invisible;
 			}
 		}
@@ -595,7 +870,9 @@ DtmXidInMVCCSnapshot(TransactionId xid, Snapshot snapshot)
 			break;
 		}
 	}
-	SpinLockRelease(&local->lock);
+	LWLockRelease(partitionLock);
+	if (waiting)
+		DtmSetWaitXid(InvalidTransactionId);
 	return PgXidInMVCCSnapshot(xid, snapshot);
 }
 
@@ -609,10 +886,11 @@ DtmInitialize()
 	info.entrysize = sizeof(DtmTransStatus);
 	info.hash = dtm_xid_hash_fn;
 	info.match = dtm_xid_match_fn;
+	info.num_partitions = DTM_NUM_PARTITIONS;
 	xid2status = ShmemInitHash("xid2status",
 							   DTM_HASH_INIT_SIZE, DTM_HASH_INIT_SIZE,
 							   &info,
-							   HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+					 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_PARTITION);
 
 	info.keysize = MAX_GTID_SIZE;
 	info.entrysize = sizeof(DtmTransId);
@@ -622,7 +900,7 @@ DtmInitialize()
 	gtid2xid = ShmemInitHash("gtid2xid",
 							 DTM_HASH_INIT_SIZE, DTM_HASH_INIT_SIZE,
 							 &info,
-					HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_KEYCOPY);
+	 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_KEYCOPY | HASH_PARTITION);
 
 	TM = &DtmTM;
 
@@ -630,14 +908,19 @@ DtmInitialize()
 	local = (DtmNodeState *) ShmemInitStruct("dtm", sizeof(DtmNodeState), &found);
 	if (!found)
 	{
-		local->time_shift = 0;
 		local->oldest_xid = FirstNormalTransactionId;
-		local->cid = dtm_get_current_time();
+		HLCInit(&local->clock);
 		local->trans_list_head = NULL;
 		local->trans_list_tail = &local->trans_list_head;
-		SpinLockInit(&local->lock);
+		local->locks = GetNamedLWLockTranche(DTM_TRANCHE_NAME);
+		pg_atomic_init_u32(&local->n_waiters, 0);
 		RegisterXactCallback(dtm_xact_callback, NULL);
 	}
+	wait_xid = (TransactionId *) ShmemInitStruct("dtm_wait_xid", sizeof(TransactionId) * ProcGlobal->allProcCount, &found);
+	if (!found)
+	{
+		MemSet(wait_xid, 0, sizeof(TransactionId) * ProcGlobal->allProcCount);
+	}
 	LWLockRelease(AddinShmemInitLock);
 }
 
@@ -650,14 +933,12 @@ DtmLocalBegin(DtmCurrentTrans * x)
 {
 	if (!TransactionIdIsValid(x->xid))
 	{
-		SpinLockAcquire(&local->lock);
 		x->xid = GetCurrentTransactionId();
 		Assert(TransactionIdIsValid(x->xid));
 		x->cid = INVALID_CID;
 		x->is_global = false;
 		x->is_prepared = false;
 		x->snapshot = dtm_get_cid();
-		SpinLockRelease(&local->lock);
 		DTM_TRACE((stderr, "DtmLocalBegin: transaction %u uses local snapshot %lu\n", x->xid, x->snapshot));
 	}
 }
@@ -671,15 +952,7 @@ DtmLocalExtend(DtmCurrentTrans * x, GlobalTransactionId gtid)
 {
 	if (gtid != NULL)
 	{
-		SpinLockAcquire(&local->lock);
-		{
-			DtmTransId *id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_ENTER, NULL);
-
-			id->xid = x->xid;
-			id->nSubxids = 0;
-			id->subxids = 0;
-		}
-		SpinLockRelease(&local->lock);
+		DtmSetTransId(gtid, x->xid);
 	}
 	x->is_global = true;
 	return x->snapshot;
@@ -692,23 +965,15 @@ DtmLocalExtend(DtmCurrentTrans * x, GlobalTransactionId gtid)
 cid_t
 DtmLocalAccess(DtmCurrentTrans * x, GlobalTransactionId gtid, cid_t global_cid)
 {
-	cid_t		local_cid;
+	cid_t		local_cid = dtm_sync(global_cid, ERROR);
 
-	SpinLockAcquire(&local->lock);
+	if (gtid != NULL)
 	{
-		if (gtid != NULL)
-		{
-			DtmTransId *id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_ENTER, NULL);
-
-			id->xid = x->xid;
-			id->nSubxids = 0;
-			id->subxids = 0;
-		}
-		local_cid = dtm_sync(global_cid);
-		x->snapshot = global_cid;
-		x->is_global = true;
+		DtmSetTransId(gtid, x->xid);
 	}
-	SpinLockRelease(&local->lock);
+	x->snapshot = global_cid;
+	x->is_global = true;
+
 	if (global_cid < local_cid - DtmVacuumDelay * USEC)
 	{
 		elog(ERROR, "Too old snapshot: requested %ld, current %ld", global_cid, local_cid);
@@ -723,22 +988,19 @@ DtmLocalAccess(DtmCurrentTrans * x, GlobalTransactionId gtid, cid_t global_cid)
 void
 DtmLocalBeginPrepare(GlobalTransactionId gtid)
 {
-	SpinLockAcquire(&local->lock);
-	{
-		DtmTransStatus *ts;
-		DtmTransId *id;
+	DtmTransStatus *ts;
+	DtmTransId	id;
+	bool		found;
 
-		id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_FIND, NULL);
-		Assert(id != NULL);
-		Assert(TransactionIdIsValid(id->xid));
-		ts = (DtmTransStatus *) hash_search(xid2status, &id->xid, HASH_ENTER, NULL);
-		ts->status = TRANSACTION_STATUS_IN_PROGRESS;
-		ts->cid = dtm_get_cid();
-		ts->nSubxids = id->nSubxids;
-		DtmTransactionListAppend(ts);
-		DtmAddSubtransactions(ts, id->subxids, id->nSubxids);
-	}
-	SpinLockRelease(&local->lock);
+	found = DtmGetTransId(gtid, &id);
+	Assert(found);
+	Assert(TransactionIdIsValid(id.xid));
+
+	LWLockAcquire(DTM_LIST_LOCK, LW_EXCLUSIVE);
+	ts = DtmTransStatusInsert(id.xid, TRANSACTION_STATUS_IN_PROGRESS, dtm_get_cid(), id.nSubxids, &found);
+	DtmTransactionListAppend(ts);
+	DtmAddSubtransactions(ts, id.subxids, id.nSubxids);
+	LWLockRelease(DTM_LIST_LOCK);
 }
 
 /*
@@ -748,46 +1010,39 @@ DtmLocalBeginPrepare(GlobalTransactionId gtid)
 cid_t
 DtmLocalPrepare(GlobalTransactionId gtid, cid_t global_cid)
 {
-	cid_t		local_cid;
+	cid_t		local_cid = dtm_get_cid();
 
-	SpinLockAcquire(&local->lock);
-	local_cid = dtm_get_cid();
 	if (local_cid > global_cid)
 	{
 		global_cid = local_cid;
 	}
-	SpinLockRelease(&local->lock);
 	return global_cid;
 }
 
 /*
- * Adjust system time according to the received maximal CSN
+ * Adjust system time according to the received maximal CSN.
+ * Backends waiting for the transaction are woken up: transaction may become invisible for them.
  */
 void
 DtmLocalEndPrepare(GlobalTransactionId gtid, cid_t cid)
 {
-	SpinLockAcquire(&local->lock);
-	{
-		DtmTransStatus *ts;
-		DtmTransId *id;
-		int			i;
+	DtmTransStatus *ts;
+	DtmTransId	id;
+	bool		found PG_USED_FOR_ASSERTS_ONLY;
 
-		id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_FIND, NULL);
-		Assert(id != NULL);
+	/* Prepared transaction has to be completed, so skew is only reported */
+	dtm_sync(cid, WARNING);
 
-		ts = (DtmTransStatus *) hash_search(xid2status, &id->xid, HASH_FIND, NULL);
-		Assert(ts != NULL);
-		ts->cid = cid;
-		for (i = 0; i < ts->nSubxids; i++)
-		{
-			ts = ts->next;
-			ts->cid = cid;
-		}
-		dtm_sync(cid);
+	found = DtmGetTransId(gtid, &id);
+	Assert(found);
 
-		DTM_TRACE((stderr, "Prepare transaction %u(%s) with CSN %lu\n", id->xid, gtid, cid));
-	}
-	SpinLockRelease(&local->lock);
+	LWLockAcquire(DTM_LIST_LOCK, LW_EXCLUSIVE);
+	ts = (DtmTransStatus *) hash_search(xid2status, &id.xid, HASH_FIND, NULL);
+	Assert(ts != NULL);
+	DtmSetTreeStatus(ts, ts->status, cid);
+	LWLockRelease(DTM_LIST_LOCK);
+
+	DTM_TRACE((stderr, "Prepare transaction %u(%s) with CSN %lu\n", id.xid, gtid, cid));
 
 	/*
 	 * Record commit in pg_committed_xact table to be make it possible to
@@ -817,64 +1072,46 @@ DtmLocalCommitPrepared(DtmCurrentTrans * x, GlobalTransactionId gtid)
 {
 	Assert(gtid != NULL);
 
-	SpinLockAcquire(&local->lock);
-	{
-		DtmTransId *id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_REMOVE, NULL);
-
-		Assert(id != NULL);
-
-		x->is_global = true;
-		x->is_prepared = true;
-		x->xid = id->xid;
-		free(id->subxids);
+	x->is_global = true;
+	x->is_prepared = true;
+	x->xid = DtmRemoveTransId(gtid);
 
-		DTM_TRACE((stderr, "Global transaction %u(%s) is precommitted\n", x->xid, gtid));
-	}
-	SpinLockRelease(&local->lock);
+	DTM_TRACE((stderr, "Global transaction %u(%s) is precommitted\n", x->xid, gtid));
 }
 
 /*
- * Set transaction status to committed
+ * Set transaction status to committed and wakeup backends waiting for it
  */
 void
 DtmLocalCommit(DtmCurrentTrans * x)
 {
-	SpinLockAcquire(&local->lock);
 	if (TransactionIdIsValid(x->xid))
 	{
 		bool		found;
 		DtmTransStatus *ts;
 
-		ts = (DtmTransStatus *) hash_search(xid2status, &x->xid, HASH_ENTER, &found);
-		ts->status = TRANSACTION_STATUS_COMMITTED;
+		LWLockAcquire(DTM_LIST_LOCK, LW_EXCLUSIVE);
 		if (x->is_prepared)
 		{
-			int			i;
-			DtmTransStatus *sts = ts;
-
-			Assert(found);
 			Assert(x->is_global);
-			for (i = 0; i < ts->nSubxids; i++)
-			{
-				sts = sts->next;
-				Assert(sts->cid == ts->cid);
-				sts->status = TRANSACTION_STATUS_COMMITTED;
-			}
+			ts = DtmTransStatusInsert(x->xid, TRANSACTION_STATUS_COMMITTED, INVALID_CID, 0, &found);
+			Assert(found);
+			DtmSetTreeStatus(ts, TRANSACTION_STATUS_COMMITTED, ts->cid);
 		}
 		else
 		{
 			TransactionId *subxids;
+			int			nSubxids = xactGetCommittedChildren(&subxids);
 
+			ts = DtmTransStatusInsert(x->xid, TRANSACTION_STATUS_COMMITTED, dtm_get_cid(), nSubxids, &found);
 			Assert(!found);
-			ts->cid = dtm_get_cid();
 			DtmTransactionListAppend(ts);
-			ts->nSubxids = xactGetCommittedChildren(&subxids);
-			DtmAddSubtransactions(ts, subxids, ts->nSubxids);
+			DtmAddSubtransactions(ts, subxids, nSubxids);
 		}
 		x->cid = ts->cid;
+		LWLockRelease(DTM_LIST_LOCK);
 		DTM_TRACE((stderr, "Local transaction %u is committed at %lu\n", x->xid, x->cid));
 	}
-	SpinLockRelease(&local->lock);
 }
 
 /*
@@ -885,52 +1122,41 @@ DtmLocalAbortPrepared(DtmCurrentTrans * x, GlobalTransactionId gtid)
 {
 	Assert(gtid != NULL);
 
-	SpinLockAcquire(&local->lock);
-	{
-		DtmTransId *id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_REMOVE, NULL);
-
-		Assert(id != NULL);
-
-		x->is_global = true;
-		x->is_prepared = true;
-		x->xid = id->xid;
-		free(id->subxids);
+	x->is_global = true;
+	x->is_prepared = true;
+	x->xid = DtmRemoveTransId(gtid);
 
-		DTM_TRACE((stderr, "Global transaction %u(%s) is preaborted\n", x->xid, gtid));
-	}
-	SpinLockRelease(&local->lock);
+	DTM_TRACE((stderr, "Global transaction %u(%s) is preaborted\n", x->xid, gtid));
 }
 
 /*
- * Set transaction status to aborted
+ * Set transaction status to aborted and wakeup backends waiting for it
  */
 void
 DtmLocalAbort(DtmCurrentTrans * x)
 {
-	SpinLockAcquire(&local->lock);
-	{
-		bool		found;
-		DtmTransStatus *ts;
+	bool		found;
+	DtmTransStatus *ts;
 
-		Assert(TransactionIdIsValid(x->xid));
-		ts = (DtmTransStatus *) hash_search(xid2status, &x->xid, HASH_ENTER, &found);
-		if (x->is_prepared)
-		{
-			Assert(found);
-			Assert(x->is_global);
-		}
-		else
-		{
-			Assert(!found);
-			ts->cid = dtm_get_cid();
-			ts->nSubxids = 0;
-			DtmTransactionListAppend(ts);
-		}
-		x->cid = ts->cid;
-		ts->status = TRANSACTION_STATUS_ABORTED;
-		DTM_TRACE((stderr, "Local transaction %u is aborted at %lu\n", x->xid, x->cid));
+	Assert(TransactionIdIsValid(x->xid));
+
+	LWLockAcquire(DTM_LIST_LOCK, LW_EXCLUSIVE);
+	ts = DtmTransStatusInsert(x->xid, TRANSACTION_STATUS_ABORTED,
+							  x->is_prepared ? INVALID_CID : dtm_get_cid(), 0, &found);
+	if (x->is_prepared)
+	{
+		Assert(found);
+		Assert(x->is_global);
+		DtmSetTreeStatus(ts, TRANSACTION_STATUS_ABORTED, ts->cid);
+	}
+	else
+	{
+		Assert(!found);
+		DtmTransactionListAppend(ts);
 	}
-	SpinLockRelease(&local->lock);
+	x->cid = ts->cid;
+	LWLockRelease(DTM_LIST_LOCK);
+	DTM_TRACE((stderr, "Local transaction %u is aborted at %lu\n", x->xid, x->cid));
 }
 
 /*
@@ -980,17 +1206,16 @@ static cid_t
 DtmGetCsn(TransactionId xid)
 {
 	cid_t		csn = 0;
+	LWLock	   *partitionLock = DtmXidPartitionLock(xid);
+	DtmTransStatus *ts;
 
-	SpinLockAcquire(&local->lock);
+	LWLockAcquire(partitionLock, LW_SHARED);
+	ts = (DtmTransStatus *) hash_search(xid2status, &xid, HASH_FIND, NULL);
+	if (ts != NULL)
 	{
-		DtmTransStatus *ts = (DtmTransStatus *) hash_search(xid2status, &xid, HASH_FIND, NULL);
-
-		if (ts != NULL)
-		{
-			csn = ts->cid;
-		}
+		csn = ts->cid;
 	}
-	SpinLockRelease(&local->lock);
+	LWLockRelease(partitionLock);
 	return csn;
 }
 
@@ -1002,30 +1227,31 @@ DtmLocalSavePreparedState(GlobalTransactionId gtid)
 {
 	if (gtid != NULL)
 	{
-		SpinLockAcquire(&local->lock);
+		LWLock	   *partitionLock = DtmGtidPartitionLock(gtid);
+		DtmTransId *id;
+
+		LWLockAcquire(partitionLock, LW_EXCLUSIVE);
+		id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_FIND, NULL);
+		if (id != NULL)
 		{
-			DtmTransId *id = (DtmTransId *) hash_search(gtid2xid, gtid, HASH_FIND, NULL);
+			TransactionId *subxids;
+			int			nSubxids = xactGetCommittedChildren(&subxids);
 
-			if (id != NULL)
+			if (nSubxids != 0)
 			{
-				TransactionId *subxids;
-				int			nSubxids = xactGetCommittedChildren(&subxids);
-
-				if (nSubxids != 0)
-				{
-					id->subxids = (TransactionId *) malloc(nSubxids * sizeof(TransactionId));
-					id->nSubxids = nSubxids;
-					memcpy(id->subxids, subxids, nSubxids * sizeof(TransactionId));
-				}
+				id->subxids = (TransactionId *) malloc(nSubxids * sizeof(TransactionId));
+				id->nSubxids = nSubxids;
+				memcpy(id->subxids, subxids, nSubxids * sizeof(TransactionId));
 			}
 		}
-		SpinLockRelease(&local->lock);
+		LWLockRelease(partitionLock);
 	}
 }
 
 /*
  * Add subtransactions to finished transactions list.
  * Copy CSN and status of parent transaction.
+ * Should be called under exclusive list lock.
  */
 static void
 DtmAddSubtransactions(DtmTransStatus * ts, TransactionId *subxids, int nSubxids)
@@ -1034,15 +1260,12 @@ DtmAddSubtransactions(DtmTransStatus * ts, TransactionId *subxids, int nSubxids)
 
 	for (i = 0; i < nSubxids; i++)
 	{
-		bool		found;
+		bool		found PG_USED_FOR_ASSERTS_ONLY;
 		DtmTransStatus *sts;
 
 		Assert(TransactionIdIsValid(subxids[i]));
-		sts = (DtmTransStatus *) hash_search(xid2status, &subxids[i], HASH_ENTER, &found);
+		sts = DtmTransStatusInsert(subxids[i], ts->status, ts->cid, 0, &found);
 		Assert(!found);
-		sts->status = ts->status;
-		sts->cid = ts->cid;
-		sts->nSubxids = 0;
 		DtmTransactionListInsertAfter(ts, sts);
 	}
 }
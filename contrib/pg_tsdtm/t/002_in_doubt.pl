@@ -0,0 +1,221 @@
+###############################################################################
+# Test of readers accessing tuples of in-doubt (prepared, but not yet
+# committed or aborted) global transactions.
+###############################################################################
+
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More tests => 4;
+use DBI;
+use DBD::Pg ':async';
+
+sub query_row
+{
+	my ($dbi, $sql, @keys) = @_;
+	my $sth = $dbi->prepare($sql) || die;
+	$sth->execute(@keys) || die;
+	my $ret = $sth->fetchrow_array || undef;
+	print "query_row('$sql') -> $ret \n";
+	return $ret;
+}
+
+sub query_exec
+{
+	my ($dbi, $sql) = @_;
+	my $rv = $dbi->do($sql) || die;
+	print "query_exec('$sql')\n";
+	return $rv;
+}
+
+sub query_row_async
+{
+	my ($dbi, $sql) = @_;
+	my $sth = $dbi->prepare($sql, {pg_async => PG_ASYNC}) || die;
+	$sth->execute() || die;
+	print "query_row_async('$sql')\n";
+	return $sth;
+}
+
+# Wait for result of asynchronous query, but not longer than timeout
+sub async_result
+{
+	my ($dbi, $sth, $timeout) = @_;
+	for (my $i = 0; $i < $timeout * 10; $i++)
+	{
+		if ($dbi->pg_ready)
+		{
+			$dbi->pg_result;
+			my $ret = $sth->fetchrow_array;
+			print "async_result -> $ret\n";
+			return $ret;
+		}
+		select(undef, undef, undef, 0.1);
+	}
+	print "async_result: timeout\n";
+	return undef;
+}
+
+###############################################################################
+# Setup nodes
+###############################################################################
+
+my @nodes;
+foreach my $name ("node1", "node2")
+{
+	my $node = get_new_node($name);
+	$node->init;
+	$node->append_conf('postgresql.conf', qq(
+		max_prepared_transactions = 10
+		shared_preload_libraries = 'pg_tsdtm'
+	));
+	$node->start;
+	$node->psql('postgres', "create extension pg_tsdtm");
+	$node->psql('postgres', "create table t(id int primary key, v int)");
+	push @nodes, $node;
+}
+my ($node1, $node2) = @nodes;
+$node1->psql('postgres', "insert into t values(1, 10)");
+$node2->psql('postgres', "insert into t values(2, 20)");
+
+my $conn1a = DBI->connect('DBI:Pg:' . $node1->connstr('postgres'));
+my $conn2a = DBI->connect('DBI:Pg:' . $node2->connstr('postgres'));
+my $conn1b = DBI->connect('DBI:Pg:' . $node1->connstr('postgres'));
+my $conn2b = DBI->connect('DBI:Pg:' . $node2->connstr('postgres'));
+
+sub start_global
+{
+	my ($gtid, $c1, $c2) = @_;
+
+	query_exec($c1, "begin transaction");
+	query_exec($c2, "begin transaction");
+	my $snapshot = query_row($c1, "select dtm_extend('$gtid')");
+	query_exec($c2, "select dtm_access($snapshot, '$gtid')");
+}
+
+# Prepare global transaction and leave it in-doubt, returns its CSN
+sub prepare_global
+{
+	my ($gtid, $c1, $c2) = @_;
+
+	query_exec($c1, "prepare transaction '$gtid'");
+	query_exec($c2, "prepare transaction '$gtid'");
+	query_exec($c1, "select dtm_begin_prepare('$gtid')");
+	query_exec($c2, "select dtm_begin_prepare('$gtid')");
+	my $csn = query_row($c1, "select dtm_prepare('$gtid', 0)");
+	return query_row($c2, "select dtm_prepare('$gtid', $csn)");
+}
+
+sub finish_global
+{
+	my ($gtid, $csn, $action, $c1, $c2) = @_;
+
+	query_exec($c1, "select dtm_end_prepare('$gtid', $csn)");
+	query_exec($c2, "select dtm_end_prepare('$gtid', $csn)");
+	query_exec($c1, "$action prepared '$gtid'");
+	query_exec($c2, "$action prepared '$gtid'");
+}
+
+sub commit_global
+{
+	my ($gtid, $c1, $c2) = @_;
+	my $csn = prepare_global($gtid, $c1, $c2);
+	finish_global($gtid, $csn, "commit", $c1, $c2);
+}
+
+###############################################################################
+# Reader of in-doubt transaction is woken up by its commit
+###############################################################################
+
+my $fail = 0;
+start_global("doubt-commit", $conn1a, $conn2a);
+query_exec($conn1a, "update t set v = 11 where id = 1");
+query_exec($conn2a, "update t set v = 21 where id = 2");
+my $csn = prepare_global("doubt-commit", $conn1a, $conn2a);
+
+start_global("reader-commit", $conn1b, $conn2b);
+my $sth = query_row_async($conn1b, "select v from t where id = 1");
+sleep(1);
+# reader has to wait for the final CSN of in-doubt transaction
+$fail = 1 if $conn1b->pg_ready != 0;
+
+finish_global("doubt-commit", $csn, "commit", $conn1a, $conn2a);
+my $v1 = async_result($conn1b, $sth, 10);
+$fail = 1 if !defined($v1) or $v1 != 11;
+commit_global("reader-commit", $conn1b, $conn2b);
+
+is($fail, 0, "Reader waits for in-doubt transaction until it is committed");
+
+###############################################################################
+# Reader of in-doubt transaction is woken up by its abort
+###############################################################################
+
+$fail = 0;
+start_global("doubt-abort", $conn1a, $conn2a);
+query_exec($conn1a, "update t set v = 12 where id = 1");
+query_exec($conn2a, "update t set v = 22 where id = 2");
+$csn = prepare_global("doubt-abort", $conn1a, $conn2a);
+
+start_global("reader-abort", $conn1b, $conn2b);
+$sth = query_row_async($conn2b, "select v from t where id = 2");
+sleep(1);
+$fail = 1 if $conn2b->pg_ready != 0;
+
+finish_global("doubt-abort", $csn, "rollback", $conn1a, $conn2a);
+my $v2 = async_result($conn2b, $sth, 10);
+$fail = 1 if !defined($v2) or $v2 != 21;
+commit_global("reader-abort", $conn1b, $conn2b);
+
+is($fail, 0, "Reader waits for in-doubt transaction until it is aborted");
+
+###############################################################################
+# Abort of in-doubt transaction with subtransactions
+###############################################################################
+
+$fail = 0;
+start_global("doubt-subxact", $conn1a, $conn2a);
+query_exec($conn1a, "savepoint s1");
+query_exec($conn1a, "update t set v = 13 where id = 1");
+query_exec($conn1a, "savepoint s2");
+query_exec($conn1a, "insert into t values(3, 30)");
+query_exec($conn2a, "update t set v = 23 where id = 2");
+$csn = prepare_global("doubt-subxact", $conn1a, $conn2a);
+
+start_global("reader-subxact", $conn1b, $conn2b);
+$sth = query_row_async($conn1b, "select sum(v) from t");
+sleep(1);
+$fail = 1 if $conn1b->pg_ready != 0;
+
+finish_global("doubt-subxact", $csn, "rollback", $conn1a, $conn2a);
+$v1 = async_result($conn1b, $sth, 10);
+# neither update nor insert made in subtransactions are visible
+$fail = 1 if !defined($v1) or $v1 != 11;
+commit_global("reader-subxact", $conn1b, $conn2b);
+
+is($fail, 0, "Reader is not blocked by aborted subtransactions of in-doubt transaction");
+
+###############################################################################
+# Many transactions: total is preserved while status of finished
+# transactions is cleaned up
+###############################################################################
+
+$fail = 0;
+for (my $i = 0; $i < 200; $i++)
+{
+	start_global("transfer-$i", $conn1a, $conn2a);
+	query_exec($conn1a, "update t set v = v - 1 where id = 1");
+	query_exec($conn2a, "update t set v = v + 1 where id = 2");
+	commit_global("transfer-$i", $conn1a, $conn2a);
+
+	if ($i % 50 == 0)
+	{
+		start_global("total-$i", $conn1b, $conn2b);
+		my $sum1 = query_row($conn1b, "select sum(v) from t");
+		my $sum2 = query_row($conn2b, "select sum(v) from t");
+		commit_global("total-$i", $conn1b, $conn2b);
+		$fail = 1 if $sum1 + $sum2 != 32;
+	}
+}
+
+is($fail, 0, "Total is preserved by global transactions");
@@ -0,0 +1,130 @@
+###############################################################################
+# Test of global transactions started by postgres_fdw with
+# postgres_fdw.use_tsdtm: the remote transaction is started and joined to the
+# global one in a single round trip, and so are prepare and voting for CSN.
+###############################################################################
+
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More tests => 7;
+use IPC::Run;
+
+###############################################################################
+# Setup nodes
+###############################################################################
+
+my @shards;
+foreach my $i (1 .. 2)
+{
+	my $shard = get_new_node("shard$i");
+	$shard->init;
+	$shard->append_conf('postgresql.conf', qq(
+		max_prepared_transactions = 10
+		shared_preload_libraries = 'pg_tsdtm'
+		log_statement = all
+	));
+	$shard->start;
+	$shard->safe_psql('postgres', "create extension pg_tsdtm");
+	$shard->safe_psql('postgres', "create table t(id int primary key, v int)");
+	$shard->safe_psql('postgres', "insert into t values($i, 100)");
+	$shard->safe_psql('postgres', "create table u(k int unique deferrable initially deferred)");
+	$shard->safe_psql('postgres', "insert into u values(1)");
+	push @shards, $shard;
+}
+
+my $coord = get_new_node("coordinator");
+$coord->init;
+$coord->append_conf('postgresql.conf', qq(
+	postgres_fdw.use_tsdtm = on
+));
+$coord->start;
+$coord->safe_psql('postgres', "create extension postgres_fdw");
+foreach my $i (1 .. 2)
+{
+	my $shard = $shards[$i - 1];
+	my $host = $shard->host;
+	my $port = $shard->port;
+	$coord->safe_psql('postgres', qq(
+		create server shard$i foreign data wrapper postgres_fdw options (host '$host', port '$port', dbname 'postgres');
+		create user mapping for current_user server shard$i;
+		create foreign table t$i(id int, v int) server shard$i options (table_name 't');
+		create foreign table u$i(k int) server shard$i options (table_name 'u');
+	));
+}
+
+sub total
+{
+	return $shards[0]->safe_psql('postgres', "select sum(v) from t") +
+		$shards[1]->safe_psql('postgres', "select sum(v) from t");
+}
+
+sub prepared
+{
+	return $shards[0]->safe_psql('postgres', "select count(*) from pg_prepared_xacts") +
+		$shards[1]->safe_psql('postgres', "select count(*) from pg_prepared_xacts");
+}
+
+###############################################################################
+# Commit of global transaction
+###############################################################################
+
+$coord->safe_psql('postgres', qq(
+	begin;
+	update t1 set v = v - 10 where id = 1;
+	update t2 set v = v + 10 where id = 2;
+	commit;
+));
+
+is($shards[0]->safe_psql('postgres', "select v from t where id = 1") . ':' .
+   $shards[1]->safe_psql('postgres', "select v from t where id = 2"),
+   "90:110", "global transaction is committed at both shards");
+is(prepared(), 0, "no prepared transactions are left");
+
+my $log = slurp_file($shards[1]->logfile);
+like($log, qr/statement: START TRANSACTION ISOLATION LEVEL REPEATABLE READ; SELECT public\.dtm_access\(/,
+	 "remote transaction is started and joined in one statement");
+like($log, qr/statement: PREPARE TRANSACTION '([0-9.]+)'; SELECT public\.dtm_begin_prepare\('\1'\); SELECT public\.dtm_prepare\('\1',0\)/,
+	 "prepare and voting for CSN are sent in one statement");
+
+###############################################################################
+# Failure of prepare at one of the shards
+###############################################################################
+
+# The deferred unique constraint is checked by PREPARE TRANSACTION, which is
+# followed by other commands in the same query string
+my ($stdout, $stderr);
+$coord->psql('postgres', qq(
+	begin;
+	update t1 set v = v - 10 where id = 1;
+	update t2 set v = v + 10 where id = 2;
+	insert into u2 values (1);
+	commit;
+), stdout => \$stdout, stderr => \$stderr);
+like($stderr, qr/transaction was aborted at one of the shards/, "failed prepare aborts global transaction");
+is($shards[0]->safe_psql('postgres', "select v from t where id = 1") . ':' . prepared(),
+   "90:0", "transaction is rolled back at the other shard");
+
+###############################################################################
+# Concurrent transfers
+###############################################################################
+
+my @clients;
+foreach my $c (1 .. 4)
+{
+	my $sql = '';
+	foreach my $n (1 .. 20)
+	{
+		my ($from, $to) = ($n + $c) % 2 ? (1, 2) : (2, 1);
+		$sql .= "begin; update t$from set v = v - 1 where id = $from; update t$to set v = v + 1 where id = $to; commit;\n";
+	}
+	push @clients, IPC::Run::start(['psql', '-X', '-q', '-d', $coord->connstr('postgres')], '<', \$sql, '>', \my $out, '2>', \my $err);
+}
+$_->finish foreach @clients;
+
+is(total() . ':' . prepared(), "200:0", "total is preserved by concurrent global transactions");
+
+$coord->stop;
+$shards[0]->stop;
+$shards[1]->stop;
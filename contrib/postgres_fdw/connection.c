@@ -17,6 +17,7 @@
 #include "access/htup_details.h"
 #include "catalog/pg_user_mapping.h"
 #include "access/xact.h"
+#include "commands/defrem.h"
 #include "access/xtm.h"
 #include "access/transam.h"
 #include "mb/pg_wchar.h"
@@ -57,6 +58,7 @@ typedef struct ConnCacheEntry
 	bool		have_error;		/* have any subxacts aborted in this xact? */
 	bool		changing_xact_state;	/* xact state change in process */
 	bool		invalidated;	/* true if reconnect is pending */
+	bool		parallel_commit;	/* commit in parallel with other servers? */
 	uint32		server_hashvalue;	/* hash value of foreign server OID */
 	uint32		mapping_hashvalue;	/* hash value of user mapping OID */
 } ConnCacheEntry;
@@ -85,9 +87,8 @@ static void disconnect_pg_server(ConnCacheEntry *entry);
 static void check_conn_params(const char **keywords, const char **values);
 static void configure_remote_session(PGconn *conn);
 static void do_sql_command(PGconn *conn, const char *sql);
-static void do_sql_send_command(PGconn *conn, const char *sql);
-static void do_sql_wait_command(PGconn *conn, const char *sql);
 static void begin_remote_xact(ConnCacheEntry *entry);
+static void extend_remote_xact(void);
 static void pgfdw_xact_callback(XactEvent event, void *arg);
 static void pgfdw_subxact_callback(SubXactEvent event,
 					   SubTransactionId mySubid,
@@ -95,6 +96,7 @@ static void pgfdw_subxact_callback(SubXactEvent event,
 					   void *arg);
 static void pgfdw_inval_callback(Datum arg, int cacheid, uint32 hashvalue);
 static void pgfdw_reject_incomplete_xact_state_change(ConnCacheEntry *entry);
+static char *pgfdw_server_name(ConnCacheEntry *entry);
 static bool pgfdw_cancel_query(PGconn *conn);
 static bool pgfdw_exec_cleanup_query(PGconn *conn, const char *query,
 						 bool ignore_errors);
@@ -192,6 +194,7 @@ GetConnection(UserMapping *user, bool will_prep_stmt)
 	if (entry->conn == NULL)
 	{
 		ForeignServer *server = GetForeignServer(user->serverid);
+		ListCell   *lc;
 
 		/* Reset all transient state fields, to be sure all are clean */
 		entry->xact_depth = 0;
@@ -199,6 +202,14 @@ GetConnection(UserMapping *user, bool will_prep_stmt)
 		entry->have_error = false;
 		entry->changing_xact_state = false;
 		entry->invalidated = false;
+		entry->parallel_commit = false;
+		foreach(lc, server->options)
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, "parallel_commit") == 0)
+				entry->parallel_commit = defGetBoolean(def);
+		}
 		entry->server_hashvalue =
 			GetSysCacheHashValue1(FOREIGNSERVEROID,
 								  ObjectIdGetDatum(server->serverid));
@@ -422,32 +433,6 @@ do_sql_command(PGconn *conn, const char *sql)
 	PQclear(res);
 }
 
-static void
-do_sql_send_command(PGconn *conn, const char *sql)
-{
-	if (PQsendQuery(conn, sql) != PGRES_COMMAND_OK)
-	{
-		PGresult   *res = PQgetResult(conn);
-
-		elog(WARNING, "Failed to send command %s", sql);
-		pgfdw_report_error(ERROR, res, conn, true, sql);
-		PQclear(res);
-	}
-}
-
-static void
-do_sql_wait_command(PGconn *conn, const char *sql)
-{
-	PGresult   *res;
-
-	while ((res = PQgetResult(conn)) != NULL)
-	{
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-			pgfdw_report_error(ERROR, res, conn, true, sql);
-		PQclear(res);
-	}
-}
-
 /*
  * Start remote transaction or subtransaction, if needed.
  *
@@ -486,45 +471,33 @@ begin_remote_xact(ConnCacheEntry *entry)
 			sql = "START TRANSACTION ISOLATION LEVEL SERIALIZABLE";
 		else
 			sql = "START TRANSACTION ISOLATION LEVEL REPEATABLE READ";
-		entry->changing_xact_state = true;
-		do_sql_command(entry->conn, sql);
-		entry->xact_depth = 1;
-		entry->changing_xact_state = false;
 
-		if (UseTsDtmTransactions)
+		if (UseTsDtmTransactions && currentConnection != NULL && entry->conn != currentConnection)
 		{
-			if (currentConnection == NULL) 
-			{
-				currentConnection = entry->conn;
-			} 
-			else if (entry->conn != currentConnection)
-			{
-				if (!currentGlobalTransactionId)
-				{	
-					char	   *resp;
-					res = PQexec(currentConnection, psprintf("SELECT public.dtm_extend('%d.%d')",
-															 MyProcPid, ++currentLocalTransactionId));
-					
-					if (PQresultStatus(res) != PGRES_TUPLES_OK)
-					{
-						pgfdw_report_error(ERROR, res, currentConnection, true, sql);
-					}
-					resp = PQgetvalue(res, 0, 0);
-					if (resp == NULL || (*resp) == '\0' || sscanf(resp, "%lld", &currentGlobalTransactionId) != 1)
-					{
-						pgfdw_report_error(ERROR, res, currentConnection, true, sql);
-					}
-					PQclear(res);
-				}
-				res = PQexec(entry->conn, psprintf("SELECT public.dtm_access(%llu, '%d.%d')", currentGlobalTransactionId, MyProcPid, currentLocalTransactionId));
+			if (!currentGlobalTransactionId)
+				extend_remote_xact();
 
-				if (PQresultStatus(res) != PGRES_TUPLES_OK)
-				{
-					pgfdw_report_error(ERROR, res, entry->conn, true, sql);
-				}
-				PQclear(res);
-			}
+			/*
+			 * Start transaction and join it to the global one in a single
+			 * round trip: result of the last command is returned.
+			 */
+			sql = psprintf("%s; SELECT public.dtm_access(%llu, '%d.%d')",
+						   sql, currentGlobalTransactionId, MyProcPid, currentLocalTransactionId);
+			entry->changing_xact_state = true;
+			res = pgfdw_exec_query(entry->conn, sql);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK)
+				pgfdw_report_error(ERROR, res, entry->conn, true, sql);
+			PQclear(res);
 		}
+		else
+		{
+			entry->changing_xact_state = true;
+			do_sql_command(entry->conn, sql);
+			if (UseTsDtmTransactions && currentConnection == NULL)
+				currentConnection = entry->conn;
+		}
+		entry->xact_depth = 1;
+		entry->changing_xact_state = false;
 	}
 
 	/*
@@ -544,6 +517,26 @@ begin_remote_xact(ConnCacheEntry *entry)
 	}
 }
 
+/*
+ * Second server is accessed by the transaction: make transaction at the first
+ * server global and get its snapshot, which is used at other servers.
+ */
+static void
+extend_remote_xact(void)
+{
+	char	   *sql = psprintf("SELECT public.dtm_extend('%d.%d')",
+							   MyProcPid, ++currentLocalTransactionId);
+	PGresult   *res = pgfdw_exec_query(currentConnection, sql);
+	char	   *resp;
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		pgfdw_report_error(ERROR, res, currentConnection, true, sql);
+	resp = PQgetvalue(res, 0, 0);
+	if (resp == NULL || (*resp) == '\0' || sscanf(resp, "%lld", &currentGlobalTransactionId) != 1)
+		pgfdw_report_error(ERROR, res, currentConnection, true, sql);
+	PQclear(res);
+}
+
 /*
  * Release connection reference count created by calling GetConnection.
  */
@@ -736,52 +729,263 @@ pgfdw_report_error(int elevel, PGresult *res, PGconn *conn,
 
 typedef bool (*DtmCommandResultHandler) (PGresult *result, void *arg);
 
+/*
+ * State of participant of distributed commit.
+ * Each statement of commit protocol is sent to all participants at once and
+ * then their results are collected in the order in which they arrive, so
+ * every phase of commit takes as long as the slowest participant.
+ */
+typedef enum
+{
+	PGFDW_PARTICIPANT_BUSY,		/* statement is sent, result is not complete */
+	PGFDW_PARTICIPANT_DONE,		/* all results of statement are received */
+	PGFDW_PARTICIPANT_FAILED	/* statement was not sent, connection is
+								 * lost or timeout is expired */
+} PgFdwParticipantState;
+
+typedef struct
+{
+	ConnCacheEntry *entry;
+	PgFdwParticipantState state;
+	PGresult   *result;			/* last result received */
+} PgFdwParticipant;
+
+/*
+ * Mark participant as failed. State of its connection is unknown, so it is
+ * not used by the following phases of commit and is discarded at abort.
+ */
+static void
+pgfdw_participant_failed(PgFdwParticipant *p)
+{
+	p->state = PGFDW_PARTICIPANT_FAILED;
+	p->entry->changing_xact_state = true;
+}
+
+/*
+ * Execute statement at all servers participating in the transaction.
+ * Statement may consist of several commands separated by semicolons, which
+ * are executed by the server in a single round trip. Result of the last
+ * command is checked against expected status and passed to the handler.
+ * Failures are reported as warnings: caller decides how to complete the
+ * transaction. If failure is not NULL, the first error result is not reported
+ * but returned to the caller, which is responsible to clear it. If
+ * parallelOnly is true, only servers with parallel_commit option participate.
+ * Waiting for results is limited by postgres_fdw.commit_timeout.
+ */
 static bool
-RunDtmStatement(char const * sql, unsigned expectedStatus, DtmCommandResultHandler handler, void *arg)
+RunDtmStatement(char const * sql, unsigned expectedStatus, DtmCommandResultHandler handler, void *arg,
+				PgFdwParticipant *failure, bool parallelOnly)
 {
 	HASH_SEQ_STATUS scan;
 	ConnCacheEntry *entry;
+	PgFdwParticipant *participants;
+	int			nParticipants = 0;
+	int			nBusy = 0;
+	int			i;
 	bool		allOk = true;
+	TimestampTz endtime = 0;
+
+	participants = (PgFdwParticipant *) palloc(hash_get_num_entries(ConnectionHash) * sizeof(PgFdwParticipant));
 
 	hash_seq_init(&scan, ConnectionHash);
 	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 	{
-		if (entry->xact_depth > 0)
+		PgFdwParticipant *p;
+
+		if (entry->conn == NULL || entry->xact_depth <= 0 || (parallelOnly && !entry->parallel_commit))
+			continue;
+
+		if (entry->changing_xact_state)
+		{
+			/* Connection failed at the previous phase */
+			allOk = false;
+			continue;
+		}
+		p = &participants[nParticipants++];
+		p->entry = entry;
+		p->result = NULL;
+		if (PQsendQuery(entry->conn, sql))
+		{
+			p->state = PGFDW_PARTICIPANT_BUSY;
+			nBusy += 1;
+		}
+		else
 		{
-			do_sql_send_command(entry->conn, sql);
+			pgfdw_report_error(WARNING, NULL, entry->conn, false, sql);
+			pgfdw_participant_failed(p);
 		}
 	}
 
-	hash_seq_init(&scan, ConnectionHash);
-	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	if (RemoteCommitTimeout > 0)
+		endtime = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), RemoteCommitTimeout);
+
+	/* In what follows, do not leak any PGresults on an error. */
+	PG_TRY();
 	{
-		if (entry->xact_depth > 0)
+		while (true)
 		{
-			PGresult   *result = PQgetResult(entry->conn);
+			WaitEventSet *set;
+			WaitEvent	event;
+			long		cur_timeout = -1;
+			int			rc;
+
+			/* Collect results which are already received */
+			for (i = 0; i < nParticipants; i++)
+			{
+				PgFdwParticipant *p = &participants[i];
+
+				while (p->state == PGFDW_PARTICIPANT_BUSY && !PQisBusy(p->entry->conn))
+				{
+					PGresult   *res = PQgetResult(p->entry->conn);
+
+					if (res == NULL)
+					{
+						p->state = PGFDW_PARTICIPANT_DONE;
+						nBusy -= 1;
+					}
+					else
+					{
+						PQclear(p->result);
+						p->result = res;
+					}
+				}
+			}
+			if (nBusy == 0)
+				break;
+
+			if (endtime != 0)
+			{
+				TimestampTz now = GetCurrentTimestamp();
+				long		secs;
+				int			microsecs;
+
+				if (now >= endtime)
+				{
+					for (i = 0; i < nParticipants; i++)
+					{
+						if (participants[i].state == PGFDW_PARTICIPANT_BUSY)
+						{
+							ereport(WARNING,
+									(errcode(ERRCODE_CONNECTION_FAILURE),
+									 errmsg("timeout expired while waiting for result of \"%s\"", sql)));
+							pgfdw_participant_failed(&participants[i]);
+						}
+					}
+					break;
+				}
+				TimestampDifference(now, endtime, &secs, &microsecs);
+				cur_timeout = secs * 1000 + microsecs / 1000 + 1;
+			}
 
-			if (PQresultStatus(result) != expectedStatus || (handler && !handler(result, arg)))
+			/* Sleep until one of the participants responds */
+			set = CreateWaitEventSet(CurrentMemoryContext, nBusy + 1);
+			AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+			for (i = 0; i < nParticipants; i++)
 			{
-				elog(WARNING, "Failed command %s: status=%d, expected status=%d", sql, PQresultStatus(result), expectedStatus);
-				pgfdw_report_error(ERROR, result, entry->conn, true, sql);
-				allOk = false;
+				if (participants[i].state == PGFDW_PARTICIPANT_BUSY)
+					AddWaitEventToSet(set, WL_SOCKET_READABLE, PQsocket(participants[i].entry->conn), NULL, &participants[i]);
 			}
-			PQclear(result);
-			PQgetResult(entry->conn);	/* consume NULL result */
+			rc = WaitEventSetWait(set, cur_timeout, &event, 1);
+			FreeWaitEventSet(set);
+
+			if (rc > 0)
+			{
+				if (event.events & WL_LATCH_SET)
+					ResetLatch(MyLatch);
+
+				if (event.events & WL_SOCKET_READABLE)
+				{
+					PgFdwParticipant *p = (PgFdwParticipant *) event.user_data;
+
+					if (!PQconsumeInput(p->entry->conn))
+					{
+						pgfdw_report_error(WARNING, NULL, p->entry->conn, false, sql);
+						pgfdw_participant_failed(p);
+						nBusy -= 1;
+					}
+				}
+			}
+			CHECK_FOR_INTERRUPTS();
 		}
 	}
+	PG_CATCH();
+	{
+		for (i = 0; i < nParticipants; i++)
+			PQclear(participants[i].result);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	for (i = 0; i < nParticipants; i++)
+	{
+		PgFdwParticipant *p = &participants[i];
+
+		if (p->state != PGFDW_PARTICIPANT_DONE)
+		{
+			allOk = false;
+		}
+		else if (PQresultStatus(p->result) != expectedStatus || (handler && !handler(p->result, arg)))
+		{
+			if (failure != NULL && failure->result == NULL)
+			{
+				*failure = *p;
+				p->result = NULL;
+			}
+			else
+				pgfdw_report_error(WARNING, p->result, p->entry->conn, false, sql);
+			allOk = false;
+		}
+		PQclear(p->result);
+	}
+	pfree(participants);
 	return allOk;
 }
 
 static bool
 RunDtmCommand(char const * sql)
 {
-	return RunDtmStatement(sql, PGRES_COMMAND_OK, NULL, NULL);
+	return RunDtmStatement(sql, PGRES_COMMAND_OK, NULL, NULL, NULL, false);
 }
 
 static bool
 RunDtmFunction(char const * sql)
 {
-	return RunDtmStatement(sql, PGRES_TUPLES_OK, NULL, NULL);
+	return RunDtmStatement(sql, PGRES_TUPLES_OK, NULL, NULL, NULL, false);
+}
+
+/*
+ * Roll back prepared global transaction. Participants which failed at the
+ * previous phases because of timeout may still complete PREPARE TRANSACTION,
+ * so their pending statement is cancelled and the transaction is rolled back
+ * too. If it is not possible, the transaction might be left prepared at the
+ * server, so its identifier is reported to let administrator resolve it.
+ */
+static void
+pgfdw_rollback_prepared(char const * gid)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+	char	   *sql = psprintf("ROLLBACK PREPARED '%s'", gid);
+
+	RunDtmCommand(sql);
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->conn == NULL || entry->xact_depth <= 0 || !entry->changing_xact_state)
+			continue;
+
+		if (PQstatus(entry->conn) != CONNECTION_OK ||
+			!pgfdw_cancel_query(entry->conn) ||
+			!pgfdw_exec_cleanup_query(entry->conn, sql, true))
+		{
+			ereport(WARNING,
+					(errcode(ERRCODE_TRANSACTION_RESOLUTION_UNKNOWN),
+					 errmsg("prepared transaction \"%s\" might be left at server \"%s\"",
+							gid, pgfdw_server_name(entry)),
+					 errhint("Use ROLLBACK PREPARED to roll it back.")));
+		}
+	}
 }
 
 
@@ -833,38 +1037,85 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 	if (!xact_got_connection)
 		return;
 
-	if (currentGlobalTransactionId != 0)
+	/*
+	 * Commit all remote transactions during pre-commit. Participants of
+	 * global transaction are committed using two-phase commit.
+	 */
+	if (event == XACT_EVENT_PARALLEL_PRE_COMMIT || event == XACT_EVENT_PRE_COMMIT)
 	{
-		switch (event)
+		/*
+		 * If abort cleanup previously failed for some connection, we can't
+		 * issue any more commands against it.
+		 */
+		hash_seq_init(&scan, ConnectionHash);
+		while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 		{
-			case XACT_EVENT_PARALLEL_PRE_COMMIT:
-			case XACT_EVENT_PRE_COMMIT:
-				{
-					csn_t		maxCSN = 0;
-
-					if (!RunDtmCommand(psprintf("PREPARE TRANSACTION '%d.%d'",
-									MyProcPid, currentLocalTransactionId)) ||
-						!RunDtmFunction(psprintf("SELECT public.dtm_begin_prepare('%d.%d')",
-									MyProcPid, currentLocalTransactionId)) ||
-						!RunDtmStatement(psprintf("SELECT public.dtm_prepare('%d.%d',0)",
-												  MyProcPid, currentLocalTransactionId), PGRES_TUPLES_OK, DtmMaxCSN, &maxCSN) ||
-						!RunDtmFunction(psprintf("SELECT public.dtm_end_prepare('%d.%d',%lld)",
-							MyProcPid, currentLocalTransactionId, maxCSN)) ||
-						!RunDtmCommand(psprintf("COMMIT PREPARED '%d.%d'",
-									  MyProcPid, currentLocalTransactionId)))
-					{
-						RunDtmCommand(psprintf("ROLLBACK PREPARED '%d.%d'",
-									  MyProcPid, currentLocalTransactionId));
-						ereport(ERROR,
-								(errcode(ERRCODE_TRANSACTION_ROLLBACK),
-								 errmsg("transaction was aborted at one of the shards")));
-						break;
-					}
-					return;
-				}
-			default:
-				break;
+			if (entry->conn != NULL && entry->xact_depth > 0)
+				pgfdw_reject_incomplete_xact_state_change(entry);
+		}
+
+		if (currentGlobalTransactionId != 0)
+		{
+			char	   *gid = psprintf("%d.%d", MyProcPid, currentLocalTransactionId);
+			csn_t		maxCSN = 0;
+
+			/*
+			 * Prepare and voting for CSN are done in one round trip.
+			 * COMMIT PREPARED can not be executed in multi-command string, so
+			 * CSN is assigned by separate statement.
+			 */
+			if (!RunDtmStatement(psprintf("PREPARE TRANSACTION '%s'; "
+										  "SELECT public.dtm_begin_prepare('%s'); "
+										  "SELECT public.dtm_prepare('%s',0)",
+										  gid, gid, gid), PGRES_TUPLES_OK, DtmMaxCSN, &maxCSN, NULL, false) ||
+				!RunDtmFunction(psprintf("SELECT public.dtm_end_prepare('%s',%lld)", gid, maxCSN)))
+			{
+				pgfdw_rollback_prepared(gid);
+				ereport(ERROR,
+						(errcode(ERRCODE_TRANSACTION_ROLLBACK),
+						 errmsg("transaction was aborted at one of the shards")));
+			}
+			if (!RunDtmCommand(psprintf("COMMIT PREPARED '%s'", gid)))
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_TRANSACTION_RESOLUTION_UNKNOWN),
+						 errmsg("prepared transaction %s was not committed at some of the shards", gid)));
+			}
 		}
+		else
+		{
+			PgFdwParticipant failure;
+
+			/*
+			 * Without two-phase commit a failure at one server can not undo
+			 * commit at the others. So servers are committed one by one and
+			 * the first failure aborts the transaction at the rest of them.
+			 * Servers with parallel_commit option trade this for latency:
+			 * they are committed at once after all others.
+			 */
+			hash_seq_init(&scan, ConnectionHash);
+			while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+			{
+				if (entry->conn == NULL || entry->xact_depth <= 0 || entry->parallel_commit)
+					continue;
+
+				entry->changing_xact_state = true;
+				do_sql_command(entry->conn, "COMMIT TRANSACTION");
+				entry->changing_xact_state = false;
+			}
+
+			failure.result = NULL;
+			if (!RunDtmStatement("COMMIT TRANSACTION", PGRES_COMMAND_OK, NULL, NULL, &failure, true))
+			{
+				/* Report the remote error itself, so that its SQLSTATE is preserved */
+				if (failure.result != NULL)
+					pgfdw_report_error(ERROR, failure.result, failure.entry->conn, true, "COMMIT TRANSACTION");
+				ereport(ERROR,
+						(errcode(ERRCODE_CONNECTION_FAILURE),
+						 errmsg("could not commit transaction at some of the foreign servers")));
+			}
+		}
+		return;
 	}
 
 	/*
@@ -892,16 +1143,8 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 			{
 				case XACT_EVENT_PARALLEL_PRE_COMMIT:
 				case XACT_EVENT_PRE_COMMIT:
-
-					/*
-					 * If abort cleanup previously failed for this connection,
-					 * we can't issue any more commands against it.
-					 */
-					pgfdw_reject_incomplete_xact_state_change(entry);
-
-					/* Commit all remote transactions during pre-commit */
-					do_sql_send_command(entry->conn, "COMMIT TRANSACTION");
-					continue;
+					/* Remote transactions are already committed above */
+					break;
 
 				case XACT_EVENT_PRE_PREPARE:
 
@@ -922,12 +1165,6 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 				case XACT_EVENT_PARALLEL_COMMIT:
 				case XACT_EVENT_COMMIT:
 				case XACT_EVENT_PREPARE:
-					if (!currentGlobalTransactionId)
-					{
-						entry->changing_xact_state = true;
-						do_sql_command(entry->conn, "COMMIT TRANSACTION");
-						entry->changing_xact_state = false;
-					}
 					/*
 					 * If there were any errors in subtransactions, and we
 					 * made prepared statements, do a DEALLOCATE ALL to make
@@ -1041,22 +1278,19 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 			disconnect_pg_server(entry);
 		}
 	}
-	if (event != XACT_EVENT_PARALLEL_PRE_COMMIT && event != XACT_EVENT_PRE_COMMIT)
-	{
-		/*
-		 * Regardless of the event type, we can now mark ourselves as out of
-		 * the transaction.  (Note: if we are here during PRE_COMMIT or
-		 * PRE_PREPARE, this saves a useless scan of the hashtable during
-		 * COMMIT or PREPARE.)
-		 */
-		xact_got_connection = false;
 
-		/* Also reset cursor numbering for next transaction */
-		cursor_number = 0;
+	/*
+	 * Regardless of the event type, we can now mark ourselves as out of the
+	 * transaction.  (Note: if we are here during PRE_PREPARE, this saves a
+	 * useless scan of the hashtable during PREPARE.)
+	 */
+	xact_got_connection = false;
+
+	/* Also reset cursor numbering for next transaction */
+	cursor_number = 0;
 
-		currentGlobalTransactionId = 0;
-		currentConnection = NULL;
-	}
+	currentGlobalTransactionId = 0;
+	currentConnection = NULL;
 }
 
 /*
@@ -1215,9 +1449,7 @@ pgfdw_inval_callback(Datum arg, int cacheid, uint32 hashvalue)
 static void
 pgfdw_reject_incomplete_xact_state_change(ConnCacheEntry *entry)
 {
-	HeapTuple	tup;
-	Form_pg_user_mapping umform;
-	ForeignServer *server;
+	char	   *servername;
 
 	/* nothing to do for inactive entries and entries of sane state */
 	if (entry->conn == NULL || !entry->changing_xact_state)
@@ -1227,6 +1459,24 @@ pgfdw_reject_incomplete_xact_state_change(ConnCacheEntry *entry)
 	disconnect_pg_server(entry);
 
 	/* find server name to be shown in the message below */
+	servername = pgfdw_server_name(entry);
+
+	ereport(ERROR,
+			(errcode(ERRCODE_CONNECTION_EXCEPTION),
+			 errmsg("connection to server \"%s\" was lost",
+					servername)));
+}
+
+/*
+ * Find name of the foreign server of the connection cache entry.
+ */
+static char *
+pgfdw_server_name(ConnCacheEntry *entry)
+{
+	HeapTuple	tup;
+	Form_pg_user_mapping umform;
+	ForeignServer *server;
+
 	tup = SearchSysCache1(USERMAPPINGOID,
 						  ObjectIdGetDatum(entry->key));
 	if (!HeapTupleIsValid(tup))
@@ -1235,10 +1485,7 @@ pgfdw_reject_incomplete_xact_state_change(ConnCacheEntry *entry)
 	server = GetForeignServer(umform->umserver);
 	ReleaseSysCache(tup);
 
-	ereport(ERROR,
-			(errcode(ERRCODE_CONNECTION_EXCEPTION),
-			 errmsg("connection to server \"%s\" was lost",
-					server->servername)));
+	return server->servername;
 }
 
 /*
@@ -263,6 +263,7 @@ typedef struct
 } ec_member_foreign_arg;
 
 bool		UseTsDtmTransactions;
+int			RemoteCommitTimeout;
 void		_PG_init(void);
 
 /*
@@ -4620,4 +4621,9 @@ _PG_init(void)
 							 "Use timestamp base distributed transaction manager for FDW connections", NULL,
 						  &UseTsDtmTransactions, false, PGC_USERSET, 0, NULL,
 							 NULL, NULL);
+	DefineCustomIntVariable("postgres_fdw.commit_timeout",
+							"Maximal time to wait for foreign servers at each phase of commit (msec)",
+							"Zero means no timeout",
+							&RemoteCommitTimeout, 0, 0, INT_MAX, PGC_USERSET,
+							GUC_UNIT_MS, NULL, NULL, NULL);
 }
@@ -167,5 +167,6 @@ extern bool is_shippable(Oid objectId, Oid classId, PgFdwRelationInfo *fpinfo);
 extern const char *get_jointype_name(JoinType jointype);
 
 extern bool UseTsDtmTransactions;
+extern int	RemoteCommitTimeout;
 
 #endif   /* POSTGRES_FDW_H */
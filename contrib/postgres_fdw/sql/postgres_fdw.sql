@@ -1423,3 +1423,41 @@ WHERE ftrelid = 'table30000'::regclass
 AND ftoptions @> array['fetch_size=60000'];
 
 ROLLBACK;
+
+-- ===================================================================
+-- test commit of remote transactions
+-- ===================================================================
+CREATE TABLE "S 1"."T 5" (c1 int, c2 text,
+	CONSTRAINT t5_pkey PRIMARY KEY (c1) DEFERRABLE INITIALLY DEFERRED);
+CREATE TABLE "S 1"."T 6" (c1 int, c2 text);
+CREATE FOREIGN TABLE ft7 (c1 int, c2 text)
+	SERVER loopback OPTIONS (schema_name 'S 1', table_name 'T 5');
+CREATE FOREIGN TABLE ft8 (c1 int, c2 text)
+	SERVER loopback2 OPTIONS (schema_name 'S 1', table_name 'T 6');
+-- both servers are committed
+BEGIN;
+INSERT INTO ft7 VALUES (1, 'one');
+INSERT INTO ft8 VALUES (1, 'one');
+COMMIT;
+SELECT * FROM ft7 ORDER BY c1;
+SELECT * FROM ft8 ORDER BY c1;
+-- remote error at commit is reported as is
+BEGIN;
+INSERT INTO ft7 VALUES (1, 'duplicate');
+SELECT count(*) FROM ft8;
+COMMIT;  -- ERROR
+SELECT * FROM ft7 ORDER BY c1;
+-- servers can be committed in parallel
+ALTER SERVER loopback OPTIONS (ADD parallel_commit 'maybe');  -- ERROR
+ALTER SERVER loopback OPTIONS (ADD parallel_commit 'true');
+ALTER SERVER loopback2 OPTIONS (ADD parallel_commit 'true');
+SET postgres_fdw.commit_timeout = '10s';
+BEGIN;
+INSERT INTO ft7 VALUES (3, 'three');
+INSERT INTO ft8 VALUES (3, 'three');
+COMMIT;
+RESET postgres_fdw.commit_timeout;
+ALTER SERVER loopback OPTIONS (DROP parallel_commit);
+ALTER SERVER loopback2 OPTIONS (DROP parallel_commit);
+SELECT * FROM ft7 ORDER BY c1;
+SELECT * FROM ft8 ORDER BY c1;
@@ -1 +1 @@
-./dtmbench -c "dbname=postgres host=localhost port=5432 sslmode=disable" $* -i 3
+./dtmbench -c "dbname=postgres host=localhost port=5432 sslmode=disable" --protocol fdw $* -i --shards 3
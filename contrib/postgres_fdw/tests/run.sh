@@ -1 +1 @@
-./dtmbench -c "dbname=postgres host=localhost port=5432 sslmode=disable" $*
+./dtmbench -c "dbname=postgres host=localhost port=5432 sslmode=disable" --protocol fdw $*
@@ -0,0 +1,114 @@
+/*-------------------------------------------------------------------------
+ *
+ * hlc.c
+ *		Hybrid logical clock
+ *
+ * Clock is shared by all backends and advanced using atomic operations,
+ * so assigning timestamps doesn't require any locks. Unlike constant shift of
+ * system time, advance caused by clocks of other nodes is not accumulated:
+ * clock returns to physical time once it catches up with the last assigned value.
+ *
+ * Portions Copyright (c) 1996-2015, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/backend/access/transam/hlc.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <time.h>
+#include <sys/time.h>
+
+#include "access/hlc.h"
+#include "datatype/timestamp.h"
+
+void
+HLCInit(HLCState *clock)
+{
+	pg_atomic_init_u64(&clock->last, HLCPhysicalTime());
+	pg_atomic_init_u64(&clock->maxSkew, 0);
+	pg_atomic_init_u64(&clock->nSkewViolations, 0);
+}
+
+/*
+ * Coarse clock is much cheaper and its precision is enough: events within one tick
+ * get logical increments.
+ */
+hlc_t
+HLCPhysicalTime(void)
+{
+#ifdef CLOCK_REALTIME_COARSE
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return (hlc_t) ts.tv_sec * USECS_PER_SEC + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (hlc_t) tv.tv_sec * USECS_PER_SEC + tv.tv_usec;
+#endif
+}
+
+hlc_t
+HLCNow(HLCState *clock)
+{
+	hlc_t		now = HLCPhysicalTime();
+	hlc_t		last = pg_atomic_read_u64(&clock->last);
+
+	return now > last ? now : last;
+}
+
+hlc_t
+HLCTick(HLCState *clock)
+{
+	hlc_t		now = HLCPhysicalTime();
+	uint64		last = pg_atomic_read_u64(&clock->last);
+	hlc_t		next;
+
+	do
+	{
+		next = now > last ? now : last + 1;
+	} while (!pg_atomic_compare_exchange_u64(&clock->last, &last, next));
+
+	return next;
+}
+
+bool
+HLCReceive(HLCState *clock, hlc_t remote, hlc_t maxSkew, hlc_t *skew)
+{
+	hlc_t		now = HLCPhysicalTime();
+	uint64		last = pg_atomic_read_u64(&clock->last);
+	hlc_t		delta = remote > now ? remote - now : 0;
+
+	if (skew != NULL)
+		*skew = delta;
+
+	if (delta != 0)
+	{
+		uint64		observed = pg_atomic_read_u64(&clock->maxSkew);
+
+		while (delta > observed && !pg_atomic_compare_exchange_u64(&clock->maxSkew, &observed, delta));
+
+		/* Rejected timestamp should not move the clock of this node */
+		if (maxSkew != 0 && delta > maxSkew)
+		{
+			pg_atomic_fetch_add_u64(&clock->nSkewViolations, 1);
+			return false;
+		}
+	}
+	while (last < remote && !pg_atomic_compare_exchange_u64(&clock->last, &last, remote));
+
+	return true;
+}
+
+int64
+HLCGetShift(HLCState *clock)
+{
+	hlc_t		now = HLCPhysicalTime();
+	hlc_t		last = pg_atomic_read_u64(&clock->last);
+
+	return last > now ? (int64) (last - now) : 0;
+}
@@ -866,7 +866,10 @@ void SetPreparedTransactionState(char const* gid, char const* state)
 		replorigin_session_advance(replorigin_session_origin_lsn,
 								   gxact->prepare_end_lsn);
 
-	XLogFlush(gxact->prepare_end_lsn);
+	if (synchronous_twophase)
+		XLogFlush(gxact->prepare_end_lsn);
+	else
+		XLogSetAsyncXactLSN(gxact->prepare_end_lsn);
 	gxact->prepare_start_lsn = ProcLastRecPtr;
 	MyPgXact->delayChkpt = false;
 
@@ -1251,7 +1254,10 @@ EndPrepare(GlobalTransaction gxact)
 		replorigin_session_advance(replorigin_session_origin_lsn,
 								   gxact->prepare_end_lsn);
 
-	XLogFlush(gxact->prepare_end_lsn);
+	if (synchronous_twophase)
+		XLogFlush(gxact->prepare_end_lsn);
+	else
+		XLogSetAsyncXactLSN(gxact->prepare_end_lsn);
 
 	/* If we crash now, we have prepared: WAL replay will fix things */
 
@@ -80,6 +80,13 @@ bool		XactDeferrable;
 
 int			synchronous_commit = SYNCHRONOUS_COMMIT_ON;
 
+/*
+ * If synchronous_twophase is off, PREPARE TRANSACTION and change of 3PC state
+ * do not wait for WAL flush: the caller is responsible for flushing WAL before
+ * reporting that transaction is prepared.
+ */
+bool		synchronous_twophase = true;
+
 /*
  * When running as a parallel worker, we place only a single
  * TransactionStateData on the parallel worker's state stack, and the XID
@@ -951,6 +951,17 @@ static struct config_bool ConfigureNamesBool[] =
 		true,
 		NULL, NULL, NULL
 	},
+	{
+		{"synchronous_twophase", PGC_SUSET, WAL_SETTINGS,
+			gettext_noop("Forces synchronous flush of WAL records of prepared transactions."),
+			gettext_noop("If disabled, flush of PREPARE TRANSACTION records is left to the "
+						 "transaction manager, which can flush records of several prepared "
+						 "transactions at once.")
+		},
+		&synchronous_twophase,
+		true,
+		NULL, NULL, NULL
+	},
 	{
 		{"ignore_checksum_failure", PGC_SUSET, DEVELOPER_OPTIONS,
 			gettext_noop("Continues processing after a checksum failure."),
@@ -0,0 +1,53 @@
+/*
+ * hlc.h
+ *
+ * Hybrid logical clock used by distributed transaction managers to assign CSNs
+ *
+ * Portions Copyright (c) 1996-2015, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/include/access/hlc.h
+ */
+#ifndef HLC_H
+#define HLC_H
+
+#include "port/atomics.h"
+
+/*
+ * Clock value is number of microseconds since Unix epoch. Physical component is taken
+ * from system clock and logical increments are added on top of it when several events
+ * happen within one tick of system clock or when clock is moved forward by timestamp received
+ * from another node. Logical advance is absorbed as soon as physical time catches up with it.
+ */
+typedef uint64 hlc_t;
+
+/* Clock state, should be placed in shared memory */
+typedef struct HLCState
+{
+	pg_atomic_uint64 last;           /* last value returned by the clock */
+	pg_atomic_uint64 maxSkew;        /* maximal observed advance of remote clock over local physical time */
+	pg_atomic_uint64 nSkewViolations;/* number of remote timestamps exceeding allowed skew */
+} HLCState;
+
+extern void HLCInit(HLCState *clock);
+
+/* Physical time in microseconds */
+extern hlc_t HLCPhysicalTime(void);
+
+/* Current clock reading: not unique, but not smaller than any value returned before */
+extern hlc_t HLCNow(HLCState *clock);
+
+/* Unique ascending clock value */
+extern hlc_t HLCTick(HLCState *clock);
+
+/*
+ * Advance clock to timestamp received from other node.
+ * Returns false and leaves clock unchanged if remote timestamp is ahead of local physical time
+ * by more than maxSkew (zero means no limit), skew itself is returned through optional skew parameter.
+ */
+extern bool HLCReceive(HLCState *clock, hlc_t remote, hlc_t maxSkew, hlc_t *skew);
+
+/* Advance of clock over physical time */
+extern int64 HLCGetShift(HLCState *clock);
+
+#endif
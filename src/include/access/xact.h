@@ -80,6 +80,9 @@ typedef enum
 /* Synchronous commit level */
 extern int	synchronous_commit;
 
+/* Flush WAL records of prepared transactions synchronously */
+extern bool synchronous_twophase;
+
 /* Kluge for 2PC support */
 extern bool MyXactAccessedTempRel;
 